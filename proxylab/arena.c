@@ -0,0 +1,59 @@
+#include "arena.h"
+
+#include <stdlib.h>
+#include <sys/mman.h>
+
+/**
+ * Round size up to a multiple of ARENA_ALIGN.
+ */
+static inline size_t AlignSize(size_t size) {
+  return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+int InitArena(struct Arena *arena, size_t size) {
+  arena->size = AlignSize(size);
+  arena->used = 0;
+  arena->overflow = NULL;
+  arena->base = mmap(NULL, arena->size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (arena->base == MAP_FAILED) {
+    arena->base = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+void FreeArena(struct Arena *arena) {
+  ResetArena(arena);
+  if (arena->base) {
+    munmap(arena->base, arena->size);
+    arena->base = NULL;
+  }
+}
+
+void *ArenaAlloc(struct Arena *arena, size_t size) {
+  size = AlignSize(size);
+
+  if (arena->base && size <= arena->size - arena->used) {
+    void *ptr = arena->base + arena->used;
+    arena->used += size;
+    return ptr;
+  }
+
+  // The block is full, the chunk header takes a whole aligned slot
+  struct ArenaChunk *chunk;
+  if (posix_memalign((void **)&chunk, ARENA_ALIGN, ARENA_ALIGN + size))
+    return NULL;
+  chunk->next = arena->overflow;
+  arena->overflow = chunk;
+  return (char *)chunk + ARENA_ALIGN;
+}
+
+void ResetArena(struct Arena *arena) {
+  while (arena->overflow) {
+    struct ArenaChunk *next = arena->overflow->next;
+    free(arena->overflow);
+    arena->overflow = next;
+  }
+  arena->used = 0;
+}
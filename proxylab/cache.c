@@ -4,11 +4,142 @@
 #include <sys/stat.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdatomic.h>
+#include <strings.h>
+#include <time.h>
+#include <zlib.h>
+
+/**
+ * Admission decisions of CacheInfo.
+ */
+#define ADMISSION_UNKNOWN 0
+#define ADMISSION_ACCEPT 1
+#define ADMISSION_REJECT 2
 
 static const char CACHE_DIR_DEFAULT[] = ".cache/";
 static char CACHE_DIR[PATH_MAX] = ".cache/";
 static const char TEMP_DIR_DEFAULT[] = ".tmp/";
 static char TEMP_DIR[PATH_MAX] = ".tmp/";
+static const char GZIP_DIR_DEFAULT[] = ".gzip/";
+static char GZIP_DIR[PATH_MAX] = ".gzip/";
+static const char SEG_DIR_DEFAULT[] = ".segments/";
+static char SEG_DIR[PATH_MAX] = ".segments/";
+/* directory of all the dirs above, empty for the executable's */
+static char CACHE_ROOT[PATH_MAX] = "";
+
+/**
+ * Content types that are worth compressing.
+ */
+static const char *const COMPRESSIBLE_TYPES[] = {
+  "text/html",
+  "text/plain",
+  "text/css",
+  "text/javascript",
+  "application/javascript",
+  "application/json"
+};
+
+/**
+ * Queue of cache files waiting to be compressed by the compressor thread.
+ */
+static struct {
+  int enabled;
+  char paths[GZIP_QUEUE_LEN][PATH_MAX];
+  int head;
+  int count;
+  pthread_mutex_t mutex;
+  pthread_cond_t not_empty;
+  pthread_t tid;
+} gzip_queue = {
+  .enabled = 0,
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+  .not_empty = PTHREAD_COND_INITIALIZER
+};
+
+/**
+ * The count-min sketch of the admission filter.
+ */
+static struct {
+  int enabled;
+  uint8_t counters[CACHE_SKETCH_DEPTH][CACHE_SKETCH_WIDTH];
+  long samples;                 // accesses since counters were halved
+  pthread_mutex_t mutex;
+} sketch = { .enabled = 0, .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static atomic_long admission_accepted = ATOMIC_VAR_INIT(0);
+static atomic_long admission_rejected = ATOMIC_VAR_INIT(0);
+
+/**
+ * FNV-1a hash of str, continued from hash.
+ */
+static uint64_t HashString(uint64_t hash, const char *str) {
+  while (*str) {
+    hash ^= (unsigned char)*str++;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+/**
+ * \returns the hash of a cache key.
+ */
+static uint64_t HashCacheKey(const char *key) {
+  return HashString(0xcbf29ce484222325ULL, key);
+}
+
+/**
+ * \returns the cache key of cache_path, which is "<Host><URL>" without
+ * trailing '/'s, or NULL if cache_path is not in CACHE_DIR.
+ */
+static const char *GetCacheKey(const char *cache_path) {
+  size_t cache_dir_len = strlen(CACHE_DIR);
+  if (strncmp(cache_path, CACHE_DIR, cache_dir_len) != 0) return NULL;
+  return cache_path + cache_dir_len;
+}
+
+/**
+ * \returns the index of key_hash in the row of the sketch. Indexes of
+ * different rows are derived by double hashing.
+ */
+static inline size_t SketchIndex(uint64_t key_hash, int row) {
+  uint32_t h1 = (uint32_t)key_hash;
+  uint32_t h2 = (uint32_t)(key_hash >> 32) | 1;
+  return (h1 + row * h2) & (CACHE_SKETCH_WIDTH - 1);
+}
+
+/**
+ * Record an access to key_hash in the sketch.
+ * Note: sketch.mutex should be held.
+ */
+static void SketchIncrement(uint64_t key_hash) {
+  for (int row = 0; row < CACHE_SKETCH_DEPTH; row++) {
+    uint8_t *counter = &sketch.counters[row][SketchIndex(key_hash, row)];
+    if (*counter < CACHE_SKETCH_MAX_FREQ) (*counter)++;
+  }
+
+  // Halve all counters periodically to age out old popularity
+  if (++sketch.samples >= CACHE_SKETCH_SAMPLES) {
+    for (int row = 0; row < CACHE_SKETCH_DEPTH; row++) {
+      for (int i = 0; i < CACHE_SKETCH_WIDTH; i++) {
+        sketch.counters[row][i] >>= 1;
+      }
+    }
+    sketch.samples = 0;
+  }
+}
+
+/**
+ * \returns the estimated access frequency of key_hash.
+ * Note: sketch.mutex should be held.
+ */
+static int SketchEstimate(uint64_t key_hash) {
+  int freq = CACHE_SKETCH_MAX_FREQ;
+  for (int row = 0; row < CACHE_SKETCH_DEPTH; row++) {
+    int counter = sketch.counters[row][SketchIndex(key_hash, row)];
+    if (counter < freq) freq = counter;
+  }
+  return freq;
+}
 
 /**
  * \returns 1 if dir exists, 0 otherwise.
@@ -26,8 +157,10 @@ int DirExist(const char *dir) {
  */
 int CreateDir(const char *path) {
   int retval;
-  char *curpath = strdup(path);
-  if (!curpath) return 1;
+  char curpath[PATH_MAX];
+  size_t path_len = strlen(path);
+  if (path_len >= sizeof(curpath)) return 1;
+  memcpy(curpath, path, path_len + 1);
   
   char *ptr = curpath;
   while (*ptr) {
@@ -35,10 +168,7 @@ int CreateDir(const char *path) {
       *ptr = '\0';
       if (!DirExist(curpath)) {
         retval = mkdir(curpath, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-        if (retval != 0) {
-          free(curpath);
-          return 1;
-        }
+        if (retval != 0) return 1;
       }
       *ptr = '/';
     }
@@ -46,13 +176,9 @@ int CreateDir(const char *path) {
   }
   if (!DirExist(curpath)) {
     retval = mkdir(curpath, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-    if (retval != 0) {
-      free(curpath);
-      return 1;
-    }
+    if (retval != 0) return 1;
   }
   
-  free(curpath);
   return 0;
 }
 
@@ -108,16 +234,24 @@ int RemoveDir(const char *dir) {
   return 0;
 }
 
+void SetCacheRoot(const char *root) {
+  snprintf(CACHE_ROOT, sizeof(CACHE_ROOT), "%s", root);
+}
+
 void InitCacheModule() {
   // Init CACHE_DIR to be "<exe_dir>/.cache/"
   // Init TEMP_DIR to be "<exe_dir>/.tmp/"
   memset(CACHE_DIR, 0, sizeof(CACHE_DIR));
-  int ret = readlink("/proc/self/exe", CACHE_DIR, sizeof(CACHE_DIR)-1);
+  int ret = 0;
+  if (CACHE_ROOT[0] != '\0')
+    strcpy(CACHE_DIR, CACHE_ROOT);
+  else
+    ret = readlink("/proc/self/exe", CACHE_DIR, sizeof(CACHE_DIR)-1);
   if (ret < 0) {
     unix_error("Failed to Readlink of /proc/self/exe");
   }
 
-  int cache_dir_default_len = strlen(CACHE_DIR_DEFAULT);
+  int cache_dir_default_len = strlen(SEG_DIR_DEFAULT);   // the longest
   int cache_dir_len = strlen(CACHE_DIR);
   int i;
   for (i = cache_dir_len-1; i >= 0; i--) {
@@ -126,16 +260,25 @@ void InitCacheModule() {
   CACHE_DIR[i+1] = '\0';
 
   strcpy(TEMP_DIR, CACHE_DIR);
+  strcpy(GZIP_DIR, CACHE_DIR);
+  strcpy(SEG_DIR, CACHE_DIR);
   cache_dir_len = strlen(CACHE_DIR);
   if (cache_dir_len+cache_dir_default_len >= sizeof(CACHE_DIR)) {
     app_error("Cache Module init failed: cache dir is too long");
   }
   strcat(CACHE_DIR, CACHE_DIR_DEFAULT);
   strcat(TEMP_DIR, TEMP_DIR_DEFAULT);
+  strcat(GZIP_DIR, GZIP_DIR_DEFAULT);
+  strcat(SEG_DIR, SEG_DIR_DEFAULT);
 
   // Set umask
   umask(DEF_UMASK);
 
+  // Init the in-memory index of CACHE_DIR, which is emptied below
+  if (InitCacheIndex(INDEX_SHARD_BITS) != 0) {
+    app_error("Cache Module init failed: no memory for cache index");
+  }
+
   // Create CACHE_DIR
   /// delete CACHE_DIR
   printf("Remove cache dir: %s\n", CACHE_DIR);
@@ -163,61 +306,392 @@ void InitCacheModule() {
   if (ret != 0) {
     unix_error("Failed to create temp dir");
   }
+
+  // Create GZIP_DIR
+  /// delete GZIP_DIR
+  printf("Remove gzip dir: %s\n", GZIP_DIR);
+  ret = RemoveDir(GZIP_DIR);
+  if (ret != 0) {
+    unix_error("Failed to remove gzip dir");
+  }
+  /// create GZIP_DIR
+  printf("Create gzip dir: %s\n", GZIP_DIR);
+  ret = CreateDir(GZIP_DIR);
+  if (ret != 0) {
+    unix_error("Failed to create gzip dir");
+  }
+
+  // Create SEG_DIR
+  /// delete SEG_DIR
+  printf("Remove segment dir: %s\n", SEG_DIR);
+  ret = RemoveDir(SEG_DIR);
+  if (ret != 0) {
+    unix_error("Failed to remove segment dir");
+  }
+  /// create SEG_DIR
+  printf("Create segment dir: %s\n", SEG_DIR);
+  ret = CreateDir(SEG_DIR);
+  if (ret != 0) {
+    unix_error("Failed to create segment dir");
+  }
+  InitSegmentStore(SEG_DIR);
+}
+
+void SetCacheAdmission(int enable) {
+  sketch.enabled = enable;
+}
+
+/**
+ * \returns the monotonic time in seconds.
+ */
+static int64_t NowSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec;
+}
+
+/**
+ * Build path "<dir><host><url>" into path, which is PATH_MAX long,
+ * with all trailing '/' removed.
+ *
+ * \returns 0 if success, 1 if the path is too long, 2 if it's empty.
+ */
+static int BuildPath(char *path, const char *dir,
+                     const char *host, const char *url) {
+  int dir_len = strlen(dir);
+  int host_len = strlen(host);
+  int url_len = strlen(url);
+  if (dir_len+host_len+url_len >= PATH_MAX) return 1;
+
+  sprintf(path, "%s%s%s", dir, host, url);
+  int path_len = strlen(path);
+  while (path_len > 0 && path[path_len-1] == '/') {
+    path[path_len-1] = '\0';
+    path_len--;
+  }
+  if (path_len <= 0) return 2;
+
+  return 0;
 }
 
 int CreateCacheInfo(struct CacheInfo *cache_info,
                     const char *host, const char *url) {
+  int retval = 0;
+
   cache_info->is_open = 0;
+  cache_info->is_gzip = 0;
   cache_info->is_write = 0;
   cache_info->fd = -1;
+  cache_info->admission = ADMISSION_UNKNOWN;
+  memset(&cache_info->meta, 0, sizeof(cache_info->meta));
+  cache_info->data = NULL;
+  cache_info->data_len = 0;
+  cache_info->data_pos = 0;
+  cache_info->max_age = CACHE_DEFAULT_MAX_AGE;
+  cache_info->stale_while_revalidate = CACHE_DEFAULT_SWR;
+  cache_info->stale_if_error = CACHE_DEFAULT_SIE;
   memset(cache_info->cache_path, 0, sizeof(cache_info->cache_path));
   memset(cache_info->temp_path, 0, sizeof(cache_info->temp_path));
+  memset(cache_info->gzip_path, 0, sizeof(cache_info->gzip_path));
   memset(cache_info->error_msg, 0, sizeof(cache_info->error_msg));
 
   // Construct cache_path
-  int cache_dir_len = strlen(CACHE_DIR);
-  int host_len = strlen(host);
-  int url_len = strlen(url);
-  if (cache_dir_len+host_len+url_len >= sizeof(cache_info->cache_path)) {
-    strcpy(cache_info->error_msg, CACHE_PATH_TOO_LONG);
+  retval = BuildPath(cache_info->cache_path, CACHE_DIR, host, url);
+  if (retval != 0) {
+    strcpy(cache_info->error_msg,
+           retval == 1 ? CACHE_PATH_TOO_LONG : CACHE_PATH_EMPTY);
     return 1;
   }
 
-  sprintf(cache_info->cache_path, "%s%s%s", CACHE_DIR, host, url);
-  int cache_path_len = strlen(cache_info->cache_path);
-  while (cache_path_len > 0 &&
-         cache_info->cache_path[cache_path_len-1] == '/') {
-    cache_info->cache_path[cache_path_len-1] = '\0';
-    cache_path_len--;
-  }
-  if (cache_path_len <= 0) {
-    strcpy(cache_info->error_msg, CACHE_PATH_EMPTY);
+  // Construct temp_path
+  retval = BuildPath(cache_info->temp_path, TEMP_DIR, host, url);
+  if (retval != 0) {
+    strcpy(cache_info->error_msg,
+           retval == 1 ? TEMP_PATH_TOO_LONG : TEMP_PATH_EMPTY);
     return 1;
   }
 
-  // Construct temp_path
-  int temp_dir_len = strlen(TEMP_DIR);
-  if (temp_dir_len+host_len+url_len >= sizeof(cache_info->temp_path)) {
-    strcpy(cache_info->error_msg, TEMP_PATH_TOO_LONG);
+  // Construct gzip_path
+  retval = BuildPath(cache_info->gzip_path, GZIP_DIR, host, url);
+  if (retval != 0) {
+    strcpy(cache_info->error_msg,
+           retval == 1 ? GZIP_PATH_TOO_LONG : GZIP_PATH_EMPTY);
     return 1;
   }
 
-  sprintf(cache_info->temp_path, "%s%s%s", TEMP_DIR, host, url);
-  int temp_path_len = strlen(cache_info->temp_path);
-  while (temp_path_len > 0 &&
-         cache_info->temp_path[temp_path_len-1] == '/') {
-    cache_info->temp_path[temp_path_len-1] = '\0';
-    temp_path_len--;
+  cache_info->key_hash = HashCacheKey(GetCacheKey(cache_info->cache_path));
+
+  // Record the access for the admission filter
+  if (sketch.enabled) {
+    pthread_mutex_lock(&sketch.mutex);
+    SketchIncrement(cache_info->key_hash);
+    pthread_mutex_unlock(&sketch.mutex);
   }
-  if (temp_path_len <= 0) {
-    strcpy(cache_info->error_msg, TEMP_PATH_EMPTY);
-    return 1;
+
+  return 0;
+}
+
+/**
+ * Create the directory that path is located in.
+ *
+ * \returns 0 if success, 1 otherwise.
+ */
+static int CreateParentDir(char *path) {
+  int retval = 0;
+  int path_len = strlen(path);
+
+  while (path_len > 0 && path[path_len-1] != '/') {
+    path_len--;
+  }
+  if (path_len > 0) {
+    char tmp = path[path_len];
+    path[path_len] = '\0';
+    retval = CreateDir(path);
+    path[path_len] = tmp;
+    if (retval != 0) return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Find the value of header field in the header block [start, end) of a
+ * http response, the field name is compared case-insensitively.
+ *
+ * \returns the value if found, NULL otherwise. value_len is set to the
+ * length of the value, without the trailing "\r\n".
+ */
+static const char *FindResponseHeader(const char *start, const char *end,
+                                      const char *field, size_t *value_len) {
+  size_t field_len = strlen(field);
+  const char *line = start;
+
+  while (line < end) {
+    const char *line_end = memchr(line, '\n', end-line);
+    if (!line_end) line_end = end;
+    if (line_end-line > field_len && line[field_len] == ':' &&
+        strncasecmp(line, field, field_len) == 0) {
+      const char *value = line+field_len+1;
+      while (value < line_end && *value == ' ') value++;
+      const char *value_end = line_end;
+      while (value_end > value &&
+             (value_end[-1] == '\r' || value_end[-1] == ' ')) value_end--;
+      *value_len = value_end-value;
+      return value;
+    }
+    line = line_end+1;
+  }
+
+  return NULL;
+}
+
+/**
+ * \returns 1 if the response in the header block [start, end) is worth
+ * compressing, 0 otherwise.
+ */
+static int IsResponseCompressible(const char *start, const char *end) {
+  const char *value = NULL;
+  size_t value_len = 0;
+
+  // Only full responses in plain text are compressed
+  if (end-start < 12 || strncmp(start, "HTTP/1.", 7) != 0 ||
+      strncmp(start+8, " 200", 4) != 0) return 0;
+  if (FindResponseHeader(start, end, "Content-Encoding", &value_len) ||
+      FindResponseHeader(start, end, "Transfer-Encoding", &value_len))
+    return 0;
+
+  value = FindResponseHeader(start, end, "Content-Type", &value_len);
+  if (!value) return 0;
+  for (int i = 0; i < sizeof(COMPRESSIBLE_TYPES)/sizeof(char *); i++) {
+    size_t type_len = strlen(COMPRESSIBLE_TYPES[i]);
+    if (value_len >= type_len &&
+        strncasecmp(value, COMPRESSIBLE_TYPES[i], type_len) == 0 &&
+        (value_len == type_len || value[type_len] == ';' ||
+         value[type_len] == ' ')) {
+      return 1;
+    }
   }
 
   return 0;
 }
 
+/**
+ * Write the gzip variant of the response cached in cache_path. The header
+ * block is copied except Content-Length, which is replaced together with
+ * the new Content-Encoding and Vary fields.
+ *
+ * \returns 0 if the variant is written, 1 otherwise.
+ */
+static int CompressCacheFile(const char *cache_path) {
+  int retval = 1;
+  int fd = -1;
+  int temp_fd = -1;
+  struct stat st_buf;
+  struct CacheMeta meta;
+  const char *pinned = NULL;         // content pinned in a segment
+  char *data = MAP_FAILED;
+  char *out = NULL;
+  char gzip_path[PATH_MAX];
+  char temp_path[PATH_MAX];
+  char header[MAXLINE];
+  z_stream stream;
+
+  // The variant is located in GZIP_DIR as cache_path is in CACHE_DIR
+  int cache_dir_len = strlen(CACHE_DIR);
+  if (strncmp(cache_path, CACHE_DIR, cache_dir_len) != 0) return 1;
+  if (strlen(GZIP_DIR)+strlen(cache_path+cache_dir_len) >= PATH_MAX ||
+      strlen(TEMP_DIR)+strlen("gzip.XXXXXX") >= PATH_MAX) return 1;
+  strcpy(gzip_path, GZIP_DIR);
+  strcat(gzip_path, cache_path+cache_dir_len);
+  strcpy(temp_path, TEMP_DIR);
+  strcat(temp_path, "gzip.XXXXXX");
+
+  // Map the cached response, unless it's mapped in a segment already
+  const char *key = GetCacheKey(cache_path);
+  if (LookupCacheIndex(key, HashCacheKey(key), &meta) &&
+      meta.location.generation != 0) {
+    pinned = PinSegment(&meta.location);
+    if (!pinned) return 1;
+    data = (char *)pinned;
+    st_buf.st_size = meta.size;
+    if (st_buf.st_size == 0) goto out;
+  }
+  else {
+    fd = open(cache_path, O_RDONLY);
+    if (fd < 0) return 1;
+    if (fstat(fd, &st_buf) != 0 || st_buf.st_size == 0) goto out;
+    data = mmap(NULL, st_buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) goto out;
+  }
+
+  // Split the response into the header block and the body
+  char *data_end = data+st_buf.st_size;
+  char *body = data;
+  while (body+4 <= data_end && strncmp(body, "\r\n\r\n", 4) != 0) body++;
+  if (body+4 > data_end) goto out;
+  body += 4;
+  if (!IsResponseCompressible(data, body)) goto out;
+  size_t body_len = data_end-body;
+  size_t value_len = 0;
+  const char *value = FindResponseHeader(data, body, "Content-Length",
+                                         &value_len);
+  if (value && strtoul(value, NULL, 10) != body_len) goto out;
+
+  // Compress the body
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                   15+16, 8, Z_DEFAULT_STRATEGY) != Z_OK) goto out;
+  size_t out_size = deflateBound(&stream, body_len);
+  out = malloc(out_size);
+  if (!out) {
+    deflateEnd(&stream);
+    goto out;
+  }
+  stream.next_in = (Bytef *)body;
+  stream.avail_in = body_len;
+  stream.next_out = (Bytef *)out;
+  stream.avail_out = out_size;
+  int zret = deflate(&stream, Z_FINISH);
+  size_t out_len = stream.total_out;
+  deflateEnd(&stream);
+  /// Not worth it if less than 1/8 is saved
+  if (zret != Z_STREAM_END || out_len > body_len - body_len/8) goto out;
+
+  // Write the variant to a temp file, then move it to gzip_path
+  temp_fd = mkstemp(temp_path);
+  if (temp_fd < 0) goto out;
+  char *line = data;
+  while (line < body-2) {
+    char *line_end = memchr(line, '\n', body-line);
+    size_t line_len = line_end-line+1;
+    if (!(line_len > 15 && strncasecmp(line, "Content-Length:", 15) == 0) &&
+        rio_writen(temp_fd, line, line_len) < 0) goto out;
+    line = line_end+1;
+  }
+  int header_len = snprintf(header, sizeof(header),
+                            "Content-Encoding: gzip\r\n"
+                            "Content-Length: %lu\r\n"
+                            "Vary: Accept-Encoding\r\n\r\n", out_len);
+  if (rio_writen(temp_fd, header, header_len) < 0 ||
+      rio_writen(temp_fd, out, out_len) < 0) goto out;
+  if (CreateParentDir(gzip_path) != 0 ||
+      rename(temp_path, gzip_path) != 0) goto out;
+  SetCacheIndexGzip(key, HashCacheKey(key), 1);
+  retval = 0;
+
+out:
+  if (temp_fd >= 0) {
+    close(temp_fd);
+    if (retval != 0) unlink(temp_path);
+  }
+  free(out);
+  if (pinned) UnpinSegment(&meta.location);
+  else if (data != MAP_FAILED) munmap(data, st_buf.st_size);
+  if (fd >= 0) close(fd);
+  return retval;
+}
+
+/**
+ * Compressor thread function: compress cache files in gzip_queue.
+ */
+static void *CompressThread(void *args) {
+  char cache_path[PATH_MAX];
+
+  while (1) {
+    pthread_mutex_lock(&gzip_queue.mutex);
+    while (gzip_queue.count == 0) {
+      pthread_cond_wait(&gzip_queue.not_empty, &gzip_queue.mutex);
+    }
+    strcpy(cache_path, gzip_queue.paths[gzip_queue.head]);
+    gzip_queue.head = (gzip_queue.head + 1) % GZIP_QUEUE_LEN;
+    gzip_queue.count--;
+    pthread_mutex_unlock(&gzip_queue.mutex);
+
+    CompressCacheFile(cache_path);
+  }
+
+  return NULL;
+}
+
+/**
+ * Queue cache_path to be compressed in background. The request is dropped
+ * if the queue is full, so that workers never wait for the compressor.
+ */
+static void EnqueueCompression(const char *cache_path) {
+  if (!gzip_queue.enabled) return;
+
+  pthread_mutex_lock(&gzip_queue.mutex);
+  if (gzip_queue.count < GZIP_QUEUE_LEN) {
+    int tail = (gzip_queue.head + gzip_queue.count) % GZIP_QUEUE_LEN;
+    strcpy(gzip_queue.paths[tail], cache_path);
+    gzip_queue.count++;
+    pthread_cond_signal(&gzip_queue.not_empty);
+  }
+  pthread_mutex_unlock(&gzip_queue.mutex);
+}
+
+void SetCacheCompression(int enable) {
+  if (enable && !gzip_queue.enabled) {
+    if (pthread_create(&gzip_queue.tid, NULL, CompressThread, NULL) != 0) {
+      return;
+    }
+    pthread_detach(gzip_queue.tid);
+    gzip_queue.enabled = 1;
+  }
+}
+
+int UseGzipCache(struct CacheInfo *cache_info) {
+  if (cache_info->is_open) return cache_info->is_gzip;
+  cache_info->is_gzip = cache_info->meta.has_gzip;
+  return cache_info->is_gzip;
+}
+
 void FreeCacheInfo(struct CacheInfo *cache_info) {
+  // content in a segment is pinned
+  if (cache_info->data) {
+    UnpinSegment(&cache_info->data_location);
+    cache_info->data = NULL;
+  }
   // cache is opened for reading
   if (cache_info->is_open) {
     close(cache_info->fd);
@@ -226,41 +700,138 @@ void FreeCacheInfo(struct CacheInfo *cache_info) {
   }
   // cache is opened for writing
   else if (cache_info->is_write) {
-    close(cache_info->fd);
-    cache_info->fd = -1;
-    cache_info->is_write = 0;
+    const char *key = GetCacheKey(cache_info->cache_path);
+    struct stat st_buf;
+    struct CacheMeta meta;
+    memset(&meta, 0, sizeof(meta));
+    if (fstat(cache_info->fd, &st_buf) == 0) meta.size = st_buf.st_size;
+    meta.fresh_until = NowSeconds() + cache_info->max_age;
+    meta.stale_until = meta.fresh_until + cache_info->stale_while_revalidate;
+    meta.error_until = meta.fresh_until + cache_info->stale_if_error;
+
+    // The compressed variant of the old content is stale now
+    SetCacheIndexGzip(key, cache_info->key_hash, 0);
+    RemoveDir(cache_info->gzip_path);
     if (IsCacheError(cache_info)) {
       RemoveDir(cache_info->temp_path);
     }
-    else if (rename(cache_info->temp_path, cache_info->cache_path) < 0) {
+    /// Small content is appended to a segment instead of a file of its
+    /// own, and the old content file, if any, is stale now
+    else if (AppendSegment(key, cache_info->key_hash, cache_info->fd,
+                           &meta) == 0) {
+      RemoveDir(cache_info->temp_path);
+      RemoveDir(cache_info->cache_path);
+      EnqueueCompression(cache_info->cache_path);
+    }
+    else if (CreateParentDir(cache_info->cache_path) != 0 ||
+             rename(cache_info->temp_path, cache_info->cache_path) < 0) {
       RemoveDir(cache_info->temp_path);
     }
+    else {
+      InsertCacheIndex(key, cache_info->key_hash, &meta);
+      EnqueueCompression(cache_info->cache_path);
+    }
+
+    close(cache_info->fd);
+    cache_info->fd = -1;
+    cache_info->is_write = 0;
   }
 }
 
 void RemoveCache(struct CacheInfo *cache_info) {
+  // Remove the index entry first, so that no one will read the files
+  const char *key = GetCacheKey(cache_info->cache_path);
+  if (key) RemoveCacheIndex(key, cache_info->key_hash);
+
   // Remove cache file
   if (strlen(cache_info->cache_path) > 0) {
     RemoveDir(cache_info->cache_path);
   }
+  // Remove compressed cache file
+  if (strlen(cache_info->gzip_path) > 0) {
+    RemoveDir(cache_info->gzip_path);
+  }
 }
 
 int IsCacheHit(struct CacheInfo *cache_info) {
-  int retval = 0;
-  struct stat st_buf;
-
-  // Can't access cache file, not hit
-  if (access(cache_info->cache_path, F_OK) != 0)
+  // CACHE_DIR is emptied at init and every cache file is indexed when it
+  // is renamed into place, so the index alone decides a hit.
+  if (!LookupCacheIndex(GetCacheKey(cache_info->cache_path),
+                        cache_info->key_hash, &cache_info->meta))
     return 0;
 
-  // Can't open meta data of cache file, not hit
-  retval = stat(cache_info->cache_path, &st_buf);
-  if (retval != 0) {
-    return 0;
+  // Content in a recycled segment is gone, which is a miss
+  if (cache_info->meta.location.generation != 0 && !cache_info->data) {
+    cache_info->data = PinSegment(&cache_info->meta.location);
+    if (!cache_info->data) return 0;
+    cache_info->data_len = cache_info->meta.size;
+    cache_info->data_pos = 0;
+    cache_info->data_location = cache_info->meta.location;
   }
+  return 1;
+}
 
-  // If cache_path is regular file, then hit
-  return S_ISREG(st_buf.st_mode);
+const char *GetCacheData(struct CacheInfo *cache_info, size_t *len) {
+  if (!cache_info->data || cache_info->is_gzip) return NULL;
+  *len = cache_info->data_len;
+  return cache_info->data;
+}
+
+enum CacheFreshness GetCacheFreshness(struct CacheInfo *cache_info) {
+  int64_t now = NowSeconds();
+
+  if (now < cache_info->meta.fresh_until) return CACHE_FRESH;
+  if (now < cache_info->meta.stale_until) return CACHE_STALE;
+  return CACHE_EXPIRED;
+}
+
+int IsCacheUsableOnError(struct CacheInfo *cache_info) {
+  return NowSeconds() < cache_info->meta.error_until;
+}
+
+int StartCacheRefresh(struct CacheInfo *cache_info) {
+  int64_t now = NowSeconds();
+  return MarkCacheIndexRefresh(GetCacheKey(cache_info->cache_path),
+                               cache_info->key_hash, now,
+                               now + CACHE_REFRESH_TIMEOUT);
+}
+
+void SetCacheFreshness(struct CacheInfo *cache_info, int max_age,
+                       int stale_while_revalidate, int stale_if_error) {
+  if (max_age >= 0) cache_info->max_age = max_age;
+  if (stale_while_revalidate >= 0)
+    cache_info->stale_while_revalidate = stale_while_revalidate;
+  if (stale_if_error >= 0) cache_info->stale_if_error = stale_if_error;
+}
+
+int IsCacheAdmitted(struct CacheInfo *cache_info) {
+  if (!sketch.enabled) return 1;
+
+  if (cache_info->admission == ADMISSION_UNKNOWN) {
+    pthread_mutex_lock(&sketch.mutex);
+    int freq = SketchEstimate(cache_info->key_hash);
+    pthread_mutex_unlock(&sketch.mutex);
+
+    if (freq >= CACHE_ADMIT_MIN_FREQ) {
+      cache_info->admission = ADMISSION_ACCEPT;
+      atomic_fetch_add(&admission_accepted, 1);
+    }
+    else {
+      cache_info->admission = ADMISSION_REJECT;
+      atomic_fetch_add(&admission_rejected, 1);
+    }
+  }
+
+  return cache_info->admission == ADMISSION_ACCEPT;
+}
+
+void ForceCacheAdmission(struct CacheInfo *cache_info) {
+  cache_info->admission = ADMISSION_ACCEPT;
+}
+
+void GetCacheAdmissionStats(long *accepted, long *rejected) {
+  *accepted = atomic_load(&admission_accepted);
+  *rejected = atomic_load(&admission_rejected);
 }
 
 int IsCacheError(struct CacheInfo *cache_info) {
@@ -274,7 +845,9 @@ int IsCacheError(struct CacheInfo *cache_info) {
  */
 int OpenCacheFile(struct CacheInfo *cache_info, int flags) {
   if (!cache_info->is_open) {
-    cache_info->fd = open(cache_info->cache_path, flags, DEF_MODE);
+    const char *path = cache_info->is_gzip ? cache_info->gzip_path
+                                           : cache_info->cache_path;
+    cache_info->fd = open(path, flags, DEF_MODE);
     if (cache_info->fd < 0) {
       return 1;
     }
@@ -285,28 +858,6 @@ int OpenCacheFile(struct CacheInfo *cache_info, int flags) {
   return 0;
 }
 
-/**
- * \returns 0 if success, 1 otherwise.
- */
-int CreateCacheDir(struct CacheInfo *cache_info) {
-  int retval = 0;
-  
-  char *cache_dir = cache_info->cache_path;
-  int cache_path_len = strlen(cache_dir);
-  while (cache_path_len > 0 && cache_dir[cache_path_len-1] != '/') {
-    cache_path_len--;
-  }
-  if (cache_path_len > 0) {
-    char tmp = cache_dir[cache_path_len];
-    cache_dir[cache_path_len] = '\0';
-    retval = CreateDir(cache_dir);
-    cache_dir[cache_path_len] = tmp;
-    if (retval != 0) return 1;
-  }
-
-  return 0;
-}
-
 /**
  * \returns 0 if success, 1 otherwise.
  */
@@ -345,37 +896,56 @@ int CreateTempDir(struct CacheInfo *cache_info) {
   return 0;
 }
 
-ssize_t WriteToCache(struct CacheInfo *cache_info,
-                     void *content, size_t length) {
+void SetCacheError(struct CacheInfo *cache_info, int errnum) {
+  strerror_r(errnum, cache_info->error_msg, sizeof(cache_info->error_msg));
+}
+
+int GetCacheWriteFd(struct CacheInfo *cache_info) {
   ssize_t retval = 0;
 
   if (!cache_info->is_write) {
-    // Make sure cache dir is created
-    retval = CreateCacheDir(cache_info);
+    // Make sure temp dir is created
+    retval = CreateTempDir(cache_info);
     if (retval != 0) {
-      strerror_r(errno, cache_info->error_msg, sizeof(cache_info->error_msg));
+      SetCacheError(cache_info, errno);
       return -1;
     }
 
-    // Make sure temp dir is created
-    retval = CreateTempDir(cache_info);
+    // Make sure temp file is opened, it's read back into a segment
+    retval = OpenTempFile(cache_info, O_RDWR|O_CREAT|O_EXCL);
     if (retval != 0) {
-      strerror_r(errno, cache_info->error_msg, sizeof(cache_info->error_msg));
+      SetCacheError(cache_info, errno);
       return -1;
     }
+  }
 
-    // Make sure temp file is opened
-    retval = OpenTempFile(cache_info, O_WRONLY|O_CREAT|O_EXCL);
-    if (retval != 0) {
-      strerror_r(errno, cache_info->error_msg, sizeof(cache_info->error_msg));
+  return cache_info->fd;
+}
+
+int GetCacheReadFd(struct CacheInfo *cache_info) {
+  if (!cache_info->is_open) {
+    // Make sure cache file is opened
+    if (OpenCacheFile(cache_info, O_RDONLY) != 0) {
+      SetCacheError(cache_info, errno);
       return -1;
     }
   }
 
+  return cache_info->fd;
+}
+
+ssize_t WriteToCache(struct CacheInfo *cache_info,
+                     void *content, size_t length) {
+  ssize_t retval = 0;
+
+  // Make sure temp file is opened
+  int fd = GetCacheWriteFd(cache_info);
+  if (fd < 0) return -1;
+
   // Write to temp file
-  retval = rio_writen(cache_info->fd, content, length);
+  retval = rio_writen(fd, content, length);
   if (retval < 0) {
-    strerror_r(errno, cache_info->error_msg, sizeof(cache_info->error_msg));
+    SetCacheError(cache_info, errno);
     return -1;
   }
 
@@ -386,19 +956,27 @@ ssize_t ReadLineFromCache(struct CacheInfo *cache_info,
                           void *buf, size_t max_len) {
   ssize_t retval = 0;
 
-  if (!cache_info->is_open) {
-    // Make sure cache file is opened
-    retval = OpenCacheFile(cache_info, O_RDONLY);
-    if (retval != 0) {
-      strerror_r(errno, cache_info->error_msg, sizeof(cache_info->error_msg));
-      return -1;
-    }
+  // Read the content in a segment from memory
+  if (cache_info->data && !cache_info->is_gzip) {
+    const char *start = cache_info->data + cache_info->data_pos;
+    size_t left = cache_info->data_len - cache_info->data_pos;
+    if (max_len == 0) return 0;
+    if (left > max_len - 1) left = max_len - 1;
+    const char *newline = memchr(start, '\n', left);
+    retval = newline ? newline - start + 1 : left;
+    memcpy(buf, start, retval);
+    ((char *)buf)[retval] = '\0';
+    cache_info->data_pos += retval;
+    return retval;
   }
 
+  // Make sure cache file is opened
+  if (GetCacheReadFd(cache_info) < 0) return -1;
+
   // Read a line from cache file
   retval = rio_readlineb(&cache_info->rp, buf, max_len);
   if (retval < 0) {
-    strerror_r(errno, cache_info->error_msg, sizeof(cache_info->error_msg));
+    SetCacheError(cache_info, errno);
     return -1;
   }
 
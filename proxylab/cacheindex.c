@@ -0,0 +1,257 @@
+#include "cacheindex.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static struct IndexShard *shards = NULL;
+static int index_shard_bits = 0;
+
+/**
+ * \returns the shard that key_hash belongs to.
+ */
+static inline struct IndexShard *GetShard(uint64_t key_hash) {
+  if (index_shard_bits == 0) return &shards[0];
+  return &shards[key_hash >> (64 - index_shard_bits)];
+}
+
+/**
+ * \returns the bucket in shard that key_hash belongs to.
+ */
+static inline struct IndexEntry **GetBucket(struct IndexShard *shard,
+                                            uint64_t key_hash) {
+  return &shard->buckets[key_hash & (shard->bucket_num - 1)];
+}
+
+/**
+ * Find key in shard.
+ * Note: the lock of shard should be held.
+ *
+ * \returns the entry if found, NULL otherwise.
+ */
+static struct IndexEntry *FindEntry(struct IndexShard *shard,
+                                    const char *key, uint64_t key_hash) {
+  struct IndexEntry *entry = *GetBucket(shard, key_hash);
+  while (entry) {
+    if (entry->key_hash == key_hash && strcmp(entry->key, key) == 0)
+      return entry;
+    entry = entry->next;
+  }
+  return NULL;
+}
+
+/**
+ * Double the buckets of shard and rehash all its entries. The shard is
+ * left unchanged if memory is not enough.
+ * Note: the write lock of shard should be held.
+ */
+static void GrowShard(struct IndexShard *shard) {
+  size_t bucket_num = shard->bucket_num * 2;
+  struct IndexEntry **buckets = calloc(bucket_num, sizeof(*buckets));
+  if (!buckets) return;
+
+  for (size_t i = 0; i < shard->bucket_num; i++) {
+    struct IndexEntry *entry = shard->buckets[i];
+    while (entry) {
+      struct IndexEntry *next = entry->next;
+      struct IndexEntry **bucket = &buckets[entry->key_hash & (bucket_num-1)];
+      entry->next = *bucket;
+      *bucket = entry;
+      entry = next;
+    }
+  }
+
+  free(shard->buckets);
+  shard->buckets = buckets;
+  shard->bucket_num = bucket_num;
+}
+
+int InitCacheIndex(int shard_bits) {
+  int shard_num = 1 << shard_bits;
+
+  if (shards) FreeCacheIndex();
+  if (posix_memalign((void **)&shards, sizeof(struct IndexShard),
+                     shard_num * sizeof(struct IndexShard))) {
+    shards = NULL;
+    return -1;
+  }
+  index_shard_bits = shard_bits;
+
+  for (int i = 0; i < shard_num; i++) {
+    pthread_rwlock_init(&shards[i].lock, NULL);
+    shards[i].buckets = calloc(INDEX_INIT_BUCKETS, sizeof(struct IndexEntry *));
+    shards[i].bucket_num = INDEX_INIT_BUCKETS;
+    shards[i].entry_num = 0;
+    if (!shards[i].buckets) {
+      for (int j = 0; j < i; j++) free(shards[j].buckets);
+      free(shards);
+      shards = NULL;
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+void FreeCacheIndex() {
+  if (!shards) return;
+
+  for (int i = 0; i < (1 << index_shard_bits); i++) {
+    struct IndexShard *shard = &shards[i];
+    for (size_t j = 0; j < shard->bucket_num; j++) {
+      struct IndexEntry *entry = shard->buckets[j];
+      while (entry) {
+        struct IndexEntry *next = entry->next;
+        free(entry->key);
+        free(entry);
+        entry = next;
+      }
+    }
+    free(shard->buckets);
+    pthread_rwlock_destroy(&shard->lock);
+  }
+
+  free(shards);
+  shards = NULL;
+}
+
+int LookupCacheIndex(const char *key, uint64_t key_hash,
+                     struct CacheMeta *meta) {
+  struct IndexShard *shard = GetShard(key_hash);
+  int found = 0;
+
+  pthread_rwlock_rdlock(&shard->lock);
+  struct IndexEntry *entry = FindEntry(shard, key, key_hash);
+  if (entry) {
+    if (meta) *meta = entry->meta;
+    found = 1;
+  }
+  pthread_rwlock_unlock(&shard->lock);
+
+  return found;
+}
+
+int InsertCacheIndex(const char *key, uint64_t key_hash,
+                     const struct CacheMeta *meta) {
+  struct IndexShard *shard = GetShard(key_hash);
+
+  pthread_rwlock_wrlock(&shard->lock);
+  struct IndexEntry *entry = FindEntry(shard, key, key_hash);
+  if (entry) {
+    entry->meta = *meta;
+    pthread_rwlock_unlock(&shard->lock);
+    return 0;
+  }
+
+  // Add a new entry
+  entry = malloc(sizeof(*entry));
+  char *key_copy = strdup(key);
+  if (!entry || !key_copy) {
+    pthread_rwlock_unlock(&shard->lock);
+    free(entry);
+    free(key_copy);
+    return -1;
+  }
+  entry->key_hash = key_hash;
+  entry->key = key_copy;
+  entry->meta = *meta;
+
+  if (shard->entry_num >= 2 * shard->bucket_num) GrowShard(shard);
+  struct IndexEntry **bucket = GetBucket(shard, key_hash);
+  entry->next = *bucket;
+  *bucket = entry;
+  shard->entry_num++;
+  pthread_rwlock_unlock(&shard->lock);
+
+  return 0;
+}
+
+void SetCacheIndexGzip(const char *key, uint64_t key_hash, int has_gzip) {
+  struct IndexShard *shard = GetShard(key_hash);
+
+  pthread_rwlock_wrlock(&shard->lock);
+  struct IndexEntry *entry = FindEntry(shard, key, key_hash);
+  if (entry) entry->meta.has_gzip = has_gzip;
+  pthread_rwlock_unlock(&shard->lock);
+}
+
+int MarkCacheIndexRefresh(const char *key, uint64_t key_hash,
+                          int64_t now, int64_t until) {
+  struct IndexShard *shard = GetShard(key_hash);
+  int marked = 0;
+
+  pthread_rwlock_wrlock(&shard->lock);
+  struct IndexEntry *entry = FindEntry(shard, key, key_hash);
+  if (entry && entry->meta.refresh_until <= now) {
+    entry->meta.refresh_until = until;
+    marked = 1;
+  }
+  pthread_rwlock_unlock(&shard->lock);
+
+  return marked;
+}
+
+int MoveCacheIndex(const char *key, uint64_t key_hash,
+                   const struct CacheLocation *from,
+                   const struct CacheLocation *to) {
+  struct IndexShard *shard = GetShard(key_hash);
+  int moved = 0;
+
+  pthread_rwlock_wrlock(&shard->lock);
+  struct IndexEntry **link = GetBucket(shard, key_hash);
+  while (*link) {
+    struct IndexEntry *entry = *link;
+    if (entry->key_hash == key_hash && strcmp(entry->key, key) == 0) {
+      struct CacheLocation *location = &entry->meta.location;
+      if (location->segment == from->segment &&
+          location->generation == from->generation &&
+          location->offset == from->offset) {
+        if (to) {
+          *location = *to;
+        }
+        else {
+          *link = entry->next;
+          free(entry->key);
+          free(entry);
+          shard->entry_num--;
+        }
+        moved = 1;
+      }
+      break;
+    }
+    link = &entry->next;
+  }
+  pthread_rwlock_unlock(&shard->lock);
+
+  return moved;
+}
+
+void RemoveCacheIndex(const char *key, uint64_t key_hash) {
+  struct IndexShard *shard = GetShard(key_hash);
+
+  pthread_rwlock_wrlock(&shard->lock);
+  struct IndexEntry **link = GetBucket(shard, key_hash);
+  while (*link) {
+    struct IndexEntry *entry = *link;
+    if (entry->key_hash == key_hash && strcmp(entry->key, key) == 0) {
+      *link = entry->next;
+      free(entry->key);
+      free(entry);
+      shard->entry_num--;
+      break;
+    }
+    link = &entry->next;
+  }
+  pthread_rwlock_unlock(&shard->lock);
+}
+
+size_t CacheIndexSize() {
+  size_t size = 0;
+
+  for (int i = 0; i < (1 << index_shard_bits); i++) {
+    pthread_rwlock_rdlock(&shards[i].lock);
+    size += shards[i].entry_num;
+    pthread_rwlock_unlock(&shards[i].lock);
+  }
+
+  return size;
+}
@@ -1,34 +1,70 @@
 #include "http.h"
+#include "scan.h"
 
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 
 const char *const ErrorMsgs[] = {
   "",
   "Fail to allocate dynamic memory.",
-  "Read line length exceeds max buffer size.",
-  "Read line has zero length.",
-  "Too much origin_lines in HttpRequest.",
+  "Request line and headers exceed HTTP_BUF_SIZE.",
+  "Too much request headers in HttpRequest.",
   "Request line is incomplete.",
   "Method field length exceeds METHOD_LEN.",
   "Url field length exceeds URL_LEN.",
   "Version field length exceeds VER_LEN.",
   "Request header is incomplete.",
-  "Host filed length exceeds HOST_LEN."
+  "Host filed length exceeds HOST_LEN.",
+  "Status line and headers exceed HTTP_BUF_SIZE.",
+  "Status line is invalid.",
+  "Content-Length is invalid.",
+  "Chunked body is invalid.",
+  "Transfer-Encoding of request is not chunked."
 };
 
-int InitHttpRequest(struct HttpRequest *http_req) {
-  // Set all strings to empty strings
+/* Delimiters that end a line, a request line token and a header name */
+static const struct ScanSet LINE_END = SCAN_SET("\n");
+static const struct ScanSet TOKEN_END = SCAN_SET(" ");
+static const struct ScanSet NAME_END = SCAN_SET(":");
+
+/**
+ * Size of the perfect hash table of well-known header names, must be a
+ * power of two.
+ */
+#define HEADER_HASH_SIZE 64
+/**
+ * The perfect hash of a header name from its length, first and last
+ * chars. The multipliers are chosen so that no two names in
+ * HTTP_HEADER_LIST collide, which the compiler checks: a collision is a
+ * duplicate case value in LookupHttpHeaderId.
+ */
+#define HEADER_HASH(len, first, last) \
+  (((len) + ((first) | 0x20) + ((last) | 0x20) * 7) & (HEADER_HASH_SIZE - 1))
+
+/* Names of well-known headers, indexed by id */
+static const char *const HeaderNames[HEADER_ID_NUM] = {
+  [HEADER_OTHER] = "",
+#define HEADER_NAME(id, name, first, last) [id] = name,
+  HTTP_HEADER_LIST(HEADER_NAME)
+#undef HEADER_NAME
+};
+
+int InitHttpRequest(struct HttpRequest *http_req, struct Arena *arena) {
+  // Set all spans to empty spans
   memset(&http_req->request_line, 0, sizeof(http_req->request_line));
   memset(&http_req->request_headers, 0, sizeof(http_req->request_headers));
-  http_req->origin_lines = NULL;
+  http_req->header_num = 0;
+  for (int i = 0; i < HEADER_ID_NUM; i++) http_req->header_index[i] = -1;
 
-  // Allocate memory to origin_lines
-  void *ptr = malloc(sizeof(struct ReadLine) * INIT_PARSE_LINES);
-  if (!ptr) return ERROR_MEM;
-  http_req->origin_lines = (struct ReadLine *)ptr;
-  http_req->line_num = INIT_PARSE_LINES;
-  http_req->cur_line = 0;
+  // Allocate memory to the receive buffer
+  http_req->buf = (char *)ArenaAlloc(arena, HTTP_BUF_SIZE);
+  if (!http_req->buf) return ERROR_MEM;
+  http_req->buf_len = 0;
+  http_req->line_start = 0;
+  http_req->scan_pos = 0;
+  http_req->body_off = 0;
+  http_req->body_len = 0;
 
   // Set parse_state
   http_req->parse_state = PARSE_LINE;
@@ -37,204 +73,1084 @@ int InitHttpRequest(struct HttpRequest *http_req) {
 }
 
 void FreeHttpRequest(struct HttpRequest *http_req) {
-  // Free dynamic memory
-  if (http_req->origin_lines) {
-    free(http_req->origin_lines);
-    http_req->origin_lines = NULL;
-  }
+  // The buffer belongs to the arena
+  http_req->buf = NULL;
 }
 
-int AddLineToHttpRequest(struct HttpRequest *http_req, char *line) {
-  // Check line length
-  size_t line_length = strnlen(line, MAXBUF);
-  if (line_length == MAXBUF) return ERROR_LINE_TOO_LONG;
-  if (line_length == 0) return ERROR_LINE_ZERO;
-
-  int line_finish = (line[line_length-1] == '\n');
-
-  // Check if origin_lines has enough memory
-  if (http_req->cur_line == http_req->line_num) {
-    if (http_req->line_num >= MAX_PARSE_LINES)
-      return ERROR_READLINE_TOO_MUCH;
-    http_req->line_num *= 2;
-    void *ptr = realloc(http_req->origin_lines,
-                        sizeof(struct ReadLine) * http_req->line_num);
-    if (!ptr) {
-      free(http_req->origin_lines);
-      http_req->origin_lines = NULL;
-      return ERROR_MEM;
-    }
-    http_req->origin_lines = ptr;
-  }
-
-  // Add line
-  strcpy(http_req->origin_lines[http_req->cur_line].line, line);
-  http_req->origin_lines[http_req->cur_line].line_finish = line_finish;
-  http_req->cur_line++;
+/**
+ * \returns the C string spanned by span, an empty string if span is empty.
+ */
+static const char *SpanToString(struct HttpRequest *http_req,
+                                struct HttpSpan span) {
+  if (span.len == 0) return "";
+  return http_req->buf + span.off;
+}
 
-  return 0;
+/**
+ * \returns 1 if span equals name case-insensitively, otherwise 0.
+ */
+static int IsSpanEqual(struct HttpRequest *http_req, struct HttpSpan span,
+                       const char *name) {
+  return span.len == strlen(name) &&
+         strncasecmp(http_req->buf + span.off, name, span.len) == 0;
 }
 
 /**
- * Extract the actual url in the http proxy protocol.
+ * Find the actual url in the http proxy protocol.
  * 
  * The url field in HTTP PROXY is like 'http://127.0.0.1:8080/',
  * the proxy should remove the preceding protocol and hostname to get
- * the actual url '/', which is stored in http_req->request_line.proxy_url.
+ * the actual url '/', which is spanned by http_req->request_line.proxy_url.
  */
-void GetProxyUrl(struct HttpRequest *http_req) {
+static void FindProxyUrl(struct HttpRequest *http_req) {
+  struct HttpSpan url = http_req->request_line.url;
   int forslash_cnt = 0;
-  char *url = http_req->request_line.url;
-  
+
   // Find the thrid '/' and set proxy url
-  while (*url) {
-    if (*url == '/') {
+  for (uint32_t i = 0; i < url.len; i++) {
+    if (http_req->buf[url.off + i] == '/') {
       forslash_cnt++;
       if (forslash_cnt == 3) {
-        http_req->request_line.proxy_url = url;
+        http_req->request_line.proxy_url.off = url.off + i;
+        http_req->request_line.proxy_url.len = url.len - i;
         return;
       }
     }
-    url++;
   }
 
-  // By default, the proxy url is NULL
-  http_req->request_line.proxy_url = NULL;
+  // By default, the proxy url is empty
+  http_req->request_line.proxy_url.len = 0;
 }
 
-int ParseRequestLine(struct HttpRequest *http_req, char *line) {
-  char *str = line;
-  char *cur = line;
-  int cnt = 0;
-  
-  while (1) {
-    if (*cur == '\0') return ERROR_REQUEST_LINE_INCOMPLETE;
-    if (*cur == ' ' || *cur == '\r' || *cur == '\n') {
-      *cur = '\0';
-      int str_len = strlen(str);
-      if (str_len > 0) {
-        if (cnt == 0) {               // method
-          if (str_len >= METHOD_LEN) return ERROR_METHOD_TOO_LONG;
-          strcpy(http_req->request_line.method, str);
-          cnt++;
-        }
-        else if (cnt == 1) {          // url
-          if (str_len >= URL_LEN) return ERROR_URL_TOO_LONG;
-          strcpy(http_req->request_line.url, str);
-          cnt++;
-          GetProxyUrl(http_req);
-        }
-        else if (cnt == 2) {          // version
-          if (str_len >= VER_LEN) return ERROR_VERSION_TOO_LONG;
-          strcpy(http_req->request_line.version, str);
-          cnt++;
-        }
-      }
-      str = cur+1;
-    }
-    if (cnt == 3) break;
-    cur++;
+/**
+ * Tokenize the request line in buf[start, end), end is the offset of the
+ * line terminator.
+ */
+static int ParseRequestLine(struct HttpRequest *http_req,
+                            size_t start, size_t end) {
+  struct HttpSpan *tokens[3] = {
+    &http_req->request_line.method,
+    &http_req->request_line.url,
+    &http_req->request_line.version
+  };
+  const size_t max_lens[3] = { METHOD_LEN, URL_LEN, VER_LEN };
+  const int errors[3] = {
+    ERROR_METHOD_TOO_LONG, ERROR_URL_TOO_LONG, ERROR_VERSION_TOO_LONG
+  };
+  char *buf = http_req->buf;
+  size_t cur = start;
+
+  // Empty lines before the request line are ignored
+  if (start == end) return 0;
+
+  for (int cnt = 0; cnt < 3; cnt++) {
+    while (cur < end && buf[cur] == ' ') cur++;
+    if (cur >= end) return ERROR_REQUEST_LINE_INCOMPLETE;
+    size_t token = cur;
+    cur += ScanDelims(&TOKEN_END, buf + cur, end - cur);
+    if (cur - token >= max_lens[cnt]) return errors[cnt];
+    tokens[cnt]->off = token;
+    tokens[cnt]->len = cur - token;
+    /// buf[end] is the line terminator, so it's safe to terminate here
+    buf[cur++] = '\0';
+  }
+
+  FindProxyUrl(http_req);
+  /// The url of CONNECT is the authority 'host:port' to tunnel to,
+  /// which is also what the Host field should be.
+  if (IsConnectRequest(http_req)) {
+    if (http_req->request_line.url.len >= HOST_LEN) return ERROR_HOST_TOO_LONG;
+    http_req->request_headers.host = http_req->request_line.url;
   }
 
   http_req->parse_state = PARSE_HEADERS;
   return 0;
 }
 
-int ParseHeaders(struct HttpRequest *http_req, char *line) {
+/**
+ * Find the end of the line starting at line_start in buf[0, buf_len),
+ * resuming the search at *scan_pos, so bytes that have been searched
+ * are never searched again.
+ *
+ * \returns 1 if found, with the offset of the line terminator stored in
+ * end and the offset of the next line in next_line, otherwise 0.
+ */
+static int FindLineEnd(const char *buf, size_t buf_len, size_t *scan_pos,
+                       size_t line_start, size_t *end, size_t *next_line) {
+  size_t line_end = *scan_pos +
+                    ScanDelims(&LINE_END, buf + *scan_pos, buf_len - *scan_pos);
+  if (line_end == buf_len) {
+    *scan_pos = buf_len;
+    return 0;
+  }
+
+  *next_line = line_end + 1;
+  if (line_end > line_start && buf[line_end-1] == '\r') line_end--;
+  *end = line_end;
+  return 1;
+}
+
+/**
+ * Tokenize the header line in buf[start, end), end is the offset of the
+ * line terminator, and add the header to a header table.
+ *
+ * \returns 0 if success, with the header stored in added, otherwise an
+ * error_code.
+ */
+static int AddHeader(char *buf, size_t start, size_t end,
+                     struct HttpHeader *headers, int *header_num,
+                     int *header_index, struct HttpHeader **added) {
+  // Get the field name
+  size_t colon = start + ScanDelims(&NAME_END, buf + start, end - start);
+  if (colon == end || colon == start) return ERROR_REQUEST_HEADER_INCOMPLETE;
+  size_t value = colon + 1;
+
+  // Get the value without surrounding white spaces
+  size_t value_end = end;
+  while (value < value_end && (buf[value] == ' ' || buf[value] == '\t'))
+    value++;
+  while (value_end > value &&
+         (buf[value_end-1] == ' ' || buf[value_end-1] == '\t'))
+    value_end--;
+
+  // Record the header
+  if (*header_num == MAX_HEADERS) return ERROR_TOO_MANY_HEADERS;
+  struct HttpHeader *header = &headers[(*header_num)++];
+  header->name.off = start;
+  header->name.len = colon - start;
+  header->value.off = value;
+  header->value.len = value_end - value;
+  header->next = -1;
+  buf[value_end] = '\0';
+
+  // Add the header to the table of its id
+  header->id = LookupHttpHeaderId(buf + start, header->name.len);
+  if (header->id != HEADER_OTHER) {
+    int *index = &header_index[header->id];
+    while (*index >= 0) index = &headers[*index].next;
+    *index = *header_num - 1;
+  }
+
+  *added = header;
+  return 0;
+}
+
+/**
+ * Tokenize the header line in buf[start, end), end is the offset of the
+ * line terminator.
+ */
+static int ParseHeaderLine(struct HttpRequest *http_req,
+                           size_t start, size_t end) {
+  struct HttpHeader *header;
+
   // This means the end of request headers.
-  if (strcmp(line, "\r\n") == 0) {
+  if (start == end) {
     http_req->parse_state = PARSE_DATA;
     return 0;
   }
 
-  // Get the field name
-  char *field = line;
-  char *cur = line;
-  while (*cur != ':' && *cur != '\0') cur++;
-  if (*cur == '\0') return ERROR_REQUEST_HEADER_INCOMPLETE;
-  *cur = '\0';
-
-  cur++;
-  while (*cur == ' ') cur++;
-
-  // Get the value
-  char *value = cur;
-  int value_len = strlen(value);
-  if (value_len <= 2) return ERROR_REQUEST_HEADER_INCOMPLETE;
-  value[value_len-2] = '\0';
-  value_len = value_len-2;
+  int retval = AddHeader(http_req->buf, start, end, http_req->headers,
+                         &http_req->header_num, http_req->header_index,
+                         &header);
+  if (retval != 0) return retval;
 
   // Update HttpRequest
-  if (strcmp(field, "Host") == 0) {
-    if (value_len >= HOST_LEN) return ERROR_HOST_TOO_LONG;
-    strcpy(http_req->request_headers.host, value);
+  if (header->id == HEADER_HOST) {
+    if (header->value.len >= HOST_LEN) return ERROR_HOST_TOO_LONG;
+    if (!IsConnectRequest(http_req))
+      http_req->request_headers.host = header->value;
   }
 
   return 0;
 }
 
-int ParseHttpRequest(struct HttpRequest *http_req, char *line) {
-  // Add a new ReadLine to HttpRequest
-  int retval = AddLineToHttpRequest(http_req, line);
-  if (retval != 0) return retval;
+/**
+ * Reset body to parse a new body, which has no bytes until it's framed.
+ */
+static void InitHttpBody(struct HttpBody *body) {
+  body->type = BODY_NONE;
+  body->chunk_state = CHUNK_SIZE;
+  body->chunk_digits = 0;
+  body->trailer_line_len = 0;
+  body->length = 0;
+  body->remaining = 0;
+  body->is_complete = 0;
+}
+
+/**
+ * Parse the Content-Length value in buf at value.
+ *
+ * \returns 0 if success, with the length stored in length, otherwise an
+ * error_code.
+ */
+static int ParseContentLength(const char *value, uint64_t *length) {
+  char *end;
+
+  if (*value < '0' || *value > '9') return ERROR_CONTENT_LENGTH_INVALID;
+  errno = 0;
+  *length = strtoull(value, &end, 10);
+  if (errno != 0 || *end != '\0') return ERROR_CONTENT_LENGTH_INVALID;
+  return 0;
+}
+
+/**
+ * Decide the framing of a body from its Transfer-Encoding and
+ * Content-Length headers in the header table of a message, see RFC 9112
+ * section 6.3. Without both, a request has no body, and a response is
+ * delimited by close. Transfer-Encoding overrides Content-Length, and
+ * Content-Length headers with different values are an error, since
+ * the next hop could frame the message by any one of them.
+ */
+static int SetBodyFraming(struct HttpBody *body, const char *buf,
+                          struct HttpHeader *headers, int *header_index,
+                          int is_request) {
+  int encoding = header_index[HEADER_TRANSFER_ENCODING];
+  int length = header_index[HEADER_CONTENT_LENGTH];
+
+  if (encoding >= 0) {
+    /// Only a final chunked coding frames the body, which is the last
+    /// coding of the last header
+    while (headers[encoding].next >= 0) encoding = headers[encoding].next;
+    const char *value = buf + headers[encoding].value.off;
+    size_t len = headers[encoding].value.len;
+    if (len >= 7 && strncasecmp(value + len - 7, "chunked", 7) == 0)
+      body->type = BODY_CHUNKED;
+    else if (is_request)
+      return ERROR_TRANSFER_ENCODING_INVALID;
+    else
+      body->type = BODY_UNTIL_CLOSE;
+  }
+  else if (length >= 0) {
+    uint64_t remaining, other;
+    int retval = ParseContentLength(buf + headers[length].value.off,
+                                    &remaining);
+    if (retval != 0) return retval;
+    for (int i = headers[length].next; i >= 0; i = headers[i].next) {
+      retval = ParseContentLength(buf + headers[i].value.off, &other);
+      if (retval != 0) return retval;
+      if (other != remaining) return ERROR_CONTENT_LENGTH_INVALID;
+    }
+    body->type = BODY_LENGTH;
+    body->remaining = remaining;
+    if (remaining == 0) body->is_complete = 1;
+  }
+  else if (is_request) {
+    body->type = BODY_NONE;
+    body->is_complete = 1;
+  }
+  else {
+    body->type = BODY_UNTIL_CLOSE;
+  }
+
+  return 0;
+}
+
+/**
+ * Parse the chunked body in data[0, len).
+ *
+ * \returns the number of bytes of data that belong to the body, or
+ * -error_code if error occurs.
+ */
+static ssize_t ParseChunkedBody(struct HttpBody *body, const char *data,
+                                size_t len) {
+  size_t used = 0;
+
+  while (used < len && !body->is_complete) {
+    char ch = data[used];
+
+    switch (body->chunk_state) {
+      case CHUNK_SIZE:
+      case CHUNK_EXT:
+        used++;
+        if (ch == '\n') {
+          if (body->chunk_digits == 0) return -ERROR_CHUNK_INVALID;
+          body->chunk_state = body->remaining > 0 ? CHUNK_DATA
+                                                  : CHUNK_TRAILER;
+          body->trailer_line_len = 0;
+        }
+        else if (body->chunk_state == CHUNK_EXT || ch == '\r') {
+          continue;
+        }
+        else if (ch == ';' || ch == ' ' || ch == '\t') {
+          body->chunk_state = CHUNK_EXT;
+        }
+        else {
+          int digit;
+          if (ch >= '0' && ch <= '9') digit = ch - '0';
+          else if (ch >= 'a' && ch <= 'f') digit = ch - 'a' + 10;
+          else if (ch >= 'A' && ch <= 'F') digit = ch - 'A' + 10;
+          else return -ERROR_CHUNK_INVALID;
+          if (body->remaining >> 60) return -ERROR_CHUNK_INVALID;
+          body->remaining = (body->remaining << 4) | digit;
+          body->chunk_digits++;
+        }
+        break;
+
+      case CHUNK_DATA: {
+        size_t data_len = len - used;
+        if (data_len > body->remaining) data_len = body->remaining;
+        used += data_len;
+        body->remaining -= data_len;
+        if (body->remaining == 0) body->chunk_state = CHUNK_DATA_END;
+        break;
+      }
+
+      case CHUNK_DATA_END:
+        used++;
+        if (ch == '\n') {
+          body->chunk_state = CHUNK_SIZE;
+          body->chunk_digits = 0;
+        }
+        else if (ch != '\r') {
+          return -ERROR_CHUNK_INVALID;
+        }
+        break;
+
+      case CHUNK_TRAILER:
+        used++;
+        /// The trailer ends with an empty line
+        if (ch == '\n') {
+          if (body->trailer_line_len == 0) body->is_complete = 1;
+          body->trailer_line_len = 0;
+        }
+        else if (ch != '\r') {
+          body->trailer_line_len++;
+        }
+        break;
+    }
+  }
+
+  return used;
+}
+
+/**
+ * Parse data[0, len) of body according to its framing.
+ *
+ * \returns the number of bytes of data that belong to the body, or
+ * -error_code if error occurs.
+ */
+static ssize_t ParseHttpBody(struct HttpBody *body, const char *data,
+                             size_t len) {
+  ssize_t used = len;
+
+  if (body->is_complete) return 0;
+
+  if (body->type == BODY_CHUNKED) {
+    used = ParseChunkedBody(body, data, len);
+  }
+  else if (body->type == BODY_LENGTH) {
+    if (used > body->remaining) used = body->remaining;
+    body->remaining -= used;
+    if (body->remaining == 0) body->is_complete = 1;
+  }
+  if (used > 0) body->length += used;
+
+  return used;
+}
+
+/**
+ * Decide the framing of the body of http_req once its headers are
+ * parsed.
+ */
+static int SetRequestFraming(struct HttpRequest *http_req) {
+  InitHttpBody(&http_req->body);
+
+  /// Everything after a CONNECT request belongs to the tunnel
+  if (IsConnectRequest(http_req)) {
+    http_req->body.type = BODY_UNTIL_CLOSE;
+    return 0;
+  }
+
+  return SetBodyFraming(&http_req->body, http_req->buf, http_req->headers,
+                        http_req->header_index, 1);
+}
+
+char *GetHttpRecvBuf(struct HttpRequest *http_req, size_t *size) {
+  *size = HTTP_BUF_SIZE - http_req->buf_len;
+  return http_req->buf + http_req->buf_len;
+}
+
+int ParseHttpRequest(struct HttpRequest *http_req, size_t len) {
+  char *buf = http_req->buf;
+  int is_framed = http_req->parse_state == PARSE_DATA;
+  int retval;
+
+  http_req->buf_len += len;
+
+  while (http_req->parse_state != PARSE_DATA) {
+    size_t end, next_line;
+    if (!FindLineEnd(buf, http_req->buf_len, &http_req->scan_pos,
+                     http_req->line_start, &end, &next_line)) {
+      if (http_req->buf_len == HTTP_BUF_SIZE) return ERROR_REQUEST_TOO_LARGE;
+      return 0;
+    }
+
+    // Parse Request Line
+    if (http_req->parse_state == PARSE_LINE)
+      retval = ParseRequestLine(http_req, http_req->line_start, end);
+    // Parse Headers
+    else
+      retval = ParseHeaderLine(http_req, http_req->line_start, end);
+    if (retval != 0) return retval;
+
+    http_req->line_start = next_line;
+    http_req->scan_pos = next_line;
+  }
+
+  if (!is_framed) {
+    http_req->body_off = http_req->line_start;
+    retval = SetRequestFraming(http_req);
+    if (retval != 0) return retval;
+  }
+
+  // The bytes after the headers are the body, and maybe bytes after it
+  size_t body_end = http_req->body_off + http_req->body_len;
+  ssize_t used = ParseHttpBody(&http_req->body, buf + body_end,
+                               http_req->buf_len - body_end);
+  if (used < 0) return -used;
+  http_req->body_len += used;
+
+  return 0;
+}
+
+/**
+ * Append a piece of data to iov.
+ */
+static inline void AppendIov(struct iovec *iov, int *iov_num,
+                             const void *base, size_t len) {
+  iov[*iov_num].iov_base = (void *)base;
+  iov[*iov_num].iov_len = len;
+  (*iov_num)++;
+}
+
+/**
+ * \returns 1 if the comma separated list contains a token equal to
+ * name[0, len) case-insensitively, otherwise 0.
+ */
+static int IsTokenListed(const char *list, const char *name, size_t len) {
+  while (*list) {
+    while (*list == ' ' || *list == '\t' || *list == ',') list++;
+    const char *token = list;
+    while (*list && *list != ',') list++;
+    const char *token_end = list;
+    while (token_end > token && (token_end[-1] == ' ' || token_end[-1] == '\t'))
+      token_end--;
+    if (token_end - token == len && strncasecmp(token, name, len) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+/**
+ * \returns 1 if header is only meaningful for the connection between
+ * the client and this proxy, and should not be forwarded, otherwise 0.
+ */
+static int IsHopByHopHeader(struct HttpRequest *http_req,
+                            struct HttpHeader *header) {
+  const enum HttpHeaderId list_ids[2] = {
+    HEADER_CONNECTION, HEADER_PROXY_CONNECTION
+  };
+
+  switch (header->id) {
+    case HEADER_CONNECTION:
+    case HEADER_PROXY_CONNECTION:
+    case HEADER_KEEP_ALIVE:
+    case HEADER_PROXY_AUTHORIZATION:
+    case HEADER_TE:
+    case HEADER_UPGRADE:
+      return 1;
+    /// Host is forwarded separately, and the framing of the body must be
+    /// kept whatever Connection says.
+    case HEADER_HOST:
+    case HEADER_CONTENT_LENGTH:
+    case HEADER_TRANSFER_ENCODING:
+      return 0;
+    default:
+      break;
+  }
+
+  // Connection may name more hop-by-hop headers
+  for (int i = 0; i < 2; i++) {
+    struct HttpHeader *list = GetHttpHeaderById(http_req, list_ids[i]);
+    for (; list; list = GetNextHttpHeader(http_req, list)) {
+      if (IsTokenListed(GetHttpHeaderValue(http_req, list),
+                        http_req->buf + header->name.off, header->name.len))
+        return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * \returns 1 if the client has more body bytes to send after those in
+ * the receive buffer, and is not waiting for a response before sending
+ * them, otherwise 0.
+ */
+static int IsBodyPending(struct HttpRequest *http_req) {
+  // 'Expect: 100-continue' clients wait for the server
+  if (GetHttpHeaderById(http_req, HEADER_EXPECT)) return 0;
+
+  return !IsRequestComplete(http_req);
+}
+
+/**
+ * Forward http_req to fd, see ForwardHttpRequest. The request line carries
+ * the url as the client sent it if is_absolute, otherwise the actual url.
+ */
+static ssize_t ForwardRequest(struct HttpRequest *http_req, int fd,
+                              int is_absolute) {
+  const char *connection = "Connection: close\r\n"
+                           "Proxy-Connection: close\r\n\r\n";
+  struct iovec iov[FORWARD_IOV_NUM];
+  struct iovec *cur_iov = iov;
+  int iov_num = 0;
+  ssize_t tot_len = 0;
+  size_t body_len;
+  char *body = GetHttpBody(http_req, &body_len);
+  int is_chunked = http_req->body.type == BODY_CHUNKED;
+  int flags = MSG_NOSIGNAL | (IsBodyPending(http_req) ? MSG_MORE : 0);
+  int is_socket = 1;
+
+  // Request line, with the url replaced by the actual url
+  AppendIov(iov, &iov_num, GetHttpMethod(http_req),
+            http_req->request_line.method.len);
+  AppendIov(iov, &iov_num, " ", 1);
+  if (is_absolute) {
+    AppendIov(iov, &iov_num, GetHttpUrl(http_req),
+              http_req->request_line.url.len);
+  }
+  else {
+    AppendIov(iov, &iov_num, GetHttpProxyUrl(http_req),
+              http_req->request_line.proxy_url.len);
+  }
+  AppendIov(iov, &iov_num, " ", 1);
+  AppendIov(iov, &iov_num, GetHttpVersion(http_req),
+            http_req->request_line.version.len);
+  AppendIov(iov, &iov_num, "\r\n", 2);
+
+  // Host first, then the end-to-end header lines, whose 'name: value'
+  // bytes are intact in the buffer
+  AppendIov(iov, &iov_num, "Host: ", 6);
+  AppendIov(iov, &iov_num, GetHttpHost(http_req),
+            http_req->request_headers.host.len);
+  AppendIov(iov, &iov_num, "\r\n", 2);
+  for (int i = 0; i < http_req->header_num; i++) {
+    struct HttpHeader *header = &http_req->headers[i];
+    if (header->id == HEADER_HOST || IsHopByHopHeader(http_req, header))
+      continue;
+    /// The body is framed by Transfer-Encoding, a Content-Length sent
+    /// along could frame it differently at the server
+    if (header->id == HEADER_CONTENT_LENGTH && is_chunked) continue;
+    AppendIov(iov, &iov_num, http_req->buf + header->name.off,
+              header->value.off + header->value.len - header->name.off);
+    AppendIov(iov, &iov_num, "\r\n", 2);
+  }
+  AppendIov(iov, &iov_num, connection, strlen(connection));
+  if (body_len > 0) AppendIov(iov, &iov_num, body, body_len);
+
+  // Write all, a blocking socket may still accept only a part of them
+  while (iov_num > 0) {
+    struct msghdr msg = { .msg_iov = cur_iov, .msg_iovlen = iov_num };
+    ssize_t retval = is_socket ? sendmsg(fd, &msg, flags)
+                               : writev(fd, cur_iov, iov_num);
+    if (retval < 0) {
+      if (errno == EINTR) continue;
+      /// fd may be a file or a pipe, e.g. in tests
+      if (errno == ENOTSOCK && is_socket) {
+        is_socket = 0;
+        continue;
+      }
+      return -1;
+    }
+    tot_len += retval;
+    while (iov_num > 0 && (size_t)retval >= cur_iov->iov_len) {
+      retval -= cur_iov->iov_len;
+      cur_iov++;
+      iov_num--;
+    }
+    if (iov_num > 0) {
+      cur_iov->iov_base = (char *)cur_iov->iov_base + retval;
+      cur_iov->iov_len -= retval;
+    }
+  }
+
+  return tot_len;
+}
+
+ssize_t ForwardHttpRequest(struct HttpRequest *http_req, int fd) {
+  return ForwardRequest(http_req, fd, 0);
+}
+
+ssize_t ForwardHttpProxyRequest(struct HttpRequest *http_req, int fd) {
+  return ForwardRequest(http_req, fd, 1);
+}
+
+const char *GetHttpMethod(struct HttpRequest *http_req) {
+  return SpanToString(http_req, http_req->request_line.method);
+}
+
+const char *GetHttpUrl(struct HttpRequest *http_req) {
+  return SpanToString(http_req, http_req->request_line.url);
+}
+
+const char *GetHttpVersion(struct HttpRequest *http_req) {
+  return SpanToString(http_req, http_req->request_line.version);
+}
+
+const char *GetHttpProxyUrl(struct HttpRequest *http_req) {
+  if (http_req->request_line.proxy_url.len == 0) return NULL;
+  return http_req->buf + http_req->request_line.proxy_url.off;
+}
+
+const char *GetHttpHost(struct HttpRequest *http_req) {
+  return SpanToString(http_req, http_req->request_headers.host);
+}
+
+enum HttpHeaderId LookupHttpHeaderId(const char *name, size_t len) {
+  enum HttpHeaderId id;
+
+  if (len == 0) return HEADER_OTHER;
+  switch (HEADER_HASH(len, name[0], name[len-1])) {
+#define HEADER_CASE(header_id, header_name, first, last)         \
+    case HEADER_HASH(sizeof(header_name) - 1, first, last):       \
+      id = header_id;                                             \
+      break;
+    HTTP_HEADER_LIST(HEADER_CASE)
+#undef HEADER_CASE
+    default:
+      return HEADER_OTHER;
+  }
+
+  // The hash only tells which name it may be
+  if (len != strlen(HeaderNames[id]) ||
+      strncasecmp(name, HeaderNames[id], len) != 0) {
+    return HEADER_OTHER;
+  }
+  return id;
+}
+
+struct HttpHeader *GetHttpHeaderById(struct HttpRequest *http_req,
+                                     enum HttpHeaderId id) {
+  int index = http_req->header_index[id];
+  return index < 0 ? NULL : &http_req->headers[index];
+}
+
+struct HttpHeader *GetNextHttpHeader(struct HttpRequest *http_req,
+                                     struct HttpHeader *header) {
+  return header->next < 0 ? NULL : &http_req->headers[header->next];
+}
+
+const char *GetHttpHeaderValue(struct HttpRequest *http_req,
+                               struct HttpHeader *header) {
+  return http_req->buf + header->value.off;
+}
+
+const char *GetHttpHeader(struct HttpRequest *http_req, const char *name) {
+  size_t len = strlen(name);
+  enum HttpHeaderId id = LookupHttpHeaderId(name, len);
+
+  if (id != HEADER_OTHER) {
+    struct HttpHeader *header = GetHttpHeaderById(http_req, id);
+    return header ? GetHttpHeaderValue(http_req, header) : NULL;
+  }
+
+  for (int i = 0; i < http_req->header_num; i++) {
+    struct HttpHeader *header = &http_req->headers[i];
+    if (header->id == HEADER_OTHER && IsSpanEqual(http_req, header->name, name))
+      return GetHttpHeaderValue(http_req, header);
+  }
+  return NULL;
+}
+
+char *GetHttpBody(struct HttpRequest *http_req, size_t *len) {
+  if (http_req->parse_state != PARSE_DATA) {
+    *len = 0;
+    return http_req->buf + http_req->buf_len;
+  }
+  *len = http_req->body_len;
+  return http_req->buf + http_req->body_off;
+}
+
+int ParseHttpRequestBody(struct HttpRequest *http_req, const char *data,
+                         size_t *len) {
+  if (http_req->parse_state != PARSE_DATA) {
+    *len = 0;
+    return 0;
+  }
 
-  // Since a long long line may be divided into multiple 'struct ReadLine's,
-  // we should combine them to a complete line before parsing it.
-  struct ReadLine *read_line_end = http_req->origin_lines+http_req->cur_line-1;
-  struct ReadLine *read_line_start = read_line_end-1;
-  /// if the newest line is not ended with '\n', then return.
-  /// else, then parse all lines that are not parsed.
-  if (!read_line_end->line_finish) return 0;
-  int tot_size = strlen(read_line_end->line) + 1;
-  char *tot_line = NULL;
-  char *cur_ptr = NULL;
-  
-  while (read_line_start >= http_req->origin_lines &&
-         !read_line_start->line_finish) {
-    tot_size += strlen(read_line_start->line);
-    read_line_start -= 1;
-  }
-
-  tot_line = (char *)malloc(tot_size);
-  if (!tot_line) return ERROR_MEM;
-  cur_ptr = tot_line;
-
-  while (read_line_start < read_line_end) {
-    read_line_start += 1;
-    int tmp_len = strlen(read_line_start->line);
-    strcpy(cur_ptr, read_line_start->line);
-    cur_ptr += tmp_len;
-  }
-  (*cur_ptr) = '\0';
-
-  // Parse Request Line
-  if (http_req->parse_state == PARSE_LINE) {
-    retval = ParseRequestLine(http_req, tot_line);
-    if (retval != 0) {
-      free(tot_line);
-      return retval;
-    }
-  }
-  // Parse Headers
-  else if (http_req->parse_state == PARSE_HEADERS) {
-    retval = ParseHeaders(http_req, tot_line);
-    if (retval != 0) {
-      free(tot_line);
-      return retval;
-    }
-  }
-
-  free(tot_line);
+  ssize_t used = ParseHttpBody(&http_req->body, data, *len);
+  if (used < 0) {
+    *len = 0;
+    return -used;
+  }
+  *len = used;
   return 0;
 }
 
+int IsRequestComplete(struct HttpRequest *http_req) {
+  return http_req->parse_state == PARSE_DATA && http_req->body.is_complete;
+}
+
 int IsRequestLineParsed(struct HttpRequest *http_req) {
   return http_req->parse_state != PARSE_LINE;
 }
 
 int IsHostParsed(struct HttpRequest *http_req) {
-  int host_len = strlen(http_req->request_headers.host);
-  return host_len > 0;
+  return http_req->request_headers.host.len > 0;
+}
+
+int IsConnectRequest(struct HttpRequest *http_req) {
+  return strcmp(GetHttpMethod(http_req), "CONNECT") == 0;
+}
+
+int IsHeadersParsed(struct HttpRequest *http_req) {
+  return http_req->parse_state == PARSE_DATA;
+}
+
+int IsEncodingAccepted(struct HttpRequest *http_req, const char *encoding) {
+  struct HttpHeader *header =
+    GetHttpHeaderById(http_req, HEADER_ACCEPT_ENCODING);
+  const char *cur = header ? GetHttpHeaderValue(http_req, header) : "";
+  size_t encoding_len = strlen(encoding);
+  int wildcard = 0;
+
+  // The field is a list like "gzip;q=1.0, identity; q=0.5, *;q=0"
+  while (*cur) {
+    while (*cur == ' ' || *cur == ',') cur++;
+    const char *token = cur;
+    while (*cur && *cur != ',' && *cur != ';' && *cur != ' ') cur++;
+    size_t token_len = cur - token;
+
+    // A zero quality value means "not acceptable"
+    int acceptable = 1;
+    while (*cur && *cur != ',') {
+      if (*cur == 'q' && cur[1] == '=') {
+        acceptable = (strtod(cur+2, NULL) > 0);
+        break;
+      }
+      cur++;
+    }
+    while (*cur && *cur != ',') cur++;
+
+    // An exact match takes precedence over the wildcard '*'
+    if (token_len == encoding_len &&
+        strncasecmp(token, encoding, encoding_len) == 0) {
+      return acceptable;
+    }
+    if (token_len == 1 && *token == '*') wildcard = acceptable;
+  }
+
+  return wildcard;
+}
+
+/**
+ * Reset http_resp to parse a new response, keeping its buffer and
+ * is_head.
+ */
+static void ResetHttpResponse(struct HttpResponse *http_resp) {
+  memset(&http_resp->status_line, 0, sizeof(http_resp->status_line));
+  http_resp->header_num = 0;
+  for (int i = 0; i < HEADER_ID_NUM; i++) http_resp->header_index[i] = -1;
+
+  http_resp->buf_len = 0;
+  http_resp->line_start = 0;
+  http_resp->scan_pos = 0;
+
+  http_resp->parse_state = RESPONSE_LINE;
+  InitHttpBody(&http_resp->body);
+}
+
+int InitHttpResponse(struct HttpResponse *http_resp, struct Arena *arena) {
+  http_resp->buf = (char *)ArenaAlloc(arena, HTTP_BUF_SIZE);
+  if (!http_resp->buf) return ERROR_MEM;
+  http_resp->is_head = 0;
+  ResetHttpResponse(http_resp);
+
+  return 0;
+}
+
+void FreeHttpResponse(struct HttpResponse *http_resp) {
+  http_resp->buf = NULL;
+}
+
+/**
+ * Tokenize the status line in buf[start, end) like 'HTTP/1.1 200 OK'.
+ */
+static int ParseStatusLine(struct HttpResponse *http_resp,
+                           size_t start, size_t end) {
+  char *buf = http_resp->buf;
+
+  size_t version_end = start + ScanDelims(&TOKEN_END, buf + start,
+                                          end - start);
+  if (version_end - start < 5 || version_end - start >= VER_LEN ||
+      strncmp(buf + start, "HTTP/", 5) != 0) {
+    return ERROR_STATUS_LINE_INVALID;
+  }
+
+  // The status code is exactly 3 digits
+  size_t code = version_end + 1;
+  if (end < code + 3) return ERROR_STATUS_LINE_INVALID;
+  int status_code = 0;
+  for (size_t i = code; i < code + 3; i++) {
+    if (buf[i] < '0' || buf[i] > '9') return ERROR_STATUS_LINE_INVALID;
+    status_code = status_code * 10 + buf[i] - '0';
+  }
+  if (code + 3 < end && buf[code+3] != ' ') return ERROR_STATUS_LINE_INVALID;
+
+  http_resp->status_line.version.off = start;
+  http_resp->status_line.version.len = version_end - start;
+  http_resp->status_line.status_code = status_code;
+  http_resp->status_line.reason.off = code + 3 < end ? code + 4 : end;
+  http_resp->status_line.reason.len = end - http_resp->status_line.reason.off;
+  buf[version_end] = '\0';
+  buf[end] = '\0';
+
+  http_resp->parse_state = RESPONSE_HEADERS;
+  return 0;
+}
+
+/**
+ * Decide how the body of http_resp is framed once its headers are
+ * parsed, see RFC 9112 section 6.3.
+ */
+static int SetResponseFraming(struct HttpResponse *http_resp) {
+  int status_code = http_resp->status_line.status_code;
+  int retval = 0;
+
+  http_resp->parse_state = RESPONSE_BODY;
+
+  if (status_code == 101) {
+    /// The connection has switched to another protocol
+    http_resp->body.type = BODY_UNTIL_CLOSE;
+  }
+  else if (http_resp->is_head || status_code == 204 || status_code == 304) {
+    http_resp->body.is_complete = 1;
+  }
+  else {
+    retval = SetBodyFraming(&http_resp->body, http_resp->buf,
+                            http_resp->headers, http_resp->header_index, 0);
+  }
+
+  if (http_resp->body.is_complete) http_resp->parse_state = RESPONSE_DONE;
+  return retval;
+}
+
+/**
+ * Parse the status line and headers in data[0, len), which are copied
+ * into the buffer of http_resp.
+ *
+ * \returns the number of bytes of data that belong to the status line and
+ * headers, or -error_code if error occurs.
+ */
+static ssize_t ParseResponseHeaders(struct HttpResponse *http_resp,
+                                    const char *data, size_t len) {
+  char *buf = http_resp->buf;
+  size_t copy_len = HTTP_BUF_SIZE - http_resp->buf_len;
+  size_t old_len = http_resp->buf_len;
+  int retval;
+
+  if (copy_len > len) copy_len = len;
+  memcpy(buf + http_resp->buf_len, data, copy_len);
+  http_resp->buf_len += copy_len;
+
+  while (http_resp->parse_state == RESPONSE_LINE ||
+         http_resp->parse_state == RESPONSE_HEADERS) {
+    size_t end, next_line;
+    struct HttpHeader *header;
+    if (!FindLineEnd(buf, http_resp->buf_len, &http_resp->scan_pos,
+                     http_resp->line_start, &end, &next_line)) {
+      if (http_resp->buf_len == HTTP_BUF_SIZE)
+        return -ERROR_RESPONSE_TOO_LARGE;
+      return copy_len;
+    }
+
+    if (http_resp->parse_state == RESPONSE_LINE) {
+      retval = ParseStatusLine(http_resp, http_resp->line_start, end);
+    }
+    else if (http_resp->line_start < end) {
+      retval = AddHeader(buf, http_resp->line_start, end, http_resp->headers,
+                         &http_resp->header_num, http_resp->header_index,
+                         &header);
+    }
+    else {
+      retval = SetResponseFraming(http_resp);
+    }
+    if (retval != 0) return -retval;
+    http_resp->line_start = next_line;
+    http_resp->scan_pos = next_line;
+  }
+
+  // Bytes copied after the headers belong to the body
+  http_resp->buf_len = http_resp->line_start;
+  return http_resp->buf_len - old_len;
+}
+
+int ParseHttpResponse(struct HttpResponse *http_resp, const char *data,
+                      size_t len) {
+  size_t used = 0;
+  ssize_t retval = 0;
+
+  while (used < len) {
+    switch (http_resp->parse_state) {
+      case RESPONSE_LINE:
+      case RESPONSE_HEADERS:
+        retval = ParseResponseHeaders(http_resp, data + used, len - used);
+        /// An interim 1xx response is followed by another response
+        if (retval >= 0 && http_resp->parse_state != RESPONSE_HEADERS &&
+            http_resp->status_line.status_code / 100 == 1 &&
+            http_resp->status_line.status_code != 101) {
+          ResetHttpResponse(http_resp);
+        }
+        break;
+
+      case RESPONSE_BODY:
+        retval = ParseHttpBody(&http_resp->body, data + used, len - used);
+        if (http_resp->body.is_complete) http_resp->parse_state = RESPONSE_DONE;
+        break;
+
+      case RESPONSE_DONE:
+      case RESPONSE_INVALID:
+        return 0;
+    }
+
+    if (retval < 0) {
+      http_resp->parse_state = RESPONSE_INVALID;
+      return -retval;
+    }
+    used += retval;
+  }
+
+  return 0;
+}
+
+int FinishHttpResponse(struct HttpResponse *http_resp) {
+  if (http_resp->parse_state == RESPONSE_BODY &&
+      http_resp->body.type == BODY_UNTIL_CLOSE) {
+    http_resp->parse_state = RESPONSE_DONE;
+  }
+  return http_resp->parse_state == RESPONSE_DONE;
+}
+
+int IsResponseHeadersParsed(struct HttpResponse *http_resp) {
+  return http_resp->parse_state == RESPONSE_BODY ||
+         http_resp->parse_state == RESPONSE_DONE;
+}
+
+int IsResponseComplete(struct HttpResponse *http_resp) {
+  return http_resp->parse_state == RESPONSE_DONE;
+}
+
+struct HttpHeader *GetHttpResponseHeader(struct HttpResponse *http_resp,
+                                         enum HttpHeaderId id) {
+  int index = http_resp->header_index[id];
+  return index < 0 ? NULL : &http_resp->headers[index];
+}
+
+/**
+ * \returns the value of directive name at token[0, len) like "max-age=60",
+ * -1 if token is not name or its value is invalid.
+ */
+static int GetDirectiveSeconds(const char *token, size_t len,
+                               const char *name) {
+  size_t name_len = strlen(name);
+  long seconds = 0;
+
+  if (len <= name_len + 1 || strncasecmp(token, name, name_len) != 0 ||
+      token[name_len] != '=') {
+    return -1;
+  }
+  for (size_t i = name_len + 1; i < len; i++) {
+    if (token[i] < '0' || token[i] > '9') return -1;
+    /// Values too large are capped, as RFC 9111 section 1.2.2 suggests
+    if (seconds < INT32_MAX) seconds = seconds * 10 + token[i] - '0';
+  }
+  return seconds < INT32_MAX ? seconds : INT32_MAX;
+}
+
+void GetCacheControl(struct HttpResponse *http_resp,
+                     struct CacheControl *cache_control) {
+  int s_maxage = -1;
+
+  cache_control->no_store = 0;
+  cache_control->max_age = -1;
+  cache_control->stale_while_revalidate = -1;
+  cache_control->stale_if_error = -1;
+
+  // The fields are lists like "public, max-age=60, stale-if-error=600"
+  int index = http_resp->header_index[HEADER_CACHE_CONTROL];
+  for (; index >= 0; index = http_resp->headers[index].next) {
+    struct HttpSpan value = http_resp->headers[index].value;
+    const char *cur = http_resp->buf + value.off;
+    const char *end = cur + value.len;
+
+    while (cur < end) {
+      while (cur < end && (*cur == ' ' || *cur == '\t' || *cur == ','))
+        cur++;
+      const char *token = cur;
+      while (cur < end && *cur != ',' && *cur != ' ' && *cur != '\t')
+        cur++;
+      size_t len = cur - token;
+      int seconds;
+
+      if ((len == 8 && strncasecmp(token, "no-store", len) == 0) ||
+          (len == 8 && strncasecmp(token, "no-cache", len) == 0) ||
+          (len == 7 && strncasecmp(token, "private", len) == 0)) {
+        cache_control->no_store = 1;
+      }
+      else if ((seconds = GetDirectiveSeconds(token, len, "s-maxage")) >= 0)
+        s_maxage = seconds;
+      else if ((seconds = GetDirectiveSeconds(token, len, "max-age")) >= 0)
+        cache_control->max_age = seconds;
+      else if ((seconds = GetDirectiveSeconds(
+                  token, len, "stale-while-revalidate")) >= 0)
+        cache_control->stale_while_revalidate = seconds;
+      else if ((seconds = GetDirectiveSeconds(
+                  token, len, "stale-if-error")) >= 0)
+        cache_control->stale_if_error = seconds;
+    }
+  }
+
+  // A shared cache prefers s-maxage
+  if (s_maxage >= 0) cache_control->max_age = s_maxage;
+}
+
+const char *GetHttpReason(int status) {
+  switch (status) {
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 410: return "Gone";
+    case 429: return "Too Many Requests";
+    case 500: return "Internal Server Error";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    case 504: return "Gateway Timeout";
+    default: return "Unknown";
+  }
+}
+
+ssize_t SendHttpError(int fd, int status) {
+  char response[256];
+  ssize_t sent = 0;
+  const char *reason = GetHttpReason(status);
+  int body_len = snprintf(NULL, 0, "%d %s\n", status, reason);
+  int len = snprintf(response, sizeof(response),
+                     "HTTP/1.1 %d %s\r\n"
+                     "Content-Type: text/plain\r\n"
+                     "Content-Length: %d\r\n"
+                     "Connection: close\r\n\r\n"
+                     "%d %s\n", status, reason, body_len, status, reason);
+
+  while (sent < len) {
+    ssize_t retval = write(fd, response + sent, len - sent);
+    if (retval < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    sent += retval;
+  }
+  return sent;
 }
 
 const char *ErrorCodeToMsg(int error_code) {
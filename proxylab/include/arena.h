@@ -0,0 +1,58 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+
+/**
+ * Alignment of every allocation, a cache line, so that buffers of one
+ * request never share a line.
+ */
+#define ARENA_ALIGN 64
+
+/**
+ * A block malloced when the arena is full, freed when it's reset.
+ */
+struct ArenaChunk {
+  struct ArenaChunk *next;
+};
+
+/**
+ * A bump allocator for the memory of one connection. Allocations are
+ * carved from a block mapped once, and released all together by
+ * ResetArena in O(1), so the request path never calls malloc or free,
+ * and a request reuses the pages that the last one has touched.
+ */
+struct Arena {
+  char *base;                   // the block, NULL if not mapped
+  size_t size;                  // size of the block
+  size_t used;                  // bytes allocated from the block
+  struct ArenaChunk *overflow;  // chunks beyond the block, rarely used
+};
+
+/**
+ * Map a block of size bytes for arena. The pages are not touched, so the
+ * memory is not committed until it's used.
+ *
+ * \returns 0 if success, -1 otherwise.
+ */
+int InitArena(struct Arena *arena, size_t size);
+
+/**
+ * Unmap the block of arena and free its overflow chunks.
+ */
+void FreeArena(struct Arena *arena);
+
+/**
+ * Allocate size bytes aligned to ARENA_ALIGN from arena. If the block is
+ * full, a chunk is malloced instead.
+ *
+ * \returns the memory, NULL if memory is not enough.
+ */
+void *ArenaAlloc(struct Arena *arena, size_t size);
+
+/**
+ * Release all memory allocated from arena, keeping its block.
+ */
+void ResetArena(struct Arena *arena);
+
+#endif /* ARENA_H_ */
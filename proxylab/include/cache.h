@@ -2,7 +2,10 @@
 #define CACHE_H_
 
 #include "csapp.h"
+#include "cacheindex.h"
+#include "segstore.h"
 #include <limits.h>
+#include <stdint.h>
 
 /**
  * Macros of error messages.
@@ -11,29 +14,107 @@
 #define CACHE_PATH_EMPTY "Cache path is emtpy"
 #define TEMP_PATH_TOO_LONG "Temp path exceeds PATH_MAX"
 #define TEMP_PATH_EMPTY "Temp path is emtpy"
+#define GZIP_PATH_TOO_LONG "Gzip path exceeds PATH_MAX"
+#define GZIP_PATH_EMPTY "Gzip path is emtpy"
+
+/**
+ * Max number of cache files waiting to be compressed.
+ */
+#define GZIP_QUEUE_LEN 64
+
+/**
+ * Parameters of the TinyLFU admission filter. The frequency of each cache
+ * key is estimated by a count-min sketch with CACHE_SKETCH_DEPTH rows of
+ * CACHE_SKETCH_WIDTH counters (a power of two). All counters are halved
+ * after CACHE_SKETCH_SAMPLES accesses, so that the sketch ages out old
+ * popularity. A missed object is admitted to the cache only if its
+ * estimated frequency reaches CACHE_ADMIT_MIN_FREQ.
+ */
+#define CACHE_SKETCH_DEPTH 4
+#define CACHE_SKETCH_WIDTH 8192
+#define CACHE_SKETCH_SAMPLES (10 * CACHE_SKETCH_WIDTH)
+#define CACHE_SKETCH_MAX_FREQ 15
+#define CACHE_ADMIT_MIN_FREQ 2
+
+/**
+ * Freshness of cached content in seconds, for a response that doesn't
+ * tell it in 'Cache-Control'. The content is fresh for
+ * CACHE_DEFAULT_MAX_AGE; after that, it's still served for
+ * CACHE_DEFAULT_SWR while a background refresh revalidates it, and for
+ * CACHE_DEFAULT_SIE when its server fails. A refresh not done in
+ * CACHE_REFRESH_TIMEOUT is assumed to be lost.
+ */
+#define CACHE_DEFAULT_MAX_AGE 300
+#define CACHE_DEFAULT_SWR 60
+#define CACHE_DEFAULT_SIE 3600
+#define CACHE_REFRESH_TIMEOUT 30
+
+/**
+ * Freshness of a cache hit.
+ */
+enum CacheFreshness {
+  CACHE_FRESH,                  // serve it
+  CACHE_STALE,                  // serve it, and refresh it in background
+  CACHE_EXPIRED                 // fetch it again
+};
 
 /**
  * Meta data for the cache of a http response.
  */
 struct CacheInfo {
   int is_open;                  // 1 if cache file is opened for reading
+  int is_gzip;                  // 1 if reading from the gzip variant
   int is_write;                 // 1 if cache file is opened for writing
   int fd;                       // opened cache/temp file description
+  int admission;                // admission decision, see IsCacheAdmitted
+  uint64_t key_hash;            // hash of the cache key "<Host><URL>"
+  struct CacheMeta meta;        // meta data in cache index if hit
+  const char *data;             // content pinned in a segment if hit,
+                                // NULL if it's in its own file
+  size_t data_len;
+  size_t data_pos;              // where ReadLineFromCache reads data
+  struct CacheLocation data_location;
+  int max_age;                  // freshness of the content written, in
+  int stale_while_revalidate;   // seconds, see SetCacheFreshness
+  int stale_if_error;
   rio_t rp;                     // robust io buffer
   char cache_path[PATH_MAX];    // cache file path when reading from
   char temp_path[PATH_MAX];     // temp file path before writing is done
+  char gzip_path[PATH_MAX];     // path of the gzip variant of cache file
   char error_msg[MAXLINE];      // the message of last error
 };
 
+/**
+ * Put the cache directories in root, which ends with '/', instead of the
+ * directory of the executable.
+ * Note: this function should be called before InitCacheModule.
+ */
+void SetCacheRoot(const char *root);
+
 /**
  * Do some initiate work to the cache module.
  * Note: this function should be called first only once before
- * any other functions in cache module.
+ * any other functions in cache module, except SetCacheRoot.
  */
 void InitCacheModule();
 
+/**
+ * Turn on/off the admission filter, it is off by default.
+ * Note: this function should be called before any worker uses the
+ * cache module.
+ */
+void SetCacheAdmission(int enable);
+
+/**
+ * Turn on compression of cache files, it is off by default. After a
+ * cache file is written, a background thread stores a gzip variant of
+ * it if the response is a plain text type like text/html or JSON.
+ */
+void SetCacheCompression(int enable);
+
 /**
  * Create a CacheInfo with the host and url of a http request.
+ * The access to host and url is recorded by the admission filter.
  * Note: host and url should not be NULL nor empty string.
  * 
  * \returns 0 if success, 1 otherwise. If returns 1, the error reason is
@@ -55,10 +136,80 @@ void FreeCacheInfo(struct CacheInfo *cache_info);
 void RemoveCache(struct CacheInfo *cache_info);
 
 /**
+ * Look up cache_info in the in-memory cache index, no file system access
+ * is needed. If hit, the meta data is copied to cache_info.meta, and
+ * content stored in a segment is pinned until FreeCacheInfo.
+ *
  * \returns 1 if cache hit, 0 otherwise.
  */
 int IsCacheHit(struct CacheInfo *cache_info);
 
+/**
+ * Get the content of cache_info, which is a cache hit, if it's stored in
+ * a segment and the gzip variant is not used.
+ *
+ * \returns the content mapped in memory, NULL if it should be read from
+ * its cache file by GetCacheReadFd. len is set to its length.
+ */
+const char *GetCacheData(struct CacheInfo *cache_info, size_t *len);
+
+/**
+ * \returns the freshness of cache_info, which is a cache hit.
+ */
+enum CacheFreshness GetCacheFreshness(struct CacheInfo *cache_info);
+
+/**
+ * \returns 1 if cache_info, which is an expired cache hit, may still be
+ * served because its server fails, 0 otherwise.
+ */
+int IsCacheUsableOnError(struct CacheInfo *cache_info);
+
+/**
+ * Claim the background refresh of cache_info, which is a stale cache hit,
+ * so that the same content is refreshed by one request at a time.
+ *
+ * \returns 1 if claimed, 0 if another refresh is in progress.
+ */
+int StartCacheRefresh(struct CacheInfo *cache_info);
+
+/**
+ * Set how long the content written to cache_info is fresh, and how long
+ * after that it may be served while it's revalidated or when its server
+ * fails, in seconds. A negative value keeps the default.
+ * Note: this function should be called before writing is done.
+ */
+void SetCacheFreshness(struct CacheInfo *cache_info, int max_age,
+                       int stale_while_revalidate, int stale_if_error);
+
+/**
+ * Consult the admission filter whether the content of cache_info,
+ * which is missed, should be written to cache. The decision is made
+ * once for each cache_info and counted in the admission statistics.
+ * This function should be called before writing to cache.
+ *
+ * \returns 1 if admitted or the filter is off, 0 otherwise.
+ */
+int IsCacheAdmitted(struct CacheInfo *cache_info);
+
+/**
+ * Admit cache_info regardless of the admission filter.
+ */
+void ForceCacheAdmission(struct CacheInfo *cache_info);
+
+/**
+ * Get the number of objects accepted and rejected by the admission
+ * filter so far.
+ */
+void GetCacheAdmissionStats(long *accepted, long *rejected);
+
+/**
+ * Read the gzip variant of the cache content instead, if it exists.
+ * Note: this function should be called before reading from cache.
+ *
+ * \returns 1 if the gzip variant is used, 0 otherwise.
+ */
+int UseGzipCache(struct CacheInfo *cache_info);
+
 /**
  * Check if CacheInfo has error.
  * 
@@ -66,6 +217,31 @@ int IsCacheHit(struct CacheInfo *cache_info);
  */
 int IsCacheError(struct CacheInfo *cache_info);
 
+/**
+ * Record the message of errnum as the last error of cache_info.
+ */
+void SetCacheError(struct CacheInfo *cache_info, int errnum);
+
+/**
+ * Get the descriptor of the temp file that cache content is written to,
+ * the temp file is created if it is not opened yet. Content written to
+ * the descriptor directly is the same as written by WriteToCache.
+ *
+ * \returns the descriptor if success, -1 otherwise. If returns -1, the
+ * error reason is stored in cache_info.error_msg.
+ */
+int GetCacheWriteFd(struct CacheInfo *cache_info);
+
+/**
+ * Get the descriptor of the cache file to read from, the cache file is
+ * opened if it is not opened yet. Content stored in a segment has no
+ * cache file, see GetCacheData.
+ *
+ * \returns the descriptor if success, -1 otherwise. If returns -1, the
+ * error reason is stored in cache_info.error_msg.
+ */
+int GetCacheReadFd(struct CacheInfo *cache_info);
+
 /**
  * Write content to cache, with the length of content.
  * 
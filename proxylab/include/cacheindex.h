@@ -0,0 +1,132 @@
+#ifndef CACHEINDEX_H_
+#define CACHEINDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/**
+ * Default number of shards is (1 << INDEX_SHARD_BITS).
+ */
+#define INDEX_SHARD_BITS 6
+/**
+ * Initial number of hash buckets of each shard, must be a power of two.
+ * A shard doubles its buckets when it holds twice as many entries.
+ */
+#define INDEX_INIT_BUCKETS 64
+
+/**
+ * Where the content of a cached object is stored in the segment store.
+ * Generations of segments start from 1, so a zeroed location means the
+ * content is stored in its own cache file.
+ */
+struct CacheLocation {
+  uint32_t segment;             // index of the segment
+  uint32_t generation;          // generation of the segment when written
+  uint64_t offset;              // offset of the content in the segment
+};
+
+/**
+ * Meta data of a cached object, which is stored in the index.
+ */
+struct CacheMeta {
+  size_t size;                  // size of the cached content
+  int has_gzip;                 // 1 if the gzip variant is stored
+  struct CacheLocation location;
+  /* Monotonic time in seconds, see GetCacheFreshness */
+  int64_t fresh_until;          // the content is fresh until
+  int64_t stale_until;          // served while it's revalidated until
+  int64_t error_until;          // served when the server fails until
+  int64_t refresh_until;        // a refresh is in progress until
+};
+
+/**
+ * An entry of the index, chained in a hash bucket.
+ */
+struct IndexEntry {
+  uint64_t key_hash;
+  char *key;                    // "<Host><URL>" without trailing '/'
+  struct CacheMeta meta;
+  struct IndexEntry *next;
+};
+
+/**
+ * A shard of the index. Each shard has its own lock, and is aligned to
+ * a cache line so that locking one shard never contends with another.
+ */
+struct IndexShard {
+  pthread_rwlock_t lock;
+  struct IndexEntry **buckets;
+  size_t bucket_num;            // always a power of two
+  size_t entry_num;
+} __attribute__((aligned(64)));
+
+/**
+ * Init the cache index with (1 << shard_bits) shards. An entry belongs
+ * to the shard selected by the high bits of its key hash, and to the
+ * bucket selected by the low bits, so the two choices are independent.
+ * Note: this function should be called before any other functions of
+ * the cache index, and is not thread safe.
+ *
+ * \returns 0 if success, -1 otherwise.
+ */
+int InitCacheIndex(int shard_bits);
+
+/**
+ * Remove all entries and release the memory of the cache index.
+ */
+void FreeCacheIndex();
+
+/**
+ * Look up key in the cache index, copy its meta data to meta if found.
+ *
+ * \returns 1 if found, 0 otherwise.
+ */
+int LookupCacheIndex(const char *key, uint64_t key_hash,
+                     struct CacheMeta *meta);
+
+/**
+ * Insert key with meta to the cache index, or replace the meta data if
+ * key is already in the index.
+ *
+ * \returns 0 if success, -1 otherwise.
+ */
+int InsertCacheIndex(const char *key, uint64_t key_hash,
+                     const struct CacheMeta *meta);
+
+/**
+ * Set the has_gzip flag of key if it is in the cache index.
+ */
+void SetCacheIndexGzip(const char *key, uint64_t key_hash, int has_gzip);
+
+/**
+ * Mark that key is being refreshed until the time until, unless another
+ * refresh of it is still in progress at the time now.
+ *
+ * \returns 1 if marked, 0 if key is not found or being refreshed.
+ */
+int MarkCacheIndexRefresh(const char *key, uint64_t key_hash,
+                          int64_t now, int64_t until);
+
+/**
+ * Move key to the segment location to if it's still stored at from, or
+ * remove key if to is NULL. This is how the segment store compacts or
+ * evicts a segment without losing newer content written meanwhile.
+ *
+ * \returns 1 if moved or removed, 0 otherwise.
+ */
+int MoveCacheIndex(const char *key, uint64_t key_hash,
+                   const struct CacheLocation *from,
+                   const struct CacheLocation *to);
+
+/**
+ * Remove key from the cache index.
+ */
+void RemoveCacheIndex(const char *key, uint64_t key_hash);
+
+/**
+ * \returns the number of entries in the cache index.
+ */
+size_t CacheIndexSize();
+
+#endif /* CACHEINDEX_H_ */
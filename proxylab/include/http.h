@@ -2,21 +2,29 @@
 #define HTTP_H_
 
 #include "csapp.h"
+#include "arena.h"
+
+#include <stdint.h>
+#include <sys/uio.h>
 
 /**
  * Macros of error code
  */
 #define SUCCESS 0
 #define ERROR_MEM 1
-#define ERROR_LINE_TOO_LONG 2
-#define ERROR_LINE_ZERO 3
-#define ERROR_READLINE_TOO_MUCH 4
-#define ERROR_REQUEST_LINE_INCOMPLETE 5
-#define ERROR_METHOD_TOO_LONG 6
-#define ERROR_URL_TOO_LONG 7
-#define ERROR_VERSION_TOO_LONG 8
-#define ERROR_REQUEST_HEADER_INCOMPLETE 9
-#define ERROR_HOST_TOO_LONG 10
+#define ERROR_REQUEST_TOO_LARGE 2
+#define ERROR_TOO_MANY_HEADERS 3
+#define ERROR_REQUEST_LINE_INCOMPLETE 4
+#define ERROR_METHOD_TOO_LONG 5
+#define ERROR_URL_TOO_LONG 6
+#define ERROR_VERSION_TOO_LONG 7
+#define ERROR_REQUEST_HEADER_INCOMPLETE 8
+#define ERROR_HOST_TOO_LONG 9
+#define ERROR_RESPONSE_TOO_LARGE 10
+#define ERROR_STATUS_LINE_INVALID 11
+#define ERROR_CONTENT_LENGTH_INVALID 12
+#define ERROR_CHUNK_INVALID 13
+#define ERROR_TRANSFER_ENCODING_INVALID 14
 
 #define METHOD_LEN 32       // max length of 'method' field in http
 #define URL_LEN 2560        // max length of 'url' field in http
@@ -24,74 +32,352 @@
 #define HOST_LEN 256        // max length of 'Host' field in http
 
 /**
- * The initial number of origin_lines when a HttpRequest is created
+ * Size of the receive buffer of a HttpRequest, the request line and all
+ * request headers must fit in it.
+ */
+#define HTTP_BUF_SIZE 16384
+/**
+ * The max number of request headers in HttpRequest
+ */
+#define MAX_HEADERS 64
+
+/**
+ * The max number of iovecs to forward a HttpRequest: 6 for the request
+ * line, 3 for the Host header, 2 for each other header, 1 for the
+ * Connection headers and the empty line, and 1 for the body.
+ */
+#define FORWARD_IOV_NUM (2 * MAX_HEADERS + 11)
+
+/**
+ * Well-known header names, each as X(id, name, first char, last char).
+ * The chars let the perfect hash of a name be a constant expression.
  */
-#define INIT_PARSE_LINES 8
+#define HTTP_HEADER_LIST(X)                                   \
+  X(HEADER_HOST, "host", 'h', 't')                            \
+  X(HEADER_CONNECTION, "connection", 'c', 'n')                \
+  X(HEADER_PROXY_CONNECTION, "proxy-connection", 'p', 'n')    \
+  X(HEADER_KEEP_ALIVE, "keep-alive", 'k', 'e')                \
+  X(HEADER_TE, "te", 't', 'e')                                \
+  X(HEADER_TRAILER, "trailer", 't', 'r')                      \
+  X(HEADER_TRANSFER_ENCODING, "transfer-encoding", 't', 'g')  \
+  X(HEADER_UPGRADE, "upgrade", 'u', 'e')                      \
+  X(HEADER_CONTENT_LENGTH, "content-length", 'c', 'h')        \
+  X(HEADER_CONTENT_TYPE, "content-type", 'c', 'e')            \
+  X(HEADER_CONTENT_ENCODING, "content-encoding", 'c', 'g')    \
+  X(HEADER_ACCEPT_ENCODING, "accept-encoding", 'a', 'g')      \
+  X(HEADER_CACHE_CONTROL, "cache-control", 'c', 'l')          \
+  X(HEADER_PRAGMA, "pragma", 'p', 'a')                        \
+  X(HEADER_IF_MODIFIED_SINCE, "if-modified-since", 'i', 'e')  \
+  X(HEADER_IF_NONE_MATCH, "if-none-match", 'i', 'h')          \
+  X(HEADER_RANGE, "range", 'r', 'e')                          \
+  X(HEADER_EXPECT, "expect", 'e', 't')                        \
+  X(HEADER_USER_AGENT, "user-agent", 'u', 't')                \
+  X(HEADER_AUTHORIZATION, "authorization", 'a', 'n')          \
+  X(HEADER_PROXY_AUTHORIZATION, "proxy-authorization", 'p', 'n') \
+  X(HEADER_COOKIE, "cookie", 'c', 'e')                        \
+  X(HEADER_VIA, "via", 'v', 'a')                              \
+  X(HEADER_X_FORWARDED_FOR, "x-forwarded-for", 'x', 'r')
+
+/**
+ * Id of a header name, HEADER_OTHER for names not in HTTP_HEADER_LIST.
+ */
+enum HttpHeaderId {
+  HEADER_OTHER,
+#define HEADER_ID(id, name, first, last) id,
+  HTTP_HEADER_LIST(HEADER_ID)
+#undef HEADER_ID
+  HEADER_ID_NUM
+};
+
+/**
+ * A string in the receive buffer of a HttpRequest. Offsets rather than
+ * pointers are recorded, so that a span stays valid wherever the buffer
+ * is placed.
+ */
+struct HttpSpan {
+  uint32_t off;             // offset in the receive buffer
+  uint32_t len;             // 0 if the string is absent
+};
+
 /**
- * The max number of origin_lines in HttpRequest 
+ * A request header, the name is not NUL-terminated.
  */
-#define MAX_PARSE_LINES 32
+struct HttpHeader {
+  struct HttpSpan name;
+  struct HttpSpan value;
+  enum HttpHeaderId id;
+  int next;                 // index of the next header with the same id,
+                            // -1 if none; not used by HEADER_OTHER
+};
 
 /**
- * A line of data read by unix IO
+ * Framing of a message body, which is tracked byte by byte as the body
+ * passes through the proxy, without buffering it.
  */
-struct ReadLine {
-  char line[MAXBUF];
-  int line_finish;        // 1 if line is ended with \n else 0
+struct HttpBody {
+  enum {
+    BODY_NONE,
+    BODY_LENGTH,            // Content-Length bytes
+    BODY_CHUNKED,           // chunked transfer coding
+    BODY_UNTIL_CLOSE        // everything until the sender closes
+  } type;
+
+  enum {
+    CHUNK_SIZE,             // hex digits of the chunk size
+    CHUNK_EXT,              // chunk extensions after the size
+    CHUNK_DATA,
+    CHUNK_DATA_END,         // CRLF after the chunk data
+    CHUNK_TRAILER           // trailer fields after the last chunk
+  } chunk_state;
+  int chunk_digits;         // digits of the chunk size parsed
+  size_t trailer_line_len;  // length of the trailer line being parsed
+
+  uint64_t length;          // number of body bytes parsed
+  uint64_t remaining;       // bytes left of the body or the current chunk
+  int is_complete;          // 1 if the end of the body is parsed
 };
 
 /**
- * Meta data of a http request, which is needed by a proxy server
+ * Meta data of a http request, which is needed by a proxy server.
+ *
+ * Data from the client is received into buf and tokenized in place: the
+ * parser records spans of the fields instead of copying them. The byte
+ * after each request line token and each header value is overwritten
+ * with '\0', so they can be used as C strings. The request line is
+ * rebuilt when forwarding, and header lines keep their 'name: value'
+ * bytes intact.
  */
 struct HttpRequest {
   struct {
-    char method[METHOD_LEN];
-    char url[URL_LEN];
-    char version[VER_LEN];
+    struct HttpSpan method;
+    struct HttpSpan url;
+    struct HttpSpan version;
     /// @brief The url field in HTTP PROXY is like 'http://127.0.0.1:8080/',
     /// the proxy should remove the preceding protocol and hostname to get
-    /// the actual url '/', which is stored in proxy_url.
-    char *proxy_url;
+    /// the actual url '/', which is spanned by proxy_url.
+    struct HttpSpan proxy_url;
   } request_line;
 
   struct {
-    char host[HOST_LEN];
+    struct HttpSpan host;
   } request_headers;
 
-  struct ReadLine *origin_lines;
-  int line_num;
-  int cur_line;
+  /// @brief All request headers in order, and the index of the first
+  /// header of each well-known id, -1 if absent.
+  struct HttpHeader headers[MAX_HEADERS];
+  int header_num;
+  int header_index[HEADER_ID_NUM];
+
+  char *buf;                // receive buffer of HTTP_BUF_SIZE bytes,
+                            // allocated from an Arena
+  size_t buf_len;           // number of bytes received in buf
+  size_t line_start;        // offset of the line being parsed
+  size_t scan_pos;          // offset to resume searching the line end
+  size_t body_off;          // offset of the first byte after headers
+  size_t body_len;          // number of body bytes in buf
 
   enum {
     PARSE_LINE,
     PARSE_HEADERS,
     PARSE_DATA
   } parse_state;
+
+  /// @brief Framing of the request body, decided once the headers are
+  /// parsed. Body bytes that do not fit in buf are passed to
+  /// ParseHttpRequestBody as they arrive.
+  struct HttpBody body;
+};
+
+/**
+ * Meta data of a http response, which is parsed as it is relayed to the
+ * client, so that the proxy knows exactly where the response ends.
+ *
+ * The status line and headers are copied into buf and tokenized like a
+ * HttpRequest. The body is never buffered, only its framing is tracked.
+ */
+struct HttpResponse {
+  struct {
+    struct HttpSpan version;
+    int status_code;
+    struct HttpSpan reason;
+  } status_line;
+
+  struct HttpHeader headers[MAX_HEADERS];
+  int header_num;
+  int header_index[HEADER_ID_NUM];
+
+  char *buf;                // status line and headers, HTTP_BUF_SIZE bytes
+  size_t buf_len;
+  size_t line_start;
+  size_t scan_pos;
+
+  int is_head;              // 1 if it answers a HEAD request, which means
+                            // there is no body, set before parsing
+
+  enum {
+    RESPONSE_LINE,
+    RESPONSE_HEADERS,
+    RESPONSE_BODY,
+    RESPONSE_DONE,
+    RESPONSE_INVALID        // parse error, the rest is not parsed
+  } parse_state;
+
+  struct HttpBody body;
 };
 
 /**
  * Init a HttpRequest, all HttpRequest variables must be
  * initialized before using them, otherwise their contents
  * will be undefined and undefined mistakes will occur.
+ * The receive buffer is allocated from arena, and lives until
+ * the arena is reset.
  * 
  * \returns 0 if success, otherwise an error_code which can
  * be converted to a message by function ErrorCodeToMsg.
  */
-int InitHttpRequest(struct HttpRequest *http_req);
+int InitHttpRequest(struct HttpRequest *http_req, struct Arena *arena);
 
 /**
  * Free a HttpRequest, any HttpRequest variable must be
- * freed after it is no longer accessed.
+ * freed after it is no longer accessed. Its buffer is given
+ * back when the arena it's allocated from is reset.
  */
 void FreeHttpRequest(struct HttpRequest *http_req);
 
 /**
- * Parse a line of http request, update struct HttpRequest.
+ * Get the free space of the receive buffer of http_req, data from the
+ * client should be received into it and then passed to ParseHttpRequest.
+ *
+ * \returns the start of the free space, whose size is stored in size.
+ */
+char *GetHttpRecvBuf(struct HttpRequest *http_req, size_t *size);
+
+/**
+ * Parse len bytes newly received into the receive buffer of http_req,
+ * update struct HttpRequest. The parser resumes where it stopped, so a
+ * request can be received in arbitrary pieces. Once the headers are
+ * parsed, the framing of the body is decided by Transfer-Encoding or
+ * Content-Length, and the bytes following the headers are parsed as
+ * the body.
  *
  * \returns 0 if success, otherwise an error_code which can
  * be converted to a message by function ErrorCodeToMsg.
  */
-int ParseHttpRequest(struct HttpRequest *http_req, char *line);
+int ParseHttpRequest(struct HttpRequest *http_req, size_t len);
+
+/**
+ * \returns the method of http_req, an empty string if it's not parsed.
+ */
+const char *GetHttpMethod(struct HttpRequest *http_req);
+
+/**
+ * \returns the url of http_req, an empty string if it's not parsed.
+ */
+const char *GetHttpUrl(struct HttpRequest *http_req);
+
+/**
+ * \returns the version of http_req, an empty string if it's not parsed.
+ */
+const char *GetHttpVersion(struct HttpRequest *http_req);
+
+/**
+ * \returns the actual url in the url of http_req, NULL if there is none.
+ */
+const char *GetHttpProxyUrl(struct HttpRequest *http_req);
+
+/**
+ * \returns the 'host:port' that http_req is sent to, which is the url of
+ * a CONNECT request or the 'Host' field otherwise, an empty string if
+ * it's not parsed.
+ */
+const char *GetHttpHost(struct HttpRequest *http_req);
+
+/**
+ * Map a header name to its id in O(1) with a perfect hash computed at
+ * compile time, case-insensitively.
+ *
+ * \returns the id of name, HEADER_OTHER if it's not well-known.
+ */
+enum HttpHeaderId LookupHttpHeaderId(const char *name, size_t len);
+
+/**
+ * \returns the first header of http_req with id, NULL if absent.
+ * Note: id should not be HEADER_OTHER.
+ */
+struct HttpHeader *GetHttpHeaderById(struct HttpRequest *http_req,
+                                     enum HttpHeaderId id);
+
+/**
+ * \returns the next header of http_req with the same id as header, NULL
+ * if there is none.
+ */
+struct HttpHeader *GetNextHttpHeader(struct HttpRequest *http_req,
+                                     struct HttpHeader *header);
+
+/**
+ * \returns the NUL-terminated value of header.
+ */
+const char *GetHttpHeaderValue(struct HttpRequest *http_req,
+                               struct HttpHeader *header);
+
+/**
+ * Look up a request header by name, case-insensitively. Well-known names
+ * are found in O(1), others by a linear search.
+ *
+ * \returns the value of the first header named name, NULL if absent.
+ */
+const char *GetHttpHeader(struct HttpRequest *http_req, const char *name);
+
+/**
+ * Get the body bytes received in the receive buffer of http_req. Bytes
+ * after the end of the body are not included.
+ *
+ * \returns the start of the bytes, whose number is stored in len.
+ */
+char *GetHttpBody(struct HttpRequest *http_req, size_t *len);
+
+/**
+ * Parse *len more bytes of the request body, which the client sends
+ * after the receive buffer of http_req is full or the request has been
+ * forwarded. *len is cut to the number of bytes that belong to the body.
+ *
+ * \returns 0 if success, otherwise an error_code.
+ */
+int ParseHttpRequestBody(struct HttpRequest *http_req, const char *data,
+                         size_t *len);
+
+/**
+ * \returns 1 if the headers and the whole body of http_req are parsed,
+ * otherwise 0. The body of a CONNECT request never ends.
+ */
+int IsRequestComplete(struct HttpRequest *http_req);
+
+/**
+ * Forward http_req to fd as a single gathered write. The request is
+ * rewritten for the origin server:
+ * 1. the request line carries the actual url;
+ * 2. the Host header comes first;
+ * 3. hop-by-hop headers, i.e. Connection, Proxy-Connection, Keep-Alive,
+ *    Proxy-Authorization, TE, Upgrade and the headers that Connection
+ *    lists, are replaced by 'Connection: close' and
+ *    'Proxy-Connection: close';
+ * 4. other header lines and the received body bytes pass through.
+ * Everything except the rewritten pieces is sent from the receive buffer
+ * without being copied. If fd is a socket and more body bytes are still
+ * to come from the client, the data is sent with MSG_MORE so that it
+ * shares TCP segments with the first body bytes.
+ *
+ * \returns the number of bytes written, -1 if error occurs.
+ */
+ssize_t ForwardHttpRequest(struct HttpRequest *http_req, int fd);
+
+/**
+ * Forward http_req to fd like ForwardHttpRequest, but keep the absolute
+ * url of the request line, for fd is another proxy.
+ *
+ * \returns the number of bytes written, -1 if error occurs.
+ */
+ssize_t ForwardHttpProxyRequest(struct HttpRequest *http_req, int fd);
 
 /**
  * \returns 1 if the fields in http_req->request_line are all
@@ -105,6 +391,107 @@ int IsRequestLineParsed(struct HttpRequest *http_req);
  */
 int IsHostParsed(struct HttpRequest *http_req);
 
+/**
+ * \returns 1 if http_req is a CONNECT request, whose url is the
+ * 'host:port' of a tunnel, otherwise 0.
+ */
+int IsConnectRequest(struct HttpRequest *http_req);
+
+/**
+ * \returns 1 if all the request headers in http_req are parsed,
+ * otherwise 0.
+ */
+int IsHeadersParsed(struct HttpRequest *http_req);
+
+/**
+ * Check the 'Accept-Encoding' field in http_req->request_headers.
+ *
+ * \returns 1 if the client accepts content encoded by encoding,
+ * e.g. "gzip", otherwise 0.
+ */
+int IsEncodingAccepted(struct HttpRequest *http_req, const char *encoding);
+
+/**
+ * Init a HttpResponse with its buffer allocated from arena, like
+ * InitHttpRequest.
+ *
+ * \returns 0 if success, otherwise an error_code.
+ */
+int InitHttpResponse(struct HttpResponse *http_resp, struct Arena *arena);
+
+/**
+ * Free a HttpResponse.
+ */
+void FreeHttpResponse(struct HttpResponse *http_resp);
+
+/**
+ * Parse len bytes of the response from the server, which may be split at
+ * any byte. Interim 1xx responses are skipped, and bytes after the end
+ * of the response are ignored.
+ * Note: after an error is returned, the rest of the response is ignored,
+ * and it never becomes complete.
+ *
+ * \returns 0 if success, otherwise an error_code.
+ */
+int ParseHttpResponse(struct HttpResponse *http_resp, const char *data,
+                      size_t len);
+
+/**
+ * Tell http_resp that the server has closed the connection, which ends
+ * a response whose body is delimited by the close.
+ *
+ * \returns 1 if the response is complete, 0 if it's truncated.
+ */
+int FinishHttpResponse(struct HttpResponse *http_resp);
+
+/**
+ * \returns 1 if the status line and headers of http_resp are parsed,
+ * otherwise 0.
+ */
+int IsResponseHeadersParsed(struct HttpResponse *http_resp);
+
+/**
+ * \returns 1 if all of http_resp has been parsed, otherwise 0.
+ */
+int IsResponseComplete(struct HttpResponse *http_resp);
+
+/**
+ * \returns the first header of http_resp with id, NULL if absent.
+ * Note: id should not be HEADER_OTHER.
+ */
+struct HttpHeader *GetHttpResponseHeader(struct HttpResponse *http_resp,
+                                         enum HttpHeaderId id);
+
+/**
+ * Directives of the 'Cache-Control' fields of a response that decide how
+ * long it may be cached, in seconds, -1 if absent.
+ */
+struct CacheControl {
+  int no_store;                 // 1 if no-store, no-cache or private
+  int max_age;                  // s-maxage, or max-age without it
+  int stale_while_revalidate;
+  int stale_if_error;
+};
+
+/**
+ * Parse the 'Cache-Control' fields of http_resp into cache_control.
+ */
+void GetCacheControl(struct HttpResponse *http_resp,
+                     struct CacheControl *cache_control);
+
+/**
+ * \returns the reason phrase of status, e.g. "Bad Gateway" for 502.
+ */
+const char *GetHttpReason(int status);
+
+/**
+ * Send a response of status with a short text body to fd, which is
+ * synthesized by the proxy, e.g. a 502 when the server can't be reached.
+ *
+ * \returns the number of bytes written, -1 if error occurs.
+ */
+ssize_t SendHttpError(int fd, int status);
+
 /**
  * Convert an error_code to a message.
  */
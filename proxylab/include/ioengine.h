@@ -0,0 +1,130 @@
+#ifndef IOENGINE_H_
+#define IOENGINE_H_
+
+#include "csapp.h"
+
+#include <sys/uio.h>
+
+/**
+ * Size of the buffer registered to io_uring for each IoEngine.
+ */
+#define IO_BUF_SIZE MAXBUF
+
+/**
+ * Number of entries in the submission queue of each io_uring.
+ */
+#define IO_RING_ENTRIES 64
+
+/**
+ * Number of fixed file slots registered to each io_uring. Every request
+ * slot of a worker owns two of them: one for the socket to the client
+ * and one for the cache file.
+ */
+#define IO_FIXED_FILES 256
+
+/**
+ * The io_uring instance and the rings mapped from the kernel.
+ */
+struct IoUring {
+  int ring_fd;                  // fd returned by io_uring_setup, -1 if none
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned sqe_tail;            // local tail of sqes not yet published
+  unsigned inflight;            // sqes submitted whose cqes aren't popped
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_ptr;                 // mmaped submission ring
+  size_t sq_size;
+  void *cq_ptr;                 // mmaped completion ring
+  size_t cq_size;
+  size_t sqes_size;
+};
+
+/**
+ * An I/O engine owned by one worker thread. When io_uring is enabled and
+ * supported by the kernel, socket sends and cache file reads/writes are
+ * batched into one submission; otherwise the engine falls back to plain
+ * read/write system calls through the rio package.
+ */
+struct IoEngine {
+  int use_uring;                // 1 if io_uring is in use
+  struct IoUring ring;
+  int fixed_files;              // 1 if fixed file slots are registered
+  int slot_fds[IO_FIXED_FILES]; // fd attached to each fixed file slot
+  char *buf;                    // buffer registered to the io_uring
+};
+
+/**
+ * Check if the running kernel supports all io_uring features needed
+ * by IoEngine. The result is probed once and then memorized.
+ *
+ * \returns 1 if supported, 0 otherwise.
+ */
+int IsIoUringSupported();
+
+/**
+ * Init an IoEngine. If want_uring is 1 and io_uring is supported, the
+ * engine uses io_uring, otherwise it falls back to plain system calls.
+ *
+ * \returns 0 if success, -1 otherwise.
+ */
+int InitIoEngine(struct IoEngine *engine, int want_uring);
+
+/**
+ * Release all the resources of engine.
+ */
+void FreeIoEngine(struct IoEngine *engine);
+
+/**
+ * Bind the socket and cache file of a request to the fixed file slots
+ * owned by request slot index, so that later operations on them skip
+ * the per-call file lookup in the kernel. Pass -1 to clear a slot.
+ * Note: this is a no-op if fixed files are not available.
+ */
+void AttachIoEngineFiles(struct IoEngine *engine, int index,
+                         int sock_fd, int file_fd);
+
+/**
+ * Send len bytes in engine->buf to sock_fd and, if file_fd >= 0, append
+ * the same bytes to file_fd. With io_uring both operations are done by a
+ * single submission.
+ *
+ * \param index the request slot index passed to AttachIoEngineFiles,
+ *              or -1 if the files are not attached.
+ * \param file_err set to errno if writing to file_fd failed, else 0.
+ *
+ * \returns len if success, -1 if sending to sock_fd failed.
+ */
+ssize_t IoEngineRelay(struct IoEngine *engine, int index,
+                      int sock_fd, int file_fd, size_t len, int *file_err);
+
+/**
+ * Send len bytes of file_fd at offset to sock_fd through engine->buf.
+ * With io_uring the read and the send are linked in one submission.
+ *
+ * \param index the request slot index passed to AttachIoEngineFiles,
+ *              or -1 if the files are not attached.
+ *
+ * \returns bytes sent if success, 0 if EOF, -1 if error.
+ */
+ssize_t IoEngineSendFile(struct IoEngine *engine, int index,
+                         int sock_fd, int file_fd, off_t offset, size_t len);
+
+/**
+ * Send len bytes at data, e.g. cache content mapped in memory, to sock_fd
+ * without copying them to engine->buf.
+ *
+ * \param index the request slot index passed to AttachIoEngineFiles,
+ *              or -1 if the files are not attached.
+ *
+ * \returns len if success, -1 if error.
+ */
+ssize_t IoEngineSend(struct IoEngine *engine, int index,
+                     int sock_fd, const void *data, size_t len);
+
+#endif /* IOENGINE_H_ */
@@ -0,0 +1,57 @@
+#ifndef NEGCACHE_H_
+#define NEGCACHE_H_
+
+#include <stdint.h>
+
+/**
+ * Number of slots of the negative cache, must be a power of two. An entry
+ * takes the slot selected by its key hash, replacing the entry there.
+ */
+#define NEG_CACHE_SLOTS 4096
+/**
+ * Default seconds to remember an origin failure, i.e. a failed connect
+ * or a 5xx response, and a 404/410 response.
+ */
+#define NEG_ERROR_TTL 5
+#define NEG_NOT_FOUND_TTL 30
+
+/**
+ * A failure remembered by the negative cache.
+ */
+struct NegativeEntry {
+  uint64_t key_hash;            // 0 if the slot is empty
+  int status;                   // status code to answer with
+  int64_t expire_ms;            // monotonic time when the entry expires
+};
+
+/**
+ * Set the TTLs of negative entries in seconds, 0 to disable them.
+ * Note: this function is not thread safe.
+ */
+void SetNegativeTtl(int error_ttl, int not_found_ttl);
+
+/**
+ * \returns 1 if a response with status should be cached negatively,
+ * i.e. 404, 410, 500, 502, 503 or 504, otherwise 0.
+ */
+int IsNegativeStatus(int status);
+
+/**
+ * Remember that "<host><url>" is answered with status, or that host can't
+ * be connected if url is NULL, for the TTL of status.
+ */
+void AddNegativeEntry(const char *host, const char *url, int status);
+
+/**
+ * Look up "<host><url>" and then host in the negative cache.
+ *
+ * \returns the status code to answer with, 0 if neither is cached.
+ */
+int LookupNegativeEntry(const char *host, const char *url);
+
+/**
+ * \returns the number of requests answered by the negative cache.
+ */
+long GetNegativeHits();
+
+#endif /* NEGCACHE_H_ */
@@ -0,0 +1,108 @@
+#ifndef ORIGIN_H_
+#define ORIGIN_H_
+
+#include "http.h"
+
+#include <stdint.h>
+
+/**
+ * Number of origins tracked at the same time, must be a power of two. An
+ * origin takes the slot selected by its host hash; an idle origin there
+ * is replaced, a busy one leaves the new origin untracked and unlimited.
+ */
+#define ORIGIN_SLOTS 1024
+/**
+ * Default max number of connections to one origin at the same time.
+ */
+#define ORIGIN_MAX_IN_FLIGHT 32
+/**
+ * The circuit of an origin opens after ORIGIN_MAX_FAILURES consecutive
+ * connect or read failures, and half-opens ORIGIN_COOLDOWN_MS later to
+ * let one request probe the origin.
+ */
+#define ORIGIN_MAX_FAILURES 5
+#define ORIGIN_COOLDOWN_MS 10000
+/**
+ * Max time a request waits for a connection slot of its origin.
+ */
+#define ORIGIN_QUEUE_TIMEOUT_MS 10000
+
+/**
+ * State of the circuit breaker of an origin.
+ */
+enum CircuitState {
+  CIRCUIT_CLOSED,               // requests pass
+  CIRCUIT_OPEN,                 // requests are rejected until the cool-down
+  CIRCUIT_HALF_OPEN             // one probing request passes
+};
+
+/**
+ * Result of asking for a connection slot of an origin.
+ */
+enum OriginAdmission {
+  ORIGIN_ADMITTED,              // a slot is taken, connect now
+  ORIGIN_QUEUED,                // no free slot, ask again later
+  ORIGIN_REJECTED               // the circuit is open, give up
+};
+
+/**
+ * What happened to the connection of a slot when it's released.
+ */
+enum OriginOutcome {
+  ORIGIN_UNKNOWN,               // e.g. the client left before a response
+  ORIGIN_SUCCESS,               // the origin answered
+  ORIGIN_FAILURE                // connecting to or reading the origin failed
+};
+
+/**
+ * An origin server, identified by its 'Host' field.
+ */
+struct Origin {
+  uint64_t key_hash;            // 0 if the slot is empty
+  char host[HOST_LEN];
+  int in_flight;                // connection slots taken
+  int waiting;                  // requests queued for a slot
+  enum CircuitState circuit;
+  int failures;                 // consecutive failures
+  int probing;                  // 1 if the half-open probe is in flight
+  int64_t open_until_ms;        // monotonic time the circuit half-opens
+};
+
+/**
+ * Set the max connections to one origin, 0 for no limit.
+ * Note: this function is not thread safe.
+ */
+void SetOriginLimit(int max_in_flight);
+
+/**
+ * Ask for a connection slot of host. A new request passes *origin as NULL,
+ * which is set to the origin of host; a queued request passes the origin
+ * it got before, and keeps its place ahead of new requests.
+ *
+ * \returns ORIGIN_ADMITTED if a slot is taken, which must be released by
+ *          ReleaseOrigin(*origin, ...) later. *origin may be NULL if host
+ *          is untracked.
+ *          ORIGIN_QUEUED if the request should ask again later, or give
+ *          up by CancelOrigin(*origin).
+ *          ORIGIN_REJECTED if the circuit of host is open, with *origin
+ *          set to NULL.
+ */
+enum OriginAdmission AcquireOrigin(const char *host, struct Origin **origin);
+
+/**
+ * Give up waiting for a slot of origin after ORIGIN_QUEUED.
+ */
+void CancelOrigin(struct Origin *origin);
+
+/**
+ * Release a slot of origin, and feed outcome to its circuit breaker.
+ */
+void ReleaseOrigin(struct Origin *origin, enum OriginOutcome outcome);
+
+/**
+ * Get the number of requests that were queued and that were rejected by
+ * an open circuit.
+ */
+void GetOriginStats(long *queued, long *rejected);
+
+#endif /* ORIGIN_H_ */
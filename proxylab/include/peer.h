@@ -0,0 +1,86 @@
+#ifndef PEER_H_
+#define PEER_H_
+
+#include <stdint.h>
+
+/**
+ * Max number of proxy instances, including this one, that share their
+ * caches as peers.
+ */
+#define PEER_MAX 16
+/**
+ * Number of points of each peer on the hash ring. More points spread the
+ * urls more evenly, and move fewer of them when a peer is added.
+ */
+#define PEER_VNODES 128
+
+/**
+ * A point on the hash ring, owned by a peer.
+ */
+struct PeerPoint {
+  uint64_t hash;
+  int peer;                     // index of the peer, 0 for this instance
+};
+
+/**
+ * Set the peers from a comma separated list of Unix socket paths. The
+ * first path is where this instance listens for its peers, the others
+ * are where the peers listen. Every instance should be given the same
+ * set of paths, in any order, so that they agree on the owner of a url.
+ * Note: this function should be called before any other functions of
+ * peers, and is not thread safe.
+ *
+ * \returns 0 if success, -1 if list is invalid.
+ */
+int InitPeers(const char *list);
+
+/**
+ * \returns 1 if peers are set by InitPeers, otherwise 0.
+ */
+int IsPeerModeEnabled();
+
+/**
+ * \returns the index of the peer that caches "<host><url>", 0 if it's
+ * this instance or there are no peers.
+ */
+int LookupPeer(const char *host, const char *url);
+
+/**
+ * \returns the Unix socket path of peer.
+ */
+const char *GetPeerPath(int peer);
+
+/**
+ * Listen on the Unix socket path of this instance, replacing a file
+ * left there by a former run.
+ *
+ * \returns the listening fd, -1 if error occurs.
+ */
+int OpenPeerListenFd();
+
+/**
+ * Connect to peer without waiting, i.e. a peer that is not running or
+ * is too busy to accept is reported at once.
+ *
+ * \returns the connected fd in blocking mode, -1 if error occurs.
+ */
+int OpenPeerFd(int peer);
+
+/**
+ * Remove the Unix socket file of this instance.
+ */
+void ClosePeers();
+
+/**
+ * Count a request forwarded to its peer, or served by this instance
+ * because the peer can't be connected.
+ */
+void CountPeerForward(int is_failed);
+
+/**
+ * Get the number of requests forwarded to peers, and of those which fell
+ * back to the server because their peers can't be connected.
+ */
+void GetPeerStats(long *forwarded, long *failed);
+
+#endif /* PEER_H_ */
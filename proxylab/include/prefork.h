@@ -0,0 +1,74 @@
+#ifndef PREFORK_H_
+#define PREFORK_H_
+
+#include "peer.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Max number of worker processes. The workers share their caches as peers,
+ * so there are at most as many as peers.
+ */
+#define PREFORK_MAX PEER_MAX
+/**
+ * Directory holding the working directory of each worker, e.g.
+ * .prefork/0/, where its cache directories and peer socket are.
+ */
+#define PREFORK_DIR ".prefork"
+/**
+ * A worker that exits within this time after it's started is restarted
+ * only after this time, so that a worker crashing at start doesn't make
+ * the master fork in a busy loop.
+ */
+#define PREFORK_RESPAWN_MS 1000
+
+/**
+ * Counters a worker keeps in the shared memory, which the master sums up.
+ */
+enum WorkerCounter {
+  WORKER_ACCEPTED,              // client connections accepted
+  WORKER_FINISHED,              // connections finished, of any kind
+  WORKER_CACHE_HITS,            // responses served from the cache
+  WORKER_COUNTER_NUM
+};
+
+/**
+ * Slot of a worker in the shared memory. The counters are kept when the
+ * worker is restarted.
+ */
+struct WorkerStats {
+  pid_t pid;                    // pid of the worker, 0 if not running
+  int restarts;                 // times the worker was restarted
+  int64_t started_ms;           // monotonic time the worker was forked
+  atomic_long counters[WORKER_COUNTER_NUM];
+};
+
+/**
+ * Run the master of worker_num worker processes, which share listenfd.
+ * The master forks the workers, restarts them when they exit, and on
+ * SIGHUP, SIGINT, SIGQUIT or SIGTERM stops them, prints their statistics
+ * and exits.
+ * Note: all signals should be blocked when this function is called.
+ *
+ * \returns the index of the worker, only in a worker process, whose
+ *          working directory is changed to PREFORK_DIR/<index>.
+ */
+int RunPrefork(int worker_num, int listenfd);
+
+/**
+ * Write the peer list of the workers, for InitPeers of the worker with
+ * index, to buf of size bytes.
+ *
+ * \returns 0 if success, -1 if buf is too small.
+ */
+int GetWorkerPeers(int index, char *buf, size_t size);
+
+/**
+ * Add 1 to counter of this worker, if this is a worker process.
+ */
+void CountWorker(enum WorkerCounter counter);
+
+#endif /* PREFORK_H_ */
@@ -0,0 +1,60 @@
+#ifndef SCAN_H_
+#define SCAN_H_
+
+#include <stddef.h>
+
+/**
+ * The max number of delimiters in a ScanSet, which is what an SSE4.2
+ * string comparison can match at once.
+ */
+#define SCAN_MAX_DELIMS 16
+
+/**
+ * A set of delimiter bytes to scan for.
+ */
+struct ScanSet {
+  char delims[SCAN_MAX_DELIMS];
+  int num;
+};
+
+/**
+ * Initializer of a ScanSet from a string literal, e.g. SCAN_SET(" :\n").
+ */
+#define SCAN_SET(delims) { delims, sizeof(delims) - 1 }
+
+/**
+ * Implementations of the scanner.
+ */
+enum ScanImpl {
+  SCAN_SCALAR,                  // one byte at a time
+  SCAN_SSE42,                   // 16 bytes at a time with pcmpestri
+  SCAN_AVX2                     // 32 bytes at a time with vpcmpeqb
+};
+
+/**
+ * Find the first byte of buf[0, len) that is in set. The implementation
+ * is chosen at the first call by the features of the CPU, and never
+ * reads outside buf.
+ *
+ * \returns the offset of the byte, len if there is none.
+ */
+size_t ScanDelims(const struct ScanSet *set, const char *buf, size_t len);
+
+/**
+ * \returns the implementation that ScanDelims uses.
+ */
+enum ScanImpl GetScanImpl();
+
+/**
+ * Force ScanDelims to use impl, which is mainly for benchmarks.
+ *
+ * \returns 0 if success, -1 if the CPU does not support impl.
+ */
+int SetScanImpl(enum ScanImpl impl);
+
+/**
+ * \returns the name of impl.
+ */
+const char *ScanImplName(enum ScanImpl impl);
+
+#endif /* SCAN_H_ */
@@ -0,0 +1,80 @@
+#ifndef SEGSTORE_H_
+#define SEGSTORE_H_
+
+#include "cacheindex.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/**
+ * The segment store keeps small cached objects in at most SEG_MAX segment
+ * files of SEG_SIZE bytes, which are preallocated when first used and
+ * mapped read-only, so that a hit is served from memory without opening
+ * any file. Objects larger than SEG_OBJECT_MAX keep their own cache files.
+ * SEG_SIZE and SEG_MAX may be set at compile time, e.g. the test of the
+ * segment store uses a few small segments.
+ */
+#ifndef SEG_SIZE
+#define SEG_SIZE (16 << 20)
+#endif
+#ifndef SEG_MAX
+#define SEG_MAX 64
+#endif
+#define SEG_OBJECT_MAX (256 << 10)
+/**
+ * When all segments are used, the oldest one that is not being read is
+ * recycled: its live objects are compacted to its start if they take at
+ * most SEG_COMPACT_MAX_LIVE bytes, otherwise they are all evicted.
+ */
+#define SEG_COMPACT_MAX_LIVE (SEG_SIZE / 2)
+
+/**
+ * A segment file. Objects are only appended to the active segment; a
+ * segment is recycled as a whole, which starts a new generation of it.
+ */
+struct Segment {
+  int fd;                       // -1 if the segment is not created yet
+  const char *base;             // read-only mapping of the whole segment
+  size_t tail;                  // bytes reserved from the start
+  long sealed_seq;              // order in which segments became full
+  _Atomic uint64_t state;       // generation << 32 | number of readers
+  atomic_int writers;           // appends in progress
+};
+
+/**
+ * Init the segment store, whose segment files are created in dir.
+ * Note: this function should be called before any other functions of
+ * the segment store, and is not thread safe.
+ */
+void InitSegmentStore(const char *dir);
+
+/**
+ * Copy meta->size bytes of fd from its start to a segment, set
+ * meta->location, and insert key with meta to the cache index.
+ *
+ * \returns 0 if success, -1 if the content should be kept in its own
+ * file, i.e. it's too large, or no segment has room for it.
+ */
+int AppendSegment(const char *key, uint64_t key_hash, int fd,
+                  struct CacheMeta *meta);
+
+/**
+ * Keep the segment of location from being recycled until UnpinSegment.
+ *
+ * \returns the content at location, NULL if the segment is recycled
+ * after the content was written there.
+ */
+const char *PinSegment(const struct CacheLocation *location);
+
+/**
+ * Release a segment pinned by PinSegment.
+ */
+void UnpinSegment(const struct CacheLocation *location);
+
+/**
+ * Get the number of segments created, and the number of times a segment
+ * was compacted and evicted.
+ */
+void GetSegmentStats(int *created, long *compacted, long *evicted);
+
+#endif /* SEGSTORE_H_ */
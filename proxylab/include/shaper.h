@@ -0,0 +1,83 @@
+#ifndef SHAPER_H_
+#define SHAPER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Max bytes of a response relayed to one client in a turn of its worker
+ * thread, i.e. a select round in which the client or its server is ready.
+ * Every connection gets the same quantum per turn, so that a large cached
+ * object is sent in pieces between the other connections of the worker.
+ */
+#define SHAPER_QUANTUM (64 << 10)
+/**
+ * A rate limited connection waits until it may send at least this many
+ * bytes, instead of sending many tiny pieces.
+ */
+#define SHAPER_MIN_SEND 4096
+
+/**
+ * Deficit round-robin counter and token bucket of a client connection.
+ */
+struct Shaper {
+  size_t deficit;               // bytes it may relay in this turn
+  int is_limited;               // 1 if the rate limit applies to it
+  double tokens;                // bytes the rate limit allows now
+  int64_t refill_ns;            // monotonic time tokens were refilled
+};
+
+/**
+ * Limit the bytes relayed to each client connection per second, 0 for no
+ * limit. Tokens accumulate up to a burst of SHAPER_QUANTUM bytes, or of
+ * 20ms at the rate if that is more.
+ * Note: this function is not thread safe.
+ */
+void SetClientRate(long bytes_per_sec);
+
+/**
+ * Init the shaper of a new connection, which is rate limited if
+ * is_limited and a rate is set.
+ */
+void InitShaper(struct Shaper *shaper, int is_limited);
+
+/**
+ * Start a turn of the connection: its deficit becomes SHAPER_QUANTUM.
+ * Since every piece is sized to fit the deficit, what is left at the end
+ * of a turn means the connection had nothing more to relay, and is not
+ * carried to the next turn.
+ */
+void StartShaperTurn(struct Shaper *shaper);
+
+/**
+ * \returns the bytes the connection may relay now, 0 if it should wait
+ * for its next turn, or for its rate limit.
+ */
+size_t GetShaperAllowance(struct Shaper *shaper);
+
+/**
+ * Take bytes relayed to the connection from its deficit and tokens.
+ */
+void ConsumeShaper(struct Shaper *shaper, size_t bytes);
+
+/**
+ * \returns the bytes that fit in the send buffer of sock_fd now, so that a
+ * blocking send of them returns without waiting for a slow client. The
+ * result is at least SHAPER_MIN_SEND, to make progress once select
+ * reports sock_fd writable, and at most max.
+ */
+size_t GetSendRoom(int sock_fd, size_t max);
+
+/**
+ * \returns 1 if the connection is held back by its rate limit, i.e. it
+ * has less than SHAPER_MIN_SEND tokens, otherwise 0.
+ */
+int IsShaperThrottled(struct Shaper *shaper);
+
+/**
+ * \returns the number of times connections were held back by the rate
+ * limit.
+ */
+long GetShaperThrottles();
+
+#endif /* SHAPER_H_ */
@@ -0,0 +1,98 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Number of buckets of a stage histogram. Bucket 0 counts durations under
+ * 1us, bucket i counts those in [2^(i-1), 2^i) us, and the last one counts
+ * all longer durations.
+ */
+#define TRACE_BUCKETS 32
+
+/**
+ * Points a request passes through. The stage that ends at a point is
+ * named by it, e.g. TRACE_PARSED ends the parse stage, which starts at the
+ * previous point the request passed. Points that a request skips, like
+ * TRACE_CONNECTED of a cache hit, merge two stages into the later one.
+ */
+enum TraceStage {
+  TRACE_ACCEPTED,               // accepted by the main thread
+  TRACE_ASSIGNED,               // added to the pool of a worker thread
+  TRACE_READ,                   // first bytes of the request are read
+  TRACE_PARSED,                 // request headers are parsed
+  TRACE_CONNECTED,              // request is sent to the server
+  TRACE_FIRST_BYTE,             // first bytes of the response are read
+  TRACE_RELAYED,                // response is relayed to the client
+  TRACE_STORED,                 // cache content is committed
+  TRACE_STAGE_NUM
+};
+
+/**
+ * Monotonic time in ns when a request passed each point, 0 if it didn't.
+ */
+struct RequestTrace {
+  int64_t stamps[TRACE_STAGE_NUM];
+};
+
+/**
+ * Percentiles of a stage, in us. A percentile is the upper bound of the
+ * bucket it falls in.
+ */
+struct TraceStats {
+  long count;
+  long p50_us;
+  long p90_us;
+  long p99_us;
+};
+
+/**
+ * Turn on tracing, and report requests that take at least slow_ms in
+ * total.
+ * Note: this function is not thread safe.
+ */
+void SetTraceThreshold(int slow_ms);
+
+/**
+ * \returns 1 if tracing is turned on, otherwise 0.
+ */
+int IsTraceEnabled();
+
+/**
+ * \returns the monotonic time in ns, 0 if tracing is off.
+ */
+int64_t GetTraceTime();
+
+/**
+ * Start the trace of a request accepted at accepted_ns, which is just
+ * added to the pool of a worker thread. Nothing is traced for the request
+ * if accepted_ns is 0.
+ */
+void StartTrace(struct RequestTrace *trace, int64_t accepted_ns);
+
+/**
+ * Record that a traced request passes stage, unless it passed before.
+ */
+void TraceRequest(struct RequestTrace *trace, enum TraceStage stage);
+
+/**
+ * Add the stages of a finished request to the histograms, and describe
+ * them in buf if the request is slow.
+ *
+ * \returns 1 if the request is slow, otherwise 0.
+ */
+int FinishTrace(struct RequestTrace *trace, char *buf, size_t size);
+
+/**
+ * \returns the name of the stage ending at stage, "total" for
+ * TRACE_ACCEPTED, whose histogram holds the total time of requests.
+ */
+const char *GetTraceStageName(enum TraceStage stage);
+
+/**
+ * Get the percentiles of the stage ending at stage.
+ */
+void GetTraceStats(enum TraceStage stage, struct TraceStats *stats);
+
+#endif /* TRACE_H_ */
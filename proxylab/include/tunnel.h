@@ -0,0 +1,63 @@
+#ifndef TUNNEL_H_
+#define TUNNEL_H_
+
+#include <stddef.h>
+
+/**
+ * Bytes buffered in each tunnel pipe.
+ */
+#define TUNNEL_PIPE_SIZE 65536
+
+/**
+ * One direction of a CONNECT tunnel. Bytes are spliced from the source
+ * socket into the pipe, then from the pipe into the destination socket,
+ * so they never get copied to user space.
+ */
+struct TunnelPipe {
+  int pipe_fds[2];              // [0] read end, [1] write end
+  size_t pending;               // bytes in the pipe not yet sent
+  int eof;                      // 1 if the source socket is closed
+  int shut;                     // 1 if the destination is shut down
+};
+
+/**
+ * Init a TunnelPipe without any pipe opened.
+ */
+void InitTunnelPipe(struct TunnelPipe *tunnel);
+
+/**
+ * Open the pipe of tunnel.
+ *
+ * \returns 0 if success, -1 otherwise.
+ */
+int OpenTunnelPipe(struct TunnelPipe *tunnel);
+
+/**
+ * Close the pipe of tunnel if it is opened.
+ */
+void CloseTunnelPipe(struct TunnelPipe *tunnel);
+
+/**
+ * Move bytes of one direction of a tunnel: fill the pipe from src_fd as
+ * long as it has room, then drain the pipe to dst_fd as much as dst_fd
+ * accepts. Shut down dst_fd for writing once src_fd is closed and the
+ * pipe is drained.
+ * Note: src_fd and dst_fd should be in non-blocking mode.
+ *
+ * \returns 0 if success, -1 if error occurs.
+ */
+int RelayTunnelPipe(struct TunnelPipe *tunnel, int src_fd, int dst_fd);
+
+/**
+ * \returns 1 if the source of tunnel should be waited to be readable,
+ * which is when it's not closed and the pipe has room, otherwise 0.
+ */
+int IsTunnelReadable(struct TunnelPipe *tunnel);
+
+/**
+ * \returns 1 if the destination of tunnel should be waited to be
+ * writable, which is when the pipe has bytes, otherwise 0.
+ */
+int IsTunnelWritable(struct TunnelPipe *tunnel);
+
+#endif /* TUNNEL_H_ */
@@ -0,0 +1,58 @@
+#ifndef WARMUP_H_
+#define WARMUP_H_
+
+/**
+ * Number of urls fetched at the same time by the cache warm-up.
+ */
+#define WARMUP_CONCURRENCY 8
+/**
+ * Number of threads that refresh stale cache content in background, and
+ * max number of urls waiting for them.
+ */
+#define REFRESH_THREADS 2
+#define REFRESH_QUEUE_LEN 64
+
+/**
+ * Result of a cache warm-up.
+ */
+struct WarmupStats {
+  int fetched;                  // urls answered with 200
+  int failed;                   // urls answered otherwise, or not at all
+  double seconds;               // time the warm-up took
+};
+
+/**
+ * Fetch every url listed in path through the proxy itself, at most
+ * WARMUP_CONCURRENCY at the same time, so that the responses fill the
+ * cache by the normal path. path holds one absolute url per line, like
+ * "http://localhost:8080/home.html"; empty lines and lines starting with
+ * '#' are skipped.
+ *
+ * Each url is fetched over a socket pair: submit is called with one end,
+ * which it should serve like a newly accepted client connection, and the
+ * request is written to and the response read from the other end. Calls
+ * of submit are serialized. This function returns when all urls are done.
+ *
+ * \returns 0 if success, -1 if path can't be read.
+ */
+int RunWarmup(const char *path, void (*submit)(int fd),
+              struct WarmupStats *stats);
+
+/**
+ * Start REFRESH_THREADS threads that fetch the urls queued by
+ * QueueRefresh, through the proxy like RunWarmup.
+ *
+ * \returns 0 if success, -1 otherwise.
+ */
+int StartRefresh(void (*submit)(int fd));
+
+/**
+ * Queue "http://<host><url>" to be fetched in background, so that its
+ * cache content is replaced by a fresh one. The url is dropped if the
+ * queue is full, so that workers never wait for the refresh threads.
+ *
+ * \returns 0 if queued, -1 otherwise.
+ */
+int QueueRefresh(const char *host, const char *url);
+
+#endif /* WARMUP_H_ */
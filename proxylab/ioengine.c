@@ -0,0 +1,559 @@
+#include "ioengine.h"
+
+#include <linux/io_uring.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+
+#define USER_DATA_SOCK 1
+#define USER_DATA_FILE 2
+#define USER_DATA_NUM 3
+
+static pthread_once_t uring_probe_once = PTHREAD_ONCE_INIT;
+static int uring_supported = 0;
+
+/**
+ * Raw io_uring system calls, glibc has no wrappers for them.
+ */
+static int SysIoUringSetup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int SysIoUringEnter(int ring_fd, unsigned to_submit,
+                           unsigned min_complete, unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit,
+                      min_complete, flags, NULL, 0);
+}
+
+static int SysIoUringRegister(int ring_fd, unsigned opcode,
+                              const void *arg, unsigned nr_args) {
+  return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+/**
+ * Release the rings of an io_uring.
+ */
+static void FreeIoUring(struct IoUring *ring) {
+  if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr)
+    munmap(ring->cq_ptr, ring->cq_size);
+  if (ring->sq_ptr) munmap(ring->sq_ptr, ring->sq_size);
+  if (ring->ring_fd >= 0) close(ring->ring_fd);
+  memset(ring, 0, sizeof(*ring));
+  ring->ring_fd = -1;
+}
+
+/**
+ * Create an io_uring with entries and map its rings.
+ *
+ * \returns 0 if success, -1 otherwise.
+ */
+static int InitIoUring(struct IoUring *ring, unsigned entries) {
+  struct io_uring_params params;
+
+  memset(ring, 0, sizeof(*ring));
+  memset(&params, 0, sizeof(params));
+  ring->ring_fd = SysIoUringSetup(entries, &params);
+  if (ring->ring_fd < 0) return -1;
+
+  // Offset -1 meaning "current file position" is needed by IoEngineRelay
+  if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+    FreeIoUring(ring);
+    return -1;
+  }
+
+  // Map the submission ring and the completion ring
+  ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_size = params.cq_off.cqes +
+                  params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_size > ring->sq_size) ring->sq_size = ring->cq_size;
+    ring->cq_size = ring->sq_size;
+  }
+  ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+                      IORING_OFF_SQ_RING);
+  if (ring->sq_ptr == MAP_FAILED) {
+    ring->sq_ptr = NULL;
+    FreeIoUring(ring);
+    return -1;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_ptr = ring->sq_ptr;
+  }
+  else {
+    ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+                        IORING_OFF_CQ_RING);
+    if (ring->cq_ptr == MAP_FAILED) {
+      ring->cq_ptr = NULL;
+      FreeIoUring(ring);
+      return -1;
+    }
+  }
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->ring_fd,
+                    IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    FreeIoUring(ring);
+    return -1;
+  }
+
+  char *sq = (char *)ring->sq_ptr;
+  char *cq = (char *)ring->cq_ptr;
+  ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring->sqe_tail = *ring->sq_tail;
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  return 0;
+}
+
+/**
+ * Get a free submission queue entry, which is zeroed.
+ *
+ * \returns the sqe if success, NULL if the submission queue is full.
+ */
+static struct io_uring_sqe *GetSqe(struct IoUring *ring) {
+  unsigned head = atomic_load_explicit((_Atomic unsigned *)ring->sq_head,
+                                       memory_order_acquire);
+  if (ring->sqe_tail - head > *ring->sq_mask) return NULL;
+
+  struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+  ring->sqe_tail++;
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+/**
+ * Take back the sqes got by GetSqe but not yet submitted.
+ */
+static void PutBackSqes(struct IoUring *ring) {
+  ring->sqe_tail = *ring->sq_tail;
+}
+
+/**
+ * Publish all sqes got by GetSqe, submit them and wait for wait_nr
+ * completions in one system call. The kernel may take fewer sqes than
+ * published, e.g. if it's short of memory, and then skips the wait; the
+ * rest are taken back so that no later call submits them.
+ * Note: the completions may not be ready yet even if all sqes are taken,
+ * e.g. if the wait is interrupted, so pop them with WaitCqe.
+ *
+ * \returns the number of sqes submitted.
+ */
+static unsigned SubmitAndWait(struct IoUring *ring, unsigned wait_nr) {
+  unsigned head = *ring->sq_tail;
+  unsigned tail = head;
+  unsigned to_submit = ring->sqe_tail - head;
+  int ret;
+
+  while (tail != ring->sqe_tail) {
+    ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+    tail++;
+  }
+  atomic_store_explicit((_Atomic unsigned *)ring->sq_tail, tail,
+                        memory_order_release);
+
+  /// The kernel returns an error only if it took no sqe, so retrying
+  /// never submits an sqe twice
+  do {
+    ret = SysIoUringEnter(ring->ring_fd, to_submit, wait_nr,
+                          IORING_ENTER_GETEVENTS);
+  } while (ret < 0 && errno == EINTR);
+  if (ret < 0) ret = 0;
+
+  // Sqes are taken in order, so the ones left are at the tail
+  if (ret < to_submit) {
+    ring->sqe_tail = head + ret;
+    atomic_store_explicit((_Atomic unsigned *)ring->sq_tail, head + ret,
+                          memory_order_release);
+  }
+  ring->inflight += ret;
+  return ret;
+}
+
+/**
+ * Pop a completion queue entry.
+ *
+ * \returns 1 if a cqe is popped, 0 if the completion queue is empty.
+ */
+static int PopCqe(struct IoUring *ring, uint64_t *user_data, int *res) {
+  unsigned head = *ring->cq_head;
+  unsigned tail = atomic_load_explicit((_Atomic unsigned *)ring->cq_tail,
+                                       memory_order_acquire);
+  if (head == tail) return 0;
+
+  struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+  *user_data = cqe->user_data;
+  *res = cqe->res;
+  atomic_store_explicit((_Atomic unsigned *)ring->cq_head, head+1,
+                        memory_order_release);
+  ring->inflight--;
+  return 1;
+}
+
+/**
+ * Pop a completion queue entry, waiting for one if none is ready.
+ *
+ * \returns 0 if success, -1 if waiting fails.
+ */
+static int WaitCqe(struct IoUring *ring, uint64_t *user_data, int *res) {
+  while (!PopCqe(ring, user_data, res)) {
+    if (SysIoUringEnter(ring->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+        errno != EINTR)
+      return -1;
+  }
+  return 0;
+}
+
+/**
+ * Probe once if io_uring and the operations used by IoEngine are
+ * supported, the result is stored in uring_supported.
+ */
+static void ProbeIoUring() {
+  struct IoUring ring;
+  size_t probe_size = sizeof(struct io_uring_probe) +
+                      IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = NULL;
+  const int ops[] = { IORING_OP_SEND, IORING_OP_READ_FIXED,
+                      IORING_OP_WRITE_FIXED };
+
+  if (InitIoUring(&ring, 2) != 0) return;
+
+  probe = calloc(1, probe_size);
+  if (probe &&
+      SysIoUringRegister(ring.ring_fd, IORING_REGISTER_PROBE,
+                         probe, IORING_OP_LAST) == 0) {
+    uring_supported = 1;
+    for (int i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+      if (ops[i] > probe->last_op ||
+          !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+        uring_supported = 0;
+      }
+    }
+  }
+
+  free(probe);
+  FreeIoUring(&ring);
+}
+
+int IsIoUringSupported() {
+  pthread_once(&uring_probe_once, ProbeIoUring);
+  return uring_supported;
+}
+
+int InitIoEngine(struct IoEngine *engine, int want_uring) {
+  memset(engine, 0, sizeof(*engine));
+  engine->ring.ring_fd = -1;
+  for (int i = 0; i < IO_FIXED_FILES; i++) engine->slot_fds[i] = -1;
+
+  // The buffer is page aligned so that pinning it costs fewer pages
+  if (posix_memalign((void **)&engine->buf, getpagesize(), IO_BUF_SIZE))
+    return -1;
+
+  if (!want_uring || !IsIoUringSupported()) return 0;
+  if (InitIoUring(&engine->ring, IO_RING_ENTRIES) != 0) return 0;
+
+  // Register the buffer, without it io_uring is not worth using
+  struct iovec iov = { .iov_base = engine->buf, .iov_len = IO_BUF_SIZE };
+  if (SysIoUringRegister(engine->ring.ring_fd, IORING_REGISTER_BUFFERS,
+                         &iov, 1) != 0) {
+    FreeIoUring(&engine->ring);
+    return 0;
+  }
+
+  // Register a sparse table of fixed files, it's fine if this fails
+  if (SysIoUringRegister(engine->ring.ring_fd, IORING_REGISTER_FILES,
+                         engine->slot_fds, IO_FIXED_FILES) == 0) {
+    engine->fixed_files = 1;
+  }
+
+  engine->use_uring = 1;
+  return 0;
+}
+
+void FreeIoEngine(struct IoEngine *engine) {
+  if (engine->use_uring) FreeIoUring(&engine->ring);
+  engine->use_uring = 0;
+  engine->fixed_files = 0;
+  free(engine->buf);
+  engine->buf = NULL;
+}
+
+void AttachIoEngineFiles(struct IoEngine *engine, int index,
+                         int sock_fd, int file_fd) {
+  if (!engine->fixed_files) return;
+  if (index < 0 || 2*index+1 >= IO_FIXED_FILES) return;
+  if (engine->slot_fds[2*index] == sock_fd &&
+      engine->slot_fds[2*index+1] == file_fd) return;
+
+  int fds[2] = { sock_fd, file_fd };
+  struct io_uring_files_update update;
+  memset(&update, 0, sizeof(update));
+  update.offset = 2*index;
+  update.fds = (uint64_t)(uintptr_t)fds;
+  if (SysIoUringRegister(engine->ring.ring_fd, IORING_REGISTER_FILES_UPDATE,
+                         &update, 2) == 2) {
+    engine->slot_fds[2*index] = sock_fd;
+    engine->slot_fds[2*index+1] = file_fd;
+  }
+  else {
+    /// Slots are in an unknown state, never use them again
+    engine->slot_fds[2*index] = -1;
+    engine->slot_fds[2*index+1] = -1;
+  }
+}
+
+/**
+ * Set the target file of sqe, using the fixed file slot if fd is
+ * attached to it.
+ */
+static void SetSqeFile(struct IoEngine *engine, struct io_uring_sqe *sqe,
+                       int slot, int fd) {
+  if (slot >= 0 && slot < IO_FIXED_FILES && engine->slot_fds[slot] == fd) {
+    sqe->fd = slot;
+    sqe->flags |= IOSQE_FIXED_FILE;
+  }
+  else {
+    sqe->fd = fd;
+  }
+}
+
+/**
+ * Stop using io_uring, after its completions are lost track of.
+ */
+static void DisableIoUring(struct IoEngine *engine) {
+  FreeIoUring(&engine->ring);
+  engine->use_uring = 0;
+  engine->fixed_files = 0;
+  for (int i = 0; i < IO_FIXED_FILES; i++) engine->slot_fds[i] = -1;
+}
+
+/**
+ * Submit the sqes got for an operation and pop the completions of all
+ * submitted ones. res[user_data] is set to the result of each of them,
+ * and kept for an sqe the kernel didn't take, so the caller inits res to
+ * what means "not done".
+ * If waiting fails, the cqes left would be taken for those of a later
+ * operation, so the engine falls back to plain system calls from then on.
+ *
+ * \returns 0 if success, -1 if waiting fails.
+ */
+static int RunSqes(struct IoEngine *engine, ssize_t res[USER_DATA_NUM]) {
+  struct IoUring *ring = &engine->ring;
+  uint64_t user_data;
+  int cqe_res;
+
+  SubmitAndWait(ring, ring->sqe_tail - *ring->sq_tail);
+  while (ring->inflight > 0) {
+    if (WaitCqe(ring, &user_data, &cqe_res) != 0) {
+      DisableIoUring(engine);
+      return -1;
+    }
+    if (user_data < USER_DATA_NUM) res[user_data] = cqe_res;
+  }
+  return 0;
+}
+
+/**
+ * Read len bytes of file_fd at offset to engine->buf and send them to
+ * sock_fd with plain system calls.
+ *
+ * \returns bytes sent if success, 0 if EOF, -1 if error.
+ */
+static ssize_t PlainSendFile(struct IoEngine *engine, int sock_fd,
+                             int file_fd, off_t offset, size_t len) {
+  ssize_t read_res;
+
+  do {
+    read_res = pread(file_fd, engine->buf, len, offset);
+  } while (read_res < 0 && errno == EINTR);
+  if (read_res <= 0) return read_res;
+  if (rio_writen(sock_fd, engine->buf, read_res) < 0) return -1;
+  return read_res;
+}
+
+ssize_t IoEngineRelay(struct IoEngine *engine, int index,
+                      int sock_fd, int file_fd, size_t len, int *file_err) {
+  // Bytes written by io_uring, what it doesn't write is written below
+  ssize_t res[USER_DATA_NUM] = { 0, 0, 0 };
+  ssize_t sock_res, file_res;
+  struct io_uring_sqe *sock_sqe = NULL, *file_sqe = NULL;
+
+  *file_err = 0;
+  if (!engine->use_uring) {
+    if (file_fd >= 0 && rio_writen(file_fd, engine->buf, len) < 0)
+      *file_err = errno;
+    return rio_writen(sock_fd, engine->buf, len);
+  }
+
+  if (index >= 0) AttachIoEngineFiles(engine, index, sock_fd, file_fd);
+
+  sock_sqe = GetSqe(&engine->ring);
+  if (file_fd >= 0) file_sqe = GetSqe(&engine->ring);
+  if (!sock_sqe || (file_fd >= 0 && !file_sqe)) {
+    PutBackSqes(&engine->ring);
+  }
+  else {
+    sock_sqe->opcode = IORING_OP_SEND;
+    SetSqeFile(engine, sock_sqe, 2*index, sock_fd);
+    sock_sqe->addr = (uint64_t)(uintptr_t)engine->buf;
+    sock_sqe->len = len;
+    sock_sqe->msg_flags = MSG_NOSIGNAL;
+    sock_sqe->user_data = USER_DATA_SOCK;
+
+    if (file_sqe) {
+      file_sqe->opcode = IORING_OP_WRITE_FIXED;
+      SetSqeFile(engine, file_sqe, 2*index+1, file_fd);
+      file_sqe->addr = (uint64_t)(uintptr_t)engine->buf;
+      file_sqe->len = len;
+      file_sqe->off = (uint64_t)-1;     // append at the current position
+      file_sqe->buf_index = 0;
+      file_sqe->user_data = USER_DATA_FILE;
+    }
+
+    /// How much was written is unknown, so both are left with a hole
+    if (RunSqes(engine, res) != 0) {
+      if (file_fd >= 0) *file_err = EIO;
+      errno = EIO;
+      return -1;
+    }
+  }
+  sock_res = res[USER_DATA_SOCK];
+  file_res = res[USER_DATA_FILE];
+
+  // Finish short writes with plain system calls
+  if (file_fd >= 0) {
+    if (file_res < 0)
+      *file_err = -file_res;
+    else if (file_res < len &&
+             rio_writen(file_fd, engine->buf+file_res, len-file_res) < 0)
+      *file_err = errno;
+  }
+  if (sock_res < 0) {
+    errno = -sock_res;
+    return -1;
+  }
+  if (sock_res < len &&
+      rio_writen(sock_fd, engine->buf+sock_res, len-sock_res) < 0)
+    return -1;
+
+  return len;
+}
+
+ssize_t IoEngineSendFile(struct IoEngine *engine, int index,
+                         int sock_fd, int file_fd, off_t offset, size_t len) {
+  // An sqe not done is the same as canceled
+  ssize_t res[USER_DATA_NUM] = { 0, -ECANCELED, -ECANCELED };
+  ssize_t read_res, sock_res;
+  struct io_uring_sqe *read_sqe = NULL, *sock_sqe = NULL;
+
+  if (len > IO_BUF_SIZE) len = IO_BUF_SIZE;
+  if (len == 0) return 0;
+
+  if (!engine->use_uring)
+    return PlainSendFile(engine, sock_fd, file_fd, offset, len);
+
+  if (index >= 0) AttachIoEngineFiles(engine, index, sock_fd, file_fd);
+
+  read_sqe = GetSqe(&engine->ring);
+  sock_sqe = GetSqe(&engine->ring);
+  if (!read_sqe || !sock_sqe) {
+    PutBackSqes(&engine->ring);
+    return PlainSendFile(engine, sock_fd, file_fd, offset, len);
+  }
+
+  // The send is linked to the read, so it starts after the read completes
+  // and is canceled if the read is short.
+  read_sqe->opcode = IORING_OP_READ_FIXED;
+  SetSqeFile(engine, read_sqe, 2*index+1, file_fd);
+  read_sqe->addr = (uint64_t)(uintptr_t)engine->buf;
+  read_sqe->len = len;
+  read_sqe->off = offset;
+  read_sqe->buf_index = 0;
+  read_sqe->flags |= IOSQE_IO_LINK;
+  read_sqe->user_data = USER_DATA_FILE;
+
+  sock_sqe->opcode = IORING_OP_SEND;
+  SetSqeFile(engine, sock_sqe, 2*index, sock_fd);
+  sock_sqe->addr = (uint64_t)(uintptr_t)engine->buf;
+  sock_sqe->len = len;
+  sock_sqe->msg_flags = MSG_NOSIGNAL;
+  sock_sqe->user_data = USER_DATA_SOCK;
+
+  if (RunSqes(engine, res) != 0) {
+    errno = EIO;
+    return -1;
+  }
+  read_res = res[USER_DATA_FILE];
+  sock_res = res[USER_DATA_SOCK];
+
+  // The read is not taken by the kernel, or canceled with a failed send
+  if (read_res == -ECANCELED)
+    return PlainSendFile(engine, sock_fd, file_fd, offset, len);
+  if (read_res < 0) {
+    errno = -read_res;
+    return -1;
+  }
+  if (read_res == 0) return 0;
+
+  // A short read cancels the send, so it's the same as sending nothing
+  if (sock_res < 0 && sock_res != -ECANCELED) {
+    errno = -sock_res;
+    return -1;
+  }
+  if (sock_res < 0) sock_res = 0;
+  if (sock_res < read_res &&
+      rio_writen(sock_fd, engine->buf+sock_res, read_res-sock_res) < 0)
+    return -1;
+
+  return read_res;
+}
+
+ssize_t IoEngineSend(struct IoEngine *engine, int index,
+                     int sock_fd, const void *data, size_t len) {
+  // Bytes sent by io_uring, what it doesn't send is sent below
+  ssize_t res[USER_DATA_NUM] = { 0, 0, 0 };
+  ssize_t sock_res;
+  struct io_uring_sqe *sqe = NULL;
+
+  if (len == 0) return 0;
+  if (!engine->use_uring) return rio_writen(sock_fd, (void *)data, len);
+
+  if (index >= 0 && engine->slot_fds[2*index] != sock_fd)
+    AttachIoEngineFiles(engine, index, sock_fd, engine->slot_fds[2*index+1]);
+
+  sqe = GetSqe(&engine->ring);
+  if (sqe) {
+    sqe->opcode = IORING_OP_SEND;
+    SetSqeFile(engine, sqe, 2*index, sock_fd);
+    sqe->addr = (uint64_t)(uintptr_t)data;
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = USER_DATA_SOCK;
+    if (RunSqes(engine, res) != 0) {
+      errno = EIO;
+      return -1;
+    }
+  }
+  sock_res = res[USER_DATA_SOCK];
+
+  // Finish a short send with plain system calls
+  if (sock_res < 0) {
+    errno = -sock_res;
+    return -1;
+  }
+  if (sock_res < len &&
+      rio_writen(sock_fd, (char *)data+sock_res, len-sock_res) < 0)
+    return -1;
+
+  return len;
+}
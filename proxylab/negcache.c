@@ -0,0 +1,95 @@
+#include "negcache.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+static struct NegativeEntry entries[NEG_CACHE_SLOTS];
+static pthread_mutex_t entries_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int error_ttl = NEG_ERROR_TTL;
+static int not_found_ttl = NEG_NOT_FOUND_TTL;
+static atomic_long negative_hits = ATOMIC_VAR_INIT(0);
+
+/**
+ * FNV-1a hash of str, continued from hash.
+ */
+static uint64_t HashString(uint64_t hash, const char *str) {
+  while (*str) {
+    hash ^= (unsigned char)*str++;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+/**
+ * \returns the hash of "<host><url>", never 0.
+ */
+static uint64_t HashKey(const char *host, const char *url) {
+  uint64_t hash = HashString(0xcbf29ce484222325ULL, host);
+  if (url) hash = HashString(hash, url);
+  return hash ? hash : 1;
+}
+
+/**
+ * \returns the monotonic time in ms.
+ */
+static int64_t NowMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void SetNegativeTtl(int error_seconds, int not_found_seconds) {
+  error_ttl = error_seconds;
+  not_found_ttl = not_found_seconds;
+}
+
+int IsNegativeStatus(int status) {
+  switch (status) {
+    case 404: case 410:
+    case 500: case 502: case 503: case 504:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+void AddNegativeEntry(const char *host, const char *url, int status) {
+  int ttl = status == 404 || status == 410 ? not_found_ttl : error_ttl;
+  if (ttl <= 0) return;
+
+  uint64_t key_hash = HashKey(host, url);
+  struct NegativeEntry *entry = &entries[key_hash & (NEG_CACHE_SLOTS - 1)];
+
+  pthread_mutex_lock(&entries_mutex);
+  entry->key_hash = key_hash;
+  entry->status = status;
+  entry->expire_ms = NowMs() + ttl * 1000;
+  pthread_mutex_unlock(&entries_mutex);
+}
+
+int LookupNegativeEntry(const char *host, const char *url) {
+  uint64_t key_hashes[2] = { HashKey(host, url), HashKey(host, NULL) };
+  int64_t now = NowMs();
+  int status = 0;
+
+  pthread_mutex_lock(&entries_mutex);
+  for (int i = 0; i < 2 && status == 0; i++) {
+    struct NegativeEntry *entry =
+        &entries[key_hashes[i] & (NEG_CACHE_SLOTS - 1)];
+    if (entry->key_hash != key_hashes[i]) continue;
+    if (entry->expire_ms > now)
+      status = entry->status;
+    else
+      entry->key_hash = 0;
+  }
+  pthread_mutex_unlock(&entries_mutex);
+
+  if (status != 0) atomic_fetch_add(&negative_hits, 1);
+  return status;
+}
+
+long GetNegativeHits() {
+  return atomic_load(&negative_hits);
+}
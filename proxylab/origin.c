@@ -0,0 +1,159 @@
+#include "origin.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+
+static struct Origin origins[ORIGIN_SLOTS];
+static pthread_mutex_t origins_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int max_in_flight = ORIGIN_MAX_IN_FLIGHT;
+static atomic_long queued_num = ATOMIC_VAR_INIT(0);
+static atomic_long rejected_num = ATOMIC_VAR_INIT(0);
+
+/**
+ * \returns the FNV-1a hash of host, never 0.
+ */
+static uint64_t HashHost(const char *host) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  while (*host) {
+    hash ^= (unsigned char)*host++;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash ? hash : 1;
+}
+
+/**
+ * \returns the monotonic time in ms.
+ */
+static int64_t NowMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Find the origin of host, or create it in its slot if the slot is empty
+ * or holds an idle origin.
+ * Note: origins_mutex should be held.
+ *
+ * \returns the origin, NULL if the slot is taken by a busy origin.
+ */
+static struct Origin *FindOrigin(const char *host) {
+  uint64_t key_hash = HashHost(host);
+  struct Origin *origin = &origins[key_hash & (ORIGIN_SLOTS - 1)];
+
+  if (origin->key_hash == key_hash && strcmp(origin->host, host) == 0)
+    return origin;
+  if (origin->key_hash != 0 &&
+      (origin->in_flight > 0 || origin->waiting > 0 ||
+       origin->circuit != CIRCUIT_CLOSED)) {
+    return NULL;
+  }
+
+  memset(origin, 0, sizeof(*origin));
+  origin->key_hash = key_hash;
+  strncpy(origin->host, host, sizeof(origin->host) - 1);
+  origin->circuit = CIRCUIT_CLOSED;
+  return origin;
+}
+
+void SetOriginLimit(int limit) {
+  max_in_flight = limit;
+}
+
+enum OriginAdmission AcquireOrigin(const char *host, struct Origin **origin) {
+  struct Origin *entry = *origin;
+  int is_waiting = entry != NULL;
+  int64_t now = NowMs();
+  enum OriginAdmission admission;
+
+  pthread_mutex_lock(&origins_mutex);
+  if (!entry) entry = FindOrigin(host);
+  if (!entry) {
+    pthread_mutex_unlock(&origins_mutex);
+    return ORIGIN_ADMITTED;
+  }
+
+  // The cool-down is over, let the next request probe the origin
+  if (entry->circuit == CIRCUIT_OPEN && now >= entry->open_until_ms) {
+    entry->circuit = CIRCUIT_HALF_OPEN;
+    entry->probing = 0;
+  }
+
+  if (entry->circuit == CIRCUIT_OPEN ||
+      (entry->circuit == CIRCUIT_HALF_OPEN && entry->probing)) {
+    if (is_waiting) entry->waiting--;
+    entry = NULL;
+    admission = ORIGIN_REJECTED;
+    atomic_fetch_add(&rejected_num, 1);
+  }
+  else if (entry->circuit == CIRCUIT_HALF_OPEN) {
+    if (is_waiting) entry->waiting--;
+    entry->probing = 1;
+    entry->in_flight++;
+    admission = ORIGIN_ADMITTED;
+  }
+  /// Queued requests go before new ones
+  else if (max_in_flight > 0 &&
+           (entry->in_flight >= max_in_flight ||
+            (!is_waiting && entry->waiting > 0))) {
+    if (!is_waiting) {
+      entry->waiting++;
+      atomic_fetch_add(&queued_num, 1);
+    }
+    admission = ORIGIN_QUEUED;
+  }
+  else {
+    if (is_waiting) entry->waiting--;
+    entry->in_flight++;
+    admission = ORIGIN_ADMITTED;
+  }
+  pthread_mutex_unlock(&origins_mutex);
+
+  *origin = entry;
+  return admission;
+}
+
+void CancelOrigin(struct Origin *origin) {
+  if (!origin) return;
+
+  pthread_mutex_lock(&origins_mutex);
+  origin->waiting--;
+  pthread_mutex_unlock(&origins_mutex);
+}
+
+void ReleaseOrigin(struct Origin *origin, enum OriginOutcome outcome) {
+  if (!origin) return;
+
+  pthread_mutex_lock(&origins_mutex);
+  origin->in_flight--;
+  switch (outcome) {
+    case ORIGIN_SUCCESS:
+      origin->failures = 0;
+      origin->circuit = CIRCUIT_CLOSED;
+      origin->probing = 0;
+      break;
+    case ORIGIN_FAILURE:
+      origin->failures++;
+      /// A failed probe opens the circuit again at once
+      if (origin->circuit == CIRCUIT_HALF_OPEN ||
+          origin->failures >= ORIGIN_MAX_FAILURES) {
+        origin->circuit = CIRCUIT_OPEN;
+        origin->open_until_ms = NowMs() + ORIGIN_COOLDOWN_MS;
+        origin->probing = 0;
+      }
+      break;
+    default:
+      /// Nothing is learned, let another request probe
+      origin->probing = 0;
+      break;
+  }
+  pthread_mutex_unlock(&origins_mutex);
+}
+
+void GetOriginStats(long *queued, long *rejected) {
+  *queued = atomic_load(&queued_num);
+  *rejected = atomic_load(&rejected_num);
+}
@@ -0,0 +1,173 @@
+#include "peer.h"
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static char peer_paths[PEER_MAX][sizeof(((struct sockaddr_un *)0)->sun_path)];
+static int peer_num = 0;
+static struct PeerPoint ring[PEER_MAX * PEER_VNODES];
+static int ring_len = 0;
+
+static atomic_long forwarded_num = ATOMIC_VAR_INIT(0);
+static atomic_long failed_num = ATOMIC_VAR_INIT(0);
+
+/**
+ * FNV-1a hash of str, continued from hash.
+ */
+static uint64_t HashString(uint64_t hash, const char *str) {
+  while (*str) {
+    hash ^= (unsigned char)*str++;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+/**
+ * Mix the bits of a FNV-1a hash, whose high bits barely change with the
+ * last characters, so that the points of similar keys spread over the
+ * whole ring.
+ */
+static uint64_t MixHash(uint64_t hash) {
+  hash ^= hash >> 30;
+  hash *= 0xbf58476d1ce4e5b9ULL;
+  hash ^= hash >> 27;
+  hash *= 0x94d049bb133111ebULL;
+  hash ^= hash >> 31;
+  return hash;
+}
+
+static int ComparePoint(const void *a, const void *b) {
+  const struct PeerPoint *pa = a, *pb = b;
+  if (pa->hash != pb->hash) return pa->hash < pb->hash ? -1 : 1;
+  /// Equal points are ordered by path, which is the same on every peer
+  return strcmp(peer_paths[pa->peer], peer_paths[pb->peer]);
+}
+
+int InitPeers(const char *list) {
+  const char *path = list;
+  char vnode[16];
+
+  // Split the list into paths
+  peer_num = 0;
+  while (*path) {
+    size_t len = strcspn(path, ",");
+    if (len == 0 || len >= sizeof(peer_paths[0]) || peer_num == PEER_MAX)
+      return -1;
+    memcpy(peer_paths[peer_num], path, len);
+    peer_paths[peer_num][len] = '\0';
+    for (int i = 0; i < peer_num; i++) {
+      if (strcmp(peer_paths[i], peer_paths[peer_num]) == 0) return -1;
+    }
+    peer_num++;
+    path += len;
+    if (*path == ',') path++;
+  }
+  if (peer_num == 0) return -1;
+
+  // Place the points of each peer by the hash of its path, so that the
+  // ring doesn't depend on the order of the list
+  ring_len = 0;
+  for (int i = 0; i < peer_num; i++) {
+    uint64_t hash = HashString(0xcbf29ce484222325ULL, peer_paths[i]);
+    for (int j = 0; j < PEER_VNODES; j++) {
+      snprintf(vnode, sizeof(vnode), "#%d", j);
+      ring[ring_len].hash = MixHash(HashString(hash, vnode));
+      ring[ring_len].peer = i;
+      ring_len++;
+    }
+  }
+  qsort(ring, ring_len, sizeof(ring[0]), ComparePoint);
+
+  return 0;
+}
+
+int IsPeerModeEnabled() {
+  return peer_num > 1;
+}
+
+int LookupPeer(const char *host, const char *url) {
+  uint64_t hash;
+  int low = 0, high = ring_len;
+
+  if (peer_num <= 1) return 0;
+
+  hash = HashString(0xcbf29ce484222325ULL, host);
+  hash = MixHash(HashString(hash, url));
+
+  // The owner is the first point at or after hash, wrapping around
+  while (low < high) {
+    int mid = low + (high - low) / 2;
+    if (ring[mid].hash < hash) low = mid + 1;
+    else high = mid;
+  }
+  return ring[low == ring_len ? 0 : low].peer;
+}
+
+const char *GetPeerPath(int peer) {
+  return peer_paths[peer];
+}
+
+/**
+ * Fill addr with the Unix socket path of peer.
+ */
+static void GetPeerAddr(int peer, struct sockaddr_un *addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  strcpy(addr->sun_path, peer_paths[peer]);
+}
+
+int OpenPeerListenFd() {
+  struct sockaddr_un addr;
+  int fd;
+
+  if (peer_num == 0) return -1;
+  GetPeerAddr(0, &addr);
+  unlink(addr.sun_path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(fd, 1024) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int OpenPeerFd(int peer) {
+  struct sockaddr_un addr;
+  int fd;
+
+  GetPeerAddr(peer, &addr);
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (fd < 0) return -1;
+
+  /// A Unix socket connects at once, or fails with EAGAIN if the backlog
+  /// of the peer is full
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+  return fd;
+}
+
+void ClosePeers() {
+  if (peer_num > 0) unlink(peer_paths[0]);
+}
+
+void CountPeerForward(int is_failed) {
+  if (is_failed) atomic_fetch_add(&failed_num, 1);
+  else atomic_fetch_add(&forwarded_num, 1);
+}
+
+void GetPeerStats(long *forwarded, long *failed) {
+  *forwarded = atomic_load(&forwarded_num);
+  *failed = atomic_load(&failed_num);
+}
@@ -0,0 +1,216 @@
+#include "prefork.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PREFORK_TICK_MS 100     // master checks for workers to restart
+
+static struct WorkerStats *workers = NULL;   // shared with the workers
+static int worker_num = 0;
+static int worker_index = -1;               // -1 in the master
+
+static const char *counter_names[WORKER_COUNTER_NUM] = {
+  "accepted", "finished", "cache hits"
+};
+
+/**
+ * \returns the monotonic time in ms.
+ */
+static int64_t NowMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Fork the worker with index. The worker goes on in RunPrefork, the
+ * master returns.
+ *
+ * \returns 1 in the worker, 0 in the master, -1 if fork fails.
+ */
+static int SpawnWorker(int index) {
+  char dir[64];
+  pid_t master = getpid();
+  pid_t pid;
+
+  /// Or the worker prints what is left in the buffer again
+  fflush(stdout);
+  pid = fork();
+  if (pid < 0) return -1;
+  if (pid > 0) {
+    workers[index].pid = pid;
+    workers[index].started_ms = NowMs();
+    printf("[Master] Worker %d started, pid: %d\n", index, pid);
+    return 0;
+  }
+
+  // The worker exits with the master, even if the master is killed
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  if (getppid() != master) exit(1);
+
+  worker_index = index;
+  snprintf(dir, sizeof(dir), "%s/%d", PREFORK_DIR, index);
+  if (chdir(dir) != 0) {
+    fprintf(stderr, "Fail to enter %s: %s\n", dir, strerror(errno));
+    exit(1);
+  }
+  return 1;
+}
+
+/**
+ * Reap the exited workers, and note when to restart them.
+ */
+static void ReapWorkers() {
+  pid_t pid;
+  int status;
+
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    for (int i = 0; i < worker_num; i++) {
+      if (workers[i].pid != pid) continue;
+      if (WIFSIGNALED(status)) {
+        printf("[Master] Worker %d (pid %d) killed by signal %d\n",
+               i, pid, WTERMSIG(status));
+      }
+      else {
+        printf("[Master] Worker %d (pid %d) exited with status %d\n",
+               i, pid, WEXITSTATUS(status));
+      }
+      workers[i].pid = 0;
+    }
+  }
+}
+
+/**
+ * Stop all workers and wait for them to exit.
+ */
+static void StopWorkers() {
+  for (int i = 0; i < worker_num; i++) {
+    if (workers[i].pid > 0) kill(workers[i].pid, SIGTERM);
+  }
+  while (wait(NULL) > 0 || errno == EINTR) continue;
+  for (int i = 0; i < worker_num; i++) workers[i].pid = 0;
+}
+
+/**
+ * Print the counters of each worker and their sums.
+ */
+static void PrintWorkerStats() {
+  long sums[WORKER_COUNTER_NUM] = {0};
+  int restarts = 0;
+
+  printf("Workers:  restarts");
+  for (int c = 0; c < WORKER_COUNTER_NUM; c++)
+    printf(" %10s", counter_names[c]);
+  printf("\n");
+  for (int i = 0; i < worker_num; i++) {
+    printf("  %-7d %8d", i, workers[i].restarts);
+    for (int c = 0; c < WORKER_COUNTER_NUM; c++) {
+      long count = atomic_load(&workers[i].counters[c]);
+      printf(" %10ld", count);
+      sums[c] += count;
+    }
+    printf("\n");
+    restarts += workers[i].restarts;
+  }
+  printf("  %-7s %8d", "total", restarts);
+  for (int c = 0; c < WORKER_COUNTER_NUM; c++) printf(" %10ld", sums[c]);
+  printf("\n");
+}
+
+int RunPrefork(int num, int listenfd) {
+  sigset_t mask;
+  siginfo_t info;
+  struct timespec tick = { 0, PREFORK_TICK_MS * 1000000L };
+  char dir[64];
+  int sig;
+
+  worker_num = num;
+
+  // Counters live in memory shared with the workers, so they outlive a
+  // crashed worker
+  workers = mmap(NULL, sizeof(struct WorkerStats) * worker_num,
+                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (workers == MAP_FAILED) {
+    perror("Fail to map worker statistics");
+    exit(1);
+  }
+  memset(workers, 0, sizeof(struct WorkerStats) * worker_num);
+
+  // Each worker has its own cache directories
+  mkdir(PREFORK_DIR, 0755);
+  for (int i = 0; i < worker_num; i++) {
+    snprintf(dir, sizeof(dir), "%s/%d", PREFORK_DIR, i);
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+      fprintf(stderr, "Fail to create %s: %s\n", dir, strerror(errno));
+      exit(1);
+    }
+  }
+
+  for (int i = 0; i < worker_num; i++) {
+    int retval = SpawnWorker(i);
+    if (retval > 0) return i;
+    if (retval < 0) perror("Fail to fork worker");
+  }
+
+  // The master only waits for signals, which are all blocked
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigaddset(&mask, SIGHUP);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGQUIT);
+  sigaddset(&mask, SIGTERM);
+  for (;;) {
+    sig = sigtimedwait(&mask, &info, &tick);
+    if (sig == SIGCHLD) ReapWorkers();
+    else if (sig > 0) break;
+
+    // Restart the exited workers, but not too often
+    for (int i = 0; i < worker_num; i++) {
+      int retval;
+      if (workers[i].pid != 0 ||
+          NowMs() - workers[i].started_ms < PREFORK_RESPAWN_MS)
+        continue;
+      workers[i].restarts++;
+      retval = SpawnWorker(i);
+      if (retval > 0) return i;
+      if (retval < 0) perror("Fail to fork worker");
+    }
+  }
+
+  printf("[Master] Stop all workers ...\n");
+  close(listenfd);
+  StopWorkers();
+  PrintWorkerStats();
+  exit(0);
+}
+
+int GetWorkerPeers(int index, char *buf, size_t size) {
+  size_t len = 0;
+
+  // Paths are relative to the working directory of a worker, which are
+  // siblings, so that every worker is given the same set of paths.
+  // The worker itself comes first.
+  for (int i = 0; i < worker_num; i++) {
+    int peer = (index + i) % worker_num;
+    int n = snprintf(buf + len, size - len, "%s../%d/peer.sock",
+                     i > 0 ? "," : "", peer);
+    if (n < 0 || (size_t)n >= size - len) return -1;
+    len += n;
+  }
+  return 0;
+}
+
+void CountWorker(enum WorkerCounter counter) {
+  if (worker_index < 0) return;
+  atomic_fetch_add_explicit(&workers[worker_index].counters[counter], 1,
+                            memory_order_relaxed);
+}
@@ -1,23 +1,45 @@
 #include "csapp.h"
 #include "http.h"
 #include "cache.h"
+#include "ioengine.h"
+#include "tunnel.h"
+#include "arena.h"
+#include "negcache.h"
+#include "origin.h"
+#include "warmup.h"
+#include "peer.h"
+#include "trace.h"
+#include "shaper.h"
+#include "prefork.h"
 
 #include <stdio.h>
 #include <stdatomic.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <netdb.h>
 #include <signal.h>
 #include <pthread.h>
 #include <time.h>
 
 #define ENABLE_STATIC_CACHE 1   // turn on/off static cache
-#define NTHREAD   4             // number of working threads
+#define NTHREAD   4             // max number of working threads
 #define MAX_REQ   80            // the max requests a thread can handle
 
 #define POOL_AVAIL_WAIT_NS 10000000   // 10ms
 #define SELECT_TIMEOUT_US 10000       // 10ms
 
+#define UPLOAD_BUF_SIZE 65536         // buffer of a request body to send
+/* memory of a connection: request and response buffers, upload buffer */
+#define REQUEST_ARENA_SIZE (2 * HTTP_BUF_SIZE + UPLOAD_BUF_SIZE)
+
+#define CONNECT_TIMEOUT_MS 3000       // give up connecting to a server
+
+#define USAGE "usage: %s [-a] [-b rate] [-f workers] [-l limit] " \
+              "[-n ttl[,ttl]] [-p sock[,peer...]] [-t slow_ms] [-u] " \
+              "[-w urls] [-z] <port>\n"
+
 #define HTTP_PORT "80"
+#define HTTPS_PORT "443"
 
 /**
  * State of a proxy request.
@@ -25,22 +47,55 @@
 enum ProxyState {
   UNCONNECTED,                  // unconnected to the target server
   CONNECTED,                    // connected to the target server
-  CACHED                        // requested data is cached
+  CACHED,                       // requested data is cached
+  TUNNEL,                       // relaying bytes of a CONNECT tunnel
+  QUEUED,                       // waiting for a connection slot of server
+  CONNECTING                    // waiting for server_fd to be connected
 };
 
+
 /**
  * Meta data of a proxy request.
  */
 struct ProxyMeta {
   int client_fd;                // file descriptor of connection to client
   int server_fd;                // file descriptor of connection to server
-  rio_t client_rp;              // robust io buffer for client_fd
-  rio_t server_rp;              // robust io buffer for server_fd
   char src_host[HOST_LEN];      // host name of client
   char src_port[HOST_LEN];      // port of client
   enum ProxyState proxy_state;
   struct HttpRequest http_request;
+  struct HttpResponse http_response;
   struct CacheInfo cache_info;
+  struct TunnelPipe tunnel[2];  // [0] client to server, [1] server to client
+  char *upload_buf;             // request body on its way to the server,
+                                // UPLOAD_BUF_SIZE bytes, NULL if none
+  size_t upload_start;          // offset of the first byte not sent
+  size_t upload_end;            // offset after the last byte received
+  struct Arena arena;           // backs all the buffers above, kept with
+                                // the slot and reset when it's reused
+  struct Origin *origin;        // origin whose slot is taken, or waited
+                                // for in QUEUED state, NULL if none
+  enum OriginOutcome origin_outcome;
+  int64_t queued_ms;            // monotonic time it's QUEUED
+  struct addrinfo *server_addrs; // addresses of the server in CONNECTING
+                                // state, NULL if none
+  struct addrinfo *next_addr;   // address to try if server_fd fails
+  int64_t connect_ms;           // monotonic time server_fd started
+                                // connecting
+  int connect_error;            // errno of the last failed address
+  int is_warmup;                // 1 if the client is the cache warm-up
+                                // or a background refresh
+  int stale_ok;                 // 1 if the expired cache content may be
+                                // served when the server fails
+  int is_relayed;               // 1 if any response data is relayed
+  int is_peer;                  // 1 if the client is a peer instance
+  int peer;                     // peer the request is forwarded to,
+                                // 0 if none
+  struct RequestTrace trace;    // time of each stage, if tracing is on
+  struct Shaper shaper;         // share of the worker and rate limit of
+                                // the response relayed to the client
+  int is_throttled;             // 1 if it waits for its rate limit
+  off_t cache_sent;             // bytes of the cache content sent
 };
 
 /**
@@ -51,7 +106,8 @@ struct RequestPool {
   int enabled[MAX_REQ];         // If each request is effective
   int req_num;                  // Number of effective requests
   fd_set read_set;              // Set of all active file descriptors
-  int max_fd;                   // Max descriptor in read_set
+  fd_set write_set;             // Set of descriptors waiting to be writable
+  int max_fd;                   // Max descriptor in read_set and write_set
   pthread_mutex_t pool_mutex;   // mutex to access RequestPool members
   pthread_cond_t pool_empty;    // condition variable if pool is empty
 };
@@ -60,6 +116,8 @@ struct RequestPool {
  * Global variables
  */
 struct RequestPool request_pools[NTHREAD];
+/* number of working threads, 1 in a worker process of prefork mode */
+int nthread = NTHREAD;
 
 /* number of request_pools that are not full */
 int avail_pools = NTHREAD;
@@ -71,10 +129,23 @@ const long pools_avail_cond_wait_ns = POOL_AVAIL_WAIT_NS;
 /* tid of threads */
 pthread_t workers[NTHREAD];
 
+/* I/O engine of each worker thread */
+struct IoEngine io_engines[NTHREAD];
+/* 1 if io_uring is requested by command line */
+int use_uring = 0;
+/* 1 if compression of cache is requested by command line */
+int use_gzip = 0;
+/* file of urls to warm up the cache with, NULL if none */
+char *warmup_path = NULL;
+/* number of worker processes of prefork mode, 0 if not in prefork mode */
+int prefork_num = 0;
+
 /* listen socket file descriptor */
 char *listen_port = NULL;
 /* listen socket file descriptor */
 int listenfd = -1;
+/* listen socket file descriptor of peers, -1 if not in peer mode */
+int peer_listenfd = -1;
 
 /* global flag to exit */
 volatile atomic_int exit_flag = ATOMIC_VAR_INIT(0);
@@ -97,20 +168,26 @@ void InitRequestPool(struct RequestPool *pool);
  * \param client_fd socket fd of client.
  * \param hostname host name of client.
  * \param port port of client.
+ * \param is_warmup 1 if the client is the cache warm-up.
+ * \param is_peer 1 if the client is a peer instance.
+ * \param accepted_ns time the connection was accepted, 0 if not traced.
+ * Note: avail_pools_mutex should be held.
  * 
  * \returns 1 if success, 0 otherwise.
  */
 int AddRequestToPool(struct RequestPool *pool, int client_fd,
-                     char *hostname, char *port);
+                     char *hostname, char *port, int is_warmup,
+                     int is_peer, int64_t accepted_ns);
 
 /**
  * Find index of the next active request in requests in
  * RequestPool structure. The active request has its 
- * client_fd or server_fd set in ready_set. The function
- * starts finding from start_index.
+ * client_fd or server_fd set in ready_set or ready_wset.
+ * The function starts finding from start_index.
  * 
  * \param pool the request pool.
- * \param ready_setp ptr to the ready set of active descriptors.
+ * \param ready_setp ptr to the ready set of readable descriptors.
+ * \param ready_wsetp ptr to the ready set of writable descriptors.
  * \param start_index the index to start from.
  * 
  * \returns the index of the next active request if found,
@@ -118,6 +195,7 @@ int AddRequestToPool(struct RequestPool *pool, int client_fd,
  */
 int GetNextActiveRequestInPool(struct RequestPool *pool,
                                fd_set *ready_setp,
+                               fd_set *ready_wsetp,
                                int start_index);
 
 /**
@@ -135,8 +213,70 @@ int HandleUnconnectedClientFd(struct RequestPool *pool,
                               size_t worker_id);
 
 /**
- * Handle a client_fd in CONNECTED state in a worker thread.
+ * Take a connection slot of the server of a request whose headers are
+ * parsed. If the server has no free slot, the request is changed to
+ * QUEUED state, and its client_fd is not read until it's admitted. If
+ * the circuit of the server is open, or the request has been QUEUED for
+ * ORIGIN_QUEUE_TIMEOUT_MS, the client is answered with 503, or with the
+ * expired cache content by UseStaleCache.
+ *
+ * \returns 1 if a slot is taken, 0 if queued or changed to CACHED state,
+ *          -1 if rejected.
+ */
+int AcquireServerSlot(struct RequestPool *pool, struct ProxyMeta *request,
+                      size_t worker_id);
+
+/**
+ * Change a request whose server fails to CACHED state, so that its
+ * expired cache content is served instead of an error, if stale-if-error
+ * allows.
+ *
+ * \returns 1 if the request is changed to CACHED state, 0 otherwise.
+ */
+int UseStaleCache(struct ProxyMeta *request, size_t worker_id);
+
+/**
+ * Connect to the server of a request whose headers are parsed, forward
+ * the request, and change its state to CONNECTED; or leave it QUEUED if
+ * the server has no free connection slot, or CONNECTING until server_fd
+ * is connected.
+ *
+ * \returns 1 if successfully handled, but the request process is not finished;
+ *          0 if successfully handled, and the request process is finished;
+ *          -1 if error occurs.
+ */
+int ConnectServer(struct RequestPool *pool, struct ProxyMeta *request,
+                  size_t worker_id);
+
+/**
+ * Forward a GET request whose cache content is owned by peer to it, and
+ * change its state to CONNECTED, so that the response of the peer is
+ * relayed like one of the server, but not cached here.
+ *
+ * \returns 1 if the request is forwarded, 0 if the peer can't be
+ *          connected, -1 if error occurs.
+ */
+int ConnectPeer(struct RequestPool *pool, struct ProxyMeta *request,
+                size_t worker_id, int peer);
+
+/**
+ * Send a request to its newly connected server_fd, which is a peer if
+ * request->peer is set, and change its state to CONNECTED.
+ *
+ * \param target where server_fd is connected to, for logs.
+ *
+ * \returns 1 if successfully handled, -1 if error occurs.
+ */
+int SendRequestToServer(struct RequestPool *pool, struct ProxyMeta *request,
+                        size_t worker_id, const char *target);
+
+/**
+ * Handle a request in CONNECTED state in a worker thread, whose client_fd
+ * is ready to read or server_fd is ready to write: relay the request body
+ * through upload_buf. The client is read only if upload_buf has room, and
+ * the server is waited to be writable only if upload_buf has bytes.
  * 
+ * \param pool the request pool.
  * \param request the ProxyMeta structure containing the client_fd.
  * \param worker_id the index of worker thread.
  * 
@@ -144,31 +284,129 @@ int HandleUnconnectedClientFd(struct RequestPool *pool,
  *          0 if successfully handled, and the request process is finished;
  *          -1 if error occurs.
  */
-int HandleConnectedClientFd(struct ProxyMeta *request, size_t worker_id);
+int HandleConnectedClientFd(struct RequestPool *pool,
+                            struct ProxyMeta *request, size_t worker_id);
 
 /**
  * Handle a client_fd in Cached state in a worker thread.
  * 
  * \param request the ProxyMeta structure containing the client_fd.
+ * \param index index of the request in its RequestPool.
  * \param worker_id the index of worker thread.
  * 
  * \returns 1 if successfully handled, but the request process is not finished;
  *          0 if successfully handled, and the request process is finished;
  *          -1 if error occurs.
  */
-int HandleCachedClientFd(struct ProxyMeta *request, size_t worker_id);
+int HandleCachedClientFd(struct ProxyMeta *request, int index,
+                         size_t worker_id);
 
 /**
  * Handle a server_fd in a worker thread.
  * 
  * \param request the ProxyMeta structure containing the server_fd.
+ * \param index index of the request in its RequestPool.
  * \param worker_id the index of worker thread.
  * 
  * \returns 1 if successfully handled, but the request process is not finished;
  *          0 if successfully handled, and the request process is finished;
  *          -1 if error occurs.
  */
-int HandleServerFd(struct ProxyMeta *request, size_t worker_id);
+int HandleServerFd(struct ProxyMeta *request, int index, size_t worker_id);
+
+/**
+ * Stop waiting for the fd a request relays the response from, i.e. its
+ * server_fd to be readable, or its client_fd to be writable in CACHED
+ * state, while its rate limit holds it back; or wait for the fd again.
+ *
+ * \param is_throttled 1 to stop waiting, 0 to wait again.
+ */
+void ThrottleRequest(struct RequestPool *pool, struct ProxyMeta *request,
+                     int is_throttled);
+
+/**
+ * Establish the tunnel of a CONNECT request whose headers are parsed,
+ * and change its state to TUNNEL; or leave it QUEUED if the server has no
+ * free connection slot, or CONNECTING until server_fd is connected.
+ *
+ * \returns 1 if the tunnel is established or queued, -1 if error occurs.
+ */
+int OpenTunnel(struct RequestPool *pool, struct ProxyMeta *request,
+               size_t worker_id);
+
+/**
+ * Establish the tunnel of a CONNECT request whose server_fd is connected
+ * to target, and change its state to TUNNEL.
+ *
+ * \returns 1 if the tunnel is established, -1 if error occurs.
+ */
+int EstablishTunnel(struct RequestPool *pool, struct ProxyMeta *request,
+                    size_t worker_id, const char *target);
+
+/**
+ * Split the host of a request, e.g. "example.com:8080", into hostname
+ * and port, which point into host_copy of HOST_LEN bytes. Without a port,
+ * port is HTTPS_PORT for a CONNECT request, HTTP_PORT otherwise.
+ */
+void SplitServerHost(struct ProxyMeta *request, char *host_copy,
+                     char **hostname, char **port);
+
+/**
+ * Start connecting the server_fd of a request to hostname:port like
+ * open_clientfd, but in non-blocking mode: the request is changed to
+ * CONNECTING state, in which server_fd is waited to be writable and
+ * client_fd is not read, and is passed on by ContinueServerConnect. Each
+ * address of the server is given CONNECT_TIMEOUT_MS, so that an
+ * unreachable server is reported as a timeout without blocking the
+ * worker thread.
+ * Note: the host name is still resolved in blocking mode.
+ *
+ * \returns 1 if connected at once, 0 if connecting, -1 if error occurs,
+ *          with errno set.
+ */
+int StartServerConnect(struct RequestPool *pool, struct ProxyMeta *request,
+                       const char *hostname, const char *port);
+
+/**
+ * Go on connecting a request in CONNECTING state, whose server_fd is
+ * writable, or has been connecting for CONNECT_TIMEOUT_MS if is_timeout.
+ * If the address fails, the next address of the server is tried.
+ *
+ * \returns 1 if connected, 0 if still connecting, -1 if all addresses
+ *          fail, with errno set to ETIMEDOUT if the last one timed out.
+ */
+int ContinueServerConnect(struct RequestPool *pool,
+                          struct ProxyMeta *request, int is_timeout);
+
+/**
+ * Go on with a request by the result of StartServerConnect or
+ * ContinueServerConnect: send the request, or establish the tunnel of a
+ * CONNECT request, if connected is 1; answer the client with 504 if the
+ * server timed out, 502 for other errors, or with the expired cache
+ * content by UseStaleCache, if connected is -1.
+ *
+ * \returns 1 if successfully handled, but the request process is not finished;
+ *          0 if successfully handled, and the request process is finished;
+ *          -1 if error occurs.
+ */
+int HandleServerConnect(struct RequestPool *pool, struct ProxyMeta *request,
+                        size_t worker_id, int connected);
+
+/**
+ * \returns the monotonic time in ms.
+ */
+int64_t GetNowMs();
+
+/**
+ * Handle a request in TUNNEL state in a worker thread, either of its
+ * client_fd and server_fd is ready.
+ *
+ * \returns 1 if successfully handled, but the tunnel is not closed;
+ *          0 if both directions of the tunnel are closed;
+ *          -1 if error occurs.
+ */
+int HandleTunnelFd(struct RequestPool *pool, struct ProxyMeta *request,
+                   size_t worker_id);
 
 /**
  * Remove a request in a RequestPool, free all resources of the request.
@@ -179,9 +417,23 @@ int HandleServerFd(struct ProxyMeta *request, size_t worker_id);
 void RmRequestInpool(struct RequestPool *pool, int index);
 
 /**
- * Main thread function: Allocate requests to workers.
+ * Allocate a request to a worker, waiting while all of them are full.
+ * Thread safe: called by the main thread, the peer thread and the refresh
+ * threads. connfd is closed if no worker takes it, i.e. the proxy exits.
+ */
+void HandleConnection(int connfd, char *hostname, char *port,
+                      int is_warmup, int is_peer);
+
+/**
+ * Serve connfd, one end of a socket pair of the cache warm-up, like a
+ * client connection.
  */
-void HandleConnection(int connfd, char *hostname, char *port);
+void HandleWarmupConnection(int connfd);
+
+/**
+ * Peer thread function: Accept connections of peer instances.
+ */
+void *PeerThread(void *args);
 
 /**
  * Work thread function: Serve requests.
@@ -211,10 +463,71 @@ int main(int argc, char **argv) {
   struct sockaddr_storage clientaddr;
   socklen_t clientlen = sizeof(clientaddr);
   sigset_t mask, prev_mask;
+  int opt;
+  int error_ttl, not_found_ttl;
 
   // Check command line args
-  if (argc != 2) {
-    fprintf(stderr, "usage: %s <port>\n", argv[0]);
+  while ((opt = getopt(argc, argv, "ab:f:l:n:p:t:uw:z")) != -1) {
+    switch (opt) {
+      case 'a':
+        SetCacheAdmission(1);
+        break;
+      case 'b':
+        /// -b rate, in KB/s per client
+        SetClientRate(atol(optarg) * 1024);
+        break;
+      case 'f':
+        prefork_num = atoi(optarg);
+        if (prefork_num < 1 || prefork_num > PREFORK_MAX) {
+          fprintf(stderr, "%s: workers should be 1 to %d: %s\n", argv[0],
+                  PREFORK_MAX, optarg);
+          exit(1);
+        }
+        break;
+      case 'l':
+        SetOriginLimit(atoi(optarg));
+        break;
+      case 'n':
+        /// -n error_ttl[,not_found_ttl], in seconds
+        error_ttl = not_found_ttl = -1;
+        if (sscanf(optarg, "%d,%d", &error_ttl, &not_found_ttl) < 1 ||
+            error_ttl < 0) {
+          fprintf(stderr, "%s: invalid ttl: %s\n", argv[0], optarg);
+          exit(1);
+        }
+        if (not_found_ttl < 0) not_found_ttl = NEG_NOT_FOUND_TTL;
+        SetNegativeTtl(error_ttl, not_found_ttl);
+        break;
+      case 'p':
+        if (InitPeers(optarg) != 0) {
+          fprintf(stderr, "%s: invalid peers: %s\n", argv[0], optarg);
+          exit(1);
+        }
+        break;
+      case 't':
+        SetTraceThreshold(atoi(optarg));
+        break;
+      case 'u':
+        use_uring = 1;
+        break;
+      case 'w':
+        warmup_path = optarg;
+        break;
+      case 'z':
+        use_gzip = 1;
+        break;
+      default:
+        fprintf(stderr, USAGE, argv[0]);
+        exit(1);
+    }
+  }
+  if (optind != argc-1) {
+    fprintf(stderr, USAGE, argv[0]);
+    exit(1);
+  }
+  if (prefork_num > 0 && IsPeerModeEnabled()) {
+    fprintf(stderr, "%s: workers of -f are peers already, drop -p\n",
+            argv[0]);
     exit(1);
   }
 
@@ -222,21 +535,69 @@ int main(int argc, char **argv) {
   sigfillset(&mask);
   pthread_sigmask(SIG_BLOCK, &mask, &prev_mask);
 
+  // Fork worker processes sharing the listen socket, each of which goes
+  // on from here with one working thread, while the master stays in
+  // RunPrefork until it exits
+  if (prefork_num > 0) {
+    char peers[PREFORK_MAX * 24];
+    char path_buf[PATH_MAX];
+    char *path;
+    int worker;
+
+    listen_port = argv[optind];
+    listenfd = Open_listenfd(listen_port);
+    printf("Proxy listening on port %s with %d workers ...\n",
+           listen_port, prefork_num);
+    /// Workers run in their own directories
+    if (warmup_path && (path = realpath(warmup_path, NULL)) != NULL)
+      warmup_path = path;
+
+    worker = RunPrefork(prefork_num, listenfd);
+    nthread = avail_pools = 1;
+    if (getcwd(path_buf, sizeof(path_buf) - 1) == NULL) {
+      unix_error("Fail to get working dir of worker");
+    }
+    strcat(path_buf, "/");
+    SetCacheRoot(path_buf);
+    if (prefork_num > 1 &&
+        (GetWorkerPeers(worker, peers, sizeof(peers)) != 0 ||
+         InitPeers(peers) != 0)) {
+      fprintf(stderr, "Fail to set peers of worker %d\n", worker);
+    }
+  }
+
   // Init cache module
   InitCacheModule();
+  if (use_gzip) SetCacheCompression(1);
 
   // Init request_pools
-  for (ssize_t i = 0; i < NTHREAD; i++) {
+  for (ssize_t i = 0; i < nthread; i++) {
     InitRequestPool(&request_pools[i]);
   }
 
+  // Init I/O engines
+  if (use_uring && !IsIoUringSupported()) {
+    printf("io_uring is not supported, fall back to plain system calls\n");
+  }
+  for (ssize_t i = 0; i < nthread; i++) {
+    if (InitIoEngine(&io_engines[i], use_uring) != 0) {
+      unix_error("Failed to init I/O engine");
+    }
+  }
+  if (io_engines[0].use_uring) printf("I/O engine: io_uring\n");
+
   // Create worker threads
-  for (ssize_t i = 0; i < NTHREAD; i++) {
+  for (ssize_t i = 0; i < nthread; i++) {
     /// All worker threads will inherit the blocked sigmask
     /// from main thread
     Pthread_create(&workers[i], NULL, WorkThread, (void *)i);
   }
 
+  // Refresh stale cache content in background
+  if (StartRefresh(HandleWarmupConnection) != 0) {
+    fprintf(stderr, "Fail to start cache refresh threads\n");
+  }
+
   // Install signal handlers
   Signal(SIGPIPE, SIG_IGN);
   Signal(SIGHUP, ExitSignalHandler);
@@ -244,10 +605,34 @@ int main(int argc, char **argv) {
   Signal(SIGINT, ExitSignalHandler);
   Signal(SIGTERM, ExitSignalHandler);
 
-  // Start listening on port
-  listen_port = argv[1];
-  listenfd = Open_listenfd(listen_port);
-  printf("Proxy listening on port %s ...\n", listen_port);
+  // Fill the cache with the hot urls before taking traffic
+  if (warmup_path) {
+    struct WarmupStats stats;
+    if (RunWarmup(warmup_path, HandleWarmupConnection, &stats) != 0) {
+      fprintf(stderr, "Fail to read urls to warm up: %s\n", warmup_path);
+    }
+    else {
+      printf("Warm-up: %d fetched, %d failed in %.2fs\n",
+             stats.fetched, stats.failed, stats.seconds);
+    }
+  }
+
+  // Start listening on port, unless the master of prefork mode did
+  if (listenfd < 0) {
+    listen_port = argv[optind];
+    listenfd = Open_listenfd(listen_port);
+    printf("Proxy listening on port %s ...\n", listen_port);
+  }
+
+  // Serve misses forwarded by peers
+  if (IsPeerModeEnabled()) {
+    pthread_t tid;
+    peer_listenfd = OpenPeerListenFd();
+    if (peer_listenfd < 0) unix_error("Fail to listen for peers");
+    Pthread_create(&tid, NULL, PeerThread, NULL);
+    Pthread_detach(tid);
+    printf("Peers listening on %s ...\n", GetPeerPath(0));
+  }
 
   // Unblock all signals
   // Afterwards, when receiving signals, ExitSignalHandler will
@@ -263,25 +648,26 @@ int main(int argc, char **argv) {
                   port, HOST_LEN, 0);
       printf("[Main thread] Get connection from %s:%s, client_fd: %d\n",
              hostname, port, connfd);
-      HandleConnection(connfd, hostname, port);
+      CountWorker(WORKER_ACCEPTED);
+      HandleConnection(connfd, hostname, port, 0, 0);
     }
   }
 
   // Cancel all worker threads
-  for (ssize_t i = 0; i < NTHREAD; i++) {
+  for (ssize_t i = 0; i < nthread; i++) {
     pthread_cancel(workers[i]);
   }
 
   // Reap all worker threads
   printf("Reap all worker threads ...\n");
-  for (ssize_t i = 0; i < NTHREAD; i++) {
+  for (ssize_t i = 0; i < nthread; i++) {
     pthread_join(workers[i], NULL);
   }
 
   // Free all resources
   printf("Free all resources ...\n");
   /// Destroy mutexes and condition variables
-  for (ssize_t i = 0; i < NTHREAD; i++) {
+  for (ssize_t i = 0; i < nthread; i++) {
     pthread_mutex_trylock(&request_pools[i].pool_mutex);
     pthread_mutex_unlock(&request_pools[i].pool_mutex);
     pthread_mutex_destroy(&request_pools[i].pool_mutex);
@@ -291,7 +677,7 @@ int main(int argc, char **argv) {
   /// Close client_fd and server_fd
   /// Free HttpRequest structures
   /// Free CacheInfo structures
-  for (ssize_t i = 0; i < NTHREAD; i++) {
+  for (ssize_t i = 0; i < nthread; i++) {
     struct RequestPool *pool = &request_pools[i];
     for (ssize_t j = 0; j < MAX_REQ; j++) {
       struct ProxyMeta *request = &pool->requests[j];
@@ -300,7 +686,51 @@ int main(int argc, char **argv) {
       if (request->client_fd >= 0) close(request->client_fd);
       if (request->server_fd >= 0) close(request->server_fd);
       FreeHttpRequest(&request->http_request);
+      FreeHttpResponse(&request->http_response);
       if (ENABLE_STATIC_CACHE) FreeCacheInfo(&request->cache_info);
+      CloseTunnelPipe(&request->tunnel[0]);
+      CloseTunnelPipe(&request->tunnel[1]);
+    }
+  }
+  /// Free arenas of all slots
+  for (ssize_t i = 0; i < nthread; i++) {
+    for (ssize_t j = 0; j < MAX_REQ; j++) {
+      FreeArena(&request_pools[i].requests[j].arena);
+    }
+  }
+  /// Free I/O engines
+  for (ssize_t i = 0; i < nthread; i++) {
+    FreeIoEngine(&io_engines[i]);
+  }
+
+  // Show statistics
+  long accepted, rejected;
+  GetCacheAdmissionStats(&accepted, &rejected);
+  printf("Cache admission: %ld accepted, %ld rejected\n", accepted, rejected);
+  printf("Negative cache: %ld hits\n", GetNegativeHits());
+  long queued;
+  GetOriginStats(&queued, &rejected);
+  printf("Origin limits: %ld queued, %ld rejected\n", queued, rejected);
+  int segments;
+  long compacted, evicted;
+  GetSegmentStats(&segments, &compacted, &evicted);
+  printf("Segment store: %d segments, %ld compacted, %ld evicted\n",
+         segments, compacted, evicted);
+  printf("Rate limit: %ld throttled\n", GetShaperThrottles());
+  if (IsPeerModeEnabled()) {
+    long forwarded, failed;
+    GetPeerStats(&forwarded, &failed);
+    printf("Peers: %ld forwarded, %ld fell back\n", forwarded, failed);
+    ClosePeers();
+  }
+  if (IsTraceEnabled()) {
+    struct TraceStats stats;
+    printf("Trace (us, upper bounds) requests      p50      p90      p99\n");
+    for (int stage = 0; stage < TRACE_STAGE_NUM; stage++) {
+      GetTraceStats(stage, &stats);
+      if (stage != TRACE_ACCEPTED && stats.count == 0) continue;
+      printf("  %-22s %8ld %8ld %8ld %8ld\n", GetTraceStageName(stage),
+             stats.count, stats.p50_us, stats.p90_us, stats.p99_us);
     }
   }
 
@@ -327,19 +757,33 @@ static struct timespec GetTimeoutTime(int64_t ns) {
 
 void InitRequestPool(struct RequestPool *pool) {
   memset(pool->enabled, 0, sizeof(pool->enabled));
+  for (int i = 0; i < MAX_REQ; i++) {
+    if (InitArena(&pool->requests[i].arena, REQUEST_ARENA_SIZE) != 0) {
+      unix_error("Failed to map request arena");
+    }
+  }
   pool->req_num = 0;
   FD_ZERO(&pool->read_set);
+  FD_ZERO(&pool->write_set);
   pool->max_fd = -1;
   pthread_mutex_init(&pool->pool_mutex, NULL);
   pthread_cond_init(&pool->pool_empty, NULL);
 }
 
-void HandleConnection(int connfd, char *hostname, char *port) {
-  static int next_worker = 0;   // next worker thread to handle the connection
+void HandleConnection(int connfd, char *hostname, char *port,
+                      int is_warmup, int is_peer) {
+  /// next worker thread to handle the connection, guarded by
+  /// avail_pools_mutex like avail_pools
+  static int next_worker = 0;
   int retval = 0;
-  int worker_id = next_worker;
-
-  // Wait for request_pools to be not full
+  int worker_id;
+  int64_t accepted_ns = GetTraceTime();
+
+  // Wait for request_pools to be not full. The main thread, the peer
+  // thread and the refresh threads all call this function, so the mutex
+  // is held until the connection is added: only callers of this function
+  // fill pools, and avail_pools never counts a full pool, so one of them
+  // takes the connection.
   pthread_mutex_lock(&avail_pools_mutex);
   while (!TestExitFlag() && avail_pools <= 0) {
     /// If signals of exit arrived here, thus ExitSignalHandler is executed
@@ -348,30 +792,50 @@ void HandleConnection(int connfd, char *hostname, char *port) {
     struct timespec timeout = GetTimeoutTime(pools_avail_cond_wait_ns);
     pthread_cond_timedwait(&pools_avail_cond, &avail_pools_mutex, &timeout);
   }
-  pthread_mutex_unlock(&avail_pools_mutex);
-
-  if (TestExitFlag()) {
-    close(connfd);
-    return;
-  }
 
   // Add the request to next available request pool
-  for (int i = 0; i < NTHREAD; i++) {
-    worker_id = (next_worker+i) % NTHREAD;
+  for (int i = 0; i < nthread && !TestExitFlag(); i++) {
+    worker_id = (next_worker+i) % nthread;
     retval = AddRequestToPool(
-      &request_pools[worker_id], connfd, hostname, port);
+      &request_pools[worker_id], connfd, hostname, port, is_warmup,
+      is_peer, accepted_ns);
     if (retval) {
-      next_worker = (worker_id + 1) % NTHREAD;
+      next_worker = (worker_id + 1) % nthread;
       break;
     }
   }
+  pthread_mutex_unlock(&avail_pools_mutex);
+
+  /// Nobody else would close it, e.g. a refresh thread waits for its end
+  /// of the socket pair to be closed
+  if (!retval) close(connfd);
+}
+
+void HandleWarmupConnection(int connfd) {
+  HandleConnection(connfd, "[Warm-up]", "0", 1, 0);
+}
+
+void *PeerThread(void *args) {
+  int connfd;
+
+  while (!TestExitFlag()) {
+    connfd = accept(peer_listenfd, NULL, NULL);
+    if (connfd >= 0) {
+      printf("[Peer thread] Get connection from peer, client_fd: %d\n",
+             connfd);
+      HandleConnection(connfd, "[Peer]", "0", 0, 1);
+    }
+  }
+
+  return NULL;
 }
 
 /**
  * Returns 1 if success, 0 otherwise.
  */ 
 int AddRequestToPool(struct RequestPool *pool, int client_fd,
-                     char *hostname, char *port) {
+                     char *hostname, char *port, int is_warmup,
+                     int is_peer, int64_t accepted_ns) {
   pthread_mutex_lock(&pool->pool_mutex);
   // The pool is full to add a new request
   if (pool->req_num >= MAX_REQ) {
@@ -386,7 +850,6 @@ int AddRequestToPool(struct RequestPool *pool, int client_fd,
     /// Init ProxyMeta structure
     pool->requests[i].client_fd = client_fd;
     pool->requests[i].server_fd = -1;
-    rio_readinitb(&pool->requests[i].client_rp, client_fd);
     int src_host_size = sizeof(pool->requests[i].src_host);
     int src_port_size = sizeof(pool->requests[i].src_port);
     strncpy(pool->requests[i].src_host, hostname, src_host_size-1);
@@ -394,8 +857,29 @@ int AddRequestToPool(struct RequestPool *pool, int client_fd,
     pool->requests[i].src_host[src_host_size-1] = '\0';
     pool->requests[i].src_port[src_port_size-1] = '\0';
     pool->requests[i].proxy_state = UNCONNECTED;
+    InitTunnelPipe(&pool->requests[i].tunnel[0]);
+    InitTunnelPipe(&pool->requests[i].tunnel[1]);
+    pool->requests[i].upload_buf = NULL;
+    pool->requests[i].upload_start = 0;
+    pool->requests[i].upload_end = 0;
+    pool->requests[i].origin = NULL;
+    pool->requests[i].origin_outcome = ORIGIN_UNKNOWN;
+    pool->requests[i].server_addrs = NULL;
+    pool->requests[i].is_warmup = is_warmup;
+    pool->requests[i].stale_ok = 0;
+    pool->requests[i].is_relayed = 0;
+    pool->requests[i].is_peer = is_peer;
+    pool->requests[i].peer = 0;
+    StartTrace(&pool->requests[i].trace, accepted_ns);
+    /// The warm-up and peers are not clients to be limited
+    InitShaper(&pool->requests[i].shaper, !is_warmup && !is_peer);
+    pool->requests[i].is_throttled = 0;
+    pool->requests[i].cache_sent = 0;
     /// Init HttpRuquest struture in ProxyMeta structure
-    int ret = InitHttpRequest(&pool->requests[i].http_request);
+    struct Arena *arena = &pool->requests[i].arena;
+    int ret = InitHttpRequest(&pool->requests[i].http_request, arena);
+    if (ret == 0)
+      ret = InitHttpResponse(&pool->requests[i].http_response, arena);
     if (ret != 0) {
       /// Usually, the program should never reach here ! ! !
       pthread_mutex_unlock(&pool->pool_mutex);
@@ -419,10 +903,8 @@ int AddRequestToPool(struct RequestPool *pool, int client_fd,
     pthread_cond_signal(&pool->pool_empty);
   }
   if (pool->req_num == MAX_REQ) {
-    /// Decrease avail_pools by 1
-    pthread_mutex_lock(&avail_pools_mutex);
+    /// Decrease avail_pools by 1, the caller holds avail_pools_mutex
     avail_pools--;
-    pthread_mutex_unlock(&avail_pools_mutex);
   }
 
   pthread_mutex_unlock(&pool->pool_mutex);
@@ -432,25 +914,66 @@ int AddRequestToPool(struct RequestPool *pool, int client_fd,
 
 void RmRequestInpool(struct RequestPool *pool, int index) {
   struct ProxyMeta *request = &pool->requests[index];
+  struct IoEngine *engine = &io_engines[pool - request_pools];
+  char trace_msg[256];
+  int is_avail;                 // 1 if the pool is no longer full
 
   // Close and free resources
+  /// fixed file slots hold references to the files, release them first
+  AttachIoEngineFiles(engine, index, -1, -1);
   if (request->client_fd >= 0) close(request->client_fd);
   if (request->server_fd >= 0) close(request->server_fd);
-  FreeHttpRequest(&request->http_request);
+  TraceRequest(&request->trace, TRACE_RELAYED);
+  /// Only a whole response is cached, whatever ended the request
+  if (ENABLE_STATIC_CACHE && request->cache_info.is_write &&
+      !IsResponseComplete(&request->http_response)) {
+    SetCacheError(&request->cache_info, EPROTO);
+  }
+  FreeHttpResponse(&request->http_response);
+  /// Committing the cache content may take a copy of the whole response
   if (ENABLE_STATIC_CACHE) FreeCacheInfo(&request->cache_info);
+  TraceRequest(&request->trace, TRACE_STORED);
+  /// A tunnel lasts as long as the client wants, which is not slow
+  if (request->proxy_state != TUNNEL &&
+      FinishTrace(&request->trace, trace_msg, sizeof(trace_msg))) {
+    const char *server_url = GetHttpProxyUrl(&request->http_request);
+    printf("[thread %ld] %s:%s==============>%s%s slow: %s\n",
+           pool - request_pools, request->src_host, request->src_port,
+           GetHttpHost(&request->http_request),
+           server_url ? server_url : "", trace_msg);
+  }
+  FreeHttpRequest(&request->http_request);
+  CloseTunnelPipe(&request->tunnel[0]);
+  CloseTunnelPipe(&request->tunnel[1]);
+  request->upload_buf = NULL;
+  ResetArena(&request->arena);
+  if (request->server_addrs) freeaddrinfo(request->server_addrs);
+  request->server_addrs = NULL;
+  /// Give the connection slot of server back, or the place in its queue
+  if (request->proxy_state == QUEUED)
+    CancelOrigin(request->origin);
+  else
+    ReleaseOrigin(request->origin, request->origin_outcome);
+  request->origin = NULL;
+  CountWorker(WORKER_FINISHED);
 
   // Update meta data of RequestPool
   pthread_mutex_lock(&pool->pool_mutex);
-  if (request->client_fd >= 0)
+  if (request->client_fd >= 0) {
     FD_CLR(request->client_fd, &pool->read_set);
-  if (request->server_fd >= 0)
+    FD_CLR(request->client_fd, &pool->write_set);
+  }
+  if (request->server_fd >= 0) {
     FD_CLR(request->server_fd, &pool->read_set);
+    FD_CLR(request->server_fd, &pool->write_set);
+  }
   
   if (request->client_fd == pool->max_fd ||
       request->server_fd == pool->max_fd) {
     pool->max_fd--;
     while (pool->max_fd >= 0) {
-      if (FD_ISSET(pool->max_fd, &pool->read_set)) {
+      if (FD_ISSET(pool->max_fd, &pool->read_set) ||
+          FD_ISSET(pool->max_fd, &pool->write_set)) {
         break;
       }
       pool->max_fd--;
@@ -458,16 +981,20 @@ void RmRequestInpool(struct RequestPool *pool, int index) {
   }
 
   pool->req_num--;
-  if (pool->req_num == MAX_REQ-1) {
-    /// Increase avail_pools by 1
+  is_avail = pool->req_num == MAX_REQ-1;
+
+  pool->enabled[index] = 0;
+  pthread_mutex_unlock(&pool->pool_mutex);
+
+  /// Increase avail_pools by 1. HandleConnection takes pool_mutex while
+  /// holding avail_pools_mutex, so it's not taken the other way round;
+  /// avail_pools may lag behind, but never counts a full pool.
+  if (is_avail) {
     pthread_mutex_lock(&avail_pools_mutex);
     avail_pools++;
     pthread_cond_signal(&pools_avail_cond);
     pthread_mutex_unlock(&avail_pools_mutex);
   }
-
-  pool->enabled[index] = 0;
-  pthread_mutex_unlock(&pool->pool_mutex);
 }
 
 void *WorkThread(void *args) {
@@ -476,10 +1003,9 @@ void *WorkThread(void *args) {
   int nready = 0;
   int max_fd = -1;
   fd_set ready_set;
+  fd_set ready_wset;
   
   struct timeval timeout;   // select waiting time
-  timeout.tv_sec = 0;
-  timeout.tv_usec = SELECT_TIMEOUT_US;
 
   while (1) {
     // Get all available file descriptors that can be read
@@ -492,50 +1018,140 @@ void *WorkThread(void *args) {
       pthread_cond_wait(&pool->pool_empty, &pool->pool_mutex);
     }
     ready_set = pool->read_set;
+    ready_wset = pool->write_set;
     max_fd = pool->max_fd;
     pthread_mutex_unlock(&pool->pool_mutex);
 
     // Call select for I/O multiplexing
     // [cancel point] This is a pthread cancel point.
-    nready = select(max_fd+1, &ready_set, NULL, NULL, &timeout);
+    /// Linux updates timeout to the time not slept, so reset it every time
+    timeout.tv_sec = 0;
+    timeout.tv_usec = SELECT_TIMEOUT_US;
+    nready = select(max_fd+1, &ready_set, &ready_wset, NULL, &timeout);
 
     // Handle all ready descriptors
     if (nready > 0) {
-      int req_ind = GetNextActiveRequestInPool(pool, &ready_set, 0);
+      int req_ind = GetNextActiveRequestInPool(pool, &ready_set,
+                                               &ready_wset, 0);
       while (req_ind != -1) {
         int retval = 1;
         struct ProxyMeta *request = &pool->requests[req_ind];
         int client_fd = request->client_fd;
         int server_fd = request->server_fd;
+        StartShaperTurn(&request->shaper);
+        /// Tunnel fds are ready to read or write
+        if (request->proxy_state == TUNNEL) {
+          retval = HandleTunnelFd(pool, request, worker_id);
+
+          /// if error occurred or tunnel closed, close the request
+          if (retval <= 0) RmRequestInpool(pool, req_ind);
+        }
+        /// Server fd is connected, or failed to
+        else if (request->proxy_state == CONNECTING) {
+          /// [cancel point] This is a pthread cancel point.
+          retval = HandleServerConnect(
+            pool, request, worker_id,
+            ContinueServerConnect(pool, request, 0));
+
+          /// The server failed, and the expired cache content is served
+          if (retval > 0 && request->proxy_state == CACHED) {
+            /// [cancel point] This is a pthread cancel point.
+            retval = HandleCachedClientFd(request, req_ind, worker_id);
+          }
+
+          /// if error occurred or proxy finished, close the request
+          if (retval <= 0) RmRequestInpool(pool, req_ind);
+        }
         /// Client fd is ready to read
-        if (client_fd >= 0 && FD_ISSET(client_fd, &ready_set)) {
+        else if (client_fd >= 0 && FD_ISSET(client_fd, &ready_set)) {
+          int client_readable = 1;
           if (request->proxy_state == UNCONNECTED) {
             /// [cancel point] This is a pthread cancel point.
             retval = HandleUnconnectedClientFd(pool, request, worker_id);
+            /// The readiness of client_fd is consumed by the read, and the
+            /// received body bytes have been forwarded if it's CONNECTED.
+            client_readable = 0;
           }
-          if (request->proxy_state == CONNECTED) {
+          if (retval > 0 && client_readable &&
+              request->proxy_state == CONNECTED) {
             /// [cancel point] This is a pthread cancel point.
-            retval = HandleConnectedClientFd(request, worker_id);
+            retval = HandleConnectedClientFd(pool, request, worker_id);
           }
-          if (request->proxy_state == CACHED) {
+          if (retval > 0 && request->proxy_state == CACHED) {
             /// [cancel point] This is a pthread cancel point.
-            retval = HandleCachedClientFd(request, worker_id);
+            retval = HandleCachedClientFd(request, req_ind, worker_id);
           }
           
           /// if error occurred or proxy finished, close the request
           if (retval <= 0) RmRequestInpool(pool, req_ind);
         }
+        /// Client fd is ready to take more of the cache content
+        else if (request->proxy_state == CACHED && client_fd >= 0 &&
+                 FD_ISSET(client_fd, &ready_wset)) {
+          /// [cancel point] This is a pthread cancel point.
+          retval = HandleCachedClientFd(request, req_ind, worker_id);
+
+          /// if error occurred or proxy finished, close the request
+          if (retval <= 0) RmRequestInpool(pool, req_ind);
+        }
+        /// Server fd is ready to take more of the request body
+        else if (request->proxy_state == CONNECTED && server_fd >= 0 &&
+                 FD_ISSET(server_fd, &ready_wset)) {
+          retval = HandleConnectedClientFd(pool, request, worker_id);
+
+          /// if error occurred or proxy finished, close the request
+          if (retval <= 0) RmRequestInpool(pool, req_ind);
+        }
         /// Server fd is ready to read
-        if (retval > 0 && server_fd >= 0 && FD_ISSET(server_fd, &ready_set)) {
+        if (retval > 0 && request->proxy_state == CONNECTED &&
+            server_fd >= 0 && FD_ISSET(server_fd, &ready_set)) {
           /// [cancel point] This is a pthread cancel point.
-          retval = HandleServerFd(request, worker_id);
+          retval = HandleServerFd(request, req_ind, worker_id);
 
           /// if error occurred or proxy finished, close the request
           if (retval <= 0) RmRequestInpool(pool, req_ind);
         }
 
-        req_ind = GetNextActiveRequestInPool(pool, &ready_set, req_ind+1);
+        req_ind = GetNextActiveRequestInPool(pool, &ready_set, &ready_wset,
+                                             req_ind+1);
+      }
+    }
+
+    // Wait again for the requests whose rate limits allow more bytes, ask
+    // again for the connection slots of queued requests, and give up the
+    // addresses that take too long to connect
+    for (int req_ind = 0; req_ind < MAX_REQ; req_ind++) {
+      struct ProxyMeta *request = &pool->requests[req_ind];
+      int retval;
+      if (!pool->enabled[req_ind]) continue;
+      if (request->is_throttled) {
+        if (!IsShaperThrottled(&request->shaper))
+          ThrottleRequest(pool, request, 0);
+        continue;
+      }
+
+      /// [cancel point] This is a pthread cancel point.
+      if (request->proxy_state == CONNECTING) {
+        if (GetNowMs() - request->connect_ms < CONNECT_TIMEOUT_MS) continue;
+        retval = HandleServerConnect(pool, request, worker_id,
+                                     ContinueServerConnect(pool, request, 1));
+      }
+      else if (request->proxy_state != QUEUED)
+        continue;
+      else if (IsConnectRequest(&request->http_request))
+        retval = OpenTunnel(pool, request, worker_id);
+      else
+        retval = ConnectServer(pool, request, worker_id);
+
+      /// The server failed, and the expired cache content is served
+      if (retval > 0 && request->proxy_state == CACHED) {
+        StartShaperTurn(&request->shaper);
+        /// [cancel point] This is a pthread cancel point.
+        retval = HandleCachedClientFd(request, req_ind, worker_id);
       }
+
+      /// if error occurred or proxy finished, close the request
+      if (retval <= 0) RmRequestInpool(pool, req_ind);
     }
   }
 
@@ -544,6 +1160,7 @@ void *WorkThread(void *args) {
 
 int GetNextActiveRequestInPool(struct RequestPool *pool,
                                fd_set *ready_setp,
+                               fd_set *ready_wsetp,
                                int start_index) {
   int ret_ind = -1;
 
@@ -552,11 +1169,13 @@ int GetNextActiveRequestInPool(struct RequestPool *pool,
     if (!pool->enabled[i]) continue;
     int client_fd = pool->requests[i].client_fd;
     int server_fd = pool->requests[i].server_fd;
-    if (client_fd >= 0 && FD_ISSET(client_fd, ready_setp)) {
+    if (client_fd >= 0 && (FD_ISSET(client_fd, ready_setp) ||
+                           FD_ISSET(client_fd, ready_wsetp))) {
       ret_ind = i;
       break;
     }
-    if (server_fd >= 0 && FD_ISSET(server_fd, ready_setp)) {
+    if (server_fd >= 0 && (FD_ISSET(server_fd, ready_setp) ||
+                           FD_ISSET(server_fd, ready_wsetp))) {
       ret_ind = i;
       break;
     }
@@ -569,182 +1188,468 @@ int GetNextActiveRequestInPool(struct RequestPool *pool,
 int HandleUnconnectedClientFd(struct RequestPool *pool,
                               struct ProxyMeta *request,
                               size_t worker_id) {
-  char line[MAXBUF];
+  struct HttpRequest *http_req = &request->http_request;
   ssize_t retval;
-  char *server_host = NULL;          // host parsed in HttpRequest
-  char *server_url = NULL;           // url parsed in HttpRequest
-  char host_copy[HOST_LEN];          // host copied from host in HttpRequest
-  char *server_hostname = NULL;      // host name extracted from host_copy
-  char *server_port = NULL;          // port extracted from host_copy
+  char *recv_buf = NULL;             // free space of the receive buffer
+  size_t recv_size = 0;
+  const char *server_host = NULL;    // host parsed in HttpRequest
+  const char *server_url = NULL;     // url parsed in HttpRequest
+  int is_get = 0;                    // only GET failures are remembered
+  int status = 0;                    // status of a synthesized response
+  enum CacheFreshness freshness;     // freshness of a cache hit
+
+  // Receive data from client into HttpRequest and parse http fields
+  recv_buf = GetHttpRecvBuf(http_req, &recv_size);
+  retval = read(request->client_fd, recv_buf, recv_size);
+  if (retval < 0) {
+    if (errno == EINTR) return 1;
+    /// retval < 0 means that error occurred when reading;
+    /// for client_fd in UNCONNECTED state.
+    printf("[thread %lu] %s:%s==============>[Unknown] read failed\n",
+           worker_id, request->src_host, request->src_port);
+    return -1;
+  }
+  if (retval == 0) {
+    /// retval == 0 means that the client closed the connection
+    /// before sending a complete request.
+    printf("[thread %lu] %s:%s==============>[Unknown] client closed\n",
+           worker_id, request->src_host, request->src_port);
+    return 0;
+  }
+  TraceRequest(&request->trace, TRACE_READ);
 
-  do {
-    // Read a line from client and parse http fields from the line
-    retval = rio_readlineb(&request->client_rp, line, sizeof(line));
-    if (retval < 0) {
-      /// retval < 0 means that error occurred when reading;
-      /// for client_fd in UNCONNECTED state.
-      printf("[thread %lu] %s:%s==============>[Unknown] read failed\n",
-             worker_id, request->src_host, request->src_port);
-      return -1;
-    }
-    if (retval == 0) {
-      /// retval < 0 means that error occurred when reading;
-      /// for client_fd in UNCONNECTED state.
-      printf("[thread %lu] %s:%s==============>[Unknown] client closed\n",
-             worker_id, request->src_host, request->src_port);
-      return 0;
-    }
+  retval = ParseHttpRequest(http_req, retval);
+  if (retval != 0) {
+    printf("[thread %lu] %s:%s==============>[Unknown] http parse error:%s\n",
+           worker_id, request->src_host, request->src_port,
+           ErrorCodeToMsg(retval));
+    /// A body that can't be framed must not reach the server, see RFC 9112
+    /// section 6.3
+    if (retval == ERROR_CONTENT_LENGTH_INVALID ||
+        retval == ERROR_TRANSFER_ENCODING_INVALID)
+      SendHttpError(request->client_fd, 400);
+    return -1;
+  }
 
-    retval = ParseHttpRequest(&request->http_request, line);
-    if (retval != 0) {
-      printf("[thread %lu] %s:%s==============>[Unknown] http parse error:%s\n",
-             worker_id, request->src_host, request->src_port,
-             ErrorCodeToMsg(retval));
-      return -1;
-    }
+  // Check if we have got the host information of server, and all the
+  // request headers that may decide how the request is served.
+  if (!IsRequestLineParsed(http_req) || !IsHostParsed(http_req) ||
+      !IsHeadersParsed(http_req)) {
+    return 1;
+  }
+  TraceRequest(&request->trace, TRACE_PARSED);
 
-    // Check if we have got the host information of server.
-    if (!IsRequestLineParsed(&request->http_request) ||
-        !IsHostParsed(&request->http_request)) {
-      continue;
-    }
+  // CONNECT requests are tunneled, not proxied
+  if (IsConnectRequest(http_req)) {
+    return OpenTunnel(pool, request, worker_id);
+  }
 
-    // Check if proxy url is valid
-    if (request->http_request.request_line.proxy_url == NULL) {
-      printf("[thread %lu] %s:%s==============>[Unknown] proxy url error\n",
-             worker_id, request->src_host, request->src_port);
-      return -1;
-    }
+  // Check if proxy url is valid
+  if (GetHttpProxyUrl(http_req) == NULL) {
+    printf("[thread %lu] %s:%s==============>[Unknown] proxy url error\n",
+           worker_id, request->src_host, request->src_port);
+    return -1;
+  }
 
-    server_host = request->http_request.request_headers.host;
-    server_url = request->http_request.request_line.proxy_url;
-    // Check if the requested url is cached
-    if (ENABLE_STATIC_CACHE) {
-      retval = CreateCacheInfo(&request->cache_info, server_host, server_url);
-      if (retval == 0) {
-        if (IsCacheHit(&request->cache_info)) {
+  server_host = GetHttpHost(http_req);
+  server_url = GetHttpProxyUrl(http_req);
+  is_get = strcmp(GetHttpMethod(http_req), "GET") == 0;
+  // Check if the requested url is cached
+  if (ENABLE_STATIC_CACHE) {
+    retval = CreateCacheInfo(&request->cache_info, server_host, server_url);
+    /// Only GET responses are cached, a HEAD response carries no body
+    if (retval == 0 && !is_get) {
+      SetCacheError(&request->cache_info, EOPNOTSUPP);
+    }
+    else if (retval == 0) {
+      /// What the warm-up fetches is hot by definition, and a refresh
+      /// replaces the cache content, so neither is served from cache
+      if (request->is_warmup) {
+        ForceCacheAdmission(&request->cache_info);
+      }
+      else if (IsCacheHit(&request->cache_info)) {
+        freshness = GetCacheFreshness(&request->cache_info);
+        /// Stale content is served at once, and refreshed in background
+        /// by one request only
+        if (freshness == CACHE_STALE &&
+            StartCacheRefresh(&request->cache_info)) {
+          QueueRefresh(server_host, server_url);
+        }
+        if (freshness != CACHE_EXPIRED) {
           request->proxy_state = CACHED;
-          printf("[thread %lu] %s:%s==============>%s%s content cached\n",
+          printf("[thread %lu] %s:%s==============>%s%s content cached%s\n",
                  worker_id, request->src_host, request->src_port,
-                 server_host, server_url);
+                 server_host, server_url,
+                 freshness == CACHE_STALE ? " (stale)" : "");
           return 1;
         }
-      }
-      else {
-        printf("[thread %lu] %s:%s==============>%s%s cache error: %s\n",
-                 worker_id, request->src_host, request->src_port,
-                 server_host, server_url, request->cache_info.error_msg);
+        /// Expired content is replaced by the response, but kept for
+        /// the case that the server fails
+        ForceCacheAdmission(&request->cache_info);
+        request->stale_ok = IsCacheUsableOnError(&request->cache_info);
       }
     }
+    else {
+      printf("[thread %lu] %s:%s==============>%s%s cache error: %s\n",
+               worker_id, request->src_host, request->src_port,
+               server_host, server_url, request->cache_info.error_msg);
+    }
+  }
 
-    // If not cached, connect to server
-    /// Extract server hostname and server port
-    strcpy(host_copy, server_host);
-    server_hostname = host_copy;
-    for (char *ch = host_copy; *ch != '\0'; ch++) {
-      if (*ch == ':') {
-        *ch = '\0';
-        server_port = ch + 1;
-        break;
-      }
+  // Answer at once if the url or its server failed recently, instead of
+  // sending every client to a server that is down
+  status = LookupNegativeEntry(server_host, is_get ? server_url : NULL);
+  if (status != 0) {
+    printf("[thread %lu] %s:%s==============>%s%s negative cached: %d\n",
+           worker_id, request->src_host, request->src_port,
+           server_host, server_url, status);
+    if (UseStaleCache(request, worker_id)) return 1;
+    SendHttpError(request->client_fd, status);
+    return 0;
+  }
+
+  // A miss of a url cached by a peer is served by that peer, which is
+  // asked only once: a request from a peer is never forwarded again
+  if (is_get && !request->is_peer) {
+    int peer = LookupPeer(server_host, server_url);
+    if (peer > 0) {
+      retval = ConnectPeer(pool, request, worker_id, peer);
+      if (retval != 0) return retval;
     }
-    /// Since it is a http proxy, we use HTTP_PORT by default
-    if (!server_port) server_port = HTTP_PORT;
+  }
 
-    /// TODO: Check if server is this proxy
+  // Connect to server, or wait for a connection slot of it
+  return ConnectServer(pool, request, worker_id);
+}
 
-    request->server_fd = open_clientfd(server_hostname, server_port);
-    if (request->server_fd < 0) {
-      printf("[thread %lu] %s:%s==============>%s:%s%s connect failed\n",
-             worker_id, request->src_host, request->src_port,
-             server_hostname, server_port, server_url);
-      return -1;
+int AcquireServerSlot(struct RequestPool *pool, struct ProxyMeta *request,
+                      size_t worker_id) {
+  const char *server_host = GetHttpHost(&request->http_request);
+  int64_t now_ms = GetNowMs();
+  enum OriginAdmission admission;
+
+  /// A queued request gives up after a while
+  if (request->proxy_state == QUEUED &&
+      now_ms - request->queued_ms >= ORIGIN_QUEUE_TIMEOUT_MS) {
+    CancelOrigin(request->origin);
+    request->origin = NULL;
+    printf("[thread %lu] %s:%s==============>%s queue timeout\n",
+           worker_id, request->src_host, request->src_port, server_host);
+    if (UseStaleCache(request, worker_id)) return 0;
+    SendHttpError(request->client_fd, 503);
+    return -1;
+  }
+
+  admission = AcquireOrigin(server_host, &request->origin);
+  if (admission == ORIGIN_REJECTED) {
+    printf("[thread %lu] %s:%s==============>%s circuit open\n",
+           worker_id, request->src_host, request->src_port, server_host);
+    if (UseStaleCache(request, worker_id)) return 0;
+    SendHttpError(request->client_fd, 503);
+    return -1;
+  }
+  if (admission == ORIGIN_QUEUED) {
+    if (request->proxy_state != QUEUED) {
+      request->proxy_state = QUEUED;
+      request->queued_ms = now_ms;
+      pthread_mutex_lock(&pool->pool_mutex);
+      FD_CLR(request->client_fd, &pool->read_set);
+      pthread_mutex_unlock(&pool->pool_mutex);
+      printf("[thread %lu] %s:%s==============>%s queued\n",
+             worker_id, request->src_host, request->src_port, server_host);
     }
-    // Update pool data
+    return 0;
+  }
+
+  // Admitted, read the client again if it was queued
+  if (request->proxy_state == QUEUED) {
+    request->proxy_state = UNCONNECTED;
     pthread_mutex_lock(&pool->pool_mutex);
-    rio_readinitb(&request->server_rp, request->server_fd);
-    FD_SET(request->server_fd, &pool->read_set);
-    if (request->server_fd > pool->max_fd) pool->max_fd = request->server_fd;
+    FD_SET(request->client_fd, &pool->read_set);
+    if (request->client_fd > pool->max_fd) pool->max_fd = request->client_fd;
     pthread_mutex_unlock(&pool->pool_mutex);
+  }
+  request->origin_outcome = ORIGIN_UNKNOWN;
+  return 1;
+}
 
-    // Send all received request lines from client to server
-    for (int i = 0; i < request->http_request.cur_line; i++) {
-      char *send_line = request->http_request.origin_lines[i].line;
-      if (i == 0) {
-        while (!request->http_request.origin_lines[i].line_finish) i++;
-        sprintf(line, "%s %s %s\r\n",
-                request->http_request.request_line.method,
-                request->http_request.request_line.proxy_url,
-                request->http_request.request_line.version);
-        send_line = line;
-      }
-      retval = rio_writen(request->server_fd, send_line, strlen(send_line));
-      if (retval < 0) {
-        printf("[thread %lu] %s:%s==============>%s:%s%s write failed\n",
-               worker_id, request->src_host, request->src_port,
-               server_hostname, server_port, server_url);
-        return -1;
-      }
+int UseStaleCache(struct ProxyMeta *request, size_t worker_id) {
+  struct RequestPool *pool = &request_pools[worker_id];
+
+  if (!request->stale_ok) return 0;
+
+  /// The cache content may be sent in several turns, without the server
+  if (request->server_fd >= 0) {
+    pthread_mutex_lock(&pool->pool_mutex);
+    FD_CLR(request->server_fd, &pool->read_set);
+    FD_CLR(request->server_fd, &pool->write_set);
+    pthread_mutex_unlock(&pool->pool_mutex);
+    close(request->server_fd);
+    request->server_fd = -1;
+  }
+  request->proxy_state = CACHED;
+  printf("[thread %lu] %s:%s<==============%s%s serve stale\n",
+         worker_id, request->src_host, request->src_port,
+         GetHttpHost(&request->http_request),
+         GetHttpProxyUrl(&request->http_request));
+  return 1;
+}
+
+int ConnectServer(struct RequestPool *pool, struct ProxyMeta *request,
+                  size_t worker_id) {
+  ssize_t retval;
+  char host_copy[HOST_LEN];          // host copied from host in HttpRequest
+  char *server_hostname = NULL;      // host name extracted from host_copy
+  char *server_port = NULL;          // port extracted from host_copy
+
+  retval = AcquireServerSlot(pool, request, worker_id);
+  if (retval <= 0) return retval == 0 ? 1 : 0;
+
+  /// TODO: Check if server is this proxy
+
+  SplitServerHost(request, host_copy, &server_hostname, &server_port);
+  return HandleServerConnect(
+    pool, request, worker_id,
+    StartServerConnect(pool, request, server_hostname, server_port));
+}
+
+void SplitServerHost(struct ProxyMeta *request, char *host_copy,
+                     char **hostname, char **port) {
+  strcpy(host_copy, GetHttpHost(&request->http_request));
+  *hostname = host_copy;
+  *port = NULL;
+  for (char *ch = host_copy; *ch != '\0'; ch++) {
+    if (*ch == ':') {
+      *ch = '\0';
+      *port = ch + 1;
+      break;
     }
+  }
+  /// Since it is a http proxy, we use HTTP_PORT by default, but a tunnel
+  /// is usually for https
+  if (!*port)
+    *port = IsConnectRequest(&request->http_request) ? HTTPS_PORT : HTTP_PORT;
+}
+
+int HandleServerConnect(struct RequestPool *pool, struct ProxyMeta *request,
+                        size_t worker_id, int connected) {
+  const char *server_host = GetHttpHost(&request->http_request);
+  const char *server_url = GetHttpProxyUrl(&request->http_request);
+  int is_tunnel = IsConnectRequest(&request->http_request);
+  char host_copy[HOST_LEN];          // host copied from host in HttpRequest
+  char *server_hostname = NULL;      // host name extracted from host_copy
+  char *server_port = NULL;          // port extracted from host_copy
+  char target[HOST_LEN + 8];         // "hostname:port" for logs
+  int status = errno == ETIMEDOUT ? 504 : 502;
+
+  if (connected == 0) return 1;
 
-    // Change client_fd state to CONNECTED
-    request->proxy_state = CONNECTED;
-    printf("[thread %lu] %s:%s==============>%s:%s%s connected\n",
+  SplitServerHost(request, host_copy, &server_hostname, &server_port);
+  snprintf(target, sizeof(target), "%s:%s", server_hostname, server_port);
+  if (connected > 0) {
+    if (is_tunnel) return EstablishTunnel(pool, request, worker_id, target);
+    return SendRequestToServer(pool, request, worker_id, target);
+  }
+
+  request->origin_outcome = ORIGIN_FAILURE;
+  printf("[thread %lu] %s:%s==============>%s%s %sconnect failed: %d\n",
+         worker_id, request->src_host, request->src_port, target,
+         is_tunnel ? "" : server_url, is_tunnel ? "tunnel " : "", status);
+  AddNegativeEntry(server_host, NULL, status);
+  if (!is_tunnel && UseStaleCache(request, worker_id)) return 1;
+  SendHttpError(request->client_fd, status);
+  return is_tunnel ? -1 : 0;
+}
+
+int ConnectPeer(struct RequestPool *pool, struct ProxyMeta *request,
+                size_t worker_id, int peer) {
+  const char *server_host = GetHttpHost(&request->http_request);
+  const char *server_url = GetHttpProxyUrl(&request->http_request);
+
+  /// Serve the request as if there were no peers if the peer is down,
+  /// which costs one more copy of the url in cache
+  request->server_fd = OpenPeerFd(peer);
+  if (request->server_fd < 0) {
+    CountPeerForward(1);
+    printf("[thread %lu] %s:%s==============>[Peer %s]%s%s connect failed\n",
            worker_id, request->src_host, request->src_port,
-           server_hostname, server_port, server_url);
+           GetPeerPath(peer), server_host, server_url);
+    return 0;
+  }
+  CountPeerForward(0);
+
+  /// The peer keeps the only cache content of the url
+  request->peer = peer;
+  request->stale_ok = 0;
+  if (ENABLE_STATIC_CACHE) SetCacheError(&request->cache_info, EREMOTE);
+
+  return SendRequestToServer(pool, request, worker_id, GetPeerPath(peer));
+}
+
+int SendRequestToServer(struct RequestPool *pool, struct ProxyMeta *request,
+                        size_t worker_id, const char *target) {
+  struct HttpRequest *http_req = &request->http_request;
+  ssize_t retval;
+  const char *server_url = GetHttpProxyUrl(http_req);
+
+  // Update pool data
+  pthread_mutex_lock(&pool->pool_mutex);
+  FD_SET(request->server_fd, &pool->read_set);
+  if (request->server_fd > pool->max_fd) pool->max_fd = request->server_fd;
+  pthread_mutex_unlock(&pool->pool_mutex);
+
+  // Send the request and the body bytes received so far to server; a
+  // peer is a proxy, which needs the absolute url
+  request->http_response.is_head = (strcmp(GetHttpMethod(http_req),
+                                           "HEAD") == 0);
+  if (request->peer > 0)
+    retval = ForwardHttpProxyRequest(http_req, request->server_fd);
+  else
+    retval = ForwardHttpRequest(http_req, request->server_fd);
+  if (retval < 0) {
+    printf("[thread %lu] %s:%s==============>%s%s write failed\n",
+           worker_id, request->src_host, request->src_port,
+           target, server_url);
+    return -1;
+  }
+
+  // The rest of the body is streamed through a fixed-size buffer; without
+  // it, the client is not read until the response is relayed
+  if (!IsRequestComplete(http_req)) {
+    request->upload_buf = ArenaAlloc(&request->arena, UPLOAD_BUF_SIZE);
+    if (!request->upload_buf) {
+      printf("[thread %lu] %s:%s==============>%s%s out of memory\n",
+             worker_id, request->src_host, request->src_port,
+             target, server_url);
+      return -1;
+    }
+    request->upload_start = 0;
+    request->upload_end = 0;
+  }
+  else {
+    pthread_mutex_lock(&pool->pool_mutex);
+    FD_CLR(request->client_fd, &pool->read_set);
+    pthread_mutex_unlock(&pool->pool_mutex);
+  }
+
+  // Change client_fd state to CONNECTED
+  request->proxy_state = CONNECTED;
+  TraceRequest(&request->trace, TRACE_CONNECTED);
+  printf("[thread %lu] %s:%s==============>%s%s connected\n",
+         worker_id, request->src_host, request->src_port,
+         target, server_url);
 
-    return 1;
-  } while (request->client_rp.rio_cnt > 0);
-  
   return 1;
 }
 
-int HandleConnectedClientFd(struct ProxyMeta *request, size_t worker_id) {
-  char line[MAXBUF];
+int HandleConnectedClientFd(struct RequestPool *pool,
+                            struct ProxyMeta *request, size_t worker_id) {
+  struct HttpRequest *http_req = &request->http_request;
+  char *buf = request->upload_buf;
   ssize_t retval;
-  char *server_host = NULL;          // host parsed in HttpRequest
-  char *server_url = NULL;           // url parsed in HttpRequest
+  const char *server_host = NULL;    // host parsed in HttpRequest
+  const char *server_url = NULL;     // url parsed in HttpRequest
 
-  server_host = request->http_request.request_headers.host;
-  server_url = request->http_request.request_line.proxy_url;
+  server_host = GetHttpHost(http_req);
+  server_url = GetHttpProxyUrl(http_req);
 
-  do {
-    // Read a line from client, write the line to server
-    retval = rio_readlineb(&request->client_rp, line, sizeof(line));
-    if (retval < 0) {
+  if (!buf) return 1;
+
+  // Receive more of the body if there is room, the client may not be
+  // readable if the server is
+  if (request->upload_end == UPLOAD_BUF_SIZE &&
+      request->upload_start > 0) {
+    request->upload_end -= request->upload_start;
+    memmove(buf, buf + request->upload_start, request->upload_end);
+    request->upload_start = 0;
+  }
+  if (!IsRequestComplete(http_req) && request->upload_end < UPLOAD_BUF_SIZE) {
+    do {
+      retval = recv(request->client_fd, buf + request->upload_end,
+                    UPLOAD_BUF_SIZE - request->upload_end, MSG_DONTWAIT);
+    } while (retval < 0 && errno == EINTR);
+    if (retval < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
       printf("[thread %lu] %s:%s==============>%s%s read failed\n",
              worker_id, request->src_host, request->src_port,
              server_host, server_url);
       return -1;
     }
-
     if (retval == 0) {
       printf("[thread %lu] %s:%s==============>%s%s client closed\n",
              worker_id, request->src_host, request->src_port,
              server_host, server_url);
       return 0;
     }
+    if (retval > 0) {
+      /// Bytes after the body are not part of this request
+      size_t len = retval;
+      retval = ParseHttpRequestBody(http_req, buf + request->upload_end, &len);
+      if (retval != 0) {
+        printf("[thread %lu] %s:%s==============>%s%s body error:%s\n",
+               worker_id, request->src_host, request->src_port,
+               server_host, server_url, ErrorCodeToMsg(retval));
+        return -1;
+      }
+      request->upload_end += len;
+    }
+  }
 
-    retval = rio_writen(request->server_fd, line, retval);
+  // Send what the server can take without blocking
+  while (request->upload_start < request->upload_end) {
+    retval = send(request->server_fd, buf + request->upload_start,
+                  request->upload_end - request->upload_start,
+                  MSG_DONTWAIT | MSG_NOSIGNAL);
     if (retval < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
       printf("[thread %lu] %s:%s==============>%s%s write failed\n",
              worker_id, request->src_host, request->src_port,
              server_host, server_url);
       return -1;
     }
-  } while (request->client_rp.rio_cnt > 0);
+    request->upload_start += retval;
+  }
+  if (request->upload_start == request->upload_end) {
+    request->upload_start = 0;
+    request->upload_end = 0;
+  }
+
+  // Backpressure: read the client only if there is room, and wait for the
+  // server only if there are bytes to send
+  int is_sent = IsRequestComplete(http_req) &&
+                request->upload_end == 0;
+  pthread_mutex_lock(&pool->pool_mutex);
+  if (!IsRequestComplete(http_req) && request->upload_end < UPLOAD_BUF_SIZE)
+    FD_SET(request->client_fd, &pool->read_set);
+  else
+    FD_CLR(request->client_fd, &pool->read_set);
+  if (request->upload_end > 0)
+    FD_SET(request->server_fd, &pool->write_set);
+  else
+    FD_CLR(request->server_fd, &pool->write_set);
+  pthread_mutex_unlock(&pool->pool_mutex);
+
+  if (is_sent) request->upload_buf = NULL;
 
   return 1;
 }
 
-int HandleCachedClientFd(struct ProxyMeta *request, size_t worker_id) {
-  char line[MAXBUF];
-  ssize_t retval;
-  char *server_host = NULL;          // host parsed in HttpRequest
-  char *server_url = NULL;           // url parsed in HttpRequest
-
-  server_host = request->http_request.request_headers.host;
-  server_url = request->http_request.request_line.proxy_url;
+int HandleCachedClientFd(struct ProxyMeta *request, int index,
+                         size_t worker_id) {
+  struct RequestPool *pool = &request_pools[worker_id];
+  struct IoEngine *engine = &io_engines[worker_id];
+  ssize_t retval = 1;
+  size_t allowance = 0;              // bytes the turn of the client allows
+  size_t sent = 0;
+  int is_done = 0;                   // 1 if all the content is sent
+  int cache_fd = -1;
+  const char *cache_data = NULL;     // content mapped in a segment
+  size_t cache_len = 0;
+  const char *server_host = NULL;    // host parsed in HttpRequest
+  const char *server_url = NULL;     // url parsed in HttpRequest
+
+  server_host = GetHttpHost(&request->http_request);
+  server_url = GetHttpProxyUrl(&request->http_request);
 
   if (!ENABLE_STATIC_CACHE) return 0;
 
@@ -756,79 +1661,464 @@ int HandleCachedClientFd(struct ProxyMeta *request, size_t worker_id) {
     return -1;
   }
 
-  retval = ReadLineFromCache(&request->cache_info, line, sizeof(line));
-  while (retval > 0) {
-    retval = rio_writen(request->client_fd, line, retval);
-    // if (retval < 0) {
-    //   printf("[thread %lu] %s:%s<==============%s%s write failed\n",
-    //          worker_id, request->src_host, request->src_port,
-    //          server_host, server_url);
-    //   return -1;
-    // }
-    retval = ReadLineFromCache(&request->cache_info, line, sizeof(line));
+  // Serve the compressed variant if the client accepts it, which is
+  // decided before the first byte is sent
+  if (request->cache_sent == 0 &&
+      IsEncodingAccepted(&request->http_request, "gzip")) {
+    UseGzipCache(&request->cache_info);
   }
 
+  // Send as much as the turn of the client allows, the rest is sent when
+  // the client is writable again, after the other ready connections
+  allowance = GetShaperAllowance(&request->shaper);
+  if (allowance > 0) allowance = GetSendRoom(request->client_fd, allowance);
+
+  // Small content is sent from its segment in memory, no file is opened
+  cache_data = GetCacheData(&request->cache_info, &cache_len);
+  if (cache_data) {
+    sent = cache_len - request->cache_sent;
+    if (sent > allowance) sent = allowance;
+    if (sent > 0) {
+      retval = IoEngineSend(engine, index, request->client_fd,
+                            cache_data + request->cache_sent, sent);
+    }
+    if (retval >= 0) request->cache_sent += sent;
+    is_done = request->cache_sent == cache_len;
+  }
+  else {
+    cache_fd = GetCacheReadFd(&request->cache_info);
+    if (cache_fd < 0) {
+      printf("[thread %lu] %s:%s<==============%s%s cache error: %s\n",
+             worker_id, request->src_host, request->src_port,
+             server_host, server_url, request->cache_info.error_msg);
+      return -1;
+    }
+
+    while (sent < allowance) {
+      size_t len = allowance - sent < IO_BUF_SIZE ? allowance - sent
+                                                  : IO_BUF_SIZE;
+      retval = IoEngineSendFile(engine, index, request->client_fd, cache_fd,
+                                request->cache_sent, len);
+      if (retval <= 0) break;
+      request->cache_sent += retval;
+      sent += retval;
+    }
+    is_done = retval == 0;
+  }
+  ConsumeShaper(&request->shaper, sent);
+
   if (retval < 0) {
-    printf("[thread %lu] %s:%s<==============%s%s cache error: %s\n",
+    printf("[thread %lu] %s:%s<==============%s%s write failed: %s\n",
            worker_id, request->src_host, request->src_port,
-           server_host, server_url, request->cache_info.error_msg);
+           server_host, server_url, strerror(errno));
     return -1;
   }
+  if (!is_done) {
+    ThrottleRequest(pool, request, IsShaperThrottled(&request->shaper));
+    return 1;
+  }
 
-  printf("[thread %lu] %s:%s<==============%s%s cache success\n",
+  CountWorker(WORKER_CACHE_HITS);
+  printf("[thread %lu] %s:%s<==============%s%s cache success%s\n",
            worker_id, request->src_host, request->src_port,
-           server_host, server_url);
+           server_host, server_url,
+           request->cache_info.is_gzip ? " (gzip)" : "");
   return 0;
 }
 
-int HandleServerFd(struct ProxyMeta *request, size_t worker_id) {
-  char line[MAXBUF];
+int HandleServerFd(struct ProxyMeta *request, int index, size_t worker_id) {
+  struct IoEngine *engine = &io_engines[worker_id];
   ssize_t retval;
   ssize_t read_len;
-  char *server_host = NULL;          // host parsed in HttpRequest
-  char *server_url = NULL;           // url parsed in HttpRequest
-
-  server_host = request->http_request.request_headers.host;
-  server_url = request->http_request.request_line.proxy_url;
+  int cache_fd = -1;
+  int cache_err = 0;
+  const char *server_host = NULL;    // host parsed in HttpRequest
+  const char *server_url = NULL;     // url parsed in HttpRequest
+  int was_parsed = 0;                // response headers parsed before
+  int status = 0;                    // status code of the response
+  struct CacheControl cache_control;
+  size_t allowance = 0;              // bytes the turn of the client allows
+
+  server_host = GetHttpHost(&request->http_request);
+  server_url = GetHttpProxyUrl(&request->http_request);
+
+  // A rate limited client holds back its server until it has tokens
+  allowance = GetShaperAllowance(&request->shaper);
+  if (allowance == 0) {
+    if (IsShaperThrottled(&request->shaper))
+      ThrottleRequest(&request_pools[worker_id], request, 1);
+    return 1;
+  }
+  if (allowance > IO_BUF_SIZE) allowance = IO_BUF_SIZE;
 
+  // Read what the server has sent so far
   do {
-    // Read a line from server
-    retval = rio_readlineb(&request->server_rp, line, sizeof(line));
-    if (retval < 0) {
-      printf("[thread %lu] %s:%s<==============%s%s read failed\n",
-             worker_id, request->src_host, request->src_port,
-             server_host, server_url);
-      return -1;
-    }
-    if (retval == 0) {
-      printf("[thread %lu] %s:%s<==============%s%s server closed\n",
+    retval = read(request->server_fd, engine->buf, allowance);
+  } while (retval < 0 && errno == EINTR);
+  if (retval < 0) {
+    request->origin_outcome = ORIGIN_FAILURE;
+    printf("[thread %lu] %s:%s<==============%s%s read failed\n",
+           worker_id, request->src_host, request->src_port,
+           server_host, server_url);
+    /// Nothing is sent to the client yet, so the stale content still can be
+    if (!request->is_relayed && UseStaleCache(request, worker_id))
+      return HandleCachedClientFd(request, index, worker_id);
+    if (ENABLE_STATIC_CACHE) SetCacheError(&request->cache_info, EPROTO);
+    return -1;
+  }
+  if (retval == 0) {
+    /// A truncated response must not be cached
+    if (!FinishHttpResponse(&request->http_response)) {
+      if (!IsResponseHeadersParsed(&request->http_response))
+        request->origin_outcome = ORIGIN_FAILURE;
+      printf("[thread %lu] %s:%s<==============%s%s response truncated\n",
              worker_id, request->src_host, request->src_port,
              server_host, server_url);
+      if (!request->is_relayed && UseStaleCache(request, worker_id))
+        return HandleCachedClientFd(request, index, worker_id);
+      if (ENABLE_STATIC_CACHE) SetCacheError(&request->cache_info, EPROTO);
       return 0;
     }
-    read_len = retval;
-
-    // Write the line to cache if possible
-    if (ENABLE_STATIC_CACHE) {
-      if (!IsCacheError(&request->cache_info)) {
-        retval = WriteToCache(&request->cache_info, line, read_len);
-        // if (retval < 0) {
-        //   printf("[thread %lu] %s:%s<==============%s%s cache error: %s\n",
-        //          worker_id, request->src_host, request->src_port,
-        //          server_host, server_url, request->cache_info.error_msg);
-        // }
-      }
+    printf("[thread %lu] %s:%s<==============%s%s server closed\n",
+           worker_id, request->src_host, request->src_port,
+           server_host, server_url);
+    return 0;
+  }
+  read_len = retval;
+  TraceRequest(&request->trace, TRACE_FIRST_BYTE);
+
+  // Track where the response ends, the data is relayed as is anyway
+  was_parsed = IsResponseHeadersParsed(&request->http_response);
+  retval = ParseHttpResponse(&request->http_response, engine->buf, read_len);
+  if (retval != 0) {
+    if (ENABLE_STATIC_CACHE) SetCacheError(&request->cache_info, EPROTO);
+    printf("[thread %lu] %s:%s<==============%s%s response parse error:%s\n",
+           worker_id, request->src_host, request->src_port,
+           server_host, server_url, ErrorCodeToMsg(retval));
+  }
+  if (!was_parsed && IsResponseHeadersParsed(&request->http_response))
+    request->origin_outcome = ORIGIN_SUCCESS;
+  /// An error response is remembered for a short time, not cached as a file
+  status = request->http_response.status_line.status_code;
+  if (!was_parsed && IsResponseHeadersParsed(&request->http_response) &&
+      IsNegativeStatus(status)) {
+    if (strcmp(GetHttpMethod(&request->http_request), "GET") == 0) {
+      AddNegativeEntry(server_host, server_url, status);
+    }
+    /// A server error is answered by the stale content if it's allowed
+    if (status >= 500 && !request->is_relayed &&
+        UseStaleCache(request, worker_id)) {
+      return HandleCachedClientFd(request, index, worker_id);
     }
+    if (ENABLE_STATIC_CACHE) SetCacheError(&request->cache_info, EAGAIN);
+  }
+  /// The server decides how long its response may be cached
+  else if (!was_parsed && IsResponseHeadersParsed(&request->http_response) &&
+           ENABLE_STATIC_CACHE && !IsCacheError(&request->cache_info)) {
+    GetCacheControl(&request->http_response, &cache_control);
+    if (cache_control.no_store) {
+      SetCacheError(&request->cache_info, EOPNOTSUPP);
+    }
+    else {
+      SetCacheFreshness(&request->cache_info, cache_control.max_age,
+                        cache_control.stale_while_revalidate,
+                        cache_control.stale_if_error);
+    }
+  }
+
+  // Get the cache file to write to if possible
+  if (ENABLE_STATIC_CACHE) {
+    if (!IsCacheError(&request->cache_info) &&
+        IsCacheAdmitted(&request->cache_info)) {
+      cache_fd = GetCacheWriteFd(&request->cache_info);
+    }
+  }
+
+  // Write the data to client and cache together
+  retval = IoEngineRelay(engine, index, request->client_fd, cache_fd,
+                         read_len, &cache_err);
+  request->is_relayed = 1;
+  ConsumeShaper(&request->shaper, read_len);
+  if (cache_err != 0) SetCacheError(&request->cache_info, cache_err);
+  /// The rest of the response can't reach the client, nor be cached
+  /// without the part lost here
+  if (retval < 0) {
+    if (ENABLE_STATIC_CACHE) SetCacheError(&request->cache_info, EIO);
+    printf("[thread %lu] %s:%s<==============%s%s write failed: %s\n",
+           worker_id, request->src_host, request->src_port,
+           server_host, server_url, strerror(errno));
+    return -1;
+  }
+
+  // The request is finished once the whole response is relayed, without
+  // waiting for the server to close
+  if (IsResponseComplete(&request->http_response)) {
+    printf("[thread %lu] %s:%s<==============%s%s response complete\n",
+           worker_id, request->src_host, request->src_port,
+           server_host, server_url);
+    return 0;
+  }
+
+  return 1;
+}
+
+void ThrottleRequest(struct RequestPool *pool, struct ProxyMeta *request,
+                     int is_throttled) {
+  int is_cached = request->proxy_state == CACHED;
+  int fd = is_cached ? request->client_fd : request->server_fd;
+  fd_set *set = is_cached ? &pool->write_set : &pool->read_set;
+
+  pthread_mutex_lock(&pool->pool_mutex);
+  if (is_throttled) {
+    FD_CLR(fd, set);
+  }
+  else {
+    FD_SET(fd, set);
+    if (fd > pool->max_fd) pool->max_fd = fd;
+  }
+  /// A client being sent the cache content has nothing more to say, its
+  /// later bytes or EOF should not wake the worker up
+  if (is_cached) FD_CLR(request->client_fd, &pool->read_set);
+  pthread_mutex_unlock(&pool->pool_mutex);
+
+  request->is_throttled = is_throttled;
+}
+
+int StartServerConnect(struct RequestPool *pool, struct ProxyMeta *request,
+                       const char *hostname, const char *port) {
+  struct addrinfo hints;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+  if (getaddrinfo(hostname, port, &hints, &request->server_addrs) != 0) {
+    request->server_addrs = NULL;
+    errno = EHOSTUNREACH;
+    return -1;
+  }
+  request->next_addr = request->server_addrs;
+  request->connect_error = ECONNREFUSED;
+
+  // The client is read again once the server is connected
+  request->proxy_state = CONNECTING;
+  pthread_mutex_lock(&pool->pool_mutex);
+  FD_CLR(request->client_fd, &pool->read_set);
+  pthread_mutex_unlock(&pool->pool_mutex);
+
+  return ContinueServerConnect(pool, request, 0);
+}
+
+/**
+ * Leave CONNECTING state: free the addresses of the server, set
+ * server_fd back to blocking mode if connected, and read the client
+ * again.
+ *
+ * \returns 1 if connected, -1 otherwise, with errno set.
+ */
+static int EndServerConnect(struct RequestPool *pool,
+                            struct ProxyMeta *request, int is_connected) {
+  freeaddrinfo(request->server_addrs);
+  request->server_addrs = NULL;
+  request->next_addr = NULL;
+  request->proxy_state = UNCONNECTED;
+
+  pthread_mutex_lock(&pool->pool_mutex);
+  if (request->server_fd >= 0)
+    FD_CLR(request->server_fd, &pool->write_set);
+  FD_SET(request->client_fd, &pool->read_set);
+  if (request->client_fd > pool->max_fd) pool->max_fd = request->client_fd;
+  pthread_mutex_unlock(&pool->pool_mutex);
+
+  if (!is_connected) {
+    errno = request->connect_error;
+    return -1;
+  }
+  fcntl(request->server_fd, F_SETFL,
+        fcntl(request->server_fd, F_GETFL) & ~O_NONBLOCK);
+  return 1;
+}
+
+int ContinueServerConnect(struct RequestPool *pool,
+                          struct ProxyMeta *request, int is_timeout) {
+  int fd = request->server_fd;
+
+  // Check the address being connected
+  if (fd >= 0) {
+    int error = ETIMEDOUT;
+    socklen_t len = sizeof(error);
+    if (!is_timeout &&
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
+      error = errno;
+    }
+    if (error == 0) return EndServerConnect(pool, request, 1);
+
+    request->connect_error = error;
+    pthread_mutex_lock(&pool->pool_mutex);
+    FD_CLR(fd, &pool->write_set);
+    pthread_mutex_unlock(&pool->pool_mutex);
+    close(fd);
+    request->server_fd = -1;
+  }
+
+  // Try the next addresses until one is connecting
+  while (request->next_addr) {
+    struct addrinfo *p = request->next_addr;
+    request->next_addr = p->ai_next;
+
+    fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    if (fd < 0) {
+      request->connect_error = errno;
+      continue;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) {
+      request->server_fd = fd;
+      return EndServerConnect(pool, request, 1);
+    }
+    if (errno != EINPROGRESS) {
+      request->connect_error = errno;
+      close(fd);
+      continue;
+    }
+
+    request->server_fd = fd;
+    request->connect_ms = GetNowMs();
+    pthread_mutex_lock(&pool->pool_mutex);
+    FD_SET(fd, &pool->write_set);
+    if (fd > pool->max_fd) pool->max_fd = fd;
+    pthread_mutex_unlock(&pool->pool_mutex);
+    return 0;
+  }
+
+  return EndServerConnect(pool, request, 0);
+}
+
+int64_t GetNowMs() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
 
-    // Write the line to client
-    retval = rio_writen(request->client_fd, line, read_len);
-    // if (retval < 0) {
-    //   printf("[thread %lu] %s:%s<==============%s%s write failed: %s\n",
-    //          worker_id, request->src_host, request->src_port,
-    //          server_host, server_url, strerror(errno));
-    //   return -1;
-    // }
-  } while (request->server_rp.rio_cnt > 0);
+int OpenTunnel(struct RequestPool *pool, struct ProxyMeta *request,
+               size_t worker_id) {
+  ssize_t retval;
+  char host_copy[HOST_LEN];          // host copied from host in HttpRequest
+  char *server_hostname = NULL;      // host name extracted from host_copy
+  char *server_port = NULL;          // port extracted from host_copy
+  const char *server_host = GetHttpHost(&request->http_request);
+  int status = 0;                    // status of a synthesized response
+
+  SplitServerHost(request, host_copy, &server_hostname, &server_port);
+
+  // Fail at once if the server failed recently
+  status = LookupNegativeEntry(server_host, NULL);
+  if (status != 0) {
+    printf("[thread %lu] %s:%s==============>%s:%s negative cached: %d\n",
+           worker_id, request->src_host, request->src_port,
+           server_hostname, server_port, status);
+    SendHttpError(request->client_fd, status);
+    return -1;
+  }
+
+  // A tunnel holds a connection slot of the server as long as it's open
+  retval = AcquireServerSlot(pool, request, worker_id);
+  if (retval <= 0) return retval == 0 ? 1 : -1;
+
+  return HandleServerConnect(
+    pool, request, worker_id,
+    StartServerConnect(pool, request, server_hostname, server_port));
+}
+
+int EstablishTunnel(struct RequestPool *pool, struct ProxyMeta *request,
+                    size_t worker_id, const char *target) {
+  ssize_t retval;
+  const char *established = "HTTP/1.1 200 Connection established\r\n\r\n";
+  char *body = NULL;                 // bytes received after the request
+  size_t body_len = 0;
+
+  // Create a pipe for each direction of the tunnel
+  for (int dir = 0; dir < 2; dir++) {
+    if (OpenTunnelPipe(&request->tunnel[dir]) < 0) {
+      printf("[thread %lu] %s:%s==============>%s pipe failed: %s\n",
+             worker_id, request->src_host, request->src_port,
+             target, strerror(errno));
+      return -1;
+    }
+  }
+
+  // Tell the client the tunnel is established
+  retval = rio_writen(request->client_fd, (void *)established,
+                      strlen(established));
+  if (retval < 0) return -1;
+
+  // Bytes the client sent after the request are the start of the tunnel
+  body = GetHttpBody(&request->http_request, &body_len);
+  if (body_len > 0) {
+    retval = rio_writen(request->server_fd, body, body_len);
+    if (retval < 0) return -1;
+  }
+
+  // Relay in non-blocking mode, so that one slow peer can't block the
+  // worker thread
+  fcntl(request->client_fd, F_SETFL,
+        fcntl(request->client_fd, F_GETFL) | O_NONBLOCK);
+  fcntl(request->server_fd, F_SETFL,
+        fcntl(request->server_fd, F_GETFL) | O_NONBLOCK);
+
+  // Update pool data
+  pthread_mutex_lock(&pool->pool_mutex);
+  FD_SET(request->server_fd, &pool->read_set);
+  if (request->server_fd > pool->max_fd) pool->max_fd = request->server_fd;
+  pthread_mutex_unlock(&pool->pool_mutex);
+
+  request->proxy_state = TUNNEL;
+  request->origin_outcome = ORIGIN_SUCCESS;
+  printf("[thread %lu] %s:%s==============>%s tunnel established\n",
+         worker_id, request->src_host, request->src_port, target);
+  return 1;
+}
+
+int HandleTunnelFd(struct RequestPool *pool, struct ProxyMeta *request,
+                   size_t worker_id) {
+  struct TunnelPipe *up = &request->tunnel[0];     // client to server
+  struct TunnelPipe *down = &request->tunnel[1];   // server to client
+  const char *server_host = GetHttpHost(&request->http_request);
+
+  if (RelayTunnelPipe(up, request->client_fd, request->server_fd) < 0 ||
+      RelayTunnelPipe(down, request->server_fd, request->client_fd) < 0) {
+    printf("[thread %lu] %s:%s<=============>%s tunnel error: %s\n",
+           worker_id, request->src_host, request->src_port,
+           server_host, strerror(errno));
+    return -1;
+  }
+
+  if (up->shut && down->shut) {
+    printf("[thread %lu] %s:%s<=============>%s tunnel closed\n",
+           worker_id, request->src_host, request->src_port, server_host);
+    return 0;
+  }
+
+  // Backpressure: a source is read only if its pipe has room, and a
+  // destination is waited to be writable only if its pipe has bytes.
+  pthread_mutex_lock(&pool->pool_mutex);
+  if (IsTunnelReadable(up))
+    FD_SET(request->client_fd, &pool->read_set);
+  else
+    FD_CLR(request->client_fd, &pool->read_set);
+  if (IsTunnelReadable(down))
+    FD_SET(request->server_fd, &pool->read_set);
+  else
+    FD_CLR(request->server_fd, &pool->read_set);
+  if (IsTunnelWritable(down))
+    FD_SET(request->client_fd, &pool->write_set);
+  else
+    FD_CLR(request->client_fd, &pool->write_set);
+  if (IsTunnelWritable(up))
+    FD_SET(request->server_fd, &pool->write_set);
+  else
+    FD_CLR(request->server_fd, &pool->write_set);
+  pthread_mutex_unlock(&pool->pool_mutex);
 
   return 1;
 }
@@ -0,0 +1,171 @@
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+typedef size_t (*ScanFunc)(const struct ScanSet *, const char *, size_t);
+
+static size_t ScanResolve(const struct ScanSet *set, const char *buf,
+                          size_t len);
+
+/* Implementation used by ScanDelims, resolved at the first call */
+static ScanFunc scan_func = ScanResolve;
+static enum ScanImpl scan_impl = SCAN_SCALAR;
+
+static size_t ScanScalar(const struct ScanSet *set, const char *buf,
+                         size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    for (int k = 0; k < set->num; k++) {
+      if (buf[i] == set->delims[k]) return i;
+    }
+  }
+  return len;
+}
+
+#ifdef SCAN_X86
+
+/**
+ * \returns the index of the first byte of the 16 bytes at buf that is in
+ * set, 16 if there is none.
+ */
+__attribute__((target("sse4.2")))
+static inline int ScanBlockSse42(__m128i delims, int num, const char *buf) {
+  __m128i data = _mm_loadu_si128((const __m128i *)buf);
+  return _mm_cmpestri(delims, num, data, 16,
+                      _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY |
+                      _SIDD_LEAST_SIGNIFICANT);
+}
+
+__attribute__((target("sse4.2")))
+static size_t ScanSse42(const struct ScanSet *set, const char *buf,
+                        size_t len) {
+  __m128i delims = _mm_loadu_si128((const __m128i *)set->delims);
+  size_t i = 0;
+
+  if (len < 16) return ScanScalar(set, buf, len);
+
+  for (; i + 16 <= len; i += 16) {
+    int index = ScanBlockSse42(delims, set->num, buf + i);
+    if (index < 16) return i + index;
+  }
+
+  // The tail is scanned by a block overlapping the scanned bytes, which
+  // have no delimiter, so the first match must be in the tail.
+  if (i < len) {
+    int index = ScanBlockSse42(delims, set->num, buf + len - 16);
+    if (index < 16) return len - 16 + index;
+  }
+  return len;
+}
+
+/**
+ * \returns a mask of the 32 bytes at buf, whose bit i is set if byte i
+ * is in the set of delims.
+ */
+__attribute__((target("avx2")))
+static inline unsigned ScanBlockAvx2(const __m256i *delims, int num,
+                                     const char *buf) {
+  __m256i data = _mm256_loadu_si256((const __m256i *)buf);
+  __m256i hits = _mm256_cmpeq_epi8(data, delims[0]);
+  for (int k = 1; k < num; k++) {
+    hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(data, delims[k]));
+  }
+  return (unsigned)_mm256_movemask_epi8(hits);
+}
+
+__attribute__((target("avx2,sse4.2")))
+static size_t ScanAvx2(const struct ScanSet *set, const char *buf,
+                       size_t len) {
+  __m256i delims[SCAN_MAX_DELIMS];
+  size_t i = 16;
+
+  // Most header tokens are short, so try a 16-byte block first, which
+  // needs no setup of the 32-byte delimiter vectors.
+  if (len < 32) return ScanSse42(set, buf, len);
+  int index = ScanBlockSse42(_mm_loadu_si128((const __m128i *)set->delims),
+                             set->num, buf);
+  if (index < 16) return index;
+
+  for (int k = 0; k < set->num; k++) {
+    delims[k] = _mm256_set1_epi8(set->delims[k]);
+  }
+
+  for (; i + 32 <= len; i += 32) {
+    unsigned mask = ScanBlockAvx2(delims, set->num, buf + i);
+    if (mask) return i + __builtin_ctz(mask);
+  }
+
+  // Same as ScanSse42, the tail is scanned by an overlapping block
+  if (i < len) {
+    unsigned mask = ScanBlockAvx2(delims, set->num, buf + len - 32);
+    if (mask) return len - 32 + __builtin_ctz(mask);
+  }
+  return len;
+}
+
+#endif /* SCAN_X86 */
+
+/**
+ * \returns the function of impl, NULL if the CPU does not support it.
+ */
+static ScanFunc GetScanFunc(enum ScanImpl impl) {
+#ifdef SCAN_X86
+  __builtin_cpu_init();
+  if (impl == SCAN_AVX2 && __builtin_cpu_supports("avx2") &&
+      __builtin_cpu_supports("sse4.2")) {
+    return ScanAvx2;
+  }
+  if (impl == SCAN_SSE42 && __builtin_cpu_supports("sse4.2")) {
+    return ScanSse42;
+  }
+#endif
+  if (impl == SCAN_SCALAR) return ScanScalar;
+  return NULL;
+}
+
+/**
+ * Choose the fastest implementation the CPU supports. Threads racing here
+ * all choose the same one.
+ */
+static void ChooseScanImpl() {
+  if (SetScanImpl(SCAN_AVX2) != 0 && SetScanImpl(SCAN_SSE42) != 0)
+    SetScanImpl(SCAN_SCALAR);
+}
+
+/**
+ * Choose the implementation at the first call, then scan with it.
+ */
+static size_t ScanResolve(const struct ScanSet *set, const char *buf,
+                          size_t len) {
+  ChooseScanImpl();
+  return ScanDelims(set, buf, len);
+}
+
+size_t ScanDelims(const struct ScanSet *set, const char *buf, size_t len) {
+  ScanFunc func = __atomic_load_n(&scan_func, __ATOMIC_RELAXED);
+  return func(set, buf, len);
+}
+
+enum ScanImpl GetScanImpl() {
+  if (__atomic_load_n(&scan_func, __ATOMIC_RELAXED) == ScanResolve)
+    ChooseScanImpl();
+  return __atomic_load_n(&scan_impl, __ATOMIC_RELAXED);
+}
+
+int SetScanImpl(enum ScanImpl impl) {
+  ScanFunc func = GetScanFunc(impl);
+  if (!func) return -1;
+  __atomic_store_n(&scan_impl, impl, __ATOMIC_RELAXED);
+  __atomic_store_n(&scan_func, func, __ATOMIC_RELAXED);
+  return 0;
+}
+
+const char *ScanImplName(enum ScanImpl impl) {
+  switch (impl) {
+    case SCAN_AVX2: return "avx2";
+    case SCAN_SSE42: return "sse4.2";
+    default: return "scalar";
+  }
+}
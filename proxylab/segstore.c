@@ -0,0 +1,372 @@
+#define _GNU_SOURCE
+#include "segstore.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define SEG_RECORD_MAGIC 0x31474553   // "SEG1"
+#define SEG_COPY_BUF (64 << 10)
+
+/**
+ * Header of an object in a segment, followed by the key with '\0', and
+ * then the content. Both are padded to 8 bytes.
+ */
+struct SegmentRecord {
+  uint32_t magic;
+  uint32_t key_len;             // length of the key with '\0'
+  uint64_t key_hash;
+  uint64_t size;                // length of the content
+};
+
+static struct Segment segments[SEG_MAX];
+static int segment_num = 0;     // segments created
+static int active = -1;         // segment appended to, -1 if none
+static long seal_seq = 0;
+static char seg_dir[PATH_MAX];
+static pthread_mutex_t store_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static atomic_long compacted_num = ATOMIC_VAR_INIT(0);
+static atomic_long evicted_num = ATOMIC_VAR_INIT(0);
+
+static inline size_t Align8(size_t n) {
+  return (n + 7) & ~(size_t)7;
+}
+
+/**
+ * \returns the offset of the content of the record at offset.
+ */
+static inline size_t ContentOffset(size_t offset, uint32_t key_len) {
+  return offset + Align8(sizeof(struct SegmentRecord) + key_len);
+}
+
+static inline size_t RecordSize(uint32_t key_len, uint64_t size) {
+  return Align8(sizeof(struct SegmentRecord) + key_len) + Align8(size);
+}
+
+static inline uint32_t Generation(uint64_t state) {
+  return (uint32_t)(state >> 32);
+}
+
+/**
+ * Write len bytes of buf to fd at offset.
+ *
+ * \returns 0 if success, -1 otherwise.
+ */
+static int WriteAt(int fd, const void *buf, size_t len, off_t offset) {
+  while (len > 0) {
+    ssize_t retval = pwrite(fd, buf, len, offset);
+    if (retval < 0 && errno == EINTR) continue;
+    if (retval <= 0) return -1;
+    buf = (const char *)buf + retval;
+    len -= retval;
+    offset += retval;
+  }
+  return 0;
+}
+
+/**
+ * Copy len bytes of src_fd from its start to dst_fd at offset. The copy
+ * is done in the kernel if possible.
+ *
+ * \returns 0 if success, -1 otherwise.
+ */
+static int CopyFile(int src_fd, int dst_fd, size_t len, off_t offset) {
+  off_t in_off = 0;
+  off_t out_off = offset;
+  char buf[SEG_COPY_BUF];
+
+  while (len > 0) {
+    ssize_t retval = copy_file_range(src_fd, &in_off, dst_fd, &out_off,
+                                     len, 0);
+    if (retval < 0 && errno == EINTR) continue;
+    if (retval <= 0) break;
+    len -= retval;
+  }
+
+  /// Not supported across these files, copy through the buffer
+  while (len > 0) {
+    size_t chunk = len < sizeof(buf) ? len : sizeof(buf);
+    ssize_t retval = pread(src_fd, buf, chunk, in_off);
+    if (retval < 0 && errno == EINTR) continue;
+    if (retval <= 0) return -1;
+    if (WriteAt(dst_fd, buf, retval, out_off) != 0) return -1;
+    in_off += retval;
+    out_off += retval;
+    len -= retval;
+  }
+
+  return 0;
+}
+
+/**
+ * Create segment index and map it.
+ * Note: store_mutex should be held.
+ *
+ * \returns 0 if success, -1 otherwise.
+ */
+static int CreateSegment(int index) {
+  struct Segment *seg = &segments[index];
+  char path[PATH_MAX];
+
+  if (snprintf(path, sizeof(path), "%ssegment.%d", seg_dir, index) >=
+      sizeof(path)) return -1;
+  int fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0644);
+  if (fd < 0) return -1;
+  /// Reserve the blocks now, so appends never fail for lack of space
+  if (posix_fallocate(fd, 0, SEG_SIZE) != 0 && ftruncate(fd, SEG_SIZE) != 0) {
+    close(fd);
+    unlink(path);
+    return -1;
+  }
+  void *base = mmap(NULL, SEG_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    close(fd);
+    unlink(path);
+    return -1;
+  }
+
+  seg->fd = fd;
+  seg->base = base;
+  seg->tail = 0;
+  seg->sealed_seq = 0;
+  atomic_store(&seg->writers, 0);
+  atomic_store(&seg->state, (uint64_t)1 << 32);
+  return 0;
+}
+
+/**
+ * Move len bytes of seg from src to dst, which is lower. The bytes are
+ * copied through a buffer in ascending order, so no byte is overwritten
+ * before it's read.
+ *
+ * \returns 0 if success, -1 otherwise.
+ */
+static int MoveWithin(struct Segment *seg, size_t dst, size_t src,
+                      size_t len) {
+  char buf[SEG_COPY_BUF];
+
+  while (len > 0) {
+    size_t chunk = len < sizeof(buf) ? len : sizeof(buf);
+    memcpy(buf, seg->base + src, chunk);
+    if (WriteAt(seg->fd, buf, chunk, dst) != 0) return -1;
+    dst += chunk;
+    src += chunk;
+    len -= chunk;
+  }
+  return 0;
+}
+
+/**
+ * Check if the record at offset of segment index is still the content of
+ * its key in the cache index.
+ *
+ * \returns 1 if live, 0 otherwise. from is set to its location.
+ */
+static int IsRecordLive(int index, uint32_t generation, size_t offset,
+                        struct CacheLocation *from) {
+  const struct SegmentRecord *record =
+      (const struct SegmentRecord *)(segments[index].base + offset);
+  const char *key = (const char *)(record + 1);
+  struct CacheMeta meta;
+
+  from->segment = index;
+  from->generation = generation;
+  from->offset = ContentOffset(offset, record->key_len);
+  if (!LookupCacheIndex(key, record->key_hash, &meta)) return 0;
+  return meta.location.segment == from->segment &&
+         meta.location.generation == from->generation &&
+         meta.location.offset == from->offset;
+}
+
+/**
+ * Start a new generation of segment index, which is not active, and
+ * either compact its live objects to its start or evict them all.
+ * Note: store_mutex should be held.
+ *
+ * \returns 0 if success, -1 if the segment is being read or written.
+ */
+static int RecycleSegment(int index) {
+  struct Segment *seg = &segments[index];
+  struct CacheLocation from, to;
+  size_t live = 0;
+  size_t offset;
+  size_t dst = 0;
+
+  if (atomic_load(&seg->writers) > 0) return -1;
+
+  // Claim the segment only if no one reads it, later pins of the old
+  // generation fail
+  uint64_t state = atomic_load(&seg->state);
+  uint32_t generation = Generation(state);
+  uint32_t next_generation = generation + 1 ? generation + 1 : 1;
+  state = (uint64_t)generation << 32;
+  if (!atomic_compare_exchange_strong(&seg->state, &state,
+                                      (uint64_t)next_generation << 32)) {
+    return -1;
+  }
+
+  // Count the live bytes
+  for (offset = 0; offset + sizeof(struct SegmentRecord) <= seg->tail; ) {
+    const struct SegmentRecord *record =
+        (const struct SegmentRecord *)(seg->base + offset);
+    if (record->magic != SEG_RECORD_MAGIC) break;
+    size_t record_size = RecordSize(record->key_len, record->size);
+    if (IsRecordLive(index, generation, offset, &from)) live += record_size;
+    offset += record_size;
+  }
+
+  // Move the live objects to the start, or drop them if they take most
+  // of the segment
+  int evict = live > SEG_COMPACT_MAX_LIVE;
+  for (offset = 0; offset + sizeof(struct SegmentRecord) <= seg->tail; ) {
+    const struct SegmentRecord *record =
+        (const struct SegmentRecord *)(seg->base + offset);
+    if (record->magic != SEG_RECORD_MAGIC) break;
+    size_t record_size = RecordSize(record->key_len, record->size);
+    uint32_t key_len = record->key_len;
+    uint64_t key_hash = record->key_hash;
+    if (IsRecordLive(index, generation, offset, &from)) {
+      if (evict) {
+        MoveCacheIndex((const char *)(record + 1), key_hash, &from, NULL);
+      }
+      else if (dst == offset ||
+               MoveWithin(seg, dst, offset, record_size) == 0) {
+        to.segment = index;
+        to.generation = next_generation;
+        to.offset = ContentOffset(dst, key_len);
+        /// The key is read from its new place, the old one may be
+        /// overwritten already
+        const char *key = seg->base + dst + sizeof(struct SegmentRecord);
+        if (MoveCacheIndex(key, key_hash, &from, &to)) dst += record_size;
+      }
+      else {
+        MoveCacheIndex((const char *)(record + 1), key_hash, &from, NULL);
+      }
+    }
+    offset += record_size;
+  }
+
+  seg->tail = evict ? 0 : dst;
+  atomic_fetch_add(evict ? &evicted_num : &compacted_num, 1);
+  return 0;
+}
+
+/**
+ * Reserve size bytes in the active segment, switching to a new or
+ * recycled segment if it's full.
+ * Note: store_mutex should be held.
+ *
+ * \returns the index of the segment, -1 if no segment has room.
+ */
+static int ReserveRecord(size_t size, size_t *offset) {
+  if (active < 0 || segments[active].tail + size > SEG_SIZE) {
+    int next = -1;
+
+    // Create a new segment first, then recycle the oldest full one
+    if (segment_num < SEG_MAX && CreateSegment(segment_num) == 0) {
+      next = segment_num++;
+    }
+    for (long tried_seq = 0; next < 0; ) {
+      int oldest = -1;
+      for (int i = 0; i < segment_num; i++) {
+        if (i == active || segments[i].sealed_seq <= tried_seq) continue;
+        if (oldest < 0 || segments[i].sealed_seq < segments[oldest].sealed_seq)
+          oldest = i;
+      }
+      if (oldest < 0) break;
+      tried_seq = segments[oldest].sealed_seq;
+      if (RecycleSegment(oldest) == 0 &&
+          segments[oldest].tail + size <= SEG_SIZE) {
+        next = oldest;
+      }
+    }
+    if (next < 0) return -1;
+
+    if (active >= 0) segments[active].sealed_seq = ++seal_seq;
+    active = next;
+    segments[active].sealed_seq = LONG_MAX;
+  }
+
+  *offset = segments[active].tail;
+  segments[active].tail += size;
+  atomic_fetch_add(&segments[active].writers, 1);
+  return active;
+}
+
+void InitSegmentStore(const char *dir) {
+  strncpy(seg_dir, dir, sizeof(seg_dir) - 1);
+  for (int i = 0; i < SEG_MAX; i++) {
+    segments[i].fd = -1;
+    segments[i].base = NULL;
+    atomic_init(&segments[i].state, 0);
+    atomic_init(&segments[i].writers, 0);
+  }
+}
+
+int AppendSegment(const char *key, uint64_t key_hash, int fd,
+                  struct CacheMeta *meta) {
+  struct SegmentRecord record;
+  size_t key_len = strlen(key) + 1;
+  size_t offset = 0;
+  int retval = -1;
+
+  if (meta->size > SEG_OBJECT_MAX || key_len > UINT32_MAX) return -1;
+
+  pthread_mutex_lock(&store_mutex);
+  int index = ReserveRecord(RecordSize(key_len, meta->size), &offset);
+  pthread_mutex_unlock(&store_mutex);
+  if (index < 0) return -1;
+  struct Segment *seg = &segments[index];
+  uint32_t generation = Generation(atomic_load(&seg->state));
+
+  // The header is written even if the copy fails, so the record can be
+  // skipped when the segment is recycled
+  memset(&record, 0, sizeof(record));
+  record.magic = SEG_RECORD_MAGIC;
+  record.key_len = key_len;
+  record.key_hash = key_hash;
+  record.size = meta->size;
+  if (WriteAt(seg->fd, &record, sizeof(record), offset) == 0 &&
+      WriteAt(seg->fd, key, key_len, offset + sizeof(record)) == 0 &&
+      CopyFile(fd, seg->fd, meta->size,
+               ContentOffset(offset, key_len)) == 0) {
+    meta->location.segment = index;
+    meta->location.generation = generation;
+    meta->location.offset = ContentOffset(offset, key_len);
+    /// Indexed before the writer leaves, so a recycle never misses it
+    retval = InsertCacheIndex(key, key_hash, meta);
+  }
+
+  atomic_fetch_sub(&seg->writers, 1);
+  return retval;
+}
+
+const char *PinSegment(const struct CacheLocation *location) {
+  if (location->generation == 0 || location->segment >= SEG_MAX) return NULL;
+
+  struct Segment *seg = &segments[location->segment];
+  uint64_t state = atomic_load(&seg->state);
+  do {
+    if (Generation(state) != location->generation) return NULL;
+  } while (!atomic_compare_exchange_weak(&seg->state, &state, state + 1));
+
+  return seg->base + location->offset;
+}
+
+void UnpinSegment(const struct CacheLocation *location) {
+  atomic_fetch_sub(&segments[location->segment].state, 1);
+}
+
+void GetSegmentStats(int *created, long *compacted, long *evicted) {
+  pthread_mutex_lock(&store_mutex);
+  *created = segment_num;
+  pthread_mutex_unlock(&store_mutex);
+  *compacted = atomic_load(&compacted_num);
+  *evicted = atomic_load(&evicted_num);
+}
@@ -0,0 +1,90 @@
+#include "shaper.h"
+
+#include <linux/sockios.h>
+#include <stdatomic.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <time.h>
+
+static long client_rate = 0;
+static double burst = SHAPER_QUANTUM;
+static atomic_long throttle_num = ATOMIC_VAR_INIT(0);
+
+/**
+ * \returns the monotonic time in ns.
+ */
+static int64_t NowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Add the tokens earned since the last refill, up to burst.
+ */
+static void RefillShaper(struct Shaper *shaper) {
+  int64_t now = NowNs();
+
+  shaper->tokens += (now - shaper->refill_ns) / 1e9 * client_rate;
+  if (shaper->tokens > burst) shaper->tokens = burst;
+  shaper->refill_ns = now;
+}
+
+void SetClientRate(long bytes_per_sec) {
+  client_rate = bytes_per_sec;
+  burst = bytes_per_sec / 50 > SHAPER_QUANTUM ? bytes_per_sec / 50
+                                               : SHAPER_QUANTUM;
+}
+
+void InitShaper(struct Shaper *shaper, int is_limited) {
+  shaper->deficit = 0;
+  shaper->is_limited = is_limited && client_rate > 0;
+  shaper->tokens = burst;
+  shaper->refill_ns = shaper->is_limited ? NowNs() : 0;
+}
+
+void StartShaperTurn(struct Shaper *shaper) {
+  shaper->deficit = SHAPER_QUANTUM;
+}
+
+size_t GetShaperAllowance(struct Shaper *shaper) {
+  if (!shaper->is_limited || shaper->deficit == 0) return shaper->deficit;
+
+  if (IsShaperThrottled(shaper)) {
+    atomic_fetch_add(&throttle_num, 1);
+    return 0;
+  }
+  return shaper->tokens < shaper->deficit ? (size_t)shaper->tokens
+                                          : shaper->deficit;
+}
+
+void ConsumeShaper(struct Shaper *shaper, size_t bytes) {
+  shaper->deficit = bytes < shaper->deficit ? shaper->deficit - bytes : 0;
+  if (shaper->is_limited) shaper->tokens -= bytes;
+}
+
+size_t GetSendRoom(int sock_fd, size_t max) {
+  int sndbuf = 0, queued = 0;
+  socklen_t len = sizeof(sndbuf);
+  size_t room = max;
+
+  /// The kernel doubles SO_SNDBUF for its bookkeeping, half of it is
+  /// left for data
+  if (getsockopt(sock_fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len) == 0 &&
+      ioctl(sock_fd, SIOCOUTQ, &queued) == 0) {
+    room = sndbuf / 2 > queued ? sndbuf / 2 - queued : 0;
+  }
+  if (room < SHAPER_MIN_SEND) room = SHAPER_MIN_SEND;
+  return room < max ? room : max;
+}
+
+int IsShaperThrottled(struct Shaper *shaper) {
+  if (!shaper->is_limited) return 0;
+
+  RefillShaper(shaper);
+  return shaper->tokens < SHAPER_MIN_SEND;
+}
+
+long GetShaperThrottles() {
+  return atomic_load(&throttle_num);
+}
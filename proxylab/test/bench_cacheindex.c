@@ -0,0 +1,126 @@
+#include "cacheindex.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define KEY_NUM 100000            // number of keys in the index
+#define LOOKUPS_PER_THREAD 2000000
+#define MAX_THREADS 64
+
+char (*keys)[64];
+uint64_t *key_hashes;
+
+/**
+ * FNV-1a hash, the same as the one used by the cache module.
+ */
+uint64_t Hash(const char *str) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  while (*str) {
+    hash ^= (unsigned char)*str++;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+double NowSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Thread function: look up random keys, 1 of 8 lookups misses.
+ */
+void *LookupThread(void *args) {
+  unsigned int seed = (unsigned int)(size_t)args;
+  struct CacheMeta meta;
+  long found = 0;
+
+  for (long i = 0; i < LOOKUPS_PER_THREAD; i++) {
+    int index = rand_r(&seed) % KEY_NUM;
+    if (i % 8 == 0) {
+      found += LookupCacheIndex("www.example.com/missing",
+                                key_hashes[index], &meta);
+    }
+    else {
+      found += LookupCacheIndex(keys[index], key_hashes[index], &meta);
+    }
+  }
+
+  return (void *)found;
+}
+
+/**
+ * Run the benchmark with nthreads threads.
+ *
+ * \returns lookups per second.
+ */
+double RunBench(int nthreads) {
+  pthread_t tids[MAX_THREADS];
+  double start = NowSeconds();
+
+  for (size_t i = 0; i < nthreads; i++) {
+    pthread_create(&tids[i], NULL, LookupThread, (void *)(i + 1));
+  }
+  for (int i = 0; i < nthreads; i++) {
+    pthread_join(tids[i], NULL);
+  }
+
+  return (double)nthreads * LOOKUPS_PER_THREAD / (NowSeconds() - start);
+}
+
+int main(int argc, char **argv) {
+  int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  const int shard_bits_list[] = { 0, INDEX_SHARD_BITS };
+
+  if (argc > 1) max_threads = atoi(argv[1]);
+  if (max_threads < 1) max_threads = 1;
+  if (max_threads > MAX_THREADS) max_threads = MAX_THREADS;
+
+  // Generate keys like "<Host><URL>"
+  keys = malloc(KEY_NUM * sizeof(*keys));
+  key_hashes = malloc(KEY_NUM * sizeof(*key_hashes));
+  if (!keys || !key_hashes) {
+    printf("Out of memory\n");
+    return 1;
+  }
+  for (int i = 0; i < KEY_NUM; i++) {
+    snprintf(keys[i], sizeof(keys[i]), "host%d.example.com:8080/page/%d.html",
+             i % 97, i);
+    key_hashes[i] = Hash(keys[i]);
+  }
+
+  printf("%-8s %-8s %16s %10s\n", "shards", "threads", "lookups/s", "scaling");
+  for (int k = 0; k < sizeof(shard_bits_list) / sizeof(int); k++) {
+    int shard_bits = shard_bits_list[k];
+    struct CacheMeta meta = { .size = 1024, .has_gzip = 0 };
+
+    if (InitCacheIndex(shard_bits) != 0) {
+      printf("Init cache index error\n");
+      return 1;
+    }
+    for (int i = 0; i < KEY_NUM; i++) {
+      InsertCacheIndex(keys[i], key_hashes[i], &meta);
+    }
+    if (CacheIndexSize() != KEY_NUM) {
+      printf("Cache index size error: %lu\n", CacheIndexSize());
+      return 1;
+    }
+
+    double base = 0;
+    for (int nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+      double rate = RunBench(nthreads);
+      if (nthreads == 1) base = rate;
+      printf("%-8d %-8d %16.0f %9.2fx\n", 1 << shard_bits, nthreads,
+             rate, rate / base);
+    }
+    FreeCacheIndex();
+  }
+
+  free(keys);
+  free(key_hashes);
+  return 0;
+}
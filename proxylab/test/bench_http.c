@@ -0,0 +1,273 @@
+#include "http.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#define ROUNDS 200000
+
+/**
+ * A typical browser request sent to a proxy.
+ */
+const char *REQUEST =
+  "GET http://ipahw.xjtu.edu.cn/szjy-boot/sso/codeLogin?userType=1&code=oauth_code_151b9c46ed1c3a2f92a5467305131b54&employeeNo=3122151052 HTTP/1.1\r\n"
+  "Host: ipahw.xjtu.edu.cn\r\n"
+  "Connection: keep-alive\r\n"
+  "User-Agent: Mozilla/5.0 (Linux; Android 13; V2183A Build/TP1A.220624.014; wv) AppleWebKit/537.36 (KHTML, like Gecko) Version/4.0 Chrome/110.0.5481.153 Mobile Safari/537.36\r\n"
+  "content-type: application/x-www-form-urlencoded\r\n"
+  "Accept: */*\r\n"
+  "X-Requested-With: synjones.commerce.xjtu\r\n"
+  "Sec-Fetch-Site: same-origin\r\n"
+  "Sec-Fetch-Mode: cors\r\n"
+  "Sec-Fetch-Dest: empty\r\n"
+  "Referer: https://ipahw.xjtu.edu.cn/sso/callback?userType=1&code=oauth_code_151b9c46ed1c3a2f92a5467305131b54\r\n"
+  "Accept-Encoding: gzip, deflate, br\r\n"
+  "Accept-Language: zh-CN,zh;q=0.9,en-US;q=0.8,en;q=0.7\r\n"
+  "Cookie: JSESSIONID=e6c36112-d614-4b45-98f8-70a66511988e\r\n"
+  "\r\n";
+
+/*
+ * The line-based parser that HttpRequest used to have: every line is
+ * copied into a struct ReadLine, joined into a malloced line, and the
+ * fields are copied into fixed arrays. It is kept here as the baseline.
+ */
+
+#define LEGACY_INIT_LINES 8
+#define LEGACY_MAX_LINES 32
+
+struct LegacyReadLine {
+  char line[MAXBUF];
+  int line_finish;
+};
+
+struct LegacyRequest {
+  char method[METHOD_LEN];
+  char url[URL_LEN];
+  char version[VER_LEN];
+  char *proxy_url;
+  char host[HOST_LEN];
+  char accept_encoding[256];
+  struct LegacyReadLine *origin_lines;
+  int line_num;
+  int cur_line;
+  int parse_state;                  // 0 line, 1 headers, 2 data
+};
+
+int LegacyInit(struct LegacyRequest *req) {
+  memset(req, 0, sizeof(*req));
+  req->origin_lines = malloc(sizeof(struct LegacyReadLine) * LEGACY_INIT_LINES);
+  if (!req->origin_lines) return -1;
+  req->line_num = LEGACY_INIT_LINES;
+  return 0;
+}
+
+void LegacyFree(struct LegacyRequest *req) {
+  free(req->origin_lines);
+  req->origin_lines = NULL;
+}
+
+int LegacyAddLine(struct LegacyRequest *req, char *line) {
+  size_t line_length = strnlen(line, MAXBUF);
+  if (line_length == MAXBUF || line_length == 0) return -1;
+
+  if (req->cur_line == req->line_num) {
+    if (req->line_num >= LEGACY_MAX_LINES) return -1;
+    req->line_num *= 2;
+    void *ptr = realloc(req->origin_lines,
+                        sizeof(struct LegacyReadLine) * req->line_num);
+    if (!ptr) return -1;
+    req->origin_lines = ptr;
+  }
+
+  strcpy(req->origin_lines[req->cur_line].line, line);
+  req->origin_lines[req->cur_line].line_finish =
+    (line[line_length-1] == '\n');
+  req->cur_line++;
+  return 0;
+}
+
+int LegacyParseRequestLine(struct LegacyRequest *req, char *line) {
+  char *fields[3] = { req->method, req->url, req->version };
+  const int max_lens[3] = { METHOD_LEN, URL_LEN, VER_LEN };
+  char *str = line;
+  char *cur = line;
+  int cnt = 0;
+
+  while (cnt < 3) {
+    if (*cur == '\0') return -1;
+    if (*cur == ' ' || *cur == '\r' || *cur == '\n') {
+      *cur = '\0';
+      int str_len = strlen(str);
+      if (str_len > 0) {
+        if (str_len >= max_lens[cnt]) return -1;
+        strcpy(fields[cnt], str);
+        cnt++;
+      }
+      str = cur+1;
+    }
+    cur++;
+  }
+
+  int forslash_cnt = 0;
+  req->proxy_url = NULL;
+  for (char *url = req->url; *url; url++) {
+    if (*url == '/' && ++forslash_cnt == 3) {
+      req->proxy_url = url;
+      break;
+    }
+  }
+  req->parse_state = 1;
+  return 0;
+}
+
+int LegacyParseHeaders(struct LegacyRequest *req, char *line) {
+  if (strcmp(line, "\r\n") == 0) {
+    req->parse_state = 2;
+    return 0;
+  }
+
+  char *field = line;
+  char *cur = line;
+  while (*cur != ':' && *cur != '\0') cur++;
+  if (*cur == '\0') return -1;
+  *cur = '\0';
+  cur++;
+  while (*cur == ' ') cur++;
+
+  char *value = cur;
+  int value_len = strlen(value);
+  if (value_len <= 2) return -1;
+  value[value_len-2] = '\0';
+  value_len -= 2;
+
+  if (strcmp(field, "Host") == 0) {
+    if (value_len >= HOST_LEN) return -1;
+    strcpy(req->host, value);
+  }
+  else if (strcasecmp(field, "Accept-Encoding") == 0) {
+    if (value_len < sizeof(req->accept_encoding))
+      strcpy(req->accept_encoding, value);
+  }
+  return 0;
+}
+
+int LegacyParse(struct LegacyRequest *req, char *line) {
+  if (LegacyAddLine(req, line) != 0) return -1;
+
+  struct LegacyReadLine *end = req->origin_lines + req->cur_line - 1;
+  struct LegacyReadLine *start = end - 1;
+  if (!end->line_finish) return 0;
+  int tot_size = strlen(end->line) + 1;
+  while (start >= req->origin_lines && !start->line_finish) {
+    tot_size += strlen(start->line);
+    start--;
+  }
+
+  char *tot_line = malloc(tot_size);
+  if (!tot_line) return -1;
+  char *cur_ptr = tot_line;
+  while (start < end) {
+    start++;
+    strcpy(cur_ptr, start->line);
+    cur_ptr += strlen(start->line);
+  }
+
+  int retval = 0;
+  if (req->parse_state == 0) retval = LegacyParseRequestLine(req, tot_line);
+  else if (req->parse_state == 1) retval = LegacyParseHeaders(req, tot_line);
+  free(tot_line);
+  return retval;
+}
+
+double NowSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Parse REQUEST with the legacy parser, which is fed line by line as
+ * rio_readlineb did.
+ *
+ * \returns ns per request.
+ */
+double BenchLegacy() {
+  char lines[LEGACY_MAX_LINES][MAXBUF];
+  int line_cnt = 0;
+  long checksum = 0;
+
+  for (const char *cur = REQUEST; *cur; line_cnt++) {
+    const char *end = strchr(cur, '\n') + 1;
+    memcpy(lines[line_cnt], cur, end - cur);
+    lines[line_cnt][end - cur] = '\0';
+    cur = end;
+  }
+
+  double start = NowSeconds();
+  for (int round = 0; round < ROUNDS; round++) {
+    struct LegacyRequest req;
+    char line[MAXBUF];
+    if (LegacyInit(&req) != 0) return -1;
+    for (int i = 0; i < line_cnt && req.parse_state != 2; i++) {
+      strcpy(line, lines[i]);          // the copy done by rio_readlineb
+      if (LegacyParse(&req, line) != 0) return -1;
+    }
+    checksum += strlen(req.host);
+    LegacyFree(&req);
+  }
+  double elapsed = NowSeconds() - start;
+
+  if (checksum != (long)ROUNDS * strlen("ipahw.xjtu.edu.cn")) return -1;
+  return elapsed * 1e9 / ROUNDS;
+}
+
+/**
+ * Parse REQUEST with HttpRequest, which is fed the whole request as a
+ * single read would.
+ *
+ * \returns ns per request.
+ */
+double BenchSpan() {
+  size_t len = strlen(REQUEST);
+  long checksum = 0;
+  struct Arena arena;
+
+  if (InitArena(&arena, HTTP_BUF_SIZE) != 0) return -1;
+
+  double start = NowSeconds();
+  for (int round = 0; round < ROUNDS; round++) {
+    struct HttpRequest req;
+    size_t size;
+    if (InitHttpRequest(&req, &arena) != 0) return -1;
+    memcpy(GetHttpRecvBuf(&req, &size), REQUEST, len);   // the read
+    if (ParseHttpRequest(&req, len) != 0 || !IsHeadersParsed(&req))
+      return -1;
+    checksum += strlen(GetHttpHost(&req));
+    FreeHttpRequest(&req);
+    ResetArena(&arena);
+  }
+  double elapsed = NowSeconds() - start;
+  FreeArena(&arena);
+
+  if (checksum != (long)ROUNDS * strlen("ipahw.xjtu.edu.cn")) return -1;
+  return elapsed * 1e9 / ROUNDS;
+}
+
+int main() {
+  double legacy = BenchLegacy();
+  double span = BenchSpan();
+
+  if (legacy < 0 || span < 0) {
+    printf("Parse error\n");
+    return 1;
+  }
+
+  printf("Request size: %lu bytes\n", strlen(REQUEST));
+  printf("%-16s %12s\n", "parser", "ns/request");
+  printf("%-16s %12.0f\n", "line copy", legacy);
+  printf("%-16s %12.0f\n", "span", span);
+  printf("Speedup: %.2fx\n", legacy / span);
+  return 0;
+}
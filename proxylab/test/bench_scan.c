@@ -0,0 +1,116 @@
+#include "http.h"
+#include "scan.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define ROUNDS 200000
+
+/**
+ * The request of test/test_http.c, as a proxy receives it.
+ */
+const char *REQUEST =
+  "GET http://ipahw.xjtu.edu.cn/szjy-boot/sso/codeLogin?userType=1&code=oauth_code_151b9c46ed1c3a2f92a5467305131b54&employeeNo=3122151052 HTTP/1.1\r\n"
+  "Host: ipahw.xjtu.edu.cn\r\n"
+  "Connection: keep-alive\r\n"
+  "User-Agent: Mozilla/5.0 (Linux; Android 13; V2183A Build/TP1A.220624.014; wv) AppleWebKit/537.36 (KHTML, like Gecko) Version/4.0 Chrome/110.0.5481.153 Mobile Safari/537.36 toon/2122423239 toonType/150 toonVersion/6.3.0 toongine/1.0.12 toongineBuild/12 platform/android language/zh skin/white fontIndex/0\r\n"
+  "content-type: application/x-www-form-urlencoded\r\n"
+  "Accept: */*\r\n"
+  "X-Requested-With: synjones.commerce.xjtu\r\n"
+  "Sec-Fetch-Site: same-origin\r\n"
+  "Sec-Fetch-Mode: cors\r\n"
+  "Sec-Fetch-Dest: empty\r\n"
+  "Referer: https://ipahw.xjtu.edu.cn/sso/callback?userType=1&code=oauth_code_151b9c46ed1c3a2f92a5467305131b54&employeeNo=3122151052&state=2222&ticket=b8279e01-d450-4f77-8b3c-0e74ab646a74\r\n"
+  "Accept-Encoding: gzip, deflate, br\r\n"
+  "Accept-Language: zh-CN,zh;q=0.9,en-US;q=0.8,en;q=0.7\r\n"
+  "Cookie: JSESSIONID=e6c36112-d614-4b45-98f8-70a66511988e\r\n"
+  "\r\n";
+
+double NowSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Split REQUEST at every byte in set, as a tokenizer does.
+ *
+ * \returns ns per request, and the number of tokens in tokens.
+ */
+double BenchTokens(const struct ScanSet *set, long *tokens) {
+  size_t len = strlen(REQUEST);
+  long count = 0;
+
+  double start = NowSeconds();
+  for (int round = 0; round < ROUNDS; round++) {
+    size_t cur = 0;
+    while (cur < len) {
+      cur += ScanDelims(set, REQUEST + cur, len - cur) + 1;
+      count++;
+    }
+  }
+  double elapsed = NowSeconds() - start;
+
+  *tokens = count / ROUNDS;
+  return elapsed * 1e9 / ROUNDS;
+}
+
+/**
+ * Parse REQUEST with HttpRequest.
+ *
+ * \returns ns per request, -1 if error occurs.
+ */
+double BenchParse() {
+  size_t len = strlen(REQUEST);
+  struct HttpRequest req;
+  struct Arena arena;
+  size_t size;
+
+  if (InitArena(&arena, HTTP_BUF_SIZE) != 0) return -1;
+
+  double start = NowSeconds();
+  for (int round = 0; round < ROUNDS; round++) {
+    // The arena hands out the same buffer every round
+    ResetArena(&arena);
+    if (InitHttpRequest(&req, &arena) != 0) return -1;
+    memcpy(GetHttpRecvBuf(&req, &size), REQUEST, len);
+    if (ParseHttpRequest(&req, len) != 0 || !IsHeadersParsed(&req))
+      return -1;
+  }
+  double elapsed = NowSeconds() - start;
+
+  FreeHttpRequest(&req);
+  FreeArena(&arena);
+  return elapsed * 1e9 / ROUNDS;
+}
+
+int main() {
+  const struct ScanSet line_end = SCAN_SET("\n");
+  const struct ScanSet delims = SCAN_SET(" :\r\n");
+  const enum ScanImpl impls[] = { SCAN_SCALAR, SCAN_SSE42, SCAN_AVX2 };
+  long lines, tokens;
+
+  printf("Request size: %lu bytes, default scanner: %s\n",
+         strlen(REQUEST), ScanImplName(GetScanImpl()));
+  printf("%-8s %14s %14s %14s\n", "scanner", "lines ns/req", "tokens ns/req",
+         "parse ns/req");
+  for (int i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+    if (SetScanImpl(impls[i]) != 0) {
+      printf("%-8s %14s\n", ScanImplName(impls[i]), "unsupported");
+      continue;
+    }
+    double lines_ns = BenchTokens(&line_end, &lines);
+    double tokens_ns = BenchTokens(&delims, &tokens);
+    double parse_ns = BenchParse();
+    if (parse_ns < 0) {
+      printf("Parse error\n");
+      return 1;
+    }
+    printf("%-8s %14.0f %14.0f %14.0f\n", ScanImplName(impls[i]),
+           lines_ns, tokens_ns, parse_ns);
+  }
+  printf("Lines: %ld, tokens: %ld\n", lines, tokens);
+
+  return 0;
+}
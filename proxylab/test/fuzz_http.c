@@ -0,0 +1,225 @@
+#include "http.h"
+#include "scan.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Fuzz target of the HTTP parsers, for libFuzzer and AFL.
+ *
+ * The first byte of an input selects how the rest is split into pieces,
+ * the rest is fed to ParseHttpRequest and then to ParseHttpResponse.
+ * Each input is parsed twice, with the scalar scanner and with the best
+ * one of the CPU, and the two results must be identical. Any broken
+ * invariant calls abort(), so that the fuzzer reports it.
+ *
+ * Built with -DFUZZ_WITH_LIBFUZZER, libFuzzer provides main. Otherwise
+ * main runs the target on every file in argv, or on stdin, which is what
+ * AFL expects: afl-fuzz -i test/corpus -o findings -- test/fuzz_http @@
+ */
+
+/* Arena of the parsers, reset for every parse */
+static struct Arena arena;
+
+#define CHECK(cond) \
+  do { if (!(cond)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, \
+                              #cond); abort(); } } while (0)
+
+/**
+ * What a request parses to, which does not depend on the scanner.
+ */
+struct RequestResult {
+  int error;
+  int header_num;
+  int complete;
+  size_t body_len;
+  uint64_t more_len;            // body bytes after the receive buffer
+  struct HttpSpan spans[4];
+};
+
+/**
+ * Check that span lies in the first len bytes of a buffer.
+ */
+static void CheckSpan(struct HttpSpan span, size_t len) {
+  CHECK(span.len == 0 || (size_t)span.off + span.len <= len);
+}
+
+/**
+ * \returns the length of the next piece at offset cur of len bytes.
+ */
+static size_t NextPiece(unsigned char mode, size_t cur, size_t len) {
+  size_t step = (mode & 0x3f) + 1;
+  /// mode >= 0x80 makes pieces grow, which hits the buffer limit soon
+  if (mode & 0x80) step += cur / 2;
+  return len - cur < step ? len - cur : step;
+}
+
+/**
+ * Parse data as a request, and check its invariants.
+ */
+static void FuzzRequest(unsigned char mode, const char *data, size_t len,
+                        struct RequestResult *result) {
+  struct HttpRequest req;
+  size_t cur = 0;
+  size_t size;
+
+  memset(result, 0, sizeof(*result));
+  ResetArena(&arena);
+  if (InitHttpRequest(&req, &arena) != 0) abort();
+
+  // Receive the input in pieces, until the buffer is full or an error
+  while (cur < len && result->error == 0) {
+    char *recv_buf = GetHttpRecvBuf(&req, &size);
+    size_t piece = NextPiece(mode, cur, len);
+    if (size == 0) break;
+    if (piece > size) piece = size;
+    memcpy(recv_buf, data + cur, piece);
+    result->error = ParseHttpRequest(&req, piece);
+    cur += piece;
+    CHECK(req.buf_len <= HTTP_BUF_SIZE);
+    CHECK(req.line_start <= req.buf_len && req.scan_pos <= req.buf_len);
+  }
+
+  // The rest of the input is the body that arrives later
+  if (result->error == 0 && cur < len) {
+    size_t more_len = len - cur;
+    result->error = ParseHttpRequestBody(&req, data + cur, &more_len);
+    CHECK(more_len <= len - cur);
+    result->more_len = more_len;
+  }
+
+  // Every span must be in the received bytes, and the getters must work
+  CheckSpan(req.request_line.method, req.buf_len);
+  CheckSpan(req.request_line.url, req.buf_len);
+  CheckSpan(req.request_line.version, req.buf_len);
+  CheckSpan(req.request_line.proxy_url, req.buf_len);
+  CheckSpan(req.request_headers.host, req.buf_len);
+  CHECK(req.header_num >= 0 && req.header_num <= MAX_HEADERS);
+  for (int i = 0; i < req.header_num; i++) {
+    CheckSpan(req.headers[i].name, req.buf_len);
+    CheckSpan(req.headers[i].value, req.buf_len);
+    CHECK(strlen(GetHttpHeaderValue(&req, &req.headers[i])) <=
+          req.headers[i].value.len);
+  }
+  if (IsRequestLineParsed(&req)) {
+    CHECK(strlen(GetHttpMethod(&req)) < METHOD_LEN);
+    CHECK(strlen(GetHttpUrl(&req)) < URL_LEN);
+    CHECK(strlen(GetHttpVersion(&req)) < VER_LEN);
+  }
+  CHECK(strlen(GetHttpHost(&req)) < HOST_LEN);
+  GetHttpHeader(&req, "content-length");
+  GetHttpHeader(&req, "x-unknown");
+  IsEncodingAccepted(&req, "gzip");
+
+  char *body = GetHttpBody(&req, &result->body_len);
+  CHECK(body >= req.buf && body + result->body_len <= req.buf + req.buf_len);
+  result->complete = IsRequestComplete(&req);
+  CHECK(!result->complete || IsHeadersParsed(&req));
+  result->header_num = req.header_num;
+  result->spans[0] = req.request_line.method;
+  result->spans[1] = req.request_line.url;
+  result->spans[2] = req.request_line.proxy_url;
+  result->spans[3] = req.request_headers.host;
+
+  FreeHttpRequest(&req);
+}
+
+/**
+ * Parse data as a response, and check its invariants.
+ *
+ * \returns the error code, with the body length in the high bits.
+ */
+static uint64_t FuzzResponse(unsigned char mode, const char *data,
+                             size_t len) {
+  struct HttpResponse resp;
+  int error = 0;
+
+  ResetArena(&arena);
+  if (InitHttpResponse(&resp, &arena) != 0) abort();
+  resp.is_head = mode & 0x40 ? 1 : 0;
+  for (size_t cur = 0; cur < len && error == 0;) {
+    size_t piece = NextPiece(mode, cur, len);
+    error = ParseHttpResponse(&resp, data + cur, piece);
+    cur += piece;
+    CHECK(resp.buf_len <= HTTP_BUF_SIZE);
+    CHECK(resp.header_num >= 0 && resp.header_num <= MAX_HEADERS);
+  }
+  CHECK(resp.body.length <= len);
+  FinishHttpResponse(&resp);
+  if (IsResponseComplete(&resp)) CHECK(IsResponseHeadersParsed(&resp));
+
+  uint64_t result = resp.body.length << 8 | error;
+  FreeHttpResponse(&resp);
+  return result;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  struct RequestResult results[2];
+  uint64_t responses[2];
+
+  if (size < 1) return 0;
+  if (!arena.base && InitArena(&arena, HTTP_BUF_SIZE) != 0) abort();
+  unsigned char mode = data[0];
+  const char *input = (const char *)data + 1;
+  size_t len = size - 1;
+
+  // The scalar scanner is the reference of the SIMD ones
+  enum ScanImpl best = GetScanImpl();
+  SetScanImpl(SCAN_SCALAR);
+  FuzzRequest(mode, input, len, &results[0]);
+  responses[0] = FuzzResponse(mode, input, len);
+  SetScanImpl(best);
+  FuzzRequest(mode, input, len, &results[1]);
+  responses[1] = FuzzResponse(mode, input, len);
+
+  CHECK(memcmp(&results[0], &results[1], sizeof(results[0])) == 0);
+  CHECK(responses[0] == responses[1]);
+  return 0;
+}
+
+#ifndef FUZZ_WITH_LIBFUZZER
+/**
+ * Read all of file into a malloced buffer.
+ *
+ * \returns the buffer, whose size is stored in size, NULL if error occurs.
+ */
+static uint8_t *ReadAll(FILE *file, size_t *size) {
+  size_t cap = 4096;
+  uint8_t *data = malloc(cap);
+
+  *size = 0;
+  while (data) {
+    *size += fread(data + *size, 1, cap - *size, file);
+    if (*size < cap) break;
+    cap *= 2;
+    uint8_t *bigger = realloc(data, cap);
+    if (!bigger) free(data);
+    data = bigger;
+  }
+  return data;
+}
+
+int main(int argc, char **argv) {
+  int runs = 0;
+
+  for (int i = argc > 1 ? 1 : 0; i < argc; i++) {
+    FILE *file = argc > 1 ? fopen(argv[i], "rb") : stdin;
+    size_t size;
+    if (!file) {
+      perror(argv[i]);
+      return 1;
+    }
+    uint8_t *data = ReadAll(file, &size);
+    if (file != stdin) fclose(file);
+    if (!data) return 1;
+
+    LLVMFuzzerTestOneInput(data, size);
+    free(data);
+    runs++;
+  }
+
+  printf("Fuzz inputs passed: %d\n", runs);
+  return 0;
+}
+#endif
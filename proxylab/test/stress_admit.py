@@ -0,0 +1,215 @@
+#!/usr/bin/python3
+
+# stress_admit.py - Fill all request pools of the proxy with idle clients,
+#                   then submit requests from the main thread (TCP clients)
+#                   and the peer thread (peer socket clients) at the same
+#                   time. Every request must be served once the idle
+#                   clients leave, and the proxy must count free slots
+#                   exactly afterwards.
+#
+# usage: test/stress_admit.py [requests per submitter]
+#        (after make and make -C tiny)
+#
+import os
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+NTHREAD = 4                     # NTHREAD in proxy.c
+MAX_REQ = 80                    # MAX_REQ in proxy.c
+POOL_SLOTS = NTHREAD * MAX_REQ
+TIMEOUT = 10                    # seconds to wait for a response
+SUBMITS = 200                   # default requests per submitter
+
+failures = 0
+
+
+def check(what, ok):
+    global failures
+    print("%-48s %s" % (what, "ok" if ok else "FAIL"))
+    if not ok:
+        failures += 1
+
+
+def free_port():
+    s = socket.socket()
+    s.bind(('', 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def wait_for_port(port):
+    for _ in range(50):
+        try:
+            socket.create_connection(('localhost', port)).close()
+            return True
+        except OSError:
+            time.sleep(0.1)
+    return False
+
+
+def fill_pools(port, num):
+    """Open num idle clients, each of which takes a slot of a pool."""
+    idle = [socket.create_connection(('localhost', port))
+            for _ in range(num)]
+    # Let the main thread add all of them
+    time.sleep(0.5)
+    return idle
+
+
+def send_get(sock, url):
+    host = url.split('/')[2]
+    sock.sendall(('GET %s HTTP/1.0\r\nHost: %s\r\n\r\n'
+                  % (url, host)).encode())
+
+
+def fetch(sock, url, timeout):
+    """Send a GET of url through sock, returns the response or None."""
+    sock.settimeout(timeout)
+    data = b''
+    try:
+        send_get(sock, url)
+        while True:
+            chunk = sock.recv(65536)
+            if not chunk:
+                break
+            data += chunk
+    except OSError:
+        return None
+    finally:
+        sock.close()
+    return data
+
+
+def open_client(kind, proxy_port, peer_path):
+    if kind == 'main':
+        return socket.create_connection(('localhost', proxy_port))
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    sock.connect(peer_path)
+    return sock
+
+
+def submit(kind, num, proxy_port, peer_path, url, results):
+    """Start num requests of a submitter, returns their threads."""
+    threads = []
+    for _ in range(num):
+        sock = open_client(kind, proxy_port, peer_path)
+        thread = threading.Thread(
+            target=lambda s=sock: results.append(
+                (kind, fetch(s, url, TIMEOUT + 5))))
+        thread.start()
+        threads.append(thread)
+    return threads
+
+
+def main():
+    per_submitter = int(sys.argv[1]) if len(sys.argv) > 1 else SUBMITS
+    root = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+    work_dir = tempfile.mkdtemp(prefix='stress_admit.')
+    peer_path = os.path.join(work_dir, 'proxy.sock')
+    tiny_port, proxy_port = free_port(), free_port()
+    url = 'http://localhost:%d/home.html' % tiny_port
+    out = open(os.path.join(work_dir, 'proxy.log'), 'w')
+
+    tiny = subprocess.Popen(['./tiny', str(tiny_port)],
+                            cwd=os.path.join(root, 'tiny'),
+                            stdout=subprocess.DEVNULL,
+                            stderr=subprocess.DEVNULL)
+    # The proxy keeps its cache in its working directory. The peer thread
+    # runs only with another peer, which is down, so the proxy serves the
+    # misses it owns by itself
+    peers = peer_path + ',' + os.path.join(work_dir, 'down.sock')
+    proxy = subprocess.Popen([os.path.join(root, 'proxy'), '-p', peers,
+                              str(proxy_port)], cwd=work_dir,
+                             stdout=out, stderr=out)
+    try:
+        if not wait_for_port(tiny_port) or not wait_for_port(proxy_port):
+            check("tiny and proxy started", False)
+            return 1
+        with open(os.path.join(root, 'tiny', 'home.html'), 'rb') as f:
+            expected = f.read()
+
+        # Two submitters wait while all pools are full
+        print("Submit %d requests from each of the main thread and the "
+              "peer thread while %d slots are taken:"
+              % (per_submitter, POOL_SLOTS))
+        idle = fill_pools(proxy_port, POOL_SLOTS)
+        results = []
+        # The proxy accepts them in its main thread and its peer thread,
+        # both of which wait for a free slot
+        threads = []
+        for kind in ('main', 'peer'):
+            threads += submit(kind, per_submitter, proxy_port, peer_path,
+                              url, results)
+        time.sleep(1)
+        check("no request served while pools are full", not results)
+
+        # Free the slots one by one, so that both submitters compete for
+        # the only free slot
+        for sock in idle:
+            sock.close()
+            time.sleep(0.001)
+        deadline = time.time() + TIMEOUT
+        for thread in threads:
+            thread.join(max(0, deadline - time.time()))
+        for kind in ('main', 'peer'):
+            served = sum(1 for k, data in results
+                         if k == kind and data and data.endswith(expected))
+            check("all %s thread requests served" % kind,
+                  served == per_submitter)
+
+        # No slot is lost or counted twice: the pools take exactly
+        # POOL_SLOTS clients, and the next one waits for a free slot
+        print("\nCount free slots:")
+        idle = fill_pools(proxy_port, POOL_SLOTS)
+        extra = socket.create_connection(('localhost', proxy_port))
+        send_get(extra, url)
+        extra.settimeout(1)
+        try:
+            early = extra.recv(1)
+            check("extra client waits while pools are full", False)
+        except socket.timeout:
+            early = None
+            check("extra client waits while pools are full", True)
+        idle.pop().close()
+        if early is None:
+            extra.settimeout(TIMEOUT)
+            data = b''
+            try:
+                while True:
+                    chunk = extra.recv(65536)
+                    if not chunk:
+                        break
+                    data += chunk
+            except OSError:
+                pass
+            check("extra client served after a slot is freed",
+                  data.endswith(expected))
+        extra.close()
+        for sock in idle:
+            sock.close()
+        check("proxy still running", proxy.poll() is None)
+    finally:
+        proxy.send_signal(signal.SIGINT)
+        try:
+            proxy.wait(2)
+        except subprocess.TimeoutExpired:
+            proxy.kill()
+        tiny.kill()
+        out.close()
+        if failures:
+            print("\nProxy log kept in %s" % work_dir)
+        else:
+            shutil.rmtree(work_dir, ignore_errors=True)
+
+    return 0 if failures == 0 else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
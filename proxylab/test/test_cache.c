@@ -5,6 +5,7 @@ const char *URL1 = "/szjy-boot/sso/codeLogin?userType=1&code=oauth_code_"
                    "151b9c46ed1c3a2f92a5467305131b54&employeeNo=3122151052";
 const char *HOST2 = "www.baidu.com";
 const char *URL2 = "/";
+const char *URL3 = "/s?wd=one-hit-wonder";
 
 char *CONTENT1 = "ipahw.xjtu.edu.cn\nHello, ipahw ! ! !";
 char *CONTENT2 = "www.baidu.com\nHello, baidu ! ! !";
@@ -86,5 +87,25 @@ int main() {
   FreeCacheInfo(&cache_info1);
   FreeCacheInfo(&cache_info2);
 
+  // Admission filter: an object is admitted at its second request
+  struct CacheInfo cache_info3;
+  long accepted, rejected;
+  SetCacheAdmission(1);
+
+  printf("\n");
+  printf("Requesting %s%s twice with admission filter ...\n", HOST2, URL3);
+  for (int i = 0; i < 2; i++) {
+    retval = CreateCacheInfo(&cache_info3, HOST2, URL3);
+    if (retval != 0) {
+      printf("Create cache_info3 error: %s\n", cache_info3.error_msg);
+      return 1;
+    }
+    printf("Request %d admitted: %d\n", i+1, IsCacheAdmitted(&cache_info3));
+    FreeCacheInfo(&cache_info3);
+  }
+  GetCacheAdmissionStats(&accepted, &rejected);
+  printf("Admission accepted: %ld, rejected: %ld\n", accepted, rejected);
+  if (accepted != 1 || rejected != 1) return 1;
+
   return 0;
 }
\ No newline at end of file
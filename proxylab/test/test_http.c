@@ -1,5 +1,6 @@
 #include "http.h"
 #include <stdio.h>
+#include <ctype.h>
 
 char *const HttpReqeustLines[] = {
   "GET /szjy-boot/sso/codeLogin?userType=1&code=oauth_code_151b9c46ed1c3a2f92a5467305131b54&employeeNo=3122151052 HTTP/1.1\r\n",
@@ -19,9 +20,143 @@ char *const HttpReqeustLines[] = {
   "\r\n"
 };
 
+/* Arena of the requests and responses, reset after each one is freed */
+struct Arena arena;
+
+/**
+ * Copy len bytes of data into the receive buffer of http_request and
+ * parse them, as if they were received from a client.
+ *
+ * \returns 0 if success, otherwise an error_code.
+ */
+int Feed(struct HttpRequest *http_request, const char *data, size_t len) {
+  size_t size;
+  char *recv_buf = GetHttpRecvBuf(http_request, &size);
+  if (len > size) return ERROR_REQUEST_TOO_LARGE;
+  memcpy(recv_buf, data, len);
+  return ParseHttpRequest(http_request, len);
+}
+
+/**
+ * Check that every well-known header name maps to its own id, both in
+ * lower case and in upper case.
+ *
+ * \returns the number of names that map correctly.
+ */
+int CheckHeaderIds() {
+  char upper[64];
+  int matched = 0;
+
+#define CHECK_HEADER_ID(id, name, first, last)                        \
+  for (int i = 0; i < sizeof(name); i++) upper[i] = toupper(name[i]); \
+  if (LookupHttpHeaderId(name, strlen(name)) == id &&                 \
+      LookupHttpHeaderId(upper, strlen(upper)) == id) {               \
+    matched++;                                                        \
+  }
+  HTTP_HEADER_LIST(CHECK_HEADER_ID)
+#undef CHECK_HEADER_ID
+
+  return matched;
+}
+
+/**
+ * Parse a response split into step-byte pieces, and show the result.
+ *
+ * \returns 1 if the response is complete, otherwise 0.
+ */
+int TestResponse(const char *name, const char *response, size_t step,
+                 int is_head) {
+  struct HttpResponse http_response;
+  size_t len = strlen(response);
+  int retval = 0;
+
+  if (InitHttpResponse(&http_response, &arena) != 0) return 0;
+  http_response.is_head = is_head;
+  for (size_t i = 0; i < len && retval == 0; i += step) {
+    retval = ParseHttpResponse(&http_response, response + i,
+                               len - i < step ? len - i : step);
+  }
+
+  printf("%-10s status: %d, body: %lu bytes, ", name,
+         http_response.status_line.status_code,
+         (unsigned long)http_response.body.length);
+  if (retval != 0) printf("error: %s\n", ErrorCodeToMsg(retval));
+  else printf("complete: %d\n", IsResponseComplete(&http_response));
+
+  retval = IsResponseComplete(&http_response);
+  FreeHttpResponse(&http_response);
+  ResetArena(&arena);
+  return retval;
+}
+
+/**
+ * Parse a request whose body starts in the receive buffer and ends in
+ * more, which is followed by extra bytes, and show the result.
+ *
+ * \returns 1 if the request is complete, otherwise 0.
+ */
+int TestRequestBody(const char *name, const char *request, const char *more) {
+  struct HttpRequest http_request;
+  size_t body_len;
+  size_t more_len = strlen(more);
+  int retval = InitHttpRequest(&http_request, &arena);
+
+  if (retval == 0) retval = Feed(&http_request, request, strlen(request));
+  if (retval == 0) {
+    GetHttpBody(&http_request, &body_len);
+    retval = ParseHttpRequestBody(&http_request, more, &more_len);
+  }
+
+  printf("%-10s ", name);
+  if (retval != 0) printf("error: %s\n", ErrorCodeToMsg(retval));
+  else printf("in buffer: %lu, more: %lu, complete: %d\n", body_len,
+              more_len, IsRequestComplete(&http_request));
+
+  retval = IsRequestComplete(&http_request);
+  FreeHttpRequest(&http_request);
+  ResetArena(&arena);
+  return retval;
+}
+
+/**
+ * Forward a request framed by both Transfer-Encoding and Content-Length,
+ * and check that Content-Length is not forwarded with it.
+ *
+ * \returns 1 if Content-Length is dropped, otherwise 0.
+ */
+int TestForwardFraming() {
+  struct HttpRequest http_request;
+  const char *request = "POST http://a/ HTTP/1.1\r\nHost: a\r\n"
+                        "Content-Length: 3\r\n"
+                        "Transfer-Encoding: chunked\r\n\r\n"
+                        "0\r\n\r\n";
+  char path[] = "/tmp/test_httpXXXXXX";
+  char forwarded[MAXLINE];
+  ssize_t len = -1;
+  int fd = mkstemp(path);
+
+  if (fd < 0) return 0;
+  unlink(path);
+  if (InitHttpRequest(&http_request, &arena) == 0 &&
+      Feed(&http_request, request, strlen(request)) == 0 &&
+      ForwardHttpRequest(&http_request, fd) > 0) {
+    len = pread(fd, forwarded, sizeof(forwarded) - 1, 0);
+  }
+  close(fd);
+  FreeHttpRequest(&http_request);
+  ResetArena(&arena);
+  if (len < 0) return 0;
+
+  forwarded[len] = '\0';
+  printf("Forwarded with Transfer-Encoding:\n%s", forwarded);
+  return strstr(forwarded, "Content-Length") == NULL &&
+         strstr(forwarded, "Transfer-Encoding: chunked") != NULL;
+}
+
 int main() {
   struct HttpRequest http_request;
-  int retval = InitHttpRequest(&http_request);
+  if (InitArena(&arena, HTTP_BUF_SIZE) != 0) return 1;
+  int retval = InitHttpRequest(&http_request, &arena);
   if (retval != 0) {
     printf("Error: %s\n", ErrorCodeToMsg(retval));
     return 1;
@@ -29,9 +164,10 @@ int main() {
 
   // Parse request lines
   int index = 0;
-  while (!IsRequestLineParsed(&http_request) || !IsHostParsed(&http_request)) {
+  while (!IsRequestLineParsed(&http_request) || !IsHostParsed(&http_request) ||
+         !IsHeadersParsed(&http_request)) {
     char *line = HttpReqeustLines[index];
-    retval = ParseHttpRequest(&http_request, line);
+    retval = Feed(&http_request, line, strlen(line));
     if (retval != 0) {
       printf("Error: %s\n", ErrorCodeToMsg(retval));
       break;
@@ -41,12 +177,118 @@ int main() {
 
   // Show parse results
   if (IsRequestLineParsed(&http_request) && IsHostParsed(&http_request)) {
-    printf("Method: %s\n", http_request.request_line.method);
-    printf("Url: %s\n", http_request.request_line.url);
-    printf("Version: %s\n", http_request.request_line.version);
-    printf("Host: %s\n", http_request.request_headers.host);
+    printf("Method: %s\n", GetHttpMethod(&http_request));
+    printf("Url: %s\n", GetHttpUrl(&http_request));
+    printf("Version: %s\n", GetHttpVersion(&http_request));
+    printf("Host: %s\n", GetHttpHost(&http_request));
+    printf("Headers: %d\n", http_request.header_num);
+    printf("Connection: %s\n", GetHttpHeader(&http_request, "Connection"));
+    printf("Sec-Fetch-Mode: %s\n", GetHttpHeader(&http_request,
+                                                 "sec-fetch-mode"));
+    printf("Accept gzip: %d\n", IsEncodingAccepted(&http_request, "gzip"));
+    printf("Accept zstd: %d\n", IsEncodingAccepted(&http_request, "zstd"));
+  }
+
+  FreeHttpRequest(&http_request);
+  ResetArena(&arena);
+
+  printf("Well-known header ids: %d/%d\n", CheckHeaderIds(),
+         HEADER_ID_NUM - 1);
+  printf("Unknown header id: %d\n", LookupHttpHeaderId("X-Host", 6));
+
+  // Parse a proxy request received in 7-byte pieces, with a body and
+  // hop-by-hop headers
+  const char *proxy_request = "POST http://localhost:8080/cgi-bin/adder "
+                              "HTTP/1.0\r\nUser-Agent: curl/7.88.1\r\n"
+                              "Host: localhost:8080\r\n"
+                              "Proxy-Connection: Keep-Alive, X-Trace\r\n"
+                              "X-Trace: 1\r\n"
+                              "Content-Length: 5\r\n\r\n1&2\r\n";
+  size_t body_len;
+  InitHttpRequest(&http_request, &arena);
+  for (size_t i = 0; i < strlen(proxy_request); i += 7) {
+    size_t len = strlen(proxy_request) - i;
+    retval = Feed(&http_request, proxy_request + i, len < 7 ? len : 7);
+    if (retval != 0) {
+      printf("Error: %s\n", ErrorCodeToMsg(retval));
+      break;
+    }
   }
+  GetHttpBody(&http_request, &body_len);
+  printf("\n");
+  printf("Proxy url: %s\n", GetHttpProxyUrl(&http_request));
+  printf("Content-Length: %s\n", GetHttpHeader(&http_request,
+                                               "content-length"));
+  printf("Body length: %lu\n", body_len);
+  printf("Forwarded:\n");
+  fflush(stdout);
+  if (ForwardHttpRequest(&http_request, STDOUT_FILENO) < 0) return 1;
+  printf("\n");
+  printf("Forwarded to a proxy:\n");
+  fflush(stdout);
+  if (ForwardHttpProxyRequest(&http_request, STDOUT_FILENO) < 0) return 1;
+  printf("\n");
 
   FreeHttpRequest(&http_request);
-  return 0;
-}
\ No newline at end of file
+  ResetArena(&arena);
+
+  // Parse request bodies that go on after the receive buffer
+  printf("\n");
+  int complete = 0;
+  complete += TestRequestBody("length",
+                              "PUT http://a/ HTTP/1.1\r\nHost: a\r\n"
+                              "Content-Length: 10\r\n\r\n0123",
+                              "456789GET /next");
+  complete += TestRequestBody("chunked",
+                              "POST http://a/ HTTP/1.1\r\nHost: a\r\n"
+                              "Transfer-Encoding: chunked\r\n\r\n4\r\nWi",
+                              "ki\r\n0\r\n\r\nGET /next");
+  complete += TestRequestBody("no body",
+                              "GET http://a/ HTTP/1.1\r\nHost: a\r\n"
+                              "\r\nGET /next", "");
+  complete += TestRequestBody("gzip",
+                              "POST http://a/ HTTP/1.1\r\nHost: a\r\n"
+                              "Transfer-Encoding: gzip\r\n\r\n", "");
+  complete += TestRequestBody("te+length",
+                              "POST http://a/ HTTP/1.1\r\nHost: a\r\n"
+                              "Content-Length: 100\r\n"
+                              "Transfer-Encoding: chunked\r\n\r\n4\r\nWi",
+                              "ki\r\n0\r\n\r\nGET /next");
+  complete += TestRequestBody("2 lengths",
+                              "POST http://a/ HTTP/1.1\r\nHost: a\r\n"
+                              "Content-Length: 4\r\n"
+                              "Content-Length: 4\r\n\r\nWi", "kiGET /next");
+  complete += TestRequestBody("conflict",
+                              "POST http://a/ HTTP/1.1\r\nHost: a\r\n"
+                              "Content-Length: 4\r\n"
+                              "Content-Length: 40\r\n\r\nWi", "ki");
+  printf("\n");
+  complete += TestForwardFraming();
+
+  // Parse responses, split at every byte and as a whole
+  const char *length_response = "HTTP/1.0 200 OK\r\n"
+                                "Server: Tiny Web Server\r\n"
+                                "Content-length: 12\r\n\r\n"
+                                "Hello World!extra bytes";
+  const char *chunked_response = "HTTP/1.1 200 OK\r\n"
+                                 "Transfer-Encoding: gzip, chunked\r\n\r\n"
+                                 "5;ext=1\r\nHello\r\n"
+                                 "7\r\n World!\r\n"
+                                 "0\r\nExpires: 0\r\n\r\n";
+  const char *continue_response = "HTTP/1.1 100 Continue\r\n\r\n"
+                                  "HTTP/1.1 204 No Content\r\n\r\n";
+  const char *bad_chunk_response = "HTTP/1.1 200 OK\r\n"
+                                   "Transfer-Encoding: chunked\r\n\r\n"
+                                   "zz\r\n";
+  printf("\n");
+  for (size_t step = 1; step <= 4096; step += 4095) {
+    complete += TestResponse("length", length_response, step, 0);
+    complete += TestResponse("chunked", chunked_response, step, 0);
+    complete += TestResponse("continue", continue_response, step, 0);
+    complete += TestResponse("head", length_response, step, 1);
+    complete += TestResponse("bad chunk", bad_chunk_response, step, 0);
+  }
+
+  FreeArena(&arena);
+  return complete == 14 ? 0 : 1;
+}
@@ -0,0 +1,133 @@
+#include "ioengine.h"
+
+const char *CONTENT = "HTTP/1.0 200 OK\r\nServer: Tiny Web Server\r\n\r\n"
+                      "Hello, io_uring ! ! !\n";
+
+/**
+ * Relay CONTENT to a socket and a temp file, then send the temp file
+ * back through the socket, and check what the peer receives.
+ *
+ * \returns 0 if success, 1 otherwise.
+ */
+int TestEngine(struct IoEngine *engine) {
+  int sv[2];
+  int file_err = 0;
+  char path[] = "/tmp/test_ioengineXXXXXX";
+  char buffer[MAXLINE];
+  size_t len = strlen(CONTENT);
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) return 1;
+  int file_fd = mkstemp(path);
+  if (file_fd < 0) return 1;
+  unlink(path);
+
+  memcpy(engine->buf, CONTENT, len);
+  if (IoEngineRelay(engine, 0, sv[0], file_fd, len, &file_err) != len ||
+      file_err != 0) {
+    printf("Relay error: %s\n", strerror(file_err ? file_err : errno));
+    return 1;
+  }
+  memset(buffer, 0, sizeof(buffer));
+  rio_readn(sv[1], buffer, len);
+  printf("Relayed: %s", buffer);
+
+  ssize_t retval = IoEngineSendFile(engine, 0, sv[0], file_fd, 0, len);
+  if (retval != len) {
+    printf("SendFile error: %ld\n", retval);
+    return 1;
+  }
+  memset(buffer, 0, sizeof(buffer));
+  rio_readn(sv[1], buffer, len);
+  printf("Sent from file: %s", buffer);
+  if (strcmp(buffer, CONTENT) != 0) return 1;
+
+  retval = IoEngineSendFile(engine, 0, sv[0], file_fd, len, len);
+  printf("Send at EOF: %ld\n", retval);
+
+  AttachIoEngineFiles(engine, 0, -1, -1);
+  close(file_fd);
+  close(sv[0]);
+  close(sv[1]);
+  return retval != 0;
+}
+
+/**
+ * With a full submission queue, operations should fall back to plain
+ * system calls, and leave nothing in flight.
+ *
+ * \returns 0 if success, 1 otherwise.
+ */
+int TestFullQueue(struct IoEngine *engine) {
+  int sv[2];
+  int file_err = 0;
+  char path[] = "/tmp/test_ioengineXXXXXX";
+  char buffer[MAXLINE];
+  size_t len = strlen(CONTENT);
+  int retval = 0;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) return 1;
+  int file_fd = mkstemp(path);
+  if (file_fd < 0) return 1;
+  unlink(path);
+
+  /// Pretend all sqes are taken, as if an operation left them behind
+  engine->ring.sqe_tail += IO_RING_ENTRIES;
+
+  memcpy(engine->buf, CONTENT, len);
+  if (IoEngineRelay(engine, 0, sv[0], file_fd, len, &file_err) != len ||
+      file_err != 0)
+    retval = 1;
+  memset(buffer, 0, sizeof(buffer));
+  rio_readn(sv[1], buffer, len);
+  if (strcmp(buffer, CONTENT) != 0) retval = 1;
+
+  engine->ring.sqe_tail += IO_RING_ENTRIES;
+  if (IoEngineSendFile(engine, 0, sv[0], file_fd, 0, len) != len)
+    retval = 1;
+  memset(buffer, 0, sizeof(buffer));
+  rio_readn(sv[1], buffer, len);
+  if (strcmp(buffer, CONTENT) != 0) retval = 1;
+
+  engine->ring.sqe_tail += IO_RING_ENTRIES;
+  if (IoEngineSend(engine, 0, sv[0], CONTENT, len) != len) retval = 1;
+  memset(buffer, 0, sizeof(buffer));
+  rio_readn(sv[1], buffer, len);
+  if (strcmp(buffer, CONTENT) != 0) retval = 1;
+
+  // The queue works again after the fallback
+  if (IoEngineSendFile(engine, 0, sv[0], file_fd, 0, len) != len)
+    retval = 1;
+  memset(buffer, 0, sizeof(buffer));
+  rio_readn(sv[1], buffer, len);
+  if (strcmp(buffer, CONTENT) != 0) retval = 1;
+  if (engine->ring.inflight != 0) retval = 1;
+  printf("Full queue: %s\n", retval ? "error" : "ok");
+
+  AttachIoEngineFiles(engine, 0, -1, -1);
+  close(file_fd);
+  close(sv[0]);
+  close(sv[1]);
+  return retval;
+}
+
+int main() {
+  struct IoEngine engine;
+  int retval = 0;
+
+  printf("io_uring supported: %d\n", IsIoUringSupported());
+
+  for (int want_uring = 0; want_uring <= 1; want_uring++) {
+    if (InitIoEngine(&engine, want_uring) != 0) {
+      printf("Init engine error\n");
+      return 1;
+    }
+    printf("\n");
+    printf("Engine use_uring: %d, fixed_files: %d\n",
+           engine.use_uring, engine.fixed_files);
+    retval |= TestEngine(&engine);
+    if (engine.use_uring) retval |= TestFullQueue(&engine);
+    FreeIoEngine(&engine);
+  }
+
+  return retval;
+}
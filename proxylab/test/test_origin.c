@@ -0,0 +1,200 @@
+#include "origin.h"
+#include "negcache.h"
+
+#include <stdio.h>
+
+/* Number of failed checks */
+int failures = 0;
+
+/**
+ * Show a check and count it if it fails.
+ */
+void Check(const char *what, int ok) {
+  printf("%-48s %s\n", what, ok ? "ok" : "FAIL");
+  if (!ok) failures++;
+}
+
+/**
+ * Two slots of an origin are taken, later requests are queued and go in
+ * the order they came, before any new request.
+ */
+void TestQueue() {
+  struct Origin *first = NULL, *second = NULL, *third = NULL;
+  struct Origin *fourth = NULL, *fifth = NULL;
+
+  printf("Queue:\n");
+  SetOriginLimit(2);
+  Check("1st request admitted",
+        AcquireOrigin("queue.test", &first) == ORIGIN_ADMITTED && first);
+  Check("2nd request admitted",
+        AcquireOrigin("queue.test", &second) == ORIGIN_ADMITTED &&
+        second == first);
+  Check("3rd request queued",
+        AcquireOrigin("queue.test", &third) == ORIGIN_QUEUED);
+  Check("4th request queued",
+        AcquireOrigin("queue.test", &fourth) == ORIGIN_QUEUED);
+  Check("queued requests counted", first->waiting == 2);
+
+  ReleaseOrigin(first, ORIGIN_SUCCESS);
+  Check("new request waits behind the queue",
+        AcquireOrigin("queue.test", &fifth) == ORIGIN_QUEUED &&
+        first->waiting == 3);
+  Check("queued request takes the free slot",
+        AcquireOrigin("queue.test", &third) == ORIGIN_ADMITTED &&
+        first->in_flight == 2 && first->waiting == 2);
+  Check("still queued while slots are taken",
+        AcquireOrigin("queue.test", &fifth) == ORIGIN_QUEUED);
+
+  CancelOrigin(fourth);
+  Check("canceled request leaves the queue", first->waiting == 1);
+
+  ReleaseOrigin(second, ORIGIN_SUCCESS);
+  Check("last queued request admitted",
+        AcquireOrigin("queue.test", &fifth) == ORIGIN_ADMITTED &&
+        first->waiting == 0 && first->in_flight == 2);
+
+  ReleaseOrigin(third, ORIGIN_SUCCESS);
+  ReleaseOrigin(fifth, ORIGIN_SUCCESS);
+  Check("all slots released", first->in_flight == 0);
+}
+
+/**
+ * Consecutive failures open the circuit of an origin, which half-opens
+ * after the cool-down to let one probe pass, and closes if it succeeds.
+ */
+void TestCircuit() {
+  struct Origin *origin = NULL, *request = NULL, *other = NULL;
+
+  printf("\nCircuit:\n");
+  for (int i = 0; i < ORIGIN_MAX_FAILURES; i++) {
+    request = NULL;
+    AcquireOrigin("circuit.test", &request);
+    ReleaseOrigin(request, ORIGIN_FAILURE);
+    if (i == 0) origin = request;
+    if (i == ORIGIN_MAX_FAILURES - 2) {
+      Check("closed before the last failure",
+            origin->circuit == CIRCUIT_CLOSED);
+    }
+  }
+  Check("open after consecutive failures", origin->circuit == CIRCUIT_OPEN);
+  request = NULL;
+  Check("open circuit rejects",
+        AcquireOrigin("circuit.test", &request) == ORIGIN_REJECTED &&
+        request == NULL);
+
+  /// Pretend the cool-down is over
+  origin->open_until_ms = 0;
+  request = NULL;
+  Check("half-open circuit admits a probe",
+        AcquireOrigin("circuit.test", &request) == ORIGIN_ADMITTED &&
+        origin->circuit == CIRCUIT_HALF_OPEN && origin->probing);
+  Check("only one probe at a time",
+        AcquireOrigin("circuit.test", &other) == ORIGIN_REJECTED);
+  ReleaseOrigin(request, ORIGIN_UNKNOWN);
+  Check("unknown outcome lets another probe",
+        origin->circuit == CIRCUIT_HALF_OPEN && !origin->probing);
+
+  request = NULL;
+  AcquireOrigin("circuit.test", &request);
+  ReleaseOrigin(request, ORIGIN_FAILURE);
+  Check("failed probe opens again", origin->circuit == CIRCUIT_OPEN &&
+        origin->open_until_ms > 0);
+
+  origin->open_until_ms = 0;
+  request = NULL;
+  AcquireOrigin("circuit.test", &request);
+  ReleaseOrigin(request, ORIGIN_SUCCESS);
+  Check("successful probe closes",
+        origin->circuit == CIRCUIT_CLOSED && origin->failures == 0);
+  request = NULL;
+  Check("closed circuit admits",
+        AcquireOrigin("circuit.test", &request) == ORIGIN_ADMITTED);
+  ReleaseOrigin(request, ORIGIN_SUCCESS);
+}
+
+/**
+ * An origin taking the slot of a busy origin is untracked, and one taking
+ * the slot of an idle origin replaces it.
+ */
+void TestSlots() {
+  struct Origin *busy = NULL, *request = NULL;
+  char host[64];
+  int found = 0;
+
+  printf("\nSlots:\n");
+  AcquireOrigin("slot.test", &busy);
+
+  // Find a host of the same slot, which can't be tracked while busy
+  for (int i = 0; i < 64 * ORIGIN_SLOTS && !found; i++) {
+    snprintf(host, sizeof(host), "host%d.test", i);
+    request = NULL;
+    AcquireOrigin(host, &request);
+    if (request) ReleaseOrigin(request, ORIGIN_SUCCESS);
+    else found = 1;
+  }
+  Check("busy slot leaves the new origin untracked", found);
+
+  ReleaseOrigin(busy, ORIGIN_SUCCESS);
+  request = NULL;
+  Check("idle origin is replaced",
+        AcquireOrigin(host, &request) == ORIGIN_ADMITTED &&
+        request == busy && strcmp(request->host, host) == 0);
+  ReleaseOrigin(request, ORIGIN_SUCCESS);
+}
+
+/**
+ * Negative entries answer for their TTL, urls fall back to their host,
+ * and an entry replaces the one in its slot.
+ */
+void TestNegativeCache() {
+  char host[64];
+  int found = 0;
+
+  printf("\nNegative cache:\n");
+  SetNegativeTtl(1, 2);
+  AddNegativeEntry("neg.test", "/missing", 404);
+  AddNegativeEntry("down.test", NULL, 504);
+  Check("url is cached",
+        LookupNegativeEntry("neg.test", "/missing") == 404);
+  Check("other urls of the host are not",
+        LookupNegativeEntry("neg.test", "/") == 0);
+  Check("url falls back to its host",
+        LookupNegativeEntry("down.test", "/any") == 504);
+
+  // Find a host of the same slot as the url
+  for (int i = 0; i < 64 * NEG_CACHE_SLOTS && !found; i++) {
+    snprintf(host, sizeof(host), "host%d.test", i);
+    AddNegativeEntry(host, NULL, 502);
+    found = LookupNegativeEntry("neg.test", "/missing") == 0;
+  }
+  Check("entry replaces the one in its slot",
+        found && LookupNegativeEntry(host, NULL) == 502);
+
+  AddNegativeEntry("neg.test", "/missing", 404);
+  sleep(1);
+  /// The coarse clock may lag a few ms behind
+  usleep(100000);
+  Check("error entry expires after its TTL",
+        LookupNegativeEntry("down.test", NULL) == 0);
+  Check("not found entry lives longer",
+        LookupNegativeEntry("neg.test", "/missing") == 404);
+
+  SetNegativeTtl(0, 0);
+  AddNegativeEntry("off.test", NULL, 502);
+  Check("TTL 0 disables", LookupNegativeEntry("off.test", NULL) == 0);
+}
+
+int main() {
+  long queued, rejected;
+
+  TestQueue();
+  TestCircuit();
+  TestSlots();
+  TestNegativeCache();
+
+  GetOriginStats(&queued, &rejected);
+  printf("\nQueued: %ld, rejected: %ld, negative hits: %ld\n",
+         queued, rejected, GetNegativeHits());
+
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,247 @@
+#include "segstore.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * The test is built with a few small segments, see SEG_TEST_FLAGS in the
+ * Makefile, so that a few dozen objects fill all of them.
+ */
+#if SEG_MAX < 3
+#error "the test needs at least 3 segments"
+#endif
+#define OBJECT_SIZE 4000
+/// Enough to fill all segments twice
+#define OBJECT_MAX (2 * SEG_MAX * (SEG_SIZE / OBJECT_SIZE + 1))
+
+/* Number of failed checks */
+int failures = 0;
+
+char seg_dir[] = "/tmp/test_segstore.XXXXXX";
+int content_fd = -1;            // file of the content to append
+struct CacheLocation locations[OBJECT_MAX];
+
+/**
+ * Show a check and count it if it fails.
+ */
+void Check(const char *what, int ok) {
+  printf("%-48s %s\n", what, ok ? "ok" : "FAIL");
+  if (!ok) failures++;
+}
+
+uint64_t HashKey(const char *key) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  while (*key) hash = (hash ^ (unsigned char)*key++) * 0x100000001b3ULL;
+  return hash;
+}
+
+void MakeKey(char *key, size_t len, int id) {
+  snprintf(key, len, "segstore.test/object%d", id);
+}
+
+/**
+ * Fill buf with the content of object id, which differs from all others.
+ */
+void MakeContent(char *buf, int id) {
+  for (int i = 0; i < OBJECT_SIZE; i++) buf[i] = (char)(id * 31 + i);
+}
+
+/**
+ * Append object id to the segment store, and keep its location.
+ *
+ * \returns 0 if success, -1 otherwise.
+ */
+int AppendObject(int id) {
+  char key[64];
+  char buf[OBJECT_SIZE];
+  struct CacheMeta meta;
+
+  MakeKey(key, sizeof(key), id);
+  MakeContent(buf, id);
+  if (pwrite(content_fd, buf, OBJECT_SIZE, 0) != OBJECT_SIZE) return -1;
+  memset(&meta, 0, sizeof(meta));
+  meta.size = OBJECT_SIZE;
+  if (AppendSegment(key, HashKey(key), content_fd, &meta) != 0) return -1;
+  locations[id] = meta.location;
+  return 0;
+}
+
+/**
+ * Append objects from id until one is stored out of segment.
+ *
+ * \returns the id of that object, -1 if failed.
+ */
+int AppendUntilLeave(int id, uint32_t segment) {
+  for (; id < OBJECT_MAX; id++) {
+    if (AppendObject(id) != 0) return -1;
+    if (locations[id].segment != segment) return id;
+  }
+  return -1;
+}
+
+/**
+ * \returns 1 if object id is in the cache index, with its meta data
+ * stored in meta, 0 otherwise.
+ */
+int LookupObject(int id, struct CacheMeta *meta) {
+  char key[64];
+
+  MakeKey(key, sizeof(key), id);
+  return LookupCacheIndex(key, HashKey(key), meta);
+}
+
+/**
+ * \returns 1 if the content of object id is read from where the cache
+ * index says, 0 otherwise.
+ */
+int IsReadable(int id) {
+  char buf[OBJECT_SIZE];
+  struct CacheMeta meta;
+  const char *content;
+  int ok;
+
+  if (!LookupObject(id, &meta)) return 0;
+  content = PinSegment(&meta.location);
+  if (content == NULL) return 0;
+  MakeContent(buf, id);
+  ok = memcmp(content, buf, OBJECT_SIZE) == 0;
+  UnpinSegment(&meta.location);
+  return ok;
+}
+
+/**
+ * Fill all segments while a reader pins the oldest one. The next full
+ * segment is compacted instead: its live objects move to its start and
+ * stay readable, while entries which no longer point there stay as they
+ * are. Once the reader leaves, the oldest segment is recycled.
+ */
+void TestRecycle() {
+  char key[64];
+  char buf[OBJECT_SIZE];
+  struct CacheMeta meta;
+  int second, third, last, next, end;
+  int created;
+  long compacted, evicted;
+  int ok;
+
+  printf("Recycle:\n");
+  // Objects [0, second) are in segment 0, [second, third) in segment 1,
+  // and last is the first one in the active segment SEG_MAX - 1
+  second = AppendUntilLeave(0, 0);
+  third = second < 0 ? -1 : AppendUntilLeave(second + 1, 1);
+  last = third;
+  for (int i = 2; i < SEG_MAX - 1 && last > 0; i++) {
+    last = AppendUntilLeave(last + 1, i);
+  }
+  Check("objects fill segments in order",
+        second > 0 && third > second &&
+        last > 0 && locations[last].segment == SEG_MAX - 1);
+  if (last < 0) return;
+
+  // A reader pins the oldest segment
+  const char *pinned = PinSegment(&locations[0]);
+  MakeContent(buf, 0);
+  Check("reader pins the oldest segment",
+        pinned != NULL && memcmp(pinned, buf, OBJECT_SIZE) == 0);
+
+  // Keep every 4th object of the second segment, store a newer version of
+  // the 2nd one in its own file, and drop the others
+  for (int i = second; i < third; i++) {
+    MakeKey(key, sizeof(key), i);
+    if ((i - second) % 4 == 0) continue;
+    if (i - second == 1) {
+      memset(&meta, 0, sizeof(meta));
+      meta.size = OBJECT_SIZE;
+      InsertCacheIndex(key, HashKey(key), &meta);
+    }
+    else {
+      RemoveCacheIndex(key, HashKey(key));
+    }
+  }
+
+  // Fill the last segment, the second one is recycled
+  next = AppendUntilLeave(last + 1, SEG_MAX - 1);
+  GetSegmentStats(&created, &compacted, &evicted);
+  Check("all segments created", created == SEG_MAX);
+  Check("pinned segment is not recycled",
+        next > 0 && locations[next].segment == 1 && compacted == 1 &&
+        evicted == 0);
+  ok = memcmp(pinned, buf, OBJECT_SIZE) == 0;
+  for (int i = 0; i < second; i++) {
+    ok = ok && IsReadable(i) && LookupObject(i, &meta) &&
+         meta.location.generation == locations[i].generation;
+  }
+  Check("pinned segment is intact", ok);
+
+  ok = 1;
+  for (int i = second; i < third; i += 4) {
+    ok = ok && LookupObject(i, &meta) && meta.location.segment == 1 &&
+         meta.location.generation == locations[i].generation + 1 &&
+         meta.location.offset <= locations[i].offset;
+  }
+  Check("live objects move to the new generation", ok);
+  ok = 1;
+  for (int i = second; i < third; i += 4) ok = ok && IsReadable(i);
+  Check("live objects are readable after compaction", ok);
+  Check("newer entry is not moved",
+        LookupObject(second + 1, &meta) && meta.location.generation == 0);
+  ok = 1;
+  for (int i = second + 2; i < third; i++) {
+    if ((i - second) % 4 != 0) ok = ok && !LookupObject(i, &meta);
+  }
+  Check("removed entries stay removed", ok);
+  Check("appended object is readable after compaction",
+        next > 0 && IsReadable(next));
+  if (next < 0) return;
+
+  // The reader leaves, the oldest segment is recycled next. All of its
+  // objects are live, which take most of it, so they are evicted.
+  UnpinSegment(&locations[0]);
+  end = AppendUntilLeave(next + 1, 1);
+  GetSegmentStats(&created, &compacted, &evicted);
+  Check("unpinned segment is recycled",
+        end > 0 && locations[end].segment == 0 &&
+        locations[end].generation == locations[0].generation + 1 &&
+        evicted == 1);
+  ok = 1;
+  for (int i = 0; i < second; i++) ok = ok && !LookupObject(i, &meta);
+  Check("evicted objects leave the index", ok);
+  Check("old generation can't be pinned", PinSegment(&locations[0]) == NULL);
+  Check("appended object is readable after eviction",
+        end > 0 && IsReadable(end));
+}
+
+int main() {
+  char path[64];
+
+  if (mkdtemp(seg_dir) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  snprintf(path, sizeof(path), "%s/content", seg_dir);
+  content_fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0644);
+  if (content_fd < 0 || InitCacheIndex(INDEX_SHARD_BITS) != 0) {
+    perror("init");
+    return 1;
+  }
+  snprintf(path, sizeof(path), "%s/", seg_dir);
+  InitSegmentStore(path);
+
+  TestRecycle();
+
+  // Remove the segment files
+  close(content_fd);
+  snprintf(path, sizeof(path), "%s/content", seg_dir);
+  unlink(path);
+  for (int i = 0; i < SEG_MAX; i++) {
+    snprintf(path, sizeof(path), "%s/segment.%d", seg_dir, i);
+    unlink(path);
+  }
+  rmdir(seg_dir);
+  FreeCacheIndex();
+
+  return failures == 0 ? 0 : 1;
+}
@@ -4,13 +4,17 @@
 /* $begin adder */
 #include "csapp.h"
 
-int main(void) {
-  char *buf, *p;
-  char arg1[MAXLINE], arg2[MAXLINE], content[MAXLINE];
+/*
+ * add - make the response body for the arguments "n1&n2" in buf,
+ *     which may be NULL
+ */
+void add(char *buf, char *content) {
+  char *p;
+  char arg1[MAXLINE], arg2[MAXLINE];
   int n1=0, n2=0;
 
   /* Extract the two arguments */
-  if ((buf = getenv("QUERY_STRING")) != NULL) {
+  if (buf != NULL) {
     p = strchr(buf, '&');
     *p = '\0';
     strcpy(arg1, buf);
@@ -25,6 +29,39 @@ int main(void) {
   sprintf(content, "%sThe answer is: %d + %d = %d\r\n<p>", 
           content, n1, n2, n1 + n2);
   sprintf(content, "%sThanks for visiting!\r\n", content);
+}
+
+/*
+ * serve_pool - answer requests framed as "<length>\n<QUERY_STRING>" on
+ *     stdin with "<length>\n<output>" on stdout, as a persistent worker
+ *     of tiny -c
+ */
+void serve_pool(void) {
+  char query[MAXLINE], content[MAXLINE], out[MAXBUF];
+  int len, n;
+
+  while (scanf("%d", &len) == 1 && getchar() == '\n') {
+    if (len < 0 || len >= MAXLINE || fread(query, 1, len, stdin) != len)
+      exit(1);
+    query[len] = '\0';
+    add(query, content);
+    /* tiny decides whether to keep the connection */
+    n = snprintf(out, MAXBUF, "Content-length: %d\r\n"
+                 "Content-type: text/html\r\n\r\n%s",
+                 (int)strlen(content), content);
+    printf("%d\n", n);
+    fwrite(out, 1, n, stdout);
+    fflush(stdout);
+  }
+  exit(0);
+}
+
+int main(void) {
+  char content[MAXLINE];
+
+  if (getenv("TINY_CGI_POOL"))
+    serve_pool();
+  add(getenv("QUERY_STRING"), content);
 
   /* Generate the HTTP response */
   printf("Connection: close\r\n");
@@ -5,31 +5,173 @@
  *
  * Updated 11/2019 droh 
  *   - Fixed sprintf() aliasing issue in serve_static(), and clienterror().
+ *
+ * With -e, tiny serves all connections concurrently from an epoll
+ * event loop instead, with non-blocking I/O and keep-alive, so that it
+ * can be the origin of load tests.
+ *
+ * Static files are kept open with their response headers, and sent with
+ * sendfile.
+ *
+ * With -c, each CGI program runs as persistent workers, which answer
+ * requests framed over a socket pair instead of being forked per request.
  */
 #include "csapp.h"
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+
+#define MAXEVENTS 1024  /* Max events returned by one epoll_wait */
+#define CFILE_SLOTS 1024 /* Slots of the open file table */
+#define CFILE_CHECK_SEC 1 /* An open file is trusted for this long before
+                             it's checked for changes again */
+#define CGI_MAXPROGS 16 /* Max CGI programs with persistent workers */
+#define CGI_MAXWORKERS 16 /* Max persistent workers of a CGI program */
+
+/* Kinds of objects behind epoll events */
+#define EV_CONN 0
+#define EV_CGI 1
+
+/*
+ * cfile_t - an open static file, with its response headers
+ */
+typedef struct {
+  char *filename;
+  int fd;
+  off_t size;
+  dev_t dev;               /* Identify the file, to find it's replaced */
+  ino_t ino;
+  struct timespec mtime;
+  time_t checked;          /* When the file was last checked */
+  char *hdrs[2];           /* Response headers, [1] with keep-alive */
+  int hdrlen[2];
+  int refs;                /* Responses using it, plus 1 in the table */
+} cfile_t;
+
+/*
+ * conn_t - a connection in event mode
+ */
+typedef struct conn {
+  int kind;                /* EV_CONN */
+  int fd;                  /* Connected socket, non-blocking */
+  char inbuf[MAXBUF];      /* Requests read but not handled yet */
+  size_t inlen;            /* Bytes in inbuf */
+  char outbuf[2*MAXBUF];   /* A whole error response */
+  char *out;               /* Response headers: outbuf, or of file */
+  size_t outlen, outpos;   /* Bytes of out, and bytes of them sent */
+  cfile_t *file;           /* File of a static response, or NULL */
+  off_t fileoff;           /* Bytes of the file sent */
+  int keep_alive;          /* Keep the connection after the response */
+  int eof;                 /* Client has closed its side */
+  uint32_t events;         /* Events the connection waits for */
+  int waiting;             /* Waits for the answer of a CGI worker */
+  struct cgipool *cgipool; /* Pool it waits in, while waiting */
+  struct cgiworker *cgi;   /* Worker answering it, or NULL if queued */
+  struct conn *next;       /* Next in the queue of cgipool */
+} conn_t;
+
+/*
+ * cgiworker_t - a persistent CGI process, which answers one request at
+ *     a time over a socket pair: tiny writes "<length>\n<QUERY_STRING>",
+ *     and the program answers "<length>\n<output>", where output is what
+ *     it would print as a plain CGI program
+ */
+typedef struct cgiworker {
+  int kind;                /* EV_CGI */
+  struct cgipool *pool;    /* Pool it belongs to */
+  pid_t pid;
+  int fd;                  /* Our end of the socket pair, or -1 */
+  conn_t *conn;            /* Connection it answers, or NULL if idle */
+  char buf[MAXBUF+32];     /* Answer read so far, '\0' terminated */
+  size_t len;              /* Bytes in buf */
+} cgiworker_t;
+
+/*
+ * cgipool_t - the persistent workers of a CGI program
+ */
+typedef struct cgipool {
+  char filename[MAXLINE];
+  cgiworker_t workers[CGI_MAXWORKERS];
+  conn_t *head, *tail;     /* Connections waiting for an idle worker */
+  int next;                /* Next worker to use in iterative mode */
+} cgipool_t;
+
+int epfd = -1;             /* The epoll instance in event mode, or -1 */
+int cgi_workers = 0;       /* Workers per CGI program, 0 to fork */
+cgipool_t *cgipools[CGI_MAXPROGS];
 
 void doit(int fd);
 void read_requesthdrs(rio_t *rp);
 int parse_uri(char *uri, char *filename, char *cgiargs);
-void serve_static(int fd, char *filename, int filesize);
+void serve_static(int fd, cfile_t *f);
 void get_filetype(char *filename, char *filetype);
 void serve_dynamic(int fd, char *filename, char *cgiargs);
 void clienterror(int fd, char *cause, char *errnum, 
                  char *shortmsg, char *longmsg);
+int build_static_headers(char *buf, char *filename, int filesize,
+                         int keep_alive);
+cfile_t *cfile_open(char *filename);
+void cfile_close(cfile_t *f);
+int build_error(char *buf, char *cause, char *errnum,
+                char *shortmsg, char *longmsg, int keep_alive);
+void serve_events(int listenfd);
+void accept_conns(int listenfd);
+int handle_conn(conn_t *c);
+int handle_request(conn_t *c, char *req);
+int send_response(conn_t *c);
+int is_pending(conn_t *c);
+void watch_conn(conn_t *c);
+void close_conn(conn_t *c);
+void sigchld_handler(int sig);
+void cgi_init(void);
+cgipool_t *cgi_pool(char *filename);
+int cgi_spawn(cgiworker_t *w);
+void cgi_stop(cgiworker_t *w);
+int cgi_send(cgiworker_t *w, char *cgiargs);
+int cgi_parse(cgiworker_t *w, char **out, size_t *outlen);
+int build_cgi_response(char *buf, char *out, size_t outlen,
+                       int *keep_alive);
+void serve_cgi(int fd, char *filename, char *cgiargs);
+void cgi_submit(conn_t *c, char *filename, char *cgiargs);
+void cgi_dispatch(cgipool_t *pool);
+void handle_cgi(cgiworker_t *w);
+void cgi_finish(cgiworker_t *w, char *out, size_t outlen);
 
 int main(int argc, char **argv) {
   int listenfd, connfd;
   char hostname[MAXLINE], port[MAXLINE];
   socklen_t clientlen;
   struct sockaddr_storage clientaddr;
+  int opt, event_mode = 0;
 
   /* Check command line args */
-  if (argc != 2) {
-    fprintf(stderr, "usage: %s <port>\n", argv[0]);
+  while ((opt = getopt(argc, argv, "c:e")) != -1) {
+    switch (opt) {
+    case 'c':
+      cgi_workers = atoi(optarg);
+      if (cgi_workers < 1 || cgi_workers > CGI_MAXWORKERS) {
+        fprintf(stderr, "%s: CGI workers should be 1 to %d\n", argv[0],
+                CGI_MAXWORKERS);
+        exit(1);
+      }
+      break;
+    case 'e':
+      event_mode = 1;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-c workers] [-e] <port>\n", argv[0]);
+      exit(1);
+    }
+  }
+  if (optind != argc-1) {
+    fprintf(stderr, "usage: %s [-c workers] [-e] <port>\n", argv[0]);
     exit(1);
   }
 
-  listenfd = Open_listenfd(argv[1]);
+  listenfd = Open_listenfd(argv[optind]);
+  if (event_mode)
+    serve_events(listenfd);
+  if (cgi_workers > 0)
+    cgi_init();
   while (1) {
     clientlen = sizeof(clientaddr);
     connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
@@ -52,6 +194,7 @@ void doit(int fd) {
   char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
   char filename[MAXLINE], cgiargs[MAXLINE];
   rio_t rio;
+  cfile_t *f;
 
   /* Read request line and headers */
   Rio_readinitb(&rio, fd);
@@ -68,28 +211,37 @@ void doit(int fd) {
 
   /* Parse URI from GET request */
   is_static = parse_uri(uri, filename, cgiargs);
+  if (is_static) { /* Serve static content */          
+    if ((f = cfile_open(filename)) == NULL) {
+      if (errno == ENOENT || errno == ENOTDIR)
+        clienterror(fd, filename, "404", "Not found",
+                    "Tiny couldn't find this file");
+      else
+        clienterror(fd, filename, "403", "Forbidden",
+                    "Tiny couldn't read the file");
+      return;
+    }
+    serve_static(fd, f);
+    cfile_close(f);
+    return;
+  }
+
   if (stat(filename, &sbuf) < 0) {
     clienterror(fd, filename, "404", "Not found",
                 "Tiny couldn't find this file");
     return;
   }
 
-  if (is_static) { /* Serve static content */          
-    if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-      clienterror(fd, filename, "403", "Forbidden",
-                  "Tiny couldn't read the file");
-      return;
-    }
-    serve_static(fd, filename, sbuf.st_size);
+  /* Serve dynamic content */
+  if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
+    clienterror(fd, filename, "403", "Forbidden",
+                "Tiny couldn't run the CGI program");
+    return;
   }
-  else { /* Serve dynamic content */
-    if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
-      clienterror(fd, filename, "403", "Forbidden",
-                  "Tiny couldn't run the CGI program");
-      return;
-    }
+  if (cgi_workers > 0)
+    serve_cgi(fd, filename, cgiargs);
+  else
     serve_dynamic(fd, filename, cgiargs);
-  }
 }
 /* $end doit */
 
@@ -145,27 +297,126 @@ int parse_uri(char *uri, char *filename, char *cgiargs) {
  * serve_static - copy a file back to the client 
  */
 /* $begin serve_static */
-void serve_static(int fd, char *filename, int filesize) {
-  int srcfd;
-  char *srcp, filetype[MAXLINE], buf[2*MAXBUF];
+void serve_static(int fd, cfile_t *f) {
+  ssize_t n;
+  off_t off;
+
+  /* Send response headers to client; MSG_MORE holds them back to go
+     out in the same packet as the body */
+  for (off = 0; off < f->hdrlen[0]; off += n) {
+    n = send(fd, f->hdrs[0] + off, f->hdrlen[0] - off, MSG_MORE);
+    if (n < 0 && errno != EINTR)
+      return;
+    if (n < 0)
+      n = 0;
+  }
+
+  /* Send response body to client, without copying it to user space */
+  off = 0;
+  while (off < f->size) {
+    n = sendfile(fd, f->fd, &off, f->size - off);
+    if (n == 0 || (n < 0 && errno != EINTR))  /* Truncated, or error */
+      return;
+  }
+}
+
+/*
+ * build_static_headers - write the response headers of a file to buf,
+ *     and return their length
+ */
+int build_static_headers(char *buf, char *filename, int filesize,
+                         int keep_alive) {
+  char filetype[MAXLINE];
 
-  /* Send response headers to client */
   get_filetype(filename, filetype);
-  sprintf(buf, "HTTP/1.0 200 OK\r\n");
-  Rio_writen(fd, buf, strlen(buf));
-  sprintf(buf, "Server: Tiny Web Server\r\n");
-  Rio_writen(fd, buf, strlen(buf));
-  sprintf(buf, "Content-length: %d\r\n", filesize);
-  Rio_writen(fd, buf, strlen(buf));
-  sprintf(buf, "Content-type: %s\r\n\r\n", filetype);
-  Rio_writen(fd, buf, strlen(buf));
+  return sprintf(buf, "HTTP/1.0 200 OK\r\n"
+                 "Server: Tiny Web Server\r\n"
+                 "%s"
+                 "Content-length: %d\r\n"
+                 "Content-type: %s\r\n\r\n",
+                 keep_alive ? "Connection: keep-alive\r\n" : "",
+                 filesize, filetype);
+}
 
-  /* Send response body to client */
-  srcfd = Open(filename, O_RDONLY, 0);
-  srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
-  Close(srcfd);
-  Rio_writen(fd, srcp, filesize);
-  Munmap(srcp, filesize);
+/*
+ * cfile_open - find the open file of filename in the table, or open it;
+ *     return NULL with errno set if it can't be served. A file in the
+ *     table is checked for changes at most once every CFILE_CHECK_SEC.
+ */
+/* $begin cfile_open */
+cfile_t *cfile_open(char *filename) {
+  static cfile_t *cfiles[CFILE_SLOTS];
+  unsigned int hash = 5381, slot;
+  char buf[2*MAXBUF];
+  struct stat sbuf;
+  cfile_t *f;
+  time_t now = time(NULL);
+  char *p;
+  int fd;
+
+  for (p = filename; *p; p++)
+    hash = hash * 33 + (unsigned char)*p;
+  slot = hash % CFILE_SLOTS;
+
+  /* Use the open file, unless it's changed or gone */
+  f = cfiles[slot];
+  if (f && !strcmp(f->filename, filename)) {
+    if (now - f->checked < CFILE_CHECK_SEC ||
+        (stat(filename, &sbuf) == 0 && sbuf.st_dev == f->dev &&
+         sbuf.st_ino == f->ino && sbuf.st_size == f->size &&
+         sbuf.st_mtim.tv_sec == f->mtime.tv_sec &&
+         sbuf.st_mtim.tv_nsec == f->mtime.tv_nsec)) {
+      f->checked = now;
+      f->refs++;
+      return f;
+    }
+  }
+
+  /* Open the file, and build its response headers once */
+  if ((fd = open(filename, O_RDONLY | O_CLOEXEC, 0)) < 0)
+    return NULL;
+  if (fstat(fd, &sbuf) < 0 || !(S_ISREG(sbuf.st_mode)) ||
+      !(S_IRUSR & sbuf.st_mode)) {
+    close(fd);
+    errno = EACCES;
+    return NULL;
+  }
+  f = Malloc(sizeof(cfile_t));
+  f->filename = Malloc(strlen(filename) + 1);
+  strcpy(f->filename, filename);
+  f->fd = fd;
+  f->size = sbuf.st_size;
+  f->dev = sbuf.st_dev;
+  f->ino = sbuf.st_ino;
+  f->mtime = sbuf.st_mtim;
+  f->checked = now;
+  f->hdrlen[0] = build_static_headers(buf, filename, f->size, 0);
+  f->hdrlen[1] = build_static_headers(buf + f->hdrlen[0], filename,
+                                      f->size, 1);
+  f->hdrs[0] = Malloc(f->hdrlen[0] + f->hdrlen[1]);
+  memcpy(f->hdrs[0], buf, f->hdrlen[0] + f->hdrlen[1]);
+  f->hdrs[1] = f->hdrs[0] + f->hdrlen[0];
+  f->refs = 2;
+
+  /* Replace the file in the slot, which is freed once the responses
+     using it are sent */
+  if (cfiles[slot])
+    cfile_close(cfiles[slot]);
+  cfiles[slot] = f;
+  return f;
+}
+/* $end cfile_open */
+
+/*
+ * cfile_close - release a file from cfile_open
+ */
+void cfile_close(cfile_t *f) {
+  if (--f->refs > 0)
+    return;
+  Close(f->fd);
+  Free(f->hdrs[0]);
+  Free(f->filename);
+  Free(f);
 }
 
 /*
@@ -214,24 +465,682 @@ void serve_dynamic(int fd, char *filename, char *cgiargs) {
 /* $begin clienterror */
 void clienterror(int fd, char *cause, char *errnum, 
                  char *shortmsg, char *longmsg) {
-  char buf[MAXLINE];
+  char buf[2*MAXBUF];
 
-  /* Print the HTTP response headers */
-  sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-  Rio_writen(fd, buf, strlen(buf));
-  sprintf(buf, "Content-type: text/html\r\n\r\n");
-  Rio_writen(fd, buf, strlen(buf));
-
-  /* Print the HTTP response body */
-  sprintf(buf, "<html><title>Tiny Error</title>");
-  Rio_writen(fd, buf, strlen(buf));
-  sprintf(buf, "<body bgcolor=""ffffff"">\r\n");
-  Rio_writen(fd, buf, strlen(buf));
-  sprintf(buf, "%s: %s\r\n", errnum, shortmsg);
-  Rio_writen(fd, buf, strlen(buf));
-  sprintf(buf, "<p>%s: %s\r\n", longmsg, cause);
-  Rio_writen(fd, buf, strlen(buf));
-  sprintf(buf, "<hr><em>The Tiny Web server</em>\r\n");
-  Rio_writen(fd, buf, strlen(buf));
+  Rio_writen(fd, buf, build_error(buf, cause, errnum, shortmsg, longmsg, 0));
 }
 /* $end clienterror */
+
+/*
+ * build_error - write an error response to buf, and return its length
+ */
+int build_error(char *buf, char *cause, char *errnum,
+                char *shortmsg, char *longmsg, int keep_alive) {
+  char body[MAXBUF];
+  int bodylen;
+
+  /* Build the HTTP response body */
+  bodylen = snprintf(body, MAXBUF, "<html><title>Tiny Error</title>"
+                     "<body bgcolor=""ffffff"">\r\n"
+                     "%s: %s\r\n"
+                     "<p>%s: %s\r\n"
+                     "<hr><em>The Tiny Web server</em>\r\n",
+                     errnum, shortmsg, longmsg, cause);
+  if (bodylen >= MAXBUF)
+    bodylen = MAXBUF - 1;
+
+  /* Build the HTTP response headers */
+  return sprintf(buf, "HTTP/1.0 %s %s\r\n"
+                 "%s"
+                 "Content-length: %d\r\n"
+                 "Content-type: text/html\r\n\r\n%s",
+                 errnum, shortmsg,
+                 keep_alive ? "Connection: keep-alive\r\n" : "",
+                 bodylen, body);
+}
+
+/*
+ * serve_events - serve all connections from an epoll event loop
+ */
+/* $begin serve_events */
+void serve_events(int listenfd) {
+  int n, i;
+  struct epoll_event ev, events[MAXEVENTS];
+  conn_t *c;
+
+  Signal(SIGPIPE, SIG_IGN);
+  Signal(SIGCHLD, sigchld_handler); /* CGI children are reaped here */
+
+  if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    unix_error("epoll_create1 error");
+  fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+  fcntl(listenfd, F_SETFD, FD_CLOEXEC);
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;   /* The listening socket has no connection */
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+    unix_error("epoll_ctl error");
+  if (cgi_workers > 0)
+    cgi_init();
+
+  while (1) {
+    n = epoll_wait(epfd, events, MAXEVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      unix_error("epoll_wait error");
+    }
+    for (i = 0; i < n; i++) {
+      c = events[i].data.ptr;
+      if (c == NULL) {
+        accept_conns(listenfd);
+        continue;
+      }
+      if (c->kind == EV_CGI) {
+        handle_cgi(events[i].data.ptr);
+        continue;
+      }
+      /* Only a hang-up is reported while waiting for a CGI worker */
+      if ((c->waiting && (events[i].events & (EPOLLERR | EPOLLHUP))) ||
+          handle_conn(c) < 0) {
+        close_conn(c);
+        continue;
+      }
+      watch_conn(c);
+    }
+  }
+}
+/* $end serve_events */
+
+/*
+ * accept_conns - accept all pending connections
+ */
+void accept_conns(int listenfd) {
+  int connfd;
+  struct epoll_event ev;
+  conn_t *c;
+
+  while ((connfd = accept(listenfd, NULL, NULL)) >= 0) {
+    fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL) | O_NONBLOCK);
+    fcntl(connfd, F_SETFD, FD_CLOEXEC);
+    c = Malloc(sizeof(conn_t));
+    c->kind = EV_CONN;
+    c->fd = connfd;
+    c->inlen = c->outlen = c->outpos = 0;
+    c->file = NULL;
+    c->keep_alive = c->eof = 0;
+    c->waiting = 0;
+    c->events = ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+      Close(connfd);
+      Free(c);
+    }
+  }
+  /* EAGAIN when no more connections are pending; otherwise, e.g. out of
+     fds, retry when the listening socket is reported again */
+}
+
+/*
+ * handle_conn - read requests of a ready connection and send their
+ *     responses; return -1 if the connection should be closed
+ */
+/* $begin handle_conn */
+int handle_conn(conn_t *c) {
+  ssize_t n;
+  char req[MAXBUF];
+  size_t reqlen;
+
+  /* Read what has arrived, as long as there is room */
+  while (!c->eof && c->inlen < MAXBUF) {
+    n = read(c->fd, c->inbuf + c->inlen, MAXBUF - c->inlen);
+    if (n > 0)
+      c->inlen += n;
+    else if (n == 0)
+      c->eof = 1;
+    else if (errno == EAGAIN || errno == EWOULDBLOCK)
+      break;
+    else if (errno != EINTR)
+      return -1;
+  }
+
+  while (1) {
+    /* Finish the pending response first, keeping requests in order */
+    if (c->waiting)
+      return 0;
+    if (is_pending(c)) {
+      if (send_response(c) < 0)
+        return -1;
+      if (is_pending(c))
+        return 0;
+      if (!c->keep_alive)
+        return -1;
+    }
+
+    /* Handle the next request once all its headers have arrived */
+    for (reqlen = 4; reqlen <= c->inlen; reqlen++) {
+      if (!memcmp(c->inbuf + reqlen - 4, "\r\n\r\n", 4))
+        break;
+    }
+    if (reqlen > c->inlen) {
+      if (c->eof || c->inlen == MAXBUF)   /* Closed, or headers too long */
+        return -1;
+      return 0;
+    }
+    memcpy(req, c->inbuf, reqlen - 2);
+    req[reqlen - 2] = '\0';
+    c->inlen -= reqlen;
+    memmove(c->inbuf, c->inbuf + reqlen, c->inlen);
+    if (handle_request(c, req) < 0)
+      return -1;
+  }
+}
+/* $end handle_conn */
+
+/*
+ * handle_request - build the response of a request in req, which holds
+ *     its request line and headers, each ending with "\r\n"; return -1
+ *     if the connection is handed to a CGI program
+ */
+/* $begin handle_request */
+int handle_request(conn_t *c, char *req) {
+  struct stat sbuf;
+  char method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+  char filename[MAXLINE], cgiargs[MAXLINE];
+  char *hdr, *emptylist[] = { NULL };
+
+  c->out = c->outbuf;
+  c->outlen = c->outpos = 0;
+  if (sscanf(req, "%s %s %s", method, uri, version) != 3) {
+    c->keep_alive = 0;
+    c->outlen = build_error(c->outbuf, req, "400", "Bad Request",
+                            "Tiny couldn't parse the request", 0);
+    return 0;
+  }
+
+  /* HTTP/1.1 keeps the connection by default, HTTP/1.0 only if asked */
+  c->keep_alive = !strcasecmp(version, "HTTP/1.1");
+  for (hdr = strstr(req, "\r\n"); hdr; hdr = strstr(hdr + 2, "\r\n")) {
+    if (strncasecmp(hdr + 2, "Connection:", 11))
+      continue;
+    hdr += 2 + 11;
+    hdr += strspn(hdr, " \t");
+    if (!strncasecmp(hdr, "close", 5))
+      c->keep_alive = 0;
+    else if (!strncasecmp(hdr, "keep-alive", 10))
+      c->keep_alive = 1;
+    break;
+  }
+
+  if (strcasecmp(method, "GET")) {
+    c->keep_alive = 0;    /* The request body, if any, is not read */
+    c->outlen = build_error(c->outbuf, method, "501", "Not Implemented",
+                            "Tiny does not implement this method", 0);
+    return 0;
+  }
+
+  /* Parse URI from GET request */
+  if (parse_uri(uri, filename, cgiargs)) {  /* Static content */
+    if ((c->file = cfile_open(filename)) == NULL) {
+      if (errno == ENOENT || errno == ENOTDIR)
+        c->outlen = build_error(c->outbuf, filename, "404", "Not found",
+                                "Tiny couldn't find this file",
+                                c->keep_alive);
+      else
+        c->outlen = build_error(c->outbuf, filename, "403", "Forbidden",
+                                "Tiny couldn't read the file",
+                                c->keep_alive);
+      return 0;
+    }
+    c->out = c->file->hdrs[c->keep_alive];
+    c->outlen = c->file->hdrlen[c->keep_alive];
+    c->fileoff = 0;
+    return 0;
+  }
+
+  /* Dynamic content */
+  if (stat(filename, &sbuf) < 0 || !(S_ISREG(sbuf.st_mode)) ||
+      !(S_IXUSR & sbuf.st_mode)) {
+    c->keep_alive = 0;
+    c->outlen = build_error(c->outbuf, filename, "403", "Forbidden",
+                            "Tiny couldn't run the CGI program", 0);
+    return 0;
+  }
+  if (cgi_workers > 0) {
+    cgi_submit(c, filename, cgiargs);
+    return 0;
+  }
+
+  /* The CGI program writes the rest of the response, and the end of it
+     is where the program exits, so it gets the connection to itself */
+  fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) & ~O_NONBLOCK);
+  if (Fork() == 0) { /* Child */
+    sprintf(c->outbuf, "HTTP/1.0 200 OK\r\nServer: Tiny Web Server\r\n");
+    Rio_writen(c->fd, c->outbuf, strlen(c->outbuf));
+    Signal(SIGPIPE, SIG_DFL);
+    setenv("QUERY_STRING", cgiargs, 1);
+    Dup2(c->fd, STDOUT_FILENO);           /* Redirect stdout to client */
+    Execve(filename, emptylist, environ); /* Run CGI program */
+  }
+  return -1;
+}
+/* $end handle_request */
+
+/*
+ * send_response - send as much of the pending response as the socket
+ *     takes; return -1 on error
+ */
+int send_response(conn_t *c) {
+  ssize_t n;
+
+  while (is_pending(c)) {
+    if (c->outpos < c->outlen) {
+      /* MSG_MORE holds back the headers to go out in the same packet as
+         the start of the file */
+      n = send(c->fd, c->out + c->outpos, c->outlen - c->outpos,
+               c->file && c->file->size > 0 ? MSG_MORE : 0);
+      if (n > 0)
+        c->outpos += n;
+    }
+    else {
+      n = sendfile(c->fd, c->file->fd, &c->fileoff,
+                   c->file->size - c->fileoff);
+      if (n == 0)   /* The file is truncated */
+        return -1;
+    }
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0;
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+  }
+
+  if (c->file) {
+    cfile_close(c->file);
+    c->file = NULL;
+  }
+  return 0;
+}
+
+/*
+ * is_pending - return 1 if the response is not sent completely
+ */
+int is_pending(conn_t *c) {
+  return c->outpos < c->outlen || (c->file && c->fileoff < c->file->size);
+}
+
+/*
+ * watch_conn - wait for the events a connection needs next: none while
+ *     it waits for a CGI worker, writable while a response is pending,
+ *     and readable otherwise
+ */
+void watch_conn(conn_t *c) {
+  struct epoll_event ev;
+
+  ev.events = c->waiting ? 0 : is_pending(c) ? EPOLLOUT : EPOLLIN;
+  if (ev.events != c->events) {
+    ev.data.ptr = c;
+    c->events = ev.events;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+  }
+}
+
+/*
+ * close_conn - close a connection and free its state
+ */
+void close_conn(conn_t *c) {
+  conn_t *p, *prev = NULL;
+
+  if (c->waiting && c->cgi) {
+    c->cgi->conn = NULL;    /* The answer of the worker is dropped */
+  }
+  else if (c->waiting) {    /* Leave the queue */
+    for (p = c->cgipool->head; p != c; prev = p, p = p->next)
+      ;
+    if (prev)
+      prev->next = c->next;
+    else
+      c->cgipool->head = c->next;
+    if (c->cgipool->tail == c)
+      c->cgipool->tail = prev;
+  }
+  if (c->file)
+    cfile_close(c->file);
+  /* A CGI child may still hold the socket, which keeps it in epfd
+     after it's closed here */
+  epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+  Close(c->fd);
+  Free(c);
+}
+
+/*
+ * sigchld_handler - reap all terminated CGI children
+ */
+void sigchld_handler(int sig) {
+  int olderrno = errno;
+
+  while (waitpid(-1, NULL, WNOHANG) > 0)
+    ;
+  errno = olderrno;
+}
+
+/*
+ * cgi_init - start the persistent workers of every CGI program
+ */
+void cgi_init(void) {
+  DIR *dir;
+  struct dirent *ent;
+  struct stat sbuf;
+  char filename[MAXLINE];
+
+  Signal(SIGPIPE, SIG_IGN);         /* A worker may die while written to */
+  Signal(SIGCHLD, sigchld_handler); /* Dead workers are reaped here */
+  if ((dir = opendir("./cgi-bin")) == NULL)
+    return;
+  while ((ent = readdir(dir)) != NULL) {
+    snprintf(filename, MAXLINE, "./cgi-bin/%s", ent->d_name);
+    if (stat(filename, &sbuf) == 0 && S_ISREG(sbuf.st_mode) &&
+        (S_IXUSR & sbuf.st_mode))
+      cgi_pool(filename);
+  }
+  closedir(dir);
+}
+
+/*
+ * cgi_pool - find the pool of a CGI program, or start one; return NULL
+ *     if there are CGI_MAXPROGS pools already
+ */
+cgipool_t *cgi_pool(char *filename) {
+  cgipool_t *pool;
+  int i, j;
+
+  for (i = 0; i < CGI_MAXPROGS && cgipools[i]; i++) {
+    if (!strcmp(cgipools[i]->filename, filename))
+      return cgipools[i];
+  }
+  if (i == CGI_MAXPROGS)
+    return NULL;
+
+  pool = Calloc(1, sizeof(cgipool_t));
+  strcpy(pool->filename, filename);
+  for (j = 0; j < cgi_workers; j++) {
+    pool->workers[j].kind = EV_CGI;
+    pool->workers[j].pool = pool;
+    pool->workers[j].fd = -1;
+    cgi_spawn(&pool->workers[j]);
+  }
+  cgipools[i] = pool;
+  return pool;
+}
+
+/*
+ * cgi_spawn - start the process of a worker, stopping the old one if
+ *     any; return -1 on error
+ */
+/* $begin cgi_spawn */
+int cgi_spawn(cgiworker_t *w) {
+  int sv[2], fd;
+  char *emptylist[] = { NULL };
+  struct epoll_event ev;
+
+  cgi_stop(w);
+
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+    return -1;
+  if ((w->pid = fork()) < 0) {
+    Close(sv[0]);
+    Close(sv[1]);
+    return -1;
+  }
+  if (w->pid == 0) { /* Child */
+    Dup2(sv[1], STDIN_FILENO);
+    Dup2(sv[1], STDOUT_FILENO);
+    /* Connections of iterative mode are not closed on exec */
+    for (fd = 3; fd < getdtablesize(); fd++)
+      close(fd);
+    Signal(SIGPIPE, SIG_DFL);
+    setenv("TINY_CGI_POOL", "1", 1);
+    Execve(w->pool->filename, emptylist, environ);
+  }
+  Close(sv[1]);
+  w->fd = sv[0];
+
+  if (epfd >= 0) {
+    fcntl(w->fd, F_SETFL, fcntl(w->fd, F_GETFL) | O_NONBLOCK);
+    ev.events = EPOLLIN;
+    ev.data.ptr = w;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, w->fd, &ev);
+  }
+  return 0;
+}
+/* $end cgi_spawn */
+
+/*
+ * cgi_stop - stop the process of a worker, which is started again when
+ *     a request needs it, so that a program that keeps failing is not
+ *     restarted in a busy loop
+ */
+void cgi_stop(cgiworker_t *w) {
+  if (w->fd >= 0) {
+    kill(w->pid, SIGKILL);
+    if (epfd >= 0)
+      epoll_ctl(epfd, EPOLL_CTL_DEL, w->fd, NULL);
+    Close(w->fd);
+    w->fd = -1;
+  }
+  w->len = 0;
+}
+
+/*
+ * cgi_send - send a request to an idle worker; return -1 on error
+ */
+int cgi_send(cgiworker_t *w, char *cgiargs) {
+  char buf[MAXLINE+16];
+  int n;
+
+  /* The frame is far smaller than the socket buffer, which is empty as
+     the worker is idle, so it's sent at once even if non-blocking */
+  n = snprintf(buf, sizeof(buf), "%d\n%s", (int)strlen(cgiargs), cgiargs);
+  w->len = 0;
+  return rio_writen(w->fd, buf, n) == n ? 0 : -1;
+}
+
+/*
+ * cgi_parse - find the output in the answer read by a worker; return 1
+ *     and set out and outlen if it's complete, 0 if not yet, or -1 if
+ *     it's malformed
+ */
+int cgi_parse(cgiworker_t *w, char **out, size_t *outlen) {
+  char *p, *nl = memchr(w->buf, '\n', w->len);
+  size_t len = 0;
+
+  if (nl == NULL)
+    return w->len > 16 ? -1 : 0;
+  if (nl == w->buf)
+    return -1;
+  for (p = w->buf; p < nl; p++) {
+    if (!isdigit((unsigned char)*p) || (len = len*10 + *p-'0') > MAXBUF)
+      return -1;
+  }
+  *out = nl + 1;
+  *outlen = len;
+  return w->buf + w->len - *out >= len ? 1 : 0;
+}
+
+/*
+ * build_cgi_response - write the response of a CGI output to buf, and
+ *     return its length. The connection is kept only if keep_alive is
+ *     asked and the output tells its Content-length.
+ */
+int build_cgi_response(char *buf, char *out, size_t outlen,
+                       int *keep_alive) {
+  char *p = out;
+  int n, has_length = 0;
+
+  /* Look for Content-length in the headers of out */
+  while (p < out + outlen && strncmp(p, "\r\n", 2)) {
+    if (!strncasecmp(p, "Content-length:", 15))
+      has_length = 1;
+    if ((p = memchr(p, '\n', out + outlen - p)) == NULL)
+      break;
+    p++;
+  }
+  *keep_alive = *keep_alive && has_length;
+
+  n = sprintf(buf, "HTTP/1.0 200 OK\r\nServer: Tiny Web Server\r\n%s",
+              *keep_alive ? "Connection: keep-alive\r\n" : "");
+  memcpy(buf + n, out, outlen);
+  return n + outlen;
+}
+
+/*
+ * serve_cgi - answer a dynamic request with a persistent worker, in
+ *     iterative mode
+ */
+/* $begin serve_cgi */
+void serve_cgi(int fd, char *filename, char *cgiargs) {
+  cgipool_t *pool;
+  cgiworker_t *w;
+  char buf[2*MAXBUF], *out;
+  size_t outlen;
+  ssize_t n;
+  int keep_alive = 0, ok = -1;
+
+  if ((pool = cgi_pool(filename)) == NULL) {
+    clienterror(fd, filename, "503", "Service Unavailable",
+                "Tiny runs too many CGI programs");
+    return;
+  }
+  w = &pool->workers[pool->next++ % cgi_workers];
+
+  if ((w->fd >= 0 || cgi_spawn(w) == 0) && cgi_send(w, cgiargs) == 0) {
+    while ((ok = cgi_parse(w, &out, &outlen)) == 0) {
+      n = read(w->fd, w->buf + w->len, sizeof(w->buf) - 1 - w->len);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0) {
+        ok = -1;
+        break;
+      }
+      w->len += n;
+      w->buf[w->len] = '\0';
+    }
+  }
+  if (ok < 0) {
+    cgi_stop(w);
+    clienterror(fd, filename, "502", "Bad Gateway",
+                "Tiny got no answer from the CGI program");
+    return;
+  }
+  Rio_writen(fd, buf, build_cgi_response(buf, out, outlen, &keep_alive));
+  w->len = 0;
+}
+/* $end serve_cgi */
+
+/*
+ * cgi_submit - queue a dynamic request of a connection for a worker, in
+ *     event mode
+ */
+void cgi_submit(conn_t *c, char *filename, char *cgiargs) {
+  cgipool_t *pool;
+
+  if ((pool = cgi_pool(filename)) == NULL) {
+    c->outlen = build_error(c->outbuf, filename, "503",
+                            "Service Unavailable",
+                            "Tiny runs too many CGI programs",
+                            c->keep_alive);
+    return;
+  }
+
+  strcpy(c->outbuf, cgiargs);   /* Kept here until a worker takes it */
+  c->waiting = 1;
+  c->cgipool = pool;
+  c->cgi = NULL;
+  c->next = NULL;
+  if (pool->tail)
+    pool->tail->next = c;
+  else
+    pool->head = c;
+  pool->tail = c;
+  cgi_dispatch(pool);
+}
+
+/*
+ * cgi_dispatch - hand the waiting connections of a pool to its idle
+ *     workers
+ */
+void cgi_dispatch(cgipool_t *pool) {
+  cgiworker_t *w;
+  conn_t *c;
+  int i;
+
+  for (i = 0; i < cgi_workers && pool->head; i++) {
+    w = &pool->workers[i];
+    if (w->conn)
+      continue;
+    c = pool->head;
+    pool->head = c->next;
+    if (pool->head == NULL)
+      pool->tail = NULL;
+    w->conn = c;
+    c->cgi = w;
+    if ((w->fd < 0 && cgi_spawn(w) < 0) || cgi_send(w, c->outbuf) < 0)
+      cgi_finish(w, NULL, 0);
+  }
+}
+
+/*
+ * handle_cgi - read the answer of a worker that is ready, in event mode
+ */
+void handle_cgi(cgiworker_t *w) {
+  char *out = NULL;
+  size_t outlen = 0;
+  ssize_t n;
+  int ok;
+
+  n = read(w->fd, w->buf + w->len, sizeof(w->buf) - 1 - w->len);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return;
+  if (n > 0) {
+    w->len += n;
+    w->buf[w->len] = '\0';
+    if ((ok = cgi_parse(w, &out, &outlen)) == 0)
+      return;
+  }
+  else {
+    ok = -1;    /* The worker has exited */
+  }
+  cgi_finish(w, ok > 0 ? out : NULL, outlen);
+}
+
+/*
+ * cgi_finish - end the request of a worker with the answer out, or with
+ *     an error if out is NULL, in which case the worker is stopped.
+ *     The connection, if still open, is waited for to be writable, and
+ *     sent the response there.
+ */
+void cgi_finish(cgiworker_t *w, char *out, size_t outlen) {
+  conn_t *c = w->conn;
+
+  w->conn = NULL;
+  if (c) {
+    c->waiting = 0;
+    c->cgi = NULL;
+    c->out = c->outbuf;
+    c->outpos = 0;
+    if (out)
+      c->outlen = build_cgi_response(c->outbuf, out, outlen,
+                                     &c->keep_alive);
+    else
+      c->outlen = build_error(c->outbuf, w->pool->filename, "502",
+                              "Bad Gateway",
+                              "Tiny got no answer from the CGI program",
+                              c->keep_alive);
+    watch_conn(c);
+  }
+  w->len = 0;
+  if (out == NULL)
+    cgi_stop(w);
+  cgi_dispatch(w->pool);
+}
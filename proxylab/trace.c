@@ -0,0 +1,114 @@
+#include "trace.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static int trace_enabled = 0;
+static int64_t slow_ns = 0;
+/* [TRACE_ACCEPTED] holds the total time, others the stage ending there */
+static atomic_long histograms[TRACE_STAGE_NUM][TRACE_BUCKETS];
+
+static const char *stage_names[TRACE_STAGE_NUM] = {
+  "total", "handoff", "pickup", "parse",
+  "connect", "first byte", "relay", "cache write"
+};
+
+void SetTraceThreshold(int slow_ms) {
+  trace_enabled = 1;
+  slow_ns = (int64_t)slow_ms * 1000000;
+}
+
+int IsTraceEnabled() {
+  return trace_enabled;
+}
+
+int64_t GetTraceTime() {
+  struct timespec ts;
+
+  if (!trace_enabled) return 0;
+  /// The coarse clock ticks every few ms, which is longer than most stages
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void StartTrace(struct RequestTrace *trace, int64_t accepted_ns) {
+  memset(trace, 0, sizeof(*trace));
+  if (accepted_ns == 0) return;
+
+  trace->stamps[TRACE_ACCEPTED] = accepted_ns;
+  trace->stamps[TRACE_ASSIGNED] = GetTraceTime();
+}
+
+void TraceRequest(struct RequestTrace *trace, enum TraceStage stage) {
+  if (trace->stamps[TRACE_ACCEPTED] == 0 || trace->stamps[stage] != 0)
+    return;
+  trace->stamps[stage] = GetTraceTime();
+}
+
+/**
+ * Count a duration in the histogram of stage.
+ */
+static void AddSample(enum TraceStage stage, int64_t ns) {
+  uint64_t us = ns > 0 ? ns / 1000 : 0;
+  int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+
+  if (bucket >= TRACE_BUCKETS) bucket = TRACE_BUCKETS - 1;
+  atomic_fetch_add_explicit(&histograms[stage][bucket], 1,
+                            memory_order_relaxed);
+}
+
+int FinishTrace(struct RequestTrace *trace, char *buf, size_t size) {
+  int64_t *stamps = trace->stamps;
+  int64_t last = stamps[TRACE_ACCEPTED];
+  char stages[TRACE_STAGE_NUM * 32];
+  int len = 0;
+
+  if (last == 0) return 0;
+
+  // Each stage lasts from the previous point the request passed
+  for (int stage = TRACE_ASSIGNED; stage < TRACE_STAGE_NUM; stage++) {
+    if (stamps[stage] == 0) continue;
+    AddSample(stage, stamps[stage] - last);
+    len += snprintf(stages + len, sizeof(stages) - len, "%s%s %.3fms",
+                    len > 0 ? ", " : "", stage_names[stage],
+                    (stamps[stage] - last) / 1e6);
+    last = stamps[stage];
+  }
+  AddSample(TRACE_ACCEPTED, last - stamps[TRACE_ACCEPTED]);
+
+  if (last - stamps[TRACE_ACCEPTED] < slow_ns) return 0;
+  snprintf(buf, size, "total %.3fms (%s)",
+           (last - stamps[TRACE_ACCEPTED]) / 1e6, stages);
+  return 1;
+}
+
+const char *GetTraceStageName(enum TraceStage stage) {
+  return stage_names[stage];
+}
+
+void GetTraceStats(enum TraceStage stage, struct TraceStats *stats) {
+  long counts[TRACE_BUCKETS];
+  long seen = 0;
+  long *percentiles[3] = { &stats->p50_us, &stats->p90_us, &stats->p99_us };
+  const int ranks[3] = { 50, 90, 99 };
+  int next = 0;
+
+  stats->count = 0;
+  for (int i = 0; i < TRACE_BUCKETS; i++) {
+    counts[i] = atomic_load(&histograms[stage][i]);
+    stats->count += counts[i];
+  }
+
+  // The percentile falls in the first bucket covering its rank
+  for (int i = 0; i < 3; i++) *percentiles[i] = 0;
+  for (int i = 0; i < TRACE_BUCKETS && next < 3; i++) {
+    seen += counts[i];
+    while (next < 3 && seen * 100 >= stats->count * ranks[next] &&
+           stats->count > 0) {
+      *percentiles[next] = 1L << i;
+      next++;
+    }
+  }
+}
@@ -0,0 +1,72 @@
+#define _GNU_SOURCE             // for splice and F_SETPIPE_SZ
+#include "tunnel.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+void InitTunnelPipe(struct TunnelPipe *tunnel) {
+  tunnel->pipe_fds[0] = -1;
+  tunnel->pipe_fds[1] = -1;
+  tunnel->pending = 0;
+  tunnel->eof = 0;
+  tunnel->shut = 0;
+}
+
+int OpenTunnelPipe(struct TunnelPipe *tunnel) {
+  if (pipe(tunnel->pipe_fds) < 0) {
+    tunnel->pipe_fds[0] = -1;
+    tunnel->pipe_fds[1] = -1;
+    return -1;
+  }
+  // It's fine if the pipe can't be resized, it just buffers less
+  fcntl(tunnel->pipe_fds[1], F_SETPIPE_SZ, TUNNEL_PIPE_SIZE);
+  return 0;
+}
+
+void CloseTunnelPipe(struct TunnelPipe *tunnel) {
+  for (int i = 0; i < 2; i++) {
+    if (tunnel->pipe_fds[i] >= 0) close(tunnel->pipe_fds[i]);
+    tunnel->pipe_fds[i] = -1;
+  }
+}
+
+int RelayTunnelPipe(struct TunnelPipe *tunnel, int src_fd, int dst_fd) {
+  ssize_t retval;
+
+  // Fill the pipe from src_fd
+  if (IsTunnelReadable(tunnel)) {
+    retval = splice(src_fd, NULL, tunnel->pipe_fds[1], NULL,
+                    TUNNEL_PIPE_SIZE - tunnel->pending,
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (retval > 0) tunnel->pending += retval;
+    else if (retval == 0) tunnel->eof = 1;
+    else if (errno != EAGAIN && errno != EINTR) return -1;
+  }
+
+  // Drain the pipe to dst_fd
+  while (tunnel->pending > 0) {
+    retval = splice(tunnel->pipe_fds[0], NULL, dst_fd, NULL,
+                    tunnel->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (retval > 0) tunnel->pending -= retval;
+    else if (retval < 0 && errno == EINTR) continue;
+    else if (retval < 0 && errno == EAGAIN) break;
+    else return -1;
+  }
+
+  if (tunnel->eof && tunnel->pending == 0 && !tunnel->shut) {
+    shutdown(dst_fd, SHUT_WR);
+    tunnel->shut = 1;
+  }
+
+  return 0;
+}
+
+int IsTunnelReadable(struct TunnelPipe *tunnel) {
+  return !tunnel->eof && tunnel->pending < TUNNEL_PIPE_SIZE;
+}
+
+int IsTunnelWritable(struct TunnelPipe *tunnel) {
+  return tunnel->pending > 0;
+}
@@ -0,0 +1,253 @@
+#include "warmup.h"
+#include "http.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+static char **urls = NULL;
+static int url_num = 0;
+static atomic_int next_url;
+static atomic_int fetched_num;
+static atomic_int failed_num;
+
+static void (*submit_fn)(int fd) = NULL;
+static pthread_mutex_t submit_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Queue of urls waiting to be fetched by the refresh threads.
+ */
+static struct {
+  int enabled;
+  char urls[REFRESH_QUEUE_LEN][URL_LEN + HOST_LEN];
+  int head;
+  int count;
+  pthread_mutex_t mutex;
+  pthread_cond_t not_empty;
+} refresh_queue = {
+  .enabled = 0,
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+  .not_empty = PTHREAD_COND_INITIALIZER
+};
+
+/**
+ * Read the urls in path, one per line.
+ *
+ * \returns 0 if success, -1 otherwise.
+ */
+static int LoadUrls(const char *path) {
+  FILE *file = fopen(path, "r");
+  char *line = NULL;
+  size_t line_size = 0;
+  int capacity = 0;
+
+  if (!file) return -1;
+  while (getline(&line, &line_size, file) >= 0) {
+    /// Strip the line ending and spaces around the url
+    char *url = line + strspn(line, " \t");
+    size_t len = strcspn(url, " \t\r\n");
+    url[len] = '\0';
+    if (len == 0 || url[0] == '#') continue;
+
+    if (url_num == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      char **bigger = realloc(urls, capacity * sizeof(*urls));
+      if (!bigger) break;
+      urls = bigger;
+    }
+    urls[url_num] = strdup(url);
+    if (!urls[url_num]) break;
+    url_num++;
+  }
+
+  free(line);
+  fclose(file);
+  return 0;
+}
+
+/**
+ * Build the proxy request of url in buf.
+ *
+ * \returns the length of the request, -1 if url is invalid.
+ */
+static int BuildRequest(const char *url, char *buf, size_t size) {
+  const char *host = url + strlen("http://");
+  size_t host_len = 0;
+  int len;
+
+  if (strncasecmp(url, "http://", strlen("http://")) != 0) return -1;
+  host_len = strcspn(host, "/");
+  if (host_len == 0 || host_len >= HOST_LEN) return -1;
+
+  len = snprintf(buf, size, "GET %s HTTP/1.1\r\nHost: %.*s\r\n"
+                 "User-Agent: proxy-warmup\r\nConnection: close\r\n\r\n",
+                 url, (int)host_len, host);
+  return len < size ? len : -1;
+}
+
+/**
+ * Fetch url through the proxy over a socket pair, and drop the response.
+ *
+ * \returns the status code of the response, 0 if there is none.
+ */
+static int FetchUrl(const char *url) {
+  char buf[URL_LEN + HOST_LEN + 128];
+  char head[32];                     // start of the status line
+  size_t head_len = 0;
+  int fds[2];
+  int status = 0;
+  ssize_t retval;
+
+  int len = BuildRequest(url, buf, sizeof(buf));
+  if (len < 0) return 0;
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) return 0;
+
+  // Let the proxy serve one end like a client connection
+  pthread_mutex_lock(&submit_mutex);
+  submit_fn(fds[1]);
+  pthread_mutex_unlock(&submit_mutex);
+
+  // Send the request, and read the response until the proxy closes
+  for (int sent = 0; sent < len; sent += retval) {
+    retval = write(fds[0], buf + sent, len - sent);
+    if (retval <= 0) {
+      close(fds[0]);
+      return 0;
+    }
+  }
+  while ((retval = read(fds[0], buf, sizeof(buf))) > 0) {
+    if (head_len < sizeof(head) - 1) {
+      size_t copy = sizeof(head) - 1 - head_len;
+      if (copy > retval) copy = retval;
+      memcpy(head + head_len, buf, copy);
+      head_len += copy;
+    }
+  }
+  close(fds[0]);
+
+  head[head_len] = '\0';
+  if (sscanf(head, "HTTP/%*d.%*d %d", &status) != 1) status = 0;
+  return status;
+}
+
+/**
+ * Thread function: fetch the urls not taken by other threads.
+ */
+static void *WarmupThread(void *args) {
+  int index;
+
+  while ((index = atomic_fetch_add(&next_url, 1)) < url_num) {
+    int status = FetchUrl(urls[index]);
+    if (status == 200) {
+      atomic_fetch_add(&fetched_num, 1);
+    }
+    else {
+      atomic_fetch_add(&failed_num, 1);
+      printf("[Warm-up] %s failed: %d\n", urls[index], status);
+    }
+  }
+
+  return NULL;
+}
+
+int RunWarmup(const char *path, void (*submit)(int fd),
+              struct WarmupStats *stats) {
+  pthread_t tids[WARMUP_CONCURRENCY];
+  int thread_num = 0;
+  struct timespec start, end;
+
+  if (LoadUrls(path) != 0) return -1;
+  submit_fn = submit;
+  atomic_store(&next_url, 0);
+  atomic_store(&fetched_num, 0);
+  atomic_store(&failed_num, 0);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < WARMUP_CONCURRENCY && i < url_num; i++) {
+    if (pthread_create(&tids[thread_num], NULL, WarmupThread, NULL) == 0)
+      thread_num++;
+  }
+  /// Fetch in this thread if no thread can be created
+  if (thread_num == 0) WarmupThread(NULL);
+  for (int i = 0; i < thread_num; i++) {
+    pthread_join(tids[i], NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  stats->fetched = atomic_load(&fetched_num);
+  stats->failed = atomic_load(&failed_num);
+  stats->seconds = (end.tv_sec - start.tv_sec) +
+                   (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  for (int i = 0; i < url_num; i++) free(urls[i]);
+  free(urls);
+  urls = NULL;
+  url_num = 0;
+  return 0;
+}
+
+/**
+ * Refresh thread function: fetch the urls in refresh_queue.
+ */
+static void *RefreshThread(void *args) {
+  char url[URL_LEN + HOST_LEN];
+
+  while (1) {
+    pthread_mutex_lock(&refresh_queue.mutex);
+    while (refresh_queue.count == 0) {
+      pthread_cond_wait(&refresh_queue.not_empty, &refresh_queue.mutex);
+    }
+    strcpy(url, refresh_queue.urls[refresh_queue.head]);
+    refresh_queue.head = (refresh_queue.head + 1) % REFRESH_QUEUE_LEN;
+    refresh_queue.count--;
+    pthread_mutex_unlock(&refresh_queue.mutex);
+
+    int status = FetchUrl(url);
+    if (status != 200) printf("[Refresh] %s failed: %d\n", url, status);
+  }
+
+  return NULL;
+}
+
+int StartRefresh(void (*submit)(int fd)) {
+  pthread_t tid;
+
+  submit_fn = submit;
+  for (int i = 0; i < REFRESH_THREADS; i++) {
+    if (pthread_create(&tid, NULL, RefreshThread, NULL) != 0) {
+      if (i == 0) return -1;
+      break;
+    }
+    pthread_detach(tid);
+  }
+
+  refresh_queue.enabled = 1;
+  return 0;
+}
+
+int QueueRefresh(const char *host, const char *url) {
+  int retval = -1;
+
+  if (!refresh_queue.enabled) return -1;
+
+  pthread_mutex_lock(&refresh_queue.mutex);
+  if (refresh_queue.count < REFRESH_QUEUE_LEN) {
+    int tail = (refresh_queue.head + refresh_queue.count) % REFRESH_QUEUE_LEN;
+    int len = snprintf(refresh_queue.urls[tail], sizeof(refresh_queue.urls[0]),
+                       "http://%s%s", host, url);
+    if (len < sizeof(refresh_queue.urls[0])) {
+      refresh_queue.count++;
+      pthread_cond_signal(&refresh_queue.not_empty);
+      retval = 0;
+    }
+  }
+  pthread_mutex_unlock(&refresh_queue.mutex);
+
+  return retval;
+}